@@ -13,7 +13,7 @@
 extern "C" {
 #endif
 
-/* Streaming Callback: Returns 0 on success, non-zero on error */
+/* Streaming Callback: Returns 0 on success, non-zero on error (see also PACKR_FLUSH_PENDING) */
 typedef int (*packr_flush_func)(void *user_data, const uint8_t *data, size_t len);
 
 /* Constants */
@@ -69,38 +69,371 @@ typedef enum {
     /* Streaming Extensions */
     TOKEN_ARRAY_STREAM  = 0xEF,
     TOKEN_BATCH_PARTIAL = 0xF0,
+
+    /* Typed Strings */
+    TOKEN_TIMESTAMP     = 0xF1,
+    TOKEN_UUID          = 0xF2,
+    TOKEN_IPV4          = 0xF3,
+
+    /* Seek Table */
+    TOKEN_BLOCK_RESET   = 0xF6, /* block start: dictionaries and delta state reset */
+    TOKEN_SEEK_TABLE    = 0xF7, /* trailer marker */
 } packr_token_t;
 
+/*
+ * Frame Flags (header byte 5)
+ * PACKR_FLAG_SEEK_TABLE: the body is followed, before the CRC, by
+ *   TOKEN_SEEK_TABLE | varint count | count x (varint offset delta, varint record delta)
+ *   | u32 LE length of the above
+ * Offsets are relative to the first body byte (after the symbol count). Every
+ * block but the first starts with TOKEN_BLOCK_RESET, so it decodes on its own.
+ */
+#define PACKR_FLAG_SEEK_TABLE   0x10
+
+/*
+ * Primer Dictionaries
+ * A primer is a set of field, string and MAC entries that encoder and
+ * decoder load into their (empty) dictionaries before the first token, so
+ * short independent frames don't spell out the same keys every time. The
+ * low 4 bits of the flags byte name it (1..15, 0 = none); only the ID goes
+ * on the wire. Serialized form, as written by tools/packr_train:
+ *   "PKRD" | u8 id | u8 fields | u8 strings | u8 macs
+ *   | entries (varint length + bytes: fields, then strings, then MACs)
+ *   | u32 LE CRC32 of everything before it
+ * Entries are added in order, so the last ones are evicted last. Block
+ * resets (seek tables) reload the primer.
+ */
+#define PACKR_FLAG_PRIMER_MASK  0x0F
+#define PACKR_PRIMER_MAGIC      "PKRD"
+#define PACKR_PRIMER_MAX_ID     15
+
+typedef struct {
+    const uint8_t *data;  /* serialized primer, not copied: must outlive its users */
+    size_t size;
+    uint8_t id;
+    uint8_t counts[3];    /* fields, strings, MACs (each up to PACKR_DICT_SIZE) */
+} packr_primer_t;
+
+typedef struct {
+    const char *str;
+    size_t len;
+} packr_primer_entry_t;
+
+/*
+ * Typed Strings
+ * String values in these forms go as binary tokens, and decode to the same
+ * text byte for byte (anything else stays a string):
+ *   ISO 8601 date-times YYYY-MM-DD(T| )hh:mm:ss[.f{1,9}][Z|+hh:mm|+hhmm], years 0000-9999
+ *     TOKEN_TIMESTAMP | u8 format | zigzag varint64 ticks [| zigzag varint offset]
+ *   UUIDs xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx, all lower or all upper case
+ *     TOKEN_UUID | u8 case (1 = upper) | 16 bytes
+ *   IPv4 addresses, dotted decimal without leading zeros
+ *     TOKEN_IPV4 | 4 bytes
+ * Timestamps are ticks of 10^-digits seconds of their wall clock since
+ * 1970-01-01T00:00:00, kept apart from the string dictionary (they seldom
+ * repeat). UUIDs and addresses do repeat: as a new string they go in the
+ * dictionary on both sides, and are then referenced with TOKEN_STRING.
+ */
+typedef struct {
+    int64_t ticks;
+    int16_t offset;   /* minutes east of UTC, for PACKR_TS_OFFSET* */
+    uint8_t format;   /* fraction digits | zone | PACKR_TS_SPACE */
+} packr_timestamp_t;
+
+#define PACKR_TS_DIGITS         0x0F  /* fraction digits, 0..9 */
+#define PACKR_TS_ZONE           0x30
+#define PACKR_TS_LOCAL          0x00  /* no zone */
+#define PACKR_TS_UTC            0x10  /* Z */
+#define PACKR_TS_OFFSET         0x20  /* +hh:mm */
+#define PACKR_TS_OFFSET_COMPACT 0x30  /* +hhmm */
+#define PACKR_TS_SPACE          0x40  /* ' ' between date and time, not 'T' */
+#define PACKR_TIMESTAMP_MAX     35    /* "9999-12-31T23:59:59.999999999+14:00" */
+
+/*
+ * Schema Cache
+ * A batch header (TOKEN_ULTRA_BATCH / TOKEN_BATCH_PARTIAL) lists every
+ * field. Prefixed with TOKEN_SCHEMA_DEF, its field list also takes the next
+ * of PACKR_SCHEMA_SLOTS slots (round robin, on both sides). A later batch
+ * with the same fields in the same order sends
+ *   TOKEN_SCHEMA_REF | u8 slot | batch token | varint rows | one flags byte per field
+ * or TOKEN_SCHEMA_REPEAT in place of REF + slot when it is the slot of the
+ * previous cached batch. Only batches that are not inside another batch's
+ * columns use the cache. Block resets empty it.
+ */
+#define PACKR_SCHEMA_SLOTS 8
+
+typedef struct {
+    char **fields;  /* NULL = empty; one block: the pointers, then the names */
+    uint32_t count;
+    uint32_t hash;
+    size_t size;    /* bytes of the block */
+} packr_schema_t;
+
+typedef struct {
+    packr_schema_t slots[PACKR_SCHEMA_SLOTS];
+    uint8_t next;   /* slot the next definition takes */
+    uint8_t last;   /* slot of the previous cached batch (TOKEN_SCHEMA_REPEAT) */
+    uint8_t depth;  /* batches being written or read, nested in one another */
+} packr_schema_cache_t;
+
+/*
+ * Batch effort (packr_encoder_set_batch): how ultra batches pick the coding
+ * of each column, and how JSON arrays are cut into batches. All write the
+ * same format.
+ *   FAST      fixed rules: MFV over 60% of the rows, 4-bit deltas unless
+ *             zero runs look better, Rice with k from the largest delta, ...
+ *   BALANCED  a cost model prices every candidate by the bytes it writes
+ *             (const, MFV, delta tokens, bitpack, Rice around the mean's k,
+ *             RLE) and takes the cheapest. JSON arrays of objects go row by
+ *             row when that prices cheaper than batches.
+ *   SMALLEST  as BALANCED, trying every Rice k, and cutting a batch in two
+ *             where that prices cheaper: where its keys or types changed,
+ *             else in halves (values changing regime).
+ * Prices are of the bytes before LZ77, which finds no matches in bit codes:
+ * with compression on, Rice has to halve the byte-aligned coding.
+ */
+#define PACKR_BATCH_FAST 0
+#define PACKR_BATCH_BALANCED 1
+#define PACKR_BATCH_SMALLEST 2
+#define PACKR_BATCH_DEFAULT PACKR_BATCH_BALANCED
+
+/* How a column of the batch being written is coded (packr_ultra.c) */
+typedef struct {
+    uint8_t flags;        /* the column's flags byte */
+    uint8_t coding;
+    uint8_t rice_k;
+    size_t mode;          /* MFV: a row holding the value */
+    size_t cost;          /* bytes, as priced by the cost model (not with FAST) */
+} packr_column_plan_t;
+
+/*
+ * Column Scratch
+ * Work memory of ultra batches, kept by the encoder from batch to batch
+ * (and array to array) so that batching allocates nothing once it is warm:
+ * the work arrays of the column coders, grown to the largest batch, the
+ * column plans, and the JSON front end's batch columns. Taken with the
+ * first batch and freed by packr_encoder_destroy (so also by
+ * packr_encoder_suspend). The decoder likewise keeps the cells, typed
+ * columns and text of its top level batches.
+ */
+typedef struct {
+    size_t rows;          /* the work arrays hold this many rows */
+    int32_t *deltas;      /* one block: deltas, rel, udeltas, then bits */
+    int32_t *rel;         /* TIME column ticks, relative to its base */
+    uint32_t *udeltas;    /* Rice input */
+    uint8_t *bits;        /* Rice output, PACKR_RICE_BOUND(rows) bytes */
+    packr_column_plan_t *plans; /* a stack: batches in CUSTOM values plan above the one they are in */
+    size_t plan_cap;
+    size_t plan_used;
+    void *json;           /* JSON front end batch columns, NULL while taken (packr_json.c) */
+    void (*json_free)(void *json, size_t *alloc_counter);
+} packr_column_scratch_t;
+
+#define PACKR_RICE_BOUND(rows) ((rows) * 2 + 1024)
+
+/*
+ * Dictionary hash index (set PACKR_DICT_HASH=0 to fall back to linear scans).
+ * Open addressing over PACKR_DICT_INDEX_SIZE one-byte slots plus an intrusive
+ * recency list, so lookup and LRU victim selection are O(1). Eviction order is
+ * exactly the same as the linear LRU scan, so streams stay byte-identical.
+ */
+#ifndef PACKR_DICT_HASH
+#define PACKR_DICT_HASH     1
+#endif
+#define PACKR_DICT_INDEX_SIZE (PACKR_DICT_SIZE * 2) /* power of two, load <= 0.5 */
+
+/*
+ * Dictionary String Arena (optional, caller-provided)
+ * Holds the bytes of all field/string/MAC dictionary entries of one context.
+ * Evicted entries leave holes that are reclaimed by compacting the live
+ * blocks in place once the bump pointer reaches the end, so the arena never
+ * grows. Each entry costs its length + 1 rounded up to pointer size, plus a
+ * PACKR_ARENA_BLOCK_OVERHEAD header. Entries that can't fit even after
+ * compaction fall back to packr_malloc. A decoder over a whole frame keeps
+ * field and string entries as views into the frame instead, so there only
+ * MACs take arena space; the incremental decoder copies them all.
+ */
+#define PACKR_ARENA_BLOCK_OVERHEAD (2 * sizeof(void*))
+
+typedef struct {
+    uint8_t *base;
+    size_t cap;
+    size_t used;  /* bump offset */
+    size_t dead;  /* bytes held by evicted blocks */
+} packr_arena_t;
+
+/*
+ * Stats (build with PACKR_STATS=1; off by default)
+ * Counters an encoder or decoder keeps about its own work, read with
+ * packr_encoder_get_stats / packr_decoder_get_stats. Built without them
+ * the counters and the code that bumps them are not compiled at all. Flush
+ * time is taken with PACKR_STATS_CLOCK_US() if defined (a uint64_t
+ * microsecond clock, e.g. esp_timer_get_time()), else esp_timer on ESP-IDF,
+ * CLOCK_MONOTONIC on POSIX and clock() elsewhere.
+ */
+#ifndef PACKR_STATS
+#define PACKR_STATS 0
+#endif
+
+typedef struct {
+    uint32_t hits;       /* encoder: value found; decoder: entry referenced */
+    uint32_t misses;     /* entries added (primer entries are not counted) */
+    uint32_t evictions;  /* misses that replaced a live entry */
+} packr_dict_stats_t;
+
+/* Ultra batch column encodings */
+typedef enum {
+    PACKR_COL_CONST,     /* one value for every row */
+    PACKR_COL_BITPACK,   /* 4-bit deltas */
+    PACKR_COL_RICE,      /* Rice coded deltas */
+    PACKR_COL_MFV,       /* most frequent value, bitmap and exceptions */
+    PACKR_COL_RLE,       /* value runs (strings, bools, exact doubles, ints when cheaper) */
+    PACKR_COL_DELTA,     /* delta tokens and zero runs */
+    PACKR_COL_CUSTOM,    /* nested values, one per row */
+    PACKR_COL_KINDS
+} packr_col_kind_t;
+
+typedef struct {
+    packr_dict_stats_t fields;
+    packr_dict_stats_t strings;
+    packr_dict_stats_t macs;
+    /*
+     * Tokens by opcode. Dictionary references and small deltas count at
+     * their base (TOKEN_FIELD, TOKEN_STRING, TOKEN_MAC, TOKEN_DELTA_SMALL
+     * 0xC3). The decoder counts value tokens, not the deltas inside columns.
+     */
+    uint32_t tokens[256];
+    uint32_t columns[PACKR_COL_KINDS];
+    /* Encoder LZ77, of the frames that went out compressed with it */
+    uint64_t lz77_literal_bytes;
+    uint64_t lz77_match_bytes;
+    uint32_t lz77_matches;       /* average match length: match bytes / matches */
+    /* Streaming encoder flush callback, header and LZ77 output included */
+    uint32_t flush_calls;
+    uint64_t flush_bytes;
+    uint64_t flush_us;
+} packr_stats_t;
+
+#if PACKR_STATS
+#define PACKR_STAT(stmt) do { stmt; } while (0)
+#else
+#define PACKR_STAT(stmt) ((void)0)
+#endif
+
 /* Dictionary Entry */
 typedef struct {
     char *value;
     size_t length;
     uint64_t last_used;
+    uint32_t hash;
+    bool view;      /* value points into the frame or primer bytes, not owned or NUL terminated */
 } dict_entry_t;
 
 /* Dictionary */
 typedef struct {
     dict_entry_t entries[PACKR_DICT_SIZE];
     uint64_t usage_counter; /* Monotonic counter for LRU */
+    packr_arena_t *arena;   /* NULL = heap storage */
+#if PACKR_DICT_HASH
+    uint8_t index[PACKR_DICT_INDEX_SIZE]; /* entry + 1, 0 = empty */
+    uint8_t lru_prev[PACKR_DICT_SIZE];
+    uint8_t lru_next[PACKR_DICT_SIZE];
+    uint8_t lru_head;  /* most recently used */
+    uint8_t lru_tail;  /* least recently used (next victim) */
+    uint8_t count;     /* slots filled so far, filled in index order */
+#endif
+#if PACKR_STATS
+    packr_dict_stats_t stats; /* kept across resets */
+#endif
 } packr_dict_t;
 
+/*
+ * Buffered LZ77 effort levels (compressed frames from packr_encoder_finish).
+ * All write the same format; higher levels are slower and smaller.
+ */
+#define PACKR_LZ77_FAST 0     /* one hash probe per position */
+#define PACKR_LZ77_GREEDY 1   /* 32-deep hash chains, longest match */
+#define PACKR_LZ77_LAZY 2     /* deeper chains, defers a match if the next one is longer */
+#define PACKR_LZ77_OPTIMAL 3  /* cheapest parse over all chain candidates */
+#define PACKR_LZ77_DEFAULT PACKR_LZ77_GREEDY
+
+/*
+ * Match window of the buffered compressor. Offsets are 16-bit, so 65535 is
+ * the limit; feed decoding needs PACKR_FEED_WINDOW >= the window used.
+ */
+#define PACKR_LZ77_WINDOW_DEFAULT 8192
+#define PACKR_LZ77_WINDOW_MAX 65535
+
 /* LZ77 Streaming Context */
-#define LZ77_WINDOW_SIZE 4096
-#define LZ77_BUFFER_SIZE (LZ77_WINDOW_SIZE * 2)
+#define LZ77_WINDOW_SIZE 4096 /* default match window of the streaming compressor */
+#define LZ77_LEN_STREAMED 0xFFFFFFFFu /* orig_len of streamed payloads (unknown up front) */
+#ifndef LZ77_BUFFER_SIZE
+#define LZ77_BUFFER_SIZE (LZ77_WINDOW_SIZE * 2) /* ring buffer, power of two */
+#endif
+/* Largest streaming window, the rest of the ring holds the input lookahead */
+#define LZ77_STREAM_WINDOW_MAX (LZ77_BUFFER_SIZE - 1024)
+
+/*
+ * Hash Table Pool (optional, shared by streaming compressors)
+ * A stream takes its hash table when it first compresses and hands it back
+ * when destroyed or suspended, so with a pool, tables are only held by
+ * streams that are compressing and are recycled instead of freed. Up to
+ * max_idle spare tables are kept (0 = no limit). Not thread safe: share a
+ * pool between streams used from the same thread only.
+ */
+typedef struct {
+    void *free_list;      /* spare tables, linked through their first word */
+    size_t idle;
+    size_t in_use;
+    size_t max_idle;
+    size_t table_size;    /* bytes per table */
+} packr_lz77_hash_pool_t;
 
 typedef struct {
-    uint8_t window[LZ77_BUFFER_SIZE];
-    uint16_t window_pos;
-    uint16_t process_pos;
-    uint16_t anchor;
+    uint8_t window[LZ77_BUFFER_SIZE]; /* ring, byte p at p % LZ77_BUFFER_SIZE */
+    uint32_t window_pos;    /* absolute positions (bytes taken in so far) */
+    uint32_t process_pos;
+    uint32_t anchor;
+    uint32_t max_dist;      /* match window, LZ77_WINDOW_SIZE by default */
     
-    // Opaque hash table pointer to keep header clean
+    // Opaque hash table pointer to keep header clean, NULL until first used
     void *ht;
+    packr_lz77_hash_pool_t *hash_pool; /* where ht comes from, NULL = heap */
 
     // Output scratchpad
     uint8_t out_buf[128];
+#if PACKR_STATS
+    uint64_t literal_bytes;
+    uint64_t match_bytes;
+    uint32_t matches;
+#endif
 } packr_lz77_stream_t;
 
+/*
+ * LZ77 Streaming Decompressor
+ * Inflates a 0xFE 0x03 payload (format byte onwards) in arbitrary chunks,
+ * keeping the last PACKR_FEED_WINDOW output bytes as match history. The
+ * streaming encoder looks back LZ77_WINDOW_SIZE bytes and the buffered one
+ * 8192 unless set with packr_encoder_set_lz77; PACKR_FEED_WINDOW must be at
+ * least the window the frame was written with.
+ */
+#ifndef PACKR_FEED_WINDOW
+#define PACKR_FEED_WINDOW LZ77_WINDOW_SIZE /* power of two */
+#endif
+
+typedef struct {
+    uint8_t window[PACKR_FEED_WINDOW];
+    uint32_t produced;   /* total output bytes, window index = produced % size */
+    uint32_t limit;      /* orig_len, LZ77_LEN_STREAMED = until the input ends */
+    uint32_t lit_left;
+    uint32_t match_len;
+    uint16_t offset;
+    uint8_t hdr[5];
+    uint8_t hdr_len;
+    uint8_t state;
+    uint8_t ctrl;
+} packr_lz77_dstream_t;
+
 /* Encoder Context */
 typedef struct {
     uint8_t *buffer;
@@ -113,13 +446,45 @@ typedef struct {
     packr_dict_t macs;
 
     bool compress;
+    uint8_t lz77_level;     /* PACKR_LZ77_*, buffered compression only */
+    uint16_t lz77_window;
+    bool entropy;           /* Huffman stage after LZ77, buffered compression only */
+    uint8_t batch_effort;   /* PACKR_BATCH_* */
     size_t total_alloc;
+    packr_arena_t arena;
 
     /* Streaming Support */
     packr_flush_func flush_cb;
     void *user_data;
-    uint32_t current_crc;
+    uint32_t current_crc;   /* running CRC of buffer[..crc_pos) and everything flushed */
+    size_t crc_pos;
     packr_lz77_stream_t lz77;
+    size_t flushed;         /* plaintext bytes already handed to flush */
+    bool lz_head_sent;      /* the 0xFE 0x03 header went out (sent with the first flush) */
+
+    /* Async Flush (optional) */
+    bool async;
+    uint8_t fill;            /* plain: half being filled (compressed: tokens in halves[0], LZ77 output staged in halves[1]) */
+    uint8_t *halves[2];
+    size_t staged;           /* LZ77 output bytes staged */
+    uint32_t half_seq[2];    /* flush_submitted when each half last went out pending */
+    uint32_t flush_submitted;
+    uint32_t flush_completed; /* bumped by packr_flush_complete */
+
+    /* Seek Table (optional) */
+    size_t seek_block_bytes; /* 0 = disabled */
+    size_t seek_last;        /* body offset of the current block */
+    uint32_t *seek_offsets;
+    uint32_t *seek_records;
+    uint32_t seek_count;
+    uint32_t seek_cap;
+
+    const packr_primer_t *primer; /* NULL = none */
+    packr_schema_cache_t schemas;
+    packr_column_scratch_t columns;
+#if PACKR_STATS
+    packr_stats_t stats;
+#endif
 } packr_encoder_t;
 
 /* Decoder Context */
@@ -129,6 +494,7 @@ typedef struct {
     size_t pos;
     
     uint8_t *internal_data; /* Decompressed or owned data buffer */
+    bool views;             /* data stays put: dictionary entries and batch strings point into it */
     
     packr_dict_t fields;
     packr_dict_t strings;
@@ -139,10 +505,81 @@ typedef struct {
     int current_field;
     
     size_t total_alloc;
+    packr_arena_t arena;
+
+    /* Seek Table (from the frame trailer) */
+    size_t body_start;
+    const uint32_t *seek_offsets;
+    const uint32_t *seek_records;
+    uint32_t seek_count;
+    bool seek_owned;
+
+    /* Primer named by the frame flags (0 = none), loaded with packr_decoder_set_primers */
+    uint8_t primer_id;
+    const packr_primer_t *primer;
+
+    packr_schema_cache_t schemas;
+    /* Kept from one top level batch to the next: its columns, the typed ones handed over, spare text */
+    void *batch_block;
+    size_t batch_block_cap;
+    void *batch_out;
+    size_t batch_out_cap;
+    void *batch_text;
+#if PACKR_STATS
+    packr_stats_t stats;
+#endif
 } packr_decoder_t;
 
+/*
+ * Output Writer
+ * Decoded JSON is staged in buf. With write_cb set, a full buffer is handed
+ * to write_cb and reused, so output can go straight to a socket or file
+ * without a full-size copy. With write_cb NULL, buf is the whole output:
+ * anything past cap - 1 is dropped and error is set. Either way buf stays
+ * NUL terminated.
+ */
+typedef int (*packr_write_func)(void *user_data, const char *data, size_t len);
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t pos;
+    packr_write_func write_cb;
+    void *user_data;
+    size_t flushed;   /* bytes already handed to write_cb */
+    int error;        /* write_cb failed or output truncated */
+} packr_writer_t;
+
+/*
+ * Incremental Decoder
+ * Takes a frame (plain or 0xFE 0x03) in chunks of any size and writes JSON
+ * to out as soon as each value is complete. A top-level array is emitted
+ * element by element, so stage only needs to hold the largest element
+ * (one record, or one streamed batch of up to 128 records) plus the 4 CRC bytes,
+ * not the frame. Memory is the stage, the LZ77 window and the dictionaries.
+ */
+typedef struct {
+    packr_decoder_t dec;      /* dictionaries and delta state, reads from stage */
+    packr_lz77_dstream_t lz;
+    packr_writer_t *out;
+    uint8_t *stage;
+    size_t stage_cap;
+    size_t stage_len;
+    uint8_t magic[2];
+    uint8_t magic_len;
+    uint8_t mode;             /* frame type, from the first two bytes */
+    uint8_t state;
+    bool first;               /* next array element is the first */
+    uint32_t left;            /* elements left in a counted top-level array */
+    const packr_primer_t *const *primers;
+    size_t primer_count;
+} packr_stream_decoder_t;
+
 /* API */
 void packr_encoder_init(packr_encoder_t *ctx, bool compress, packr_flush_func flush_cb, void *user_data, uint8_t *work_buffer, size_t work_cap);
+/* As packr_encoder_init, with dictionary strings kept in a caller-provided arena (NULL/0 = heap) */
+void packr_encoder_init_ex(packr_encoder_t *ctx, bool compress, packr_flush_func flush_cb, void *user_data,
+                           uint8_t *work_buffer, size_t work_cap, uint8_t *arena, size_t arena_cap);
 int packr_encode_null(packr_encoder_t *ctx);
 int packr_encode_bool(packr_encoder_t *ctx, bool value);
 int packr_encode_int(packr_encoder_t *ctx, int32_t value);
@@ -152,23 +589,268 @@ int packr_encode_binary(packr_encoder_t *ctx, const uint8_t *data, size_t len);
 int packr_encode_string(packr_encoder_t *ctx, const char *str, size_t len);
 int packr_encode_field(packr_encoder_t *ctx, const char *str, size_t len);
 int packr_encode_mac(packr_encoder_t *ctx, const char *str);
+int packr_encode_timestamp(packr_encoder_t *ctx, const packr_timestamp_t *ts);
+/* A string, as a typed token when it is a timestamp, UUID or IPv4 address (see Typed Strings) */
+int packr_encode_typed(packr_encoder_t *ctx, const char *str, size_t len);
 int packr_encode_token(packr_encoder_t *ctx, packr_token_t token);
 size_t packr_encoder_finish(packr_encoder_t *ctx, uint8_t *out_buffer);
+/*
+ * Buffered mode: writes the frame to out (out_cap bytes) and returns its
+ * length, 0 if it does not fit. packr_encoder_frame_bound() bytes are always
+ * enough, and a compressed frame goes straight into out. out may also be the
+ * work buffer (packr_encoder_finish with NULL or the work buffer does that);
+ * compression then needs the free tail of the work buffer to hold the frame
+ * again, and without that room the frame is written uncompressed. Nothing is
+ * allocated either way. Streaming mode flushes the rest and returns 0.
+ */
+size_t packr_encoder_finish_to(packr_encoder_t *ctx, uint8_t *out, size_t out_cap);
+size_t packr_encoder_frame_bound(const packr_encoder_t *ctx);
 void packr_encoder_destroy(packr_encoder_t *ctx);
 
+/*
+ * LZ77 effort (PACKR_LZ77_*) and window (0 = PACKR_LZ77_WINDOW_DEFAULT,
+ * up to PACKR_LZ77_WINDOW_MAX) of a buffered compressed encoder. Streaming
+ * encoders always probe once and take the window only (0 = LZ77_WINDOW_SIZE,
+ * up to LZ77_STREAM_WINDOW_MAX). Returns 0 on success.
+ */
+int packr_encoder_set_lz77(packr_encoder_t *ctx, int level, size_t window);
+
+/*
+ * Entropy stage of a buffered compressed encoder (off by default): the
+ * frame is written with the smallest of LZ77 (0xFE 0x03), canonical Huffman
+ * over the LZ77 output (0xFE 0x05) and Huffman over the frame (0xFE 0x04).
+ * Like LZ77 it works in out or the free tail of the work buffer; a Huffman
+ * form that has no room there is not tried. Streaming encoders return -1.
+ */
+int packr_encoder_set_entropy(packr_encoder_t *ctx, bool on);
+
+/* Batch effort (PACKR_BATCH_*, see Batch effort). Returns 0 on success */
+int packr_encoder_set_batch(packr_encoder_t *ctx, int effort);
+
+/*
+ * Seek Table: cut a new block at the first block point after every
+ * block_bytes of body. Must be called before anything was flushed.
+ * Returns 0 on success.
+ */
+int packr_encoder_enable_seek(packr_encoder_t *ctx, size_t block_bytes);
+/* Marks a legal block boundary (start of top-level record number record) */
+int packr_encoder_block_point(packr_encoder_t *ctx, uint32_t record);
+
+/*
+ * Async Flush (streaming encoders)
+ * The work buffer is split in two halves and the flush callback may return
+ * PACKR_FLUSH_PENDING to keep the data it was handed (e.g. while DMA sends
+ * it), calling packr_flush_complete once per pending return, in order, when
+ * done. Encoding goes on in the other half meanwhile: plain frames alternate
+ * halves, compressed ones take tokens in the first half and stage LZ77
+ * output for the callback in the second. The encoder only waits, spinning on
+ * PACKR_FLUSH_IDLE(), when it needs a half that is still in flight.
+ * packr_encoder_finish and packr_encoder_suspend wait for everything; a
+ * resumed encoder is synchronous until this is called again. Returns 0 on
+ * success.
+ */
+#define PACKR_FLUSH_PENDING 1
+#ifndef PACKR_FLUSH_IDLE
+#define PACKR_FLUSH_IDLE() ((void)0) /* e.g. taskYIELD() if completion comes from another task */
+#endif
+
+int packr_encoder_enable_async(packr_encoder_t *ctx);
+/* A pending flush is done with its data. Safe to call from an interrupt handler */
+void packr_flush_complete(packr_encoder_t *ctx);
+
+/*
+ * Suspend / Resume (streaming encoders)
+ * packr_encoder_suspend pushes the pending work buffer out through the flush
+ * callback (and LZ77, which keeps its lookahead), serializes what is left of
+ * the stream into out and destroys ctx, so an idle stream costs nothing
+ * but its snapshot:
+ *   "PKRS" | u8 version | u8 flags (0x01 compress) | u8 primer id
+ *   | u32 LE CRC state | u64 LE body bytes flushed | u64 LE symbol count
+ *   | u64 LE seek block bytes (0 = off)
+ *     [| u64 LE block start | varint count | count x (varint offset, varint record)]
+ *   | 3 x dictionary (fields, strings, MACs):
+ *       u8 count | count x (u8 slot | varint length | bytes), least recently used first
+ *   | u8 next schema slot | u8 last schema slot
+ *   | PACKR_SCHEMA_SLOTS x (varint field count | count x (varint length | bytes))
+ *   | LZ77 state (compressing only): u32 LE window, write, process and
+ *     anchor positions, kept bytes, payload length | payload (packr_lz77_compress
+ *     of the match window and pending input)
+ *   | u32 LE CRC32 of everything before it
+ * packr_encoder_resume rebuilds the encoder, possibly on another context,
+ * callback and work buffer. Dictionary slots, recency and schema slots come
+ * back as they were, so the token stream carries on unchanged; LZ77 output
+ * can differ a little since its hash table is rebuilt from the window.
+ * Stats and the dictionary arena are not kept (resumed dictionaries use the
+ * heap), nor the batch effort (set it again after resuming).
+ */
+#define PACKR_SNAPSHOT_MAGIC    "PKRS"
+#define PACKR_SNAPSHOT_VERSION  0x01
+
+/* Upper bound of the snapshot size, 0 if ctx cannot be suspended right now */
+size_t packr_encoder_suspend_bound(const packr_encoder_t *ctx);
+/*
+ * Suspends a streaming encoder between values (not inside a batch).
+ * Returns the snapshot size, or 0 (ctx kept, still usable) if ctx is not
+ * streaming, is mid-batch, a flush fails or out_cap is too small.
+ */
+size_t packr_encoder_suspend(packr_encoder_t *ctx, uint8_t *out, size_t out_cap);
+/*
+ * Resumes a snapshot into ctx. primer must be the one the stream was started
+ * with (NULL if none). Returns 0 on success, -1 if the snapshot is corrupt
+ * or the primer does not match; ctx is then left destroyed.
+ */
+int packr_encoder_resume(packr_encoder_t *ctx, const uint8_t *snap, size_t size, packr_flush_func flush_cb,
+                         void *user_data, uint8_t *work_buffer, size_t work_cap, const packr_primer_t *primer);
+/* Streaming compressed encoders: take the LZ77 hash table from pool. Call after init or resume, before encoding */
+int packr_encoder_set_hash_pool(packr_encoder_t *ctx, packr_lz77_hash_pool_t *pool);
+
 /* LZ77 Streaming Context */
 void packr_lz77_init(packr_lz77_stream_t *ctx);
+/* Match window (0 = LZ77_WINDOW_SIZE, up to LZ77_STREAM_WINDOW_MAX). Returns 0 on success */
+int packr_lz77_set_window(packr_lz77_stream_t *ctx, size_t window);
 void packr_lz77_destroy(packr_lz77_stream_t *ctx);
 int packr_lz77_compress_stream(packr_lz77_stream_t *ctx, const uint8_t *in, size_t in_len, 
                                packr_flush_func flush_cb, void *user_data, int flush);
+/*
+ * Stream state for packr_encoder_suspend: positions, plus the match window
+ * and pending input as an LZ77 payload. Save returns its size (0 if it does
+ * not fit); load returns the bytes it read (0 if corrupt) and leaves the hash
+ * table to be rebuilt from the window when the stream next compresses.
+ */
+size_t packr_lz77_save(const packr_lz77_stream_t *ctx, uint8_t *out, size_t out_cap);
+size_t packr_lz77_load(packr_lz77_stream_t *ctx, const uint8_t *in, size_t in_len);
+void packr_lz77_hash_pool_init(packr_lz77_hash_pool_t *pool, size_t max_idle);
+/* Frees the spare tables. Streams still holding one must be destroyed first */
+void packr_lz77_hash_pool_destroy(packr_lz77_hash_pool_t *pool);
+void packr_lz77_dstream_init(packr_lz77_dstream_t *ctx);
+/*
+ * Consumes up to in_len bytes and produces up to out_cap, stopping early when
+ * out fills up. Returns 0 on success (check *in_used / *out_len), -1 if the
+ * stream is corrupt or references history outside the window.
+ */
+int packr_lz77_decompress_stream(packr_lz77_dstream_t *ctx, const uint8_t *in, size_t in_len, size_t *in_used,
+                                 uint8_t *out, size_t out_cap, size_t *out_len);
 
 void packr_decoder_init(packr_decoder_t *ctx, const uint8_t *data, size_t size);
+void packr_decoder_init_ex(packr_decoder_t *ctx, const uint8_t *data, size_t size, uint8_t *arena, size_t arena_cap);
 int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end);
 void packr_decoder_destroy(packr_decoder_t *ctx);
 
+void packr_stream_decoder_init(packr_stream_decoder_t *sd, uint8_t *stage, size_t stage_cap, packr_writer_t *out,
+                               uint8_t *arena, size_t arena_cap);
+/*
+ * Returns 0 when it needs more input, 1 once the frame's value is complete
+ * (later input is ignored), -1 on a corrupt frame, an element that does
+ * not fit the stage or a Huffman transform (decode those whole). Flushes out
+ * before returning.
+ */
+int packr_decoder_feed(packr_stream_decoder_t *sd, const uint8_t *chunk, size_t len);
+void packr_stream_decoder_destroy(packr_stream_decoder_t *sd);
+
+void packr_writer_init(packr_writer_t *w, char *buf, size_t cap, packr_write_func write_cb, void *user_data);
+/* Hands pending bytes to write_cb. Returns 0 on success */
+int packr_writer_flush(packr_writer_t *w);
+/* As packr_decode_next, into a writer. Call packr_writer_flush when done */
+int packr_decode_to(packr_decoder_t *ctx, packr_writer_t *w);
+
+/* Random Access (frames written with a seek table) */
+uint32_t packr_decoder_block_count(const packr_decoder_t *ctx);
+/* First record index of block. Returns 0 on success */
+int packr_decoder_block_info(const packr_decoder_t *ctx, uint32_t block, uint32_t *first_record);
+/* Decodes the records of one block, comma separated. Returns 0 on success, -1 on error */
+int packr_decode_block(packr_decoder_t *ctx, uint32_t block, char **cursor, char *end);
+int packr_decode_block_to(packr_decoder_t *ctx, uint32_t block, packr_writer_t *w);
+/*
+ * Sets up ctx to read the same frame as src with its own dictionaries, e.g.
+ * to decode blocks on another thread. src must outlive ctx.
+ */
+void packr_decoder_attach(packr_decoder_t *ctx, const packr_decoder_t *src);
+
+/*
+ * Typed Columns
+ * packr_decode_columns decodes the frame's value like packr_decode_to, but
+ * hands each top-level column batch (a whole array of records, or each
+ * streamed chunk of one) to batch_cb as typed arrays instead of formatting
+ * it. The arrays are only valid during the call; a non-zero return stops
+ * decoding. A value that isn't column batches is written to w as JSON
+ * (w NULL: fails). The fields of nested objects the encoder flattened into
+ * the batch come as columns of their own named by path ("sensor.gps.lat").
+ * Returns 1 on success, 0 on error.
+ */
+typedef enum {
+    PACKR_COLUMN_NULL,    /* no row has a value */
+    PACKR_COLUMN_INT32,
+    PACKR_COLUMN_DOUBLE,
+    PACKR_COLUMN_STRING,  /* contents between the quotes, JSON escapes kept */
+    PACKR_COLUMN_BOOL,
+    PACKR_COLUMN_JSON     /* mixed or nested values, each as JSON text */
+} packr_column_type_t;
+
+typedef struct {
+    const char *str;
+    size_t len;
+} packr_str_t;
+
+typedef struct {
+    const char *name;
+    packr_column_type_t type;
+    union {
+        const int32_t *ints;
+        const double *doubles;
+        const packr_str_t *strings; /* STRING and JSON */
+        const uint8_t *bools;
+    };
+    const uint8_t *nulls;  /* per row: 1 = value, 0 = null or missing (the slot then reads 0 / empty) */
+} packr_decoded_column_t;
+
+typedef int (*packr_batch_func)(void *user_data, const packr_decoded_column_t *cols, uint32_t col_count,
+                                uint32_t rows);
+
+int packr_decode_columns(packr_decoder_t *ctx, packr_batch_func batch_cb, void *user_data, packr_writer_t *w);
+
+/* Stats (see PACKR_STATS): copy the counters out, or zero them. Get returns -1 when built without */
+int packr_encoder_get_stats(const packr_encoder_t *ctx, packr_stats_t *stats);
+void packr_encoder_reset_stats(packr_encoder_t *ctx);
+int packr_decoder_get_stats(const packr_decoder_t *ctx, packr_stats_t *stats);
+void packr_decoder_reset_stats(packr_decoder_t *ctx);
+
+/* Primers */
+/* Checks a serialized primer and points primer at it. Returns 0 on success */
+int packr_primer_init(packr_primer_t *primer, const uint8_t *data, size_t size);
+/*
+ * Serializes a primer (up to PACKR_DICT_SIZE entries per list) into out.
+ * Returns its size, or 0 if it does not fit in out_cap or the input is invalid.
+ */
+size_t packr_primer_build(uint8_t *out, size_t out_cap, uint8_t id,
+                          const packr_primer_entry_t *fields, size_t field_count,
+                          const packr_primer_entry_t *strings, size_t string_count,
+                          const packr_primer_entry_t *macs, size_t mac_count);
+/* Loads the primer and names it in the frame. Call before encoding anything. Returns 0 on success */
+int packr_encoder_set_primer(packr_encoder_t *ctx, const packr_primer_t *primer);
+/*
+ * Loads the primer the frame names from primers. Call after init, before
+ * decoding. Returns 0 on success (or if the frame names none), -1 if it is
+ * not among primers; decoding such a frame without it fails.
+ */
+int packr_decoder_set_primers(packr_decoder_t *ctx, const packr_primer_t *const *primers, size_t count);
+/* Primers for frames fed later; the array must outlive sd */
+void packr_stream_decoder_set_primers(packr_stream_decoder_t *sd, const packr_primer_t *const *primers, size_t count);
+
 /* Helpers needed by JSON parser */
 int packr_encode_varint(packr_encoder_t *ctx, uint32_t value);
+int packr_encode_varint64(packr_encoder_t *ctx, uint64_t value);
+/* Untokenized payload bytes (goes through flush and CRC like everything else) */
+int packr_encode_raw(packr_encoder_t *ctx, const uint8_t *data, size_t len);
 uint32_t zigzag_encode(int32_t value);
+uint64_t zigzag_encode64(int64_t value);
+/*
+ * Starts a batch header with field_names (see Schema Cache): writes
+ * TOKEN_SCHEMA_REPEAT or TOKEN_SCHEMA_REF + slot and returns 1 if they are
+ * cached, so the header leaves the names out. Otherwise caches them, writes
+ * TOKEN_SCHEMA_DEF and returns 0 (or writes nothing, inside another batch
+ * or if there is no memory). -1 on error.
+ */
+int packr_encode_schema(packr_encoder_t *ctx, char **field_names, int count);
 
 /* Memory Tracking */
 void* packr_malloc(size_t size);
@@ -179,7 +861,17 @@ void packr_reset_alloc_stats(void);
 
 /* LZ77 / Transform */
 size_t packr_lz77_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap);
+/* As packr_lz77_compress at a PACKR_LZ77_* level, matching up to window bytes back (0 = default) */
+size_t packr_lz77_compress_ex(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap,
+                              int level, size_t window);
 size_t packr_lz77_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap);
+size_t packr_lz77_decompressed_size(const uint8_t *in, size_t in_len);
+/* Bytes of in the payload takes up (all of it if streamed), 0 if truncated */
+size_t packr_lz77_stream_length(const uint8_t *in, size_t in_len);
+#if PACKR_STATS
+/* Adds a payload's literal and match bytes to the lz77_* counters of stats */
+void packr_lz77_count(const uint8_t *in, size_t in_len, packr_stats_t *stats);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,221 @@
+/*
+ * PACKR - Bit I/O
+ * MSB-first bit writer and reader shared by the Rice column coder and the
+ * Huffman transform. Bits go through a 64-bit accumulator, so a field (or a
+ * whole Rice code) is one shift/OR and unary runs are counted with clz. The
+ * byte stream is the same as writing one bit at a time.
+ */
+
+#ifndef PACKR_BITIO_H
+#define PACKR_BITIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returned by the reader when the data runs out */
+#define PACKR_BITIO_ERROR 0xFFFFFFFFu
+/* Longest unary run the reader accepts */
+#define PACKR_BITIO_MAX_UNARY 65536u
+
+static inline int packr_clz64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return v ? __builtin_clzll(v) : 64;
+#else
+    int n = 0;
+    if (!v) return 64;
+    while (!(v & 0x8000000000000000ULL)) { v <<= 1; n++; }
+    return n;
+#endif
+}
+
+/* Writer */
+
+typedef struct {
+    uint8_t *buf;
+    size_t cap;
+    size_t pos;     /* bytes written, stops at cap */
+    uint64_t acc;   /* pending bits in the low cnt bits */
+    int cnt;        /* < 32 between calls */
+} packr_bitwriter_t;
+
+static inline void packr_bw_init(packr_bitwriter_t *bw, uint8_t *buf, size_t cap) {
+    bw->buf = buf;
+    bw->cap = cap;
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->cnt = 0;
+}
+
+static inline void packr_bw_byte(packr_bitwriter_t *bw, uint8_t b) {
+    if (bw->pos < bw->cap) bw->buf[bw->pos++] = b;
+}
+
+/* Writes the low bits (0..32) of val */
+static inline void packr_bw_put(packr_bitwriter_t *bw, uint32_t val, int bits) {
+    if (bits <= 0) return;
+    uint64_t mask = (bits == 32) ? 0xFFFFFFFFu : ((1u << bits) - 1);
+    bw->acc = (bw->acc << bits) | (val & mask);
+    bw->cnt += bits;
+
+    if (bw->cnt >= 32) {
+        uint32_t w = (uint32_t)(bw->acc >> (bw->cnt - 32));
+        bw->cnt -= 32;
+        if (bw->pos + 4 <= bw->cap) {
+            bw->buf[bw->pos] = (uint8_t)(w >> 24);
+            bw->buf[bw->pos + 1] = (uint8_t)(w >> 16);
+            bw->buf[bw->pos + 2] = (uint8_t)(w >> 8);
+            bw->buf[bw->pos + 3] = (uint8_t)w;
+            bw->pos += 4;
+        } else {
+            packr_bw_byte(bw, (uint8_t)(w >> 24));
+            packr_bw_byte(bw, (uint8_t)(w >> 16));
+            packr_bw_byte(bw, (uint8_t)(w >> 8));
+            packr_bw_byte(bw, (uint8_t)w);
+        }
+    }
+}
+
+/* q zeros, then a one */
+static inline void packr_bw_put_unary(packr_bitwriter_t *bw, uint32_t q) {
+    while (q >= 32) {
+        packr_bw_put(bw, 0, 32);
+        q -= 32;
+    }
+    packr_bw_put(bw, 1, (int)q + 1);
+}
+
+/* Rice code of u with parameter k: unary(u >> k), then the low k bits */
+static inline void packr_bw_put_rice(packr_bitwriter_t *bw, uint32_t u, int k) {
+    uint32_t q = u >> k;
+    uint32_t r = u & ((1u << k) - 1);
+    if (q + 1 + (uint32_t)k <= 32) {
+        packr_bw_put(bw, (1u << k) | r, (int)q + 1 + k);
+    } else {
+        packr_bw_put_unary(bw, q);
+        packr_bw_put(bw, r, k);
+    }
+}
+
+/* Writes out the pending bits, zero padding the last byte */
+static inline void packr_bw_flush(packr_bitwriter_t *bw) {
+    while (bw->cnt >= 8) {
+        bw->cnt -= 8;
+        packr_bw_byte(bw, (uint8_t)(bw->acc >> bw->cnt));
+    }
+    if (bw->cnt > 0) packr_bw_byte(bw, (uint8_t)(bw->acc << (8 - bw->cnt)));
+    bw->acc = 0;
+    bw->cnt = 0;
+}
+
+/* Reader */
+
+typedef struct {
+    const uint8_t *buf;
+    size_t cap;
+    size_t pos;     /* bytes loaded into acc */
+    uint64_t acc;   /* next bit is bit 63 */
+    int cnt;        /* valid bits in acc */
+} packr_bitreader_t;
+
+static inline void packr_br_init(packr_bitreader_t *br, const uint8_t *buf, size_t cap) {
+    br->buf = buf;
+    br->cap = cap;
+    br->pos = 0;
+    br->acc = 0;
+    br->cnt = 0;
+}
+
+static inline void packr_br_refill(packr_bitreader_t *br) {
+    if (br->pos + 8 <= br->cap && br->cnt < 64) {
+        const uint8_t *p = br->buf + br->pos;
+        uint64_t w = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) |
+                     ((uint64_t)p[3] << 32) | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                     ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+        /* Bits past the whole bytes taken are loaded again, in place, next time */
+        int n = (63 - br->cnt) >> 3;
+        br->acc |= w >> br->cnt;
+        br->pos += (size_t)n;
+        br->cnt += n * 8;
+        return;
+    }
+    while (br->cnt <= 56 && br->pos < br->cap) {
+        br->acc |= (uint64_t)br->buf[br->pos++] << (56 - br->cnt);
+        br->cnt += 8;
+    }
+}
+
+/* Reads a field of 0..32 bits, PACKR_BITIO_ERROR if the data runs out */
+static inline uint32_t packr_br_get(packr_bitreader_t *br, int bits) {
+    if (bits <= 0) return 0;
+    if (bits > 32) return PACKR_BITIO_ERROR;
+    if (br->cnt < bits) {
+        packr_br_refill(br);
+        if (br->cnt < bits) return PACKR_BITIO_ERROR;
+    }
+    uint32_t v = (uint32_t)(br->acc >> (64 - bits));
+    br->acc <<= bits;
+    br->cnt -= bits;
+    return v;
+}
+
+/* The next bits (1..32) without taking them, zero filled past the end of the data */
+static inline uint32_t packr_br_peek(packr_bitreader_t *br, int bits) {
+    if (br->cnt < bits) packr_br_refill(br);
+    return (uint32_t)(br->acc >> (64 - bits));
+}
+
+/* Takes bits already looked at with packr_br_peek. Returns 0, or -1 if the data ran out */
+static inline int packr_br_skip(packr_bitreader_t *br, int bits) {
+    if (br->cnt < bits) return -1;
+    br->acc <<= bits;
+    br->cnt -= bits;
+    return 0;
+}
+
+/* Counts zeros up to and including the next one */
+static inline uint32_t packr_br_get_unary(packr_bitreader_t *br) {
+    uint32_t q = 0;
+    for (;;) {
+        if (br->cnt == 0) {
+            packr_br_refill(br);
+            if (br->cnt == 0) return PACKR_BITIO_ERROR;
+        }
+        int z = packr_clz64(br->acc);
+        if (z < br->cnt) {
+            q += (uint32_t)z;
+            br->acc = (br->acc << z) << 1;
+            br->cnt -= z + 1;
+            return q > PACKR_BITIO_MAX_UNARY ? PACKR_BITIO_ERROR : q;
+        }
+        q += (uint32_t)br->cnt;
+        br->acc = 0;
+        br->cnt = 0;
+        if (q > PACKR_BITIO_MAX_UNARY) return PACKR_BITIO_ERROR;
+    }
+}
+
+/* Reads one Rice code into u. Returns 0, or -1 if the data runs out */
+static inline int packr_br_get_rice(packr_bitreader_t *br, int k, uint32_t *u) {
+    if (k < 0 || k > 31) return -1;
+    uint32_t q = packr_br_get_unary(br);
+    if (q == PACKR_BITIO_ERROR) return -1;
+    uint32_t r = packr_br_get(br, k);
+    if (r == PACKR_BITIO_ERROR) return -1;
+    *u = (q << k) | r;
+    return 0;
+}
+
+/* Bytes consumed so far, counting a partly read byte */
+static inline size_t packr_br_used(const packr_bitreader_t *br) {
+    return br->pos - (size_t)(br->cnt >> 3);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
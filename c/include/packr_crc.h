@@ -0,0 +1,43 @@
+/*
+ * PACKR - CRC-32
+ * The frame checksum (IEEE 802.3 polynomial, reflected, as zlib). Slice-by-8
+ * tables in portable C, PCLMULQDQ folding on x86 when the CPU has it, the
+ * ARMv8 CRC32 instructions when the target has them, and the ROM routine on
+ * ESP32.
+ */
+
+#ifndef PACKR_CRC_H
+#define PACKR_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Table slices of the portable path: 1 (1 KB), 8 (8 KB) or 16 (16 KB) */
+#ifndef PACKR_CRC_SLICES
+#define PACKR_CRC_SLICES 8
+#endif
+
+/*
+ * Running CRC: start from 0xFFFFFFFF, feed the data in any number of
+ * pieces, the CRC is the result ^ 0xFFFFFFFF.
+ */
+uint32_t packr_crc32_update(uint32_t crc, const uint8_t *data, size_t len);
+
+/* CRC of data in one go */
+uint32_t packr_crc32(const uint8_t *data, size_t len);
+
+/* CRC of A followed by B, from crc_a = CRC(A), crc_b = CRC(B) and B's length */
+uint32_t packr_crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+
+/* Backend picked for this CPU: "pclmul", "armv8", "esp32-rom" or "slice-by-N" */
+const char *packr_crc32_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * PACKR - Number Formatting and Parsing
+ * Locale-independent replacements for the printf conversions the decoder
+ * uses (output is byte-identical to the matching printf format) and for
+ * the strtol/strtod calls of the JSON front end. Also the text forms of
+ * the typed string tokens.
+ */
+
+#ifndef PACKR_FORMAT_H
+#define PACKR_FORMAT_H
+
+#include "packr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set PACKR_FAST_FORMAT=0 to go back to snprintf and strtod */
+#ifndef PACKR_FAST_FORMAT
+#define PACKR_FAST_FORMAT 1
+#endif
+
+/* Worst case output of packr_format_g, "-1.2345678901234567e-308" */
+#define PACKR_FORMAT_MAX 32
+
+/* "%u" / "%d". Returns the length, out needs 11 bytes. Not NUL terminated */
+size_t packr_format_u32(char *out, uint32_t value);
+size_t packr_format_i32(char *out, int32_t value);
+
+/*
+ * "%.<precision>g" with exact round-half-even, precision 1..17.
+ * Returns the length, out needs PACKR_FORMAT_MAX bytes. Not NUL terminated.
+ */
+size_t packr_format_g(char *out, double value, int precision);
+
+/* packr_parse_number results */
+#define PACKR_NUMBER_INT   0
+#define PACKR_NUMBER_FLOAT 1
+
+/*
+ * Parses the JSON number s[0..len), no NUL needed. Integers (no '.', 'e'
+ * or 'E') also go to *i, wrapped to int32 as (int32_t)strtol does on LP64
+ * hosts; *d always gets the correctly rounded value. Returns
+ * PACKR_NUMBER_INT or PACKR_NUMBER_FLOAT.
+ */
+int packr_parse_number(const char *s, size_t len, int32_t *i, double *d);
+
+/*
+ * Typed strings (see packr.h). The parsers take s[0..len), no NUL needed,
+ * and only accept text the matching formatter gives back byte for byte.
+ * They return 0 on success. The formatters return the length (0 if the
+ * value has no text form, from a corrupt frame), not NUL terminated.
+ */
+#define PACKR_UUID_LEN 36
+#define PACKR_IPV4_MAX 15
+#define PACKR_TYPED_MAX PACKR_UUID_LEN /* longest of the three */
+
+int packr_parse_timestamp(const char *s, size_t len, packr_timestamp_t *ts);
+/* out needs PACKR_TIMESTAMP_MAX bytes */
+size_t packr_format_timestamp(char *out, const packr_timestamp_t *ts);
+int packr_parse_uuid(const char *s, size_t len, uint8_t uuid[16], bool *upper);
+/* out needs PACKR_UUID_LEN bytes */
+size_t packr_format_uuid(char *out, const uint8_t uuid[16], bool upper);
+int packr_parse_ipv4(const char *s, size_t len, uint8_t ip[4]);
+/* out needs PACKR_IPV4_MAX bytes */
+size_t packr_format_ipv4(char *out, const uint8_t ip[4]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
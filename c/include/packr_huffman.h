@@ -0,0 +1,50 @@
+/*
+ * PACKR - Canonical Huffman
+ * Entropy stage of the frame transforms (0xFE 0x04 = Huffman, 0xFE 0x05 =
+ * LZ77 then Huffman), in the format of the Python reference:
+ *
+ *   0x01 | u32 LE length | u16 LE symbol count | (symbol, code length)...
+ *        | MSB-first codes, zero padded
+ *   0x02 | u32 LE length | symbol       (one symbol repeated)
+ *
+ * Pairs are sorted by (code length, symbol) and codes are numbered in that
+ * order. The encoder keeps codes to PACKR_HUFF_ENC_BITS so the decoder's
+ * lookup table resolves each one in a single step; longer codes (up to 15,
+ * from other encoders) take a short walk. Neither side allocates; each
+ * needs under 6 KB of stack.
+ */
+
+#ifndef PACKR_HUFFMAN_H
+#define PACKR_HUFFMAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PACKR_HUFF_MAX_BITS     15  /* longest code the format allows */
+#define PACKR_HUFF_ENC_BITS     11  /* longest code the encoder writes */
+#define PACKR_HUFF_LOOKUP_BITS  11  /* decoder table: 2^11 entries of 2 bytes */
+
+/* Exact output size of packr_huffman_compress, 0 if in_len is 0 */
+size_t packr_huffman_size(const uint8_t *in, size_t in_len);
+
+/* Returns the compressed length, 0 if in_len is 0 or it does not fit out_cap */
+size_t packr_huffman_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap);
+
+/* Length field of a payload, 0 if in is too short to hold one */
+size_t packr_huffman_decompressed_size(const uint8_t *in, size_t in_len);
+
+/*
+ * Returns the decompressed length, 0 on a corrupt or truncated payload or
+ * one larger than out_cap. in_used (may be NULL) gets the bytes it took up.
+ */
+size_t packr_huffman_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *in_used);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
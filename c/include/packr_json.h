@@ -17,6 +17,22 @@ extern "C" {
  */
 int json_encode_to_packr(const char *json, size_t len, packr_encoder_t *enc);
 
+/*
+ * Walks the records of a top-level JSON array without parsing them.
+ * json_array_begin returns 0 if json starts with an array, -1 otherwise.
+ * json_array_next returns 1 with the record's [start, start + rec_len) span,
+ * 0 after the last record, or -1 on malformed input.
+ */
+typedef struct {
+    const char *json;
+    size_t len;
+    size_t pos;
+    int done;
+} json_array_iter_t;
+
+int json_array_begin(json_array_iter_t *it, const char *json, size_t len);
+int json_array_next(json_array_iter_t *it, size_t *start, size_t *rec_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,61 @@
+/*
+ * PACKR - Block-Parallel Encoder & Multi-Block Container
+ */
+
+#ifndef PACKR_PARALLEL_H
+#define PACKR_PARALLEL_H
+
+#include "packr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Container Layout
+ *   "PKRM" | version | varint block_count
+ *   block_count x (varint frame_len, varint record_count)
+ *   frames, back to back
+ * Every frame is a complete, independent PACKR frame (own dictionaries and
+ * CRC) that decodes to a JSON array holding that block's records.
+ */
+#define PACKR_CONTAINER_MAGIC   0x4D524B50  /* "PKRM" LE */
+#define PACKR_CONTAINER_VERSION 0x01
+
+/* Target JSON bytes per block when block_bytes is 0 */
+#ifndef PACKR_PARALLEL_BLOCK_BYTES
+#define PACKR_PARALLEL_BLOCK_BYTES (1024 * 1024)
+#endif
+
+/*
+ * Splits a top-level JSON array at record boundaries and encodes the blocks
+ * on up to nthreads workers. Blocks are at least block_bytes of JSON (0 =
+ * default), shrunk if needed so every thread gets work. Input that is not an
+ * array is encoded as a single block.
+ * Writes the container to out and its length to *out_len.
+ * Returns 0 on success, non-zero on error (including out_cap too small).
+ */
+int packr_encode_parallel(const char *json, size_t len, int nthreads, bool compress, size_t block_bytes,
+                          uint8_t *out, size_t out_cap, size_t *out_len);
+
+/* Container Reader */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    uint32_t block_count;
+    size_t index_pos;  /* first index entry */
+    size_t data_pos;   /* first frame */
+} packr_container_t;
+
+/* Returns 0 if data holds a valid container header and index */
+int packr_container_open(packr_container_t *c, const uint8_t *data, size_t size);
+
+/* Locates block `index` by walking the index. Returns 0 on success */
+int packr_container_block(const packr_container_t *c, uint32_t index,
+                          const uint8_t **frame, size_t *frame_len, uint32_t *records);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
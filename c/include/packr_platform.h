@@ -6,6 +6,7 @@
 #define PACKR_PLATFORM_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 
 #ifdef __cplusplus
@@ -63,13 +64,136 @@ static inline void packr_store_le32(void *ptr, uint32_t val) {
 
 #endif
 
-/* 
- * SIMD Hooks (Placeholder for ESP32-S3 PIE or others)
- * Returns length of match or 0 if SIMD not used/available.
+/*
+ * Atomics for library-global state (alloc stats, lazy tables), so several
+ * encoders may run on different threads. Single-threaded targets without
+ * GCC builtins fall back to plain accesses.
  */
+#if defined(__GNUC__) || defined(__clang__)
+    #define packr_atomic_add(p, v)      __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+    #define packr_atomic_sub(p, v)      __atomic_sub_fetch((p), (v), __ATOMIC_RELAXED)
+    #define packr_atomic_load(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+    #define packr_atomic_store(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+    #define packr_atomic_cas(p, e, v)   __atomic_compare_exchange_n((p), (e), (v), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+    #define packr_atomic_add(p, v)      (*(p) += (v))
+    #define packr_atomic_sub(p, v)      (*(p) -= (v))
+    #define packr_atomic_load(p)        (*(p))
+    #define packr_atomic_store(p, v)    (*(p) = (v))
+    #define packr_atomic_cas(p, e, v)   (*(p) == *(e) ? (*(p) = (v), 1) : (*(e) = *(p), 0))
+#endif
+
+/*
+ * Match Length
+ * Number of equal leading bytes of p1 and p2, up to max_len. Only the first
+ * max_len bytes of each are read. SSE2/AVX2 and NEON compare 16-32 bytes
+ * per step, other targets with unaligned loads (Xtensa included) compare
+ * 8 or 4 byte words and find the first difference with ctz. Set
+ * PACKR_SIMD=0 to leave out the vector paths.
+ */
+#ifndef PACKR_SIMD
+#define PACKR_SIMD 1
+#endif
+
+#if PACKR_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    #define PACKR_MATCH_SSE2 1
+    #include <emmintrin.h>
+    #if defined(__AVX2__)
+        #define PACKR_MATCH_AVX2 1
+        #include <immintrin.h>
+    #endif
+#elif PACKR_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+    #define PACKR_MATCH_NEON 1
+    #include <arm_neon.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define PACKR_MATCH_WORDS 0 /* ctz finds the first byte on little endian only */
+#elif PACKR_UNALIGNED_ACCESS || defined(__aarch64__) || defined(__ARM_FEATURE_UNALIGNED)
+    #define PACKR_MATCH_WORDS 1
+#else
+    #define PACKR_MATCH_WORDS 0
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+    #include <intrin.h>
+#endif
+
+/* Trailing zero bits, v != 0 */
+static inline unsigned packr_ctz32(uint32_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(v);
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return (unsigned)i;
+#else
+    unsigned n = 0;
+    while (!(v & 1)) { v >>= 1; n++; }
+    return n;
+#endif
+}
+
+static inline unsigned packr_ctz64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctzll(v);
+#else
+    uint32_t lo = (uint32_t)v;
+    return lo ? packr_ctz32(lo) : 32 + packr_ctz32((uint32_t)(v >> 32));
+#endif
+}
+
 static inline size_t packr_simd_match_len(const uint8_t *p1, const uint8_t *p2, size_t max_len) {
-    // TODO: Implement ESP32-S3 PIE specific instructions here later
-    return 0; 
+    size_t len = 0;
+
+#if PACKR_MATCH_AVX2
+    while (len + 32 <= max_len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p1 + len));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p2 + len));
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (m) return len + packr_ctz32(m);
+        len += 32;
+    }
+#endif
+#if PACKR_MATCH_SSE2
+    while (len + 16 <= max_len) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p1 + len));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p2 + len));
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFFu;
+        if (m) return len + packr_ctz32(m);
+        len += 16;
+    }
+#elif PACKR_MATCH_NEON
+    while (len + 16 <= max_len) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(p1 + len), vld1q_u8(p2 + len));
+        /* No movemask: narrowing shift leaves 4 bits per byte */
+        uint64_t m = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (m) return len + (packr_ctz64(m) >> 2);
+        len += 16;
+    }
+#endif
+
+#if PACKR_MATCH_WORDS
+    #if UINTPTR_MAX > 0xFFFFFFFFu
+    while (len + 8 <= max_len) {
+        uint64_t a, b;
+        memcpy(&a, p1 + len, 8);
+        memcpy(&b, p2 + len, 8);
+        if (a != b) return len + (packr_ctz64(a ^ b) >> 3);
+        len += 8;
+    }
+    #endif
+    while (len + 4 <= max_len) {
+        uint32_t a, b;
+        memcpy(&a, p1 + len, 4);
+        memcpy(&b, p2 + len, 4);
+        if (a != b) return len + (packr_ctz32(a ^ b) >> 3);
+        len += 4;
+    }
+#endif
+
+    while (len < max_len && p1[len] == p2[len]) len++;
+    return len;
 }
 
 
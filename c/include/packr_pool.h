@@ -0,0 +1,93 @@
+/*
+ * PACKR - Stream Context Pool
+ */
+
+#ifndef PACKR_POOL_H
+#define PACKR_POOL_H
+
+#include "packr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Many long-lived streaming encoders (one per device, connection, ...) with
+ * at most max_active of them live at a time. Each live stream runs on an
+ * engine: an encoder plus its work buffer. Touching a stream that has none
+ * takes a free engine or suspends the least recently used live stream (see
+ * packr_encoder_suspend) to free one, and resumes the stream's snapshot on
+ * it. Idle streams cost their snapshot and a packr_pool_stream_t, and LZ77
+ * hash tables are shared through a packr_lz77_hash_pool_t, so memory
+ * follows the live streams, not the open ones.
+ * Not thread safe: use one pool per thread, or lock around it.
+ */
+#define PACKR_POOL_NONE 0xFFFFFFFFu
+
+typedef struct {
+    packr_encoder_t enc;
+    uint32_t stream;      /* stream running on it, PACKR_POOL_NONE = free */
+    uint64_t last_used;
+    uint8_t work[];       /* work_cap bytes */
+} packr_pool_engine_t;
+
+typedef struct {
+    packr_pool_engine_t *engine; /* NULL = suspended (or closed) */
+    uint8_t *snap;        /* suspended state */
+    size_t snap_len;
+    size_t snap_cap;      /* bytes allocated, more than snap_len if it kept the scratch buffer */
+    packr_flush_func flush_cb;
+    void *user_data;
+    uint32_t next_free;   /* closed ids, reused first */
+    bool open;
+} packr_pool_stream_t;
+
+typedef struct {
+    packr_pool_stream_t *streams;
+    uint32_t stream_count;
+    uint32_t stream_cap;
+    uint32_t free_head;   /* first closed id, PACKR_POOL_NONE = none */
+
+    packr_pool_engine_t **engines; /* max_active slots, allocated on first use */
+    size_t max_active;
+    size_t work_cap;
+    bool compress;
+    const packr_primer_t *primer;
+    packr_lz77_hash_pool_t hashes;
+
+    uint8_t *scratch;     /* snapshots are written here, then copied at their size (or kept if that fails) */
+    size_t scratch_cap;
+    size_t snap_bytes;    /* held by suspended streams */
+    uint64_t clock;
+} packr_ctx_pool_t;
+
+/*
+ * Every stream gets the same settings: compress, a work buffer of work_cap
+ * bytes and primer (NULL = none, must outlive the pool). Returns 0 on success.
+ */
+int packr_pool_init(packr_ctx_pool_t *pool, size_t max_active, bool compress, size_t work_cap,
+                    const packr_primer_t *primer);
+/* Drops every stream without finishing its frame, and frees everything */
+void packr_pool_destroy(packr_ctx_pool_t *pool);
+
+/* Starts a stream (its frame header goes to flush_cb) and returns its id in *id. Returns 0 on success */
+int packr_pool_open(packr_ctx_pool_t *pool, packr_flush_func flush_cb, void *user_data, uint32_t *id);
+/*
+ * The stream's encoder, resumed if it was suspended, or NULL on error. It
+ * stays valid until the next packr_pool_* call, which may suspend it; leave
+ * it between values (not inside a batch) before then.
+ */
+packr_encoder_t *packr_pool_acquire(packr_ctx_pool_t *pool, uint32_t id);
+/* Suspends a live stream now (e.g. when its device goes quiet). Returns 0 on success */
+int packr_pool_suspend(packr_ctx_pool_t *pool, uint32_t id);
+/* Finishes the stream's frame (CRC, final LZ77 flush) and frees the id. Returns 0 on success */
+int packr_pool_close(packr_ctx_pool_t *pool, uint32_t id);
+
+/* Bytes held by the pool: engines, hash tables, snapshots and stream slots */
+size_t packr_pool_memory(const packr_ctx_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * PACKR - JSON Byte Scanning
+ * Finds the next byte the parser cares about without looking at every
+ * byte in C. SSE2/AVX2 on x86 and NEON on AArch64 check 16-32 bytes per
+ * step, everything else (MCUs) uses the plain loops.
+ */
+
+#ifndef PACKR_SCAN_H
+#define PACKR_SCAN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set PACKR_SIMD=0 to build only the scalar scanner */
+#ifndef PACKR_SIMD
+#define PACKR_SIMD 1
+#endif
+
+/*
+ * All return the position of the first matching byte in s[pos, len), or
+ * len if there is none.
+ */
+
+/* '"' or '\\' (the end of a string body) */
+size_t packr_scan_string(const char *s, size_t pos, size_t len);
+/* '"', '{', '}', '[' or ']' (the bytes that change nesting outside strings) */
+size_t packr_scan_nesting(const char *s, size_t pos, size_t len);
+/* Not whitespace, as isspace() in the C locale */
+size_t packr_scan_space(const char *s, size_t pos, size_t len);
+
+/* Scanner picked for this CPU: "avx2", "sse2", "neon" or "scalar" */
+const char *packr_scan_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * PACKR - Struct Encoders
+ *
+ * Encodes C structs straight to the tokens json_encode_to_packr would
+ * write for their JSON, with no text generated or parsed. The struct is
+ * described once as an X-macro list of (member, type) pairs:
+ *
+ *   typedef struct { uint32_t id; float temp; bool ok; const char *site; } reading_t;
+ *
+ *   #define READING_FIELDS(X) X(id, INT) X(temp, DOUBLE) X(ok, BOOL) X(site, STRING)
+ *
+ *   PACKR_STRUCT_ENCODER(reading, reading_t, READING_FIELDS)
+ *
+ * which defines
+ *   int packr_encode_reading(packr_encoder_t *enc, const reading_t *v);
+ *   int packr_encode_reading_array(packr_encoder_t *enc, const reading_t *v, size_t count);
+ *
+ * The first writes one object, the second an array of them as column
+ * batches (a plain array below PACKR_STRUCT_MIN_ROWS). Both return 0 on
+ * success. Key names and lengths, the column list and the column types are
+ * fixed at compile time; only the dictionary lookups, which depend on what
+ * the stream has seen, are left to run time.
+ *
+ * Types: INT (any integer member, as int32), DOUBLE (float or double),
+ * BOOL, STRING (NUL terminated char pointer or array, NULL reads as "") and
+ * MAC ("AA:BB:CC:DD:EE:FF", a string column in arrays, as in JSON). Strings
+ * are copied as is, so they must not need JSON escaping. As in JSON, those
+ * holding timestamps, UUIDs or IPv4 addresses go as their typed tokens, and
+ * a string column all of timestamps as a TIME column.
+ */
+
+#ifndef PACKR_STRUCT_H
+#define PACKR_STRUCT_H
+
+#include "packr.h"
+#include "packr_ultra.h"
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Same batch limits as the JSON encoder */
+#define PACKR_STRUCT_BATCH_ROWS 128
+#define PACKR_STRUCT_MIN_ROWS   4
+
+typedef void (*packr_struct_fill_func)(packr_column_t *cols, const void *items, size_t first, size_t rows);
+typedef int (*packr_struct_item_func)(packr_encoder_t *ctx, const void *item);
+
+/*
+ * Encodes count items of item_size bytes as an array: column batches of up
+ * to PACKR_STRUCT_BATCH_ROWS rows filled by fill, or encode_item for each
+ * one if there are too few. What PACKR_STRUCT_ENCODER's _array calls.
+ */
+int packr_encode_struct_array(packr_encoder_t *ctx, const void *items, size_t count, size_t item_size,
+                              int col_count, const char *const *names, const col_type_t *types,
+                              packr_struct_fill_func fill, packr_struct_item_func encode_item);
+
+static inline int packr_struct_put_string(packr_encoder_t *ctx, const char *s) {
+    return s ? packr_encode_typed(ctx, s, strlen(s)) : packr_encode_string(ctx, "", 0);
+}
+
+/* One member of an object */
+#define PACKR_STRUCT_PUT_INT(enc, x)    packr_encode_int(enc, (int32_t)(x))
+#define PACKR_STRUCT_PUT_DOUBLE(enc, x) packr_encode_double(enc, (double)(x))
+#define PACKR_STRUCT_PUT_BOOL(enc, x)   packr_encode_bool(enc, (x) != 0)
+#define PACKR_STRUCT_PUT_STRING(enc, x) packr_struct_put_string(enc, x)
+#define PACKR_STRUCT_PUT_MAC(enc, x)    packr_encode_mac(enc, x)
+
+#define PACKR_STRUCT_MEMBER_(m, t) \
+    if (ret == 0) ret = packr_encode_field(enc, #m, sizeof(#m) - 1); \
+    if (ret == 0) ret = PACKR_STRUCT_PUT_##t(enc, v->m);
+
+/* One row of a column */
+#define PACKR_STRUCT_SET_INT(col, r, x)    (col)->ints[r] = (int32_t)(x)
+#define PACKR_STRUCT_SET_DOUBLE(col, r, x) (col)->floats[r] = (double)(x)
+#define PACKR_STRUCT_SET_BOOL(col, r, x)   (col)->bools[r] = (uint8_t)((x) != 0)
+#define PACKR_STRUCT_SET_STRING(col, r, x) (col)->strings[r] = (char *)(x)
+#define PACKR_STRUCT_SET_MAC(col, r, x)    (col)->strings[r] = (char *)(x)
+
+#define PACKR_STRUCT_FILL_(m, t) \
+    for (size_t r = 0; r < rows; r++) PACKR_STRUCT_SET_##t(col, r, v[r].m); \
+    col++;
+
+#define PACKR_STRUCT_COL_INT    COL_TYPE_INT
+#define PACKR_STRUCT_COL_DOUBLE COL_TYPE_FLOAT
+#define PACKR_STRUCT_COL_BOOL   COL_TYPE_BOOL
+#define PACKR_STRUCT_COL_STRING COL_TYPE_STRING
+#define PACKR_STRUCT_COL_MAC    COL_TYPE_STRING
+
+#define PACKR_STRUCT_NAME_(m, t) #m,
+#define PACKR_STRUCT_TYPE_(m, t) PACKR_STRUCT_COL_##t,
+
+#define PACKR_STRUCT_ENCODER(name, type, FIELDS) \
+    static inline int packr_encode_##name(packr_encoder_t *enc, const type *v) { \
+        int ret = packr_encode_token(enc, TOKEN_OBJECT_START); \
+        FIELDS(PACKR_STRUCT_MEMBER_) \
+        return ret ? ret : packr_encode_token(enc, TOKEN_OBJECT_END); \
+    } \
+    static inline int packr_encode_##name##_item(packr_encoder_t *enc, const void *item) { \
+        return packr_encode_##name(enc, (const type *)item); \
+    } \
+    static inline void packr_fill_##name(packr_column_t *cols, const void *items, size_t first, size_t rows) { \
+        const type *v = (const type *)items + first; \
+        packr_column_t *col = cols; \
+        FIELDS(PACKR_STRUCT_FILL_) \
+    } \
+    static inline int packr_encode_##name##_array(packr_encoder_t *enc, const type *v, size_t count) { \
+        static const char *const names[] = { FIELDS(PACKR_STRUCT_NAME_) }; \
+        static const col_type_t types[] = { FIELDS(PACKR_STRUCT_TYPE_) }; \
+        return packr_encode_struct_array(enc, v, count, sizeof(type), (int)(sizeof(names) / sizeof(names[0])), \
+                                         names, types, packr_fill_##name, packr_encode_##name##_item); \
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
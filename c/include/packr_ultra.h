@@ -9,9 +9,14 @@ typedef enum {
     COL_TYPE_STRING,
     COL_TYPE_BOOL,
     COL_TYPE_NULL,
-    COL_TYPE_CUSTOM
+    COL_TYPE_CUSTOM,
+    COL_TYPE_OBJECT,    /* nested object: its fields are the group columns after it */
+    COL_TYPE_TIME       /* ISO 8601 timestamps (see Typed Strings in packr.h) */
 } col_type_t;
 
+/* times[r].format of a TIME row without a timestamp (null or missing) */
+#define PACKR_TIME_NONE 0xFF
+
 struct packr_encoder_t; /* Forward declaration */
 
 typedef struct {
@@ -21,15 +26,45 @@ typedef struct {
         int32_t *ints;
         double *floats;
         char **strings;
-        uint8_t *bools;
+        uint8_t *bools;   /* also OBJECT: 1 = the row's value is null, not an object */
+        packr_timestamp_t *times;
         void **custom_data;
     };
     uint8_t *nulls; /* valid=1, null/missing=0 */
     
     /* Callback for custom encoding */
     int (*custom_encoder)(packr_encoder_t *ctx, void *data);
+
+    uint32_t group; /* OBJECT: columns nested in it, at any depth */
 } packr_column_t;
 
+/*
+ * An OBJECT column is written with flags 0x10 (| 0x08 missing rows | 0x01
+ * null rows) and a varint of the columns in its group, which follow it in
+ * the batch. Its values are the missing rows bitmap (as any column), then
+ * with 0x01 a bitmap of the rows that are null. A row where it is present
+ * and not null is an object holding the fields of its group present there.
+ *
+ * A TIME column whose present rows all have a timestamp of one format and
+ * offset, within 2^30 ticks of the first, is written with flags 0x20 (|
+ * 0x08 | 0x01 constant or 0x02 delta). After the missing rows bitmap come
+ * u8 format [| zigzag varint offset] | zigzag varint64 base ticks, then the
+ * rows as an INT column of ticks relative to the base (missing rows repeat
+ * the row before). Any other TIME column is RLE of TOKEN_TIMESTAMP values,
+ * with TOKEN_NULL for rows without one.
+ */
+
 int packr_encode_ultra_columns(packr_encoder_t *ctx, int row_count, int col_count, char **field_names, packr_column_t *columns, int partial);
 
+/*
+ * What the columns would cost as an ultra batch, in bytes past its header,
+ * as priced by the batch effort (at least PACKR_BATCH_BALANCED). Strings
+ * count as one token each. SIZE_MAX on error.
+ */
+size_t packr_ultra_cost(packr_encoder_t *ctx, int col_count, const packr_column_t *columns);
+/* The same for the rows written one by one as objects, schema aside */
+size_t packr_ultra_row_cost(int row_count, int col_count, const packr_column_t *columns);
+/* Rows start..start+count-1 of src as a column of their own, sharing its arrays */
+void packr_column_slice(packr_column_t *dst, const packr_column_t *src, size_t start, size_t count);
+
 #endif
@@ -2,33 +2,68 @@
  * PACKR - Core Implementation
  */
 
+/* CLOCK_MONOTONIC for the stats flush timing */
+#if defined(PACKR_STATS) && PACKR_STATS && !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "packr.h"
 #include "packr_platform.h"
+#include "packr_format.h"
+#include "packr_bitio.h"
+#include "packr_crc.h"
+#include "packr_huffman.h"
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
-
-/* CRC32 Table */
-static uint32_t crc32_table[256];
-static int crc32_table_inited = 0;
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+#if PACKR_STATS && !defined(PACKR_STATS_CLOCK_US)
+#if defined(ESP_PLATFORM)
+#include "esp_timer.h"
+#define PACKR_STATS_CLOCK_US() ((uint64_t)esp_timer_get_time())
+#else
+#include <time.h>
+static uint64_t stats_clock_us(void) {
+#if defined(_POSIX_TIMERS) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#else
+    return (uint64_t)clock() * 1000000u / CLOCKS_PER_SEC;
+#endif
+}
+#define PACKR_STATS_CLOCK_US() stats_clock_us()
+#endif
+#endif
 
 static size_t g_total_alloc = 0;
 static size_t g_peak_alloc = 0;
 
-size_t packr_get_total_alloc(void) { return g_total_alloc; }
-size_t packr_get_peak_alloc(void) { return g_peak_alloc; }
-void packr_reset_alloc_stats(void) { g_total_alloc = 0; g_peak_alloc = 0; }
+size_t packr_get_total_alloc(void) { return packr_atomic_load(&g_total_alloc); }
+size_t packr_get_peak_alloc(void) { return packr_atomic_load(&g_peak_alloc); }
+void packr_reset_alloc_stats(void) { packr_atomic_store(&g_total_alloc, 0); packr_atomic_store(&g_peak_alloc, 0); }
+
+/* Global stats are shared by every context, so they may be hit from several threads */
+static void alloc_stats_add(size_t size) {
+    size_t now = packr_atomic_add(&g_total_alloc, size);
+    size_t peak = packr_atomic_load(&g_peak_alloc);
+    while (now > peak && !packr_atomic_cas(&g_peak_alloc, &peak, now)) {}
+}
+
+static void alloc_stats_sub(size_t size) {
+    packr_atomic_sub(&g_total_alloc, size);
+}
 
 void* packr_malloc(size_t size) {
     if (size == 0) return NULL;
-    g_total_alloc += size;
-    if (g_total_alloc > g_peak_alloc) g_peak_alloc = g_total_alloc;
     // We store the size before the pointer to track free
     void *ptr = malloc(size + sizeof(size_t));
     if (!ptr) return NULL;
+    alloc_stats_add(size);
     *(size_t*)ptr = size;
     return (void*)((size_t*)ptr + 1);
 }
@@ -36,36 +71,11 @@ void* packr_malloc(size_t size) {
 void packr_free(void *ptr) {
     if (!ptr) return;
     void *real_ptr = (void*)((size_t*)ptr - 1);
-    g_total_alloc -= *(size_t*)real_ptr;
+    alloc_stats_sub(*(size_t*)real_ptr);
     free(real_ptr);
 }
 
 
-static void make_crc_table(void) {
-    uint32_t c;
-    for (int n = 0; n < 256; n++) {
-        c = (uint32_t)n;
-        for (int k = 0; k < 8; k++) {
-            if (c & 1) c = 0xEDB88320 ^ (c >> 1);
-            else c = c >> 1;
-        }
-        crc32_table[n] = c;
-    }
-    crc32_table_inited = 1;
-}
-
-static uint32_t update_crc32(uint32_t crc, const uint8_t *data, size_t len) {
-    if (!crc32_table_inited) make_crc_table();
-    for (size_t i = 0; i < len; i++) {
-        crc = (crc >> 8) ^ crc32_table[(crc ^ data[i]) & 0xFF];
-    }
-    return crc;
-}
-
-static uint32_t calculate_crc32(const uint8_t *data, size_t len) {
-    return update_crc32(0xFFFFFFFF, data, len) ^ 0xFFFFFFFF;
-}
-
 /* Helpers */
 
 
@@ -73,31 +83,43 @@ uint32_t zigzag_encode(int32_t value) {
     return (uint32_t)((value << 1) ^ (value >> 31));
 }
 
+uint64_t zigzag_encode64(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
 static int packr_flush_buffer(packr_encoder_t *ctx);
 
-static int buffer_append_internal(packr_encoder_t *ctx, const uint8_t *data, size_t len, int update_crc) {
-    if (update_crc && ctx->flush_cb) {
-        // Only rolling update CRC in Streaming Mode
-        if (ctx->compress) {
-             // If compressing, CRC happens BEFORE compression?
-             // Python spec check: `calculate_crc32(ctx->buffer, frame_len)` on the UNCOMPRESSED data?
-             // Legacy `packr_encoder_finish`: `crc = calculate_crc32(ctx->buffer, frame_len)`.
-             // `buffer` here IS uncompressed.
-             // Then compression happens on `buffer`.
-             // Correct. CRC is on plaintext.
-        }
-        ctx->current_crc = update_crc32(ctx->current_crc, data, len);
+/*
+ * Folds the bytes appended since the last call into the running CRC. Done
+ * every PACKR_CRC_CHUNK bytes, while they are still in cache, and before the
+ * buffer is flushed.
+ */
+#define PACKR_CRC_CHUNK 1024
+
+static void encoder_crc_sync(packr_encoder_t *ctx) {
+    if (ctx->pos > ctx->crc_pos) {
+        ctx->current_crc = packr_crc32_update(ctx->current_crc, ctx->buffer + ctx->crc_pos, ctx->pos - ctx->crc_pos);
     }
-    
+    ctx->crc_pos = ctx->pos;
+}
+
+static int buffer_append_internal(packr_encoder_t *ctx, const uint8_t *data, size_t len, int update_crc) {
+    /* The CRC covers the plaintext, before any LZ77 */
+    if (!update_crc) encoder_crc_sync(ctx);
+
     // Check if buffer is valid
     if (!ctx->buffer || ctx->capacity == 0) return -1;
 
+    /* Buffered mode keeps room behind the body for the CRC */
+    size_t cap = ctx->flush_cb ? ctx->capacity : ctx->capacity - MIN(ctx->capacity, 4);
+
     size_t offset = 0;
     while (offset < len) {
-        size_t space = ctx->capacity - ctx->pos;
+        size_t space = cap > ctx->pos ? cap - ctx->pos : 0;
         if (space == 0) {
+             if (!update_crc) ctx->crc_pos = ctx->pos;
              if (packr_flush_buffer(ctx) != 0) return -1;
-             space = ctx->capacity - ctx->pos;
+             space = cap - ctx->pos;
         }
         
         size_t chunk = (len - offset) < space ? (len - offset) : space;
@@ -106,6 +128,8 @@ static int buffer_append_internal(packr_encoder_t *ctx, const uint8_t *data, siz
         ctx->pos += chunk;
         offset += chunk;
     }
+    if (!update_crc) ctx->crc_pos = ctx->pos;
+    else if (ctx->pos - ctx->crc_pos >= PACKR_CRC_CHUNK) encoder_crc_sync(ctx);
     return 0;
 }
 
@@ -113,6 +137,10 @@ static int buffer_append(packr_encoder_t *ctx, const uint8_t *data, size_t len)
     return buffer_append_internal(ctx, data, len, 1);
 }
 
+int packr_encode_raw(packr_encoder_t *ctx, const uint8_t *data, size_t len) {
+    return buffer_append(ctx, data, len);
+}
+
 static int buffer_append_byte(packr_encoder_t *ctx, uint8_t b) {
     return buffer_append(ctx, &b, 1);
 }
@@ -129,25 +157,264 @@ int packr_encode_varint(packr_encoder_t *ctx, uint32_t value) {
     return buffer_append(ctx, buf, i);
 }
 
-static void dict_init(packr_dict_t *dict) {
+int packr_encode_varint64(packr_encoder_t *ctx, uint64_t value) {
+    uint8_t buf[10];
+    int i = 0;
+    while (value > 0x7F) {
+        buf[i++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[i++] = value & 0x7F;
+    return buffer_append(ctx, buf, i);
+}
+
+/* Dictionary String Arena */
+typedef struct {
+    char **owner;  /* entry value to patch when compacting, NULL = evicted */
+    size_t size;   /* block size including this header */
+} arena_block_t;
+
+#define ARENA_ALIGN(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+static void arena_init(packr_arena_t *arena, uint8_t *buf, size_t cap, size_t *alloc_counter) {
+    memset(arena, 0, sizeof(packr_arena_t));
+    if (!buf) return;
+
+    size_t skew = (size_t)((uintptr_t)buf & (sizeof(void*) - 1));
+    if (skew) skew = sizeof(void*) - skew;
+    if (cap <= skew + sizeof(arena_block_t)) return;
+
+    arena->base = buf + skew;
+    arena->cap = (cap - skew) & ~(sizeof(void*) - 1);
+
+    /* The whole arena is the dictionary memory bound, account for it once */
+    alloc_stats_add(arena->cap);
+    if (alloc_counter) *alloc_counter += arena->cap;
+}
+
+static void arena_destroy(packr_arena_t *arena, size_t *alloc_counter) {
+    if (!arena->base) return;
+    alloc_stats_sub(arena->cap);
+    if (alloc_counter) *alloc_counter -= arena->cap;
+    memset(arena, 0, sizeof(packr_arena_t));
+}
+
+static int arena_owns(const packr_arena_t *arena, const void *ptr) {
+    return arena && arena->base &&
+           (const uint8_t*)ptr >= arena->base && (const uint8_t*)ptr < arena->base + arena->cap;
+}
+
+/* Slide live blocks down over evicted ones, patching their owners */
+static void arena_compact(packr_arena_t *arena) {
+    size_t rd = 0, wr = 0;
+    while (rd < arena->used) {
+        arena_block_t *blk = (arena_block_t*)(arena->base + rd);
+        size_t size = blk->size;
+        if (blk->owner) {
+            if (wr != rd) {
+                memmove(arena->base + wr, blk, size);
+                blk = (arena_block_t*)(arena->base + wr);
+                *blk->owner = (char*)(blk + 1);
+            }
+            wr += size;
+        }
+        rd += size;
+    }
+    arena->used = wr;
+    arena->dead = 0;
+}
+
+static char *arena_alloc(packr_arena_t *arena, char **owner, size_t len) {
+    if (!arena || !arena->base) return NULL;
+    size_t size = sizeof(arena_block_t) + ARENA_ALIGN(len);
+    if (arena->used + size > arena->cap) {
+        if (arena->used - arena->dead + size > arena->cap) return NULL;
+        arena_compact(arena);
+    }
+    arena_block_t *blk = (arena_block_t*)(arena->base + arena->used);
+    blk->owner = owner;
+    blk->size = size;
+    arena->used += size;
+    return (char*)(blk + 1);
+}
+
+static void arena_release(packr_arena_t *arena, char *ptr) {
+    arena_block_t *blk = (arena_block_t*)ptr - 1;
+    blk->owner = NULL;
+    if ((uint8_t*)blk + blk->size == arena->base + arena->used) {
+        arena->used -= blk->size; /* Last block, just pull the bump pointer back */
+    } else {
+        arena->dead += blk->size;
+    }
+}
+
+static void dict_init(packr_dict_t *dict, packr_arena_t *arena) {
+#if PACKR_STATS
+    packr_dict_stats_t stats = dict->stats;
+#endif
     memset(dict, 0, sizeof(packr_dict_t));
+    dict->arena = (arena && arena->base) ? arena : NULL;
+#if PACKR_STATS
+    dict->stats = stats;
+#endif
+}
+
+/* Allocate storage (len + 1) for entry index, from the arena when possible */
+static char *dict_store(packr_dict_t *dict, int index, size_t len, size_t *alloc_counter) {
+    dict_entry_t *e = &dict->entries[index];
+    e->value = arena_alloc(dict->arena, &e->value, len + 1);
+    if (!e->value) {
+        e->value = packr_malloc(len + 1);
+        if (e->value && alloc_counter) *alloc_counter += (len + 1);
+    }
+    return e->value;
+}
+
+static void dict_release(packr_dict_t *dict, int index, size_t *alloc_counter) {
+    dict_entry_t *e = &dict->entries[index];
+    if (!e->value) return;
+    if (e->view) {
+        e->view = false;
+    } else if (arena_owns(dict->arena, e->value)) {
+        arena_release(dict->arena, e->value);
+    } else {
+        if (alloc_counter) *alloc_counter -= (e->length + 1);
+        packr_free(e->value);
+    }
+    e->value = NULL;
+}
+
+/* FNV-1a */
+static uint32_t dict_hash(const char *value, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)value[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#if PACKR_DICT_HASH
+
+#define DICT_INDEX_MASK (PACKR_DICT_INDEX_SIZE - 1)
+
+static void dict_lru_unlink(packr_dict_t *dict, int i) {
+    uint8_t p = dict->lru_prev[i], n = dict->lru_next[i];
+    if (dict->lru_head == i) dict->lru_head = n; else dict->lru_next[p] = n;
+    if (dict->lru_tail == i) dict->lru_tail = p; else dict->lru_prev[n] = p;
+}
+
+static void dict_lru_push_front(packr_dict_t *dict, int i) {
+    if (dict->count == 0) {
+        dict->lru_head = dict->lru_tail = (uint8_t)i;
+        return;
+    }
+    dict->lru_next[i] = dict->lru_head;
+    dict->lru_prev[dict->lru_head] = (uint8_t)i;
+    dict->lru_head = (uint8_t)i;
+}
+
+/* Links unlisted i at the tail of a list that isn't empty */
+static void dict_lru_push_back(packr_dict_t *dict, int i) {
+    dict->lru_prev[i] = dict->lru_tail;
+    dict->lru_next[dict->lru_tail] = (uint8_t)i;
+    dict->lru_tail = (uint8_t)i;
+}
+
+/* Remove entry i from the open-addressing index (backward-shift deletion), if it is there */
+static void dict_index_remove(packr_dict_t *dict, int i) {
+    uint32_t slot = dict->entries[i].hash & DICT_INDEX_MASK;
+    while (dict->index[slot] != i + 1) {
+        if (dict->index[slot] == 0) return; /* left empty by a failed store */
+        slot = (slot + 1) & DICT_INDEX_MASK;
+    }
+
+    uint32_t hole = slot;
+    uint32_t j = slot;
+    while (1) {
+        j = (j + 1) & DICT_INDEX_MASK;
+        if (dict->index[j] == 0) break;
+        uint32_t home = dict->entries[dict->index[j] - 1].hash & DICT_INDEX_MASK;
+        /* Entry at j can fill the hole unless its home lies cyclically in (hole, j] */
+        int stays = (hole <= j) ? (home > hole && home <= j) : (home > hole || home <= j);
+        if (!stays) {
+            dict->index[hole] = dict->index[j];
+            hole = j;
+        }
+    }
+    dict->index[hole] = 0;
+}
+
+static void dict_index_insert(packr_dict_t *dict, int i) {
+    uint32_t slot = dict->entries[i].hash & DICT_INDEX_MASK;
+    while (dict->index[slot] != 0) slot = (slot + 1) & DICT_INDEX_MASK;
+    dict->index[slot] = (uint8_t)(i + 1);
 }
 
-static int dict_get_or_add(packr_dict_t *dict, const char *value, size_t len, int *out_index, size_t *alloc_counter) {
+#endif
+
+/* Mark entry as most recently used (decoder references) */
+static void dict_touch(packr_dict_t *dict, int index) {
+    PACKR_STAT(dict->stats.hits++);
+    dict->entries[index].last_used = ++dict->usage_counter;
+#if PACKR_DICT_HASH
+    if (dict->lru_head != index) {
+        dict_lru_unlink(dict, index);
+        dict_lru_push_front(dict, index);
+    }
+#endif
+}
+
+/*
+ * Finds value or adds it over the LRU entry. With view set the entry points
+ * at value itself, which must outlive the dictionary; otherwise it is copied.
+ */
+static int dict_get_or_add(packr_dict_t *dict, const char *value, size_t len, bool view,
+                           int *out_index, size_t *alloc_counter) {
+    uint32_t hash = dict_hash(value, len);
+    int index = -1;
+
+#if PACKR_DICT_HASH
+    bool fresh = dict->count < PACKR_DICT_SIZE;
+    /* Lookup */
+    for (uint32_t slot = hash & DICT_INDEX_MASK; dict->index[slot]; slot = (slot + 1) & DICT_INDEX_MASK) {
+        int i = dict->index[slot] - 1;
+        if (dict->entries[i].hash == hash &&
+            dict->entries[i].length == len &&
+            memcmp(dict->entries[i].value, value, len) == 0) {
+
+            dict_touch(dict, i);
+            *out_index = i;
+            return 0; /* Found */
+        }
+    }
+
+    /* Add new: slots fill in order, then the LRU tail is recycled */
+    if (dict->count < PACKR_DICT_SIZE) {
+        index = dict->count;
+        dict_lru_push_front(dict, index);
+        dict->count++;
+    } else {
+        index = dict->lru_tail;
+        dict_index_remove(dict, index);
+        dict_lru_unlink(dict, index);
+        dict_lru_push_front(dict, index);
+    }
+#else
     /* Lookup */
     for (int i = 0; i < PACKR_DICT_SIZE; i++) {
         if (dict->entries[i].value &&
+            dict->entries[i].hash == hash &&
             dict->entries[i].length == len &&
             memcmp(dict->entries[i].value, value, len) == 0) {
 
-            dict->entries[i].last_used = ++dict->usage_counter;
+            dict_touch(dict, i);
             *out_index = i;
             return 0; /* Found */
         }
     }
 
     /* Add new */
-    int index = -1;
 
     /* First pass: find empty slot */
     for (int i = 0; i < PACKR_DICT_SIZE; i++) {
@@ -167,53 +434,151 @@ static int dict_get_or_add(packr_dict_t *dict, const char *value, size_t len, in
             }
         }
     }
+#endif
 
     /* Replace */
-    if (dict->entries[index].value) {
-        if (alloc_counter) *alloc_counter -= (dict->entries[index].length + 1);
-        packr_free(dict->entries[index].value);
-    }
-    dict->entries[index].value = packr_malloc(len + 1);
-    if (alloc_counter) *alloc_counter += (len + 1);
-    memcpy(dict->entries[index].value, value, len);
-    dict->entries[index].value[len] = '\0';
+    PACKR_STAT(dict->stats.misses++; if (dict->entries[index].value) dict->stats.evictions++);
+    dict_release(dict, index, alloc_counter);
+    if (view) {
+        dict->entries[index].value = (char*)value;
+        dict->entries[index].view = true;
+    } else {
+        if (!dict_store(dict, index, len, alloc_counter)) {
+#if PACKR_DICT_HASH
+            /* Undo the push: a new slot is unused again, a recycled one (now empty) the tail */
+            dict_lru_unlink(dict, index);
+            if (fresh) dict->count--;
+            else dict_lru_push_back(dict, index);
+#endif
+            return -1;
+        }
+        memcpy(dict->entries[index].value, value, len);
+        dict->entries[index].value[len] = '\0';
+    }
     dict->entries[index].length = len;
+    dict->entries[index].hash = hash;
     dict->entries[index].last_used = ++dict->usage_counter;
+#if PACKR_DICT_HASH
+    dict_index_insert(dict, index);
+#endif
 
     *out_index = index;
     return 1; /* Added */
 }
 
+/* Schema Cache */
+
+static uint32_t schema_hash(char *const *fields, uint32_t count) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < count; i++) {
+        h = (h ^ dict_hash(fields[i], strlen(fields[i]))) * 16777619u;
+    }
+    return h;
+}
+
+/* Slot holding exactly these fields, -1 if none */
+static int schema_find(const packr_schema_cache_t *sc, char *const *fields, uint32_t count, uint32_t hash) {
+    for (int i = 0; i < PACKR_SCHEMA_SLOTS; i++) {
+        const packr_schema_t *s = &sc->slots[i];
+        if (!s->fields || s->hash != hash || s->count != count) continue;
+        uint32_t f = 0;
+        while (f < count && strcmp(s->fields[f], fields[f]) == 0) f++;
+        if (f == count) return i;
+    }
+    return -1;
+}
+
+/* Copies fields into the next slot, evicting what it held. Returns the slot, -1 if out of memory */
+static int schema_store(packr_schema_cache_t *sc, char *const *fields, uint32_t count, uint32_t hash,
+                        size_t *alloc_counter) {
+    size_t size = count * sizeof(char*);
+    for (uint32_t i = 0; i < count; i++) size += strlen(fields[i]) + 1;
+
+    char **block = packr_malloc(size);
+    if (!block) return -1;
+    char *names = (char*)(block + count);
+    for (uint32_t i = 0; i < count; i++) {
+        size_t len = strlen(fields[i]) + 1;
+        memcpy(names, fields[i], len);
+        block[i] = names;
+        names += len;
+    }
+
+    int slot = sc->next;
+    packr_schema_t *s = &sc->slots[slot];
+    if (s->fields) {
+        *alloc_counter -= s->size;
+        packr_free(s->fields);
+    }
+    s->fields = block;
+    s->count = count;
+    s->hash = hash;
+    s->size = size;
+    *alloc_counter += size;
+    sc->next = (uint8_t)((slot + 1) % PACKR_SCHEMA_SLOTS);
+    sc->last = (uint8_t)slot;
+    return slot;
+}
+
+/* Empties every slot (block start, destroy) */
+static void schema_cache_reset(packr_schema_cache_t *sc, size_t *alloc_counter) {
+    for (int i = 0; i < PACKR_SCHEMA_SLOTS; i++) {
+        packr_schema_t *s = &sc->slots[i];
+        if (!s->fields) continue;
+        *alloc_counter -= s->size;
+        packr_free(s->fields);
+        memset(s, 0, sizeof(packr_schema_t));
+    }
+    sc->next = 0;
+    sc->last = 0;
+}
+
 /* Encoder */
 
+#if PACKR_STATS
+/* Stands in for the caller's flush callback to count and time every call */
+static int encoder_flush_timed(void *user_data, const uint8_t *data, size_t len) {
+    packr_encoder_t *ctx = (packr_encoder_t*)user_data;
+    uint64_t start = PACKR_STATS_CLOCK_US();
+    int ret = ctx->flush_cb(ctx->user_data, data, len);
+    ctx->stats.flush_us += PACKR_STATS_CLOCK_US() - start;
+    ctx->stats.flush_calls++;
+    ctx->stats.flush_bytes += len;
+    return ret;
+}
+#define ENCODER_FLUSH_CB(ctx) encoder_flush_timed
+#define ENCODER_FLUSH_DATA(ctx) ((void*)(ctx))
+#else
+#define ENCODER_FLUSH_CB(ctx) ((ctx)->flush_cb)
+#define ENCODER_FLUSH_DATA(ctx) ((ctx)->user_data)
+#endif
+
 void packr_encoder_init(packr_encoder_t *ctx, bool compress, packr_flush_func flush_cb, void *user_data, uint8_t *work_buffer, size_t work_cap) {
+    packr_encoder_init_ex(ctx, compress, flush_cb, user_data, work_buffer, work_cap, NULL, 0);
+}
+
+void packr_encoder_init_ex(packr_encoder_t *ctx, bool compress, packr_flush_func flush_cb, void *user_data,
+                           uint8_t *work_buffer, size_t work_cap, uint8_t *arena, size_t arena_cap) {
     memset(ctx, 0, sizeof(packr_encoder_t));
     ctx->compress = compress;
+    ctx->lz77_level = PACKR_LZ77_DEFAULT;
+    ctx->lz77_window = PACKR_LZ77_WINDOW_DEFAULT;
+    ctx->batch_effort = PACKR_BATCH_DEFAULT;
     ctx->buffer = work_buffer;
     ctx->capacity = work_cap;
     ctx->flush_cb = flush_cb;
     ctx->user_data = user_data;
     ctx->current_crc = 0xFFFFFFFF;
     ctx->total_alloc = sizeof(packr_encoder_t);
-    dict_init(&ctx->fields);
-    dict_init(&ctx->strings);
-    dict_init(&ctx->macs);
+    arena_init(&ctx->arena, arena, arena_cap, &ctx->total_alloc);
+    dict_init(&ctx->fields, &ctx->arena);
+    dict_init(&ctx->strings, &ctx->arena);
+    dict_init(&ctx->macs, &ctx->arena);
 
     if (ctx->flush_cb) {
-        /* Streaming Mode: Write Header Immediately */
-        if (ctx->compress) {
-            packr_lz77_init(&ctx->lz77);
-        
-            // Emit LZ77 Header
-            uint8_t lz_head[7];
-            lz_head[0] = 0xFE; 
-            lz_head[1] = 0x03;
-            // Length unknown/max
-            lz_head[3] = 0xFF; lz_head[4] = 0xFF; lz_head[5] = 0xFF; lz_head[6] = 0xFF;
-            
-            ctx->flush_cb(ctx->user_data, lz_head, 7);
-        }
-        
+        /* Streaming Mode: Header goes in the work buffer (the LZ77 one out with the first flush) */
+        if (ctx->compress) packr_lz77_init(&ctx->lz77);
+
         ctx->pos = 0;
         uint8_t header[16];
         int h_pos = 0;
@@ -223,30 +588,176 @@ void packr_encoder_init(packr_encoder_t *ctx, bool compress, packr_flush_func fl
         header[h_pos++] = 0x00; // Symbol Count (Varint 0 = 1 byte)
         buffer_append(ctx, header, h_pos);
     } else {
-        /* Legacy Mode: Reserve Header Space */
-        ctx->pos = 11; 
+        /* Legacy Mode: Reserve Header Space (the CRC starts with the body) */
+        ctx->pos = 11;
+        ctx->crc_pos = 11;
     }
 }
 
 static void dict_destroy(packr_dict_t *dict, size_t *alloc_counter) {
     for (int i = 0; i < PACKR_DICT_SIZE; i++) {
-        if (dict->entries[i].value) {
-            if (alloc_counter) *alloc_counter -= (dict->entries[i].length + 1);
-            packr_free(dict->entries[i].value);
-            dict->entries[i].value = NULL;
-        }
+        dict_release(dict, i, alloc_counter);
+    }
+}
+
+static int dicts_prime(packr_dict_t *fields, packr_dict_t *strings, packr_dict_t *macs,
+                       const packr_primer_t *primer, size_t *alloc_counter);
+
+/* Drop every entry of all three dictionaries (block start), then reload the primer */
+static int dicts_reset(packr_dict_t *fields, packr_dict_t *strings, packr_dict_t *macs,
+                       packr_arena_t *arena, const packr_primer_t *primer, size_t *alloc_counter) {
+    dict_destroy(fields, alloc_counter);
+    dict_destroy(strings, alloc_counter);
+    dict_destroy(macs, alloc_counter);
+    /* Nothing live is left in the arena, start over instead of compacting */
+    if (arena->base) {
+        arena->used = 0;
+        arena->dead = 0;
     }
+    dict_init(fields, arena);
+    dict_init(strings, arena);
+    dict_init(macs, arena);
+    return dicts_prime(fields, strings, macs, primer, alloc_counter);
 }
 
 void packr_encoder_destroy(packr_encoder_t *ctx) {
     dict_destroy(&ctx->fields, &ctx->total_alloc);
     dict_destroy(&ctx->strings, &ctx->total_alloc);
     dict_destroy(&ctx->macs, &ctx->total_alloc);
+    arena_destroy(&ctx->arena, &ctx->total_alloc);
+    schema_cache_reset(&ctx->schemas, &ctx->total_alloc);
     if (ctx->compress) packr_lz77_destroy(&ctx->lz77);
+    if (ctx->seek_cap) {
+        ctx->total_alloc -= 2 * ctx->seek_cap * sizeof(uint32_t);
+        packr_free(ctx->seek_offsets);
+        packr_free(ctx->seek_records);
+    }
+    packr_column_scratch_t *cs = &ctx->columns;
+    if (cs->rows) {
+        ctx->total_alloc -= cs->rows * 3 * sizeof(int32_t) + PACKR_RICE_BOUND(cs->rows);
+        packr_free(cs->deltas);
+    }
+    ctx->total_alloc -= cs->plan_cap * sizeof(packr_column_plan_t);
+    packr_free(cs->plans);
+    if (cs->json) cs->json_free(cs->json, &ctx->total_alloc);
+    memset(cs, 0, sizeof(packr_column_scratch_t));
     ctx->total_alloc -= sizeof(packr_encoder_t);
 }
 
+/* Seek Table */
+
+/* Body bytes written so far (the header is 11 reserved bytes buffered, 7 streaming) */
+static size_t encoder_body_offset(const packr_encoder_t *ctx) {
+    return ctx->flushed + ctx->pos - (ctx->flush_cb ? 7 : 11);
+}
+
+int packr_encoder_set_lz77(packr_encoder_t *ctx, int level, size_t window) {
+    if (level < PACKR_LZ77_FAST || level > PACKR_LZ77_OPTIMAL) return -1;
+    if (ctx->flush_cb) {
+        if (!ctx->compress) return 0;
+        return packr_lz77_set_window(&ctx->lz77, window);
+    }
+    if (window == 0) window = PACKR_LZ77_WINDOW_DEFAULT;
+    if (window > PACKR_LZ77_WINDOW_MAX) return -1;
+    ctx->lz77_level = (uint8_t)level;
+    ctx->lz77_window = (uint16_t)window;
+    return 0;
+}
+
+int packr_encoder_set_entropy(packr_encoder_t *ctx, bool on) {
+    if (ctx->flush_cb) return -1;
+    ctx->entropy = on;
+    return 0;
+}
+
+int packr_encoder_set_batch(packr_encoder_t *ctx, int effort) {
+    if (effort < PACKR_BATCH_FAST || effort > PACKR_BATCH_SMALLEST) return -1;
+    ctx->batch_effort = (uint8_t)effort;
+    return 0;
+}
+
+int packr_encoder_enable_seek(packr_encoder_t *ctx, size_t block_bytes) {
+    if (block_bytes == 0 || ctx->flushed > 0) return -1;
+    ctx->seek_block_bytes = block_bytes;
+    if (ctx->flush_cb) {
+        /* Header is still in the work buffer: patch the flags and redo the CRC */
+        if (ctx->pos < 7) return -1;
+        ctx->buffer[5] |= PACKR_FLAG_SEEK_TABLE;
+        ctx->current_crc = 0xFFFFFFFF;
+        ctx->crc_pos = 0;
+    }
+    return 0;
+}
+
+int packr_encoder_block_point(packr_encoder_t *ctx, uint32_t record) {
+    if (!ctx->seek_block_bytes) return 0;
+
+    size_t offset = encoder_body_offset(ctx);
+    if (ctx->seek_count > 0 && offset - ctx->seek_last < ctx->seek_block_bytes) return 0;
+
+    if (ctx->seek_count == ctx->seek_cap) {
+        uint32_t cap = ctx->seek_cap ? ctx->seek_cap * 2 : 16;
+        uint32_t *offsets = packr_malloc(cap * sizeof(uint32_t));
+        uint32_t *records = packr_malloc(cap * sizeof(uint32_t));
+        if (!offsets || !records) {
+            packr_free(offsets);
+            packr_free(records);
+            return -1;
+        }
+        if (ctx->seek_count) {
+            memcpy(offsets, ctx->seek_offsets, ctx->seek_count * sizeof(uint32_t));
+            memcpy(records, ctx->seek_records, ctx->seek_count * sizeof(uint32_t));
+        }
+        packr_free(ctx->seek_offsets);
+        packr_free(ctx->seek_records);
+        ctx->total_alloc += 2 * (cap - ctx->seek_cap) * sizeof(uint32_t);
+        ctx->seek_offsets = offsets;
+        ctx->seek_records = records;
+        ctx->seek_cap = cap;
+    }
+
+    ctx->seek_offsets[ctx->seek_count] = (uint32_t)offset;
+    ctx->seek_records[ctx->seek_count] = record;
+    ctx->seek_last = offset;
+
+    /* First block starts from fresh (or just primed) dictionaries anyway */
+    if (ctx->seek_count++ > 0) {
+        if (dicts_reset(&ctx->fields, &ctx->strings, &ctx->macs, &ctx->arena, ctx->primer, &ctx->total_alloc) != 0) {
+            return -1;
+        }
+        schema_cache_reset(&ctx->schemas, &ctx->total_alloc);
+        return packr_encode_token(ctx, TOKEN_BLOCK_RESET);
+    }
+    return 0;
+}
+
+static int encoder_write_seek_table(packr_encoder_t *ctx) {
+    size_t start = encoder_body_offset(ctx);
+    uint8_t marker = TOKEN_SEEK_TABLE;
+    if (buffer_append(ctx, &marker, 1) != 0) return -1;
+    if (packr_encode_varint(ctx, ctx->seek_count) != 0) return -1;
+    for (uint32_t i = 0; i < ctx->seek_count; i++) {
+        uint32_t prev_off = i ? ctx->seek_offsets[i - 1] : 0;
+        uint32_t prev_rec = i ? ctx->seek_records[i - 1] : 0;
+        if (packr_encode_varint(ctx, ctx->seek_offsets[i] - prev_off) != 0) return -1;
+        if (packr_encode_varint(ctx, ctx->seek_records[i] - prev_rec) != 0) return -1;
+    }
+    uint8_t len_buf[4];
+    packr_store_le32(len_buf, (uint32_t)(encoder_body_offset(ctx) - start));
+    return buffer_append(ctx, len_buf, 4);
+}
+
+#if PACKR_STATS
+/* Histogram slot of a token: dictionary references and small deltas at their base */
+static uint8_t stats_token_slot(uint8_t token) {
+    if (token < TOKEN_INT) return token & 0xC0;
+    if (token > TOKEN_DELTA_SMALL && token < TOKEN_DELTA_LARGE) return TOKEN_DELTA_SMALL;
+    return token;
+}
+#endif
+
 int packr_encode_token(packr_encoder_t *ctx, packr_token_t token) {
+    PACKR_STAT(ctx->stats.tokens[stats_token_slot((uint8_t)token)]++);
     ctx->symbol_count++;
     return buffer_append_byte(ctx, (uint8_t)token);
 }
@@ -362,7 +873,8 @@ int packr_encode_binary(packr_encoder_t *ctx, const uint8_t *data, size_t len) {
 
 int packr_encode_string(packr_encoder_t *ctx, const char *str, size_t len) {
     int index;
-    int is_new = dict_get_or_add(&ctx->strings, str, len, &index, &ctx->total_alloc);
+    int is_new = dict_get_or_add(&ctx->strings, str, len, false, &index, &ctx->total_alloc);
+    if (is_new < 0) return -1;
 
     if (is_new) {
         packr_encode_token(ctx, TOKEN_NEW_STRING);
@@ -373,9 +885,33 @@ int packr_encode_string(packr_encoder_t *ctx, const char *str, size_t len) {
     }
 }
 
+int packr_encode_schema(packr_encoder_t *ctx, char **field_names, int count) {
+    packr_schema_cache_t *sc = &ctx->schemas;
+    if (sc->depth > 0 || count <= 0) return 0;
+
+    uint32_t hash = schema_hash(field_names, (uint32_t)count);
+    int slot = schema_find(sc, field_names, (uint32_t)count, hash);
+    if (slot >= 0) {
+        int ret;
+        if (slot == sc->last) {
+            ret = packr_encode_token(ctx, TOKEN_SCHEMA_REPEAT);
+        } else {
+            ret = packr_encode_token(ctx, TOKEN_SCHEMA_REF);
+            if (ret == 0) ret = buffer_append_byte(ctx, (uint8_t)slot);
+        }
+        sc->last = (uint8_t)slot;
+        return ret == 0 ? 1 : -1;
+    }
+
+    /* The decoder caches whatever follows TOKEN_SCHEMA_DEF, so only send it once stored */
+    if (schema_store(sc, field_names, (uint32_t)count, hash, &ctx->total_alloc) < 0) return 0;
+    return packr_encode_token(ctx, TOKEN_SCHEMA_DEF);
+}
+
 int packr_encode_field(packr_encoder_t *ctx, const char *str, size_t len) {
     int index;
-    int is_new = dict_get_or_add(&ctx->fields, str, len, &index, &ctx->total_alloc);
+    int is_new = dict_get_or_add(&ctx->fields, str, len, false, &index, &ctx->total_alloc);
+    if (is_new < 0) return -1;
 
     if (is_new) {
         packr_encode_token(ctx, TOKEN_NEW_FIELD);
@@ -388,7 +924,8 @@ int packr_encode_field(packr_encoder_t *ctx, const char *str, size_t len) {
 
 int packr_encode_mac(packr_encoder_t *ctx, const char *str) {
     int index;
-    int is_new = dict_get_or_add(&ctx->macs, str, strlen(str), &index, &ctx->total_alloc);
+    int is_new = dict_get_or_add(&ctx->macs, str, strlen(str), false, &index, &ctx->total_alloc);
+    if (is_new < 0) return -1;
 
     if (is_new) {
         packr_encode_token(ctx, TOKEN_NEW_MAC);
@@ -421,20 +958,142 @@ int packr_encode_mac(packr_encoder_t *ctx, const char *str) {
     }
 }
 
+int packr_encode_timestamp(packr_encoder_t *ctx, const packr_timestamp_t *ts) {
+    packr_encode_token(ctx, TOKEN_TIMESTAMP);
+    buffer_append_byte(ctx, ts->format);
+    int ret = packr_encode_varint64(ctx, zigzag_encode64(ts->ticks));
+    if (ret == 0 && (ts->format & PACKR_TS_ZONE) >= PACKR_TS_OFFSET) {
+        ret = packr_encode_varint(ctx, zigzag_encode(ts->offset));
+    }
+    return ret;
+}
+
+int packr_encode_typed(packr_encoder_t *ctx, const char *str, size_t len) {
+    packr_timestamp_t ts;
+    uint8_t bytes[17];
+    size_t n;
+    packr_token_t token;
+    if (packr_parse_timestamp(str, len, &ts) == 0) return packr_encode_timestamp(ctx, &ts);
+    bool upper;
+    if (packr_parse_uuid(str, len, bytes + 1, &upper) == 0) {
+        token = TOKEN_UUID;
+        bytes[0] = upper;
+        n = 17;
+    } else if (packr_parse_ipv4(str, len, bytes) == 0) {
+        token = TOKEN_IPV4;
+        n = 4;
+    } else {
+        return packr_encode_string(ctx, str, len);
+    }
+
+    /* Shares the string dictionary: a repeat costs one byte either way */
+    int index;
+    int is_new = dict_get_or_add(&ctx->strings, str, len, false, &index, &ctx->total_alloc);
+    if (is_new < 0) return -1;
+    if (!is_new) return packr_encode_token(ctx, (packr_token_t)(TOKEN_STRING + index));
+    packr_encode_token(ctx, token);
+    return buffer_append(ctx, bytes, n);
+}
+
+/* LZ77 header of compressed streams, unknown length */
+static const uint8_t lz_stream_head[7] = { 0xFE, 0x03, 0x02, 0xFF, 0xFF, 0xFF, 0xFF };
+
+/* Async Flush */
+
+/* Waits until the pending flush numbered seq (0 = none) has completed */
+static void encoder_wait_flushed(packr_encoder_t *ctx, uint32_t seq) {
+    while ((int32_t)(packr_atomic_load(&ctx->flush_completed) - seq) < 0) PACKR_FLUSH_IDLE();
+}
+
+/* Hands half h to the callback. Returns 0 on success */
+static int encoder_submit(packr_encoder_t *ctx, int h, size_t len) {
+    int ret = ENCODER_FLUSH_CB(ctx)(ENCODER_FLUSH_DATA(ctx), ctx->halves[h], len);
+    if (ret == PACKR_FLUSH_PENDING) {
+        ctx->half_seq[h] = ++ctx->flush_submitted;
+        return 0;
+    }
+    return ret;
+}
+
+/* LZ77 output sink of async compressed streams: fills the second half, sending it when full */
+static int encoder_stage(void *user_data, const uint8_t *data, size_t len) {
+    packr_encoder_t *ctx = (packr_encoder_t*)user_data;
+    while (len > 0) {
+        size_t n = MIN(len, ctx->capacity - ctx->staged);
+        memcpy(ctx->halves[1] + ctx->staged, data, n);
+        ctx->staged += n;
+        data += n;
+        len -= n;
+        if (ctx->staged == ctx->capacity) {
+            if (encoder_submit(ctx, 1, ctx->staged) != 0) return -1;
+            ctx->staged = 0;
+            encoder_wait_flushed(ctx, ctx->half_seq[1]);
+        }
+    }
+    return 0;
+}
+
+/* Compressed async flush: the LZ77 output of in (all of it with final set) goes out from the second half */
+static int encoder_flush_staged(packr_encoder_t *ctx, const uint8_t *in, size_t len, int final) {
+    encoder_wait_flushed(ctx, ctx->half_seq[1]);
+    ctx->staged = 0;
+    if (!ctx->lz_head_sent) {
+        encoder_stage(ctx, lz_stream_head, sizeof(lz_stream_head));
+        ctx->lz_head_sent = true;
+    }
+    int ret = packr_lz77_compress_stream(&ctx->lz77, in, len, encoder_stage, ctx, final);
+    if (ret != 0) return ret;
+    if (ctx->staged > 0 && encoder_submit(ctx, 1, ctx->staged) != 0) return -1;
+    ctx->staged = 0;
+    return 0;
+}
+
+int packr_encoder_enable_async(packr_encoder_t *ctx) {
+    size_t half = ctx->capacity / 2;
+    /* Whatever is pending has to fit the first half */
+    if (!ctx->flush_cb || ctx->async || half < 16 || ctx->pos > half) return -1;
+    ctx->halves[0] = ctx->buffer;
+    ctx->halves[1] = ctx->buffer + half;
+    ctx->capacity = half;
+    ctx->fill = 0;
+    ctx->async = true;
+    return 0;
+}
+
+void packr_flush_complete(packr_encoder_t *ctx) {
+    packr_atomic_add(&ctx->flush_completed, 1);
+}
 
 static int packr_flush_buffer(packr_encoder_t *ctx) {
     if (ctx->pos == 0) return 0;
     
-    if (ctx->flush_cb) {
+    if (ctx->flush_cb && ctx->async) {
+        encoder_crc_sync(ctx);
+        if (ctx->compress) {
+            /* LZ77 copies the tokens into its window, so the first half is free again right away */
+            if (encoder_flush_staged(ctx, ctx->buffer, ctx->pos, 0) != 0) return -1;
+        } else {
+            if (encoder_submit(ctx, ctx->fill, ctx->pos) != 0) return -1;
+            ctx->fill ^= 1;
+            ctx->buffer = ctx->halves[ctx->fill];
+            encoder_wait_flushed(ctx, ctx->half_seq[ctx->fill]);
+        }
+    } else if (ctx->flush_cb) {
+        encoder_crc_sync(ctx);
         // Streaming
         if (ctx->compress) {
+            if (!ctx->lz_head_sent) {
+                int ret = ENCODER_FLUSH_CB(ctx)(ENCODER_FLUSH_DATA(ctx), lz_stream_head, sizeof(lz_stream_head));
+                if (ret != 0) return ret;
+                ctx->lz_head_sent = true;
+            }
             // Push via LZ77
             int ret = packr_lz77_compress_stream(&ctx->lz77, ctx->buffer, ctx->pos, 
-                                              ctx->flush_cb, ctx->user_data, 0); // Flush=0 (accumulate)
+                                              ENCODER_FLUSH_CB(ctx), ENCODER_FLUSH_DATA(ctx), 0); // Flush=0 (accumulate)
             if (ret != 0) return ret;
             // Success - Fall through to reset pos
         } else {
-             int ret = ctx->flush_cb(ctx->user_data, ctx->buffer, ctx->pos);
+             int ret = ENCODER_FLUSH_CB(ctx)(ENCODER_FLUSH_DATA(ctx), ctx->buffer, ctx->pos);
              if (ret != 0) return ret;
         }
     } else {
@@ -442,11 +1101,47 @@ static int packr_flush_buffer(packr_encoder_t *ctx) {
         return -1;
     }
     
+    ctx->flushed += ctx->pos;
     ctx->pos = 0;
+    ctx->crc_pos = 0;
     return 0;
 }
 
-size_t packr_encoder_finish(packr_encoder_t *ctx, uint8_t *out_buffer) {
+/*
+ * Huffman forms of a buffered frame, tried when they beat lz_len bytes of
+ * LZ77 output in comp_buf (frame_len if LZ77 gave nothing). Huffman over the
+ * LZ77 output goes past it in place, else in the free tail of the work
+ * buffer; over the frame it goes in comp_buf. Returns the transform written
+ * to *dst, 0 if neither is smaller or has room.
+ */
+static uint8_t encoder_entropy(packr_encoder_t *ctx, const uint8_t *frame, size_t frame_len,
+                               uint8_t *comp_buf, size_t comp_cap, size_t lz_len, uint8_t **dst, size_t *len) {
+    size_t best = lz_len ? lz_len : frame_len;
+    uint8_t *tail = ctx->buffer + ctx->pos + 4;
+    uint8_t *spare = (comp_buf == tail) ? comp_buf + lz_len : tail;
+    size_t spare_cap = (comp_buf == tail) ? comp_cap - lz_len : ctx->capacity - ctx->pos - 4;
+
+    size_t huff_lz = lz_len ? packr_huffman_size(comp_buf, lz_len) : 0;
+    size_t huff_raw = packr_huffman_size(frame, frame_len);
+    int lz_ok = huff_lz > 0 && huff_lz < best && huff_lz <= spare_cap;
+    int raw_ok = huff_raw > 0 && huff_raw < best && huff_raw <= comp_cap;
+
+    if (lz_ok && (!raw_ok || huff_lz <= huff_raw)) {
+        *len = packr_huffman_compress(comp_buf, lz_len, spare, spare_cap);
+        *dst = spare;
+        return 0x05; // LZ77 then Huffman
+    }
+    if (raw_ok) {
+        *len = packr_huffman_compress(frame, frame_len, comp_buf, comp_cap);
+        *dst = comp_buf;
+        return 0x04; // Huffman
+    }
+    return 0;
+}
+
+size_t packr_encoder_finish_to(packr_encoder_t *ctx, uint8_t *out, size_t out_cap) {
+    if (ctx->seek_block_bytes && encoder_write_seek_table(ctx) != 0) return 0;
+
     if (ctx->flush_cb) {
         // --- Streaming Mode ---
         packr_flush_buffer(ctx); // Flush any pending payload
@@ -462,9 +1157,13 @@ size_t packr_encoder_finish(packr_encoder_t *ctx, uint8_t *out_buffer) {
         packr_flush_buffer(ctx);
         
         // Final LZ77 Flush
-        if (ctx->compress) {
-            packr_lz77_compress_stream(&ctx->lz77, NULL, 0, ctx->flush_cb, ctx->user_data, 1); // Flush=1
+        if (ctx->compress && ctx->async) {
+            encoder_flush_staged(ctx, NULL, 0, 1);
+        } else if (ctx->compress) {
+            packr_lz77_compress_stream(&ctx->lz77, NULL, 0, ENCODER_FLUSH_CB(ctx), ENCODER_FLUSH_DATA(ctx), 1); // Flush=1
         }
+        /* The work buffer is the caller's again once nothing is in flight */
+        encoder_wait_flushed(ctx, ctx->flush_submitted);
         
         return 0; // Length undefined for streaming
     } else {
@@ -476,77 +1175,100 @@ size_t packr_encoder_finish(packr_encoder_t *ctx, uint8_t *out_buffer) {
         /* Magic */
         header[h_pos++] = 0x50; header[h_pos++] = 0x4B; header[h_pos++] = 0x52; header[h_pos++] = 0x31;
         header[h_pos++] = PACKR_VERSION;
-        header[h_pos++] = 0x00;
+        header[h_pos++] = (ctx->seek_block_bytes ? PACKR_FLAG_SEEK_TABLE : 0x00) | (ctx->primer ? ctx->primer->id : 0);
         
         /* Symbol Count */
-        uint8_t varint[5];
         uint32_t val = ctx->symbol_count;
-        int v_len = 0;
         while (val > 0x7F) {
-            varint[v_len++] = (val & 0x7F) | 0x80;
+            header[h_pos++] = (val & 0x7F) | 0x80;
             val >>= 7;
         }
-        varint[v_len++] = val & 0x7F;
-        memcpy(header + h_pos, varint, v_len);
-        h_pos += v_len;
+        header[h_pos++] = val & 0x7F;
         
-        /* Move body data to directly after header */
+        encoder_crc_sync(ctx);
         size_t body_len = ctx->pos - 11;
-        memmove(ctx->buffer + h_pos, ctx->buffer + 11, body_len);
-        
-        /* Copy header */
-        memcpy(ctx->buffer, header, h_pos);
-        
-        size_t frame_len = h_pos + body_len;
-        
-        /* CRC (Full Calculation) */
-        uint32_t crc = calculate_crc32(ctx->buffer, frame_len);
-        ctx->buffer[frame_len++] = crc & 0xFF;
-        ctx->buffer[frame_len++] = (crc >> 8) & 0xFF;
-        ctx->buffer[frame_len++] = (crc >> 16) & 0xFF;
-        ctx->buffer[frame_len++] = (crc >> 24) & 0xFF;
-        
+        uint32_t crc = packr_crc32_combine(packr_crc32(header, h_pos), ctx->current_crc ^ 0xFFFFFFFF, body_len);
+
+        /*
+         * The header goes at the end of the reserved gap and the CRC behind
+         * the body (append kept room for it), so the frame is contiguous
+         * without moving the body.
+         */
+        uint8_t *frame = ctx->buffer + 11 - h_pos;
+        memcpy(frame, header, h_pos);
+        packr_store_le32(ctx->buffer + ctx->pos, crc);
+        size_t frame_len = h_pos + body_len + 4;
+
+        int in_place = (out == ctx->buffer);
+        if (in_place) out_cap = ctx->capacity;
+
         /* Compress? */
         if (ctx->compress && frame_len > 20) {
-            uint8_t *comp_buf = NULL;
-            int using_internal_buf = 0;
-            
-            /* Try to use the remaining space in the buffer as scratchpad */
-            if (ctx->capacity > frame_len && (ctx->capacity - frame_len) >= (frame_len + 128)) {
-                comp_buf = ctx->buffer + frame_len;
-                using_internal_buf = 1;
-            } else {
-                comp_buf = packr_malloc(frame_len + 128);
-            }
-
-            if (comp_buf) {
-                size_t comp_len = packr_lz77_compress(ctx->buffer, frame_len, comp_buf, frame_len + 128);
-                
-                if (comp_len > 0 && comp_len < frame_len) {
-                    if (comp_len + 2 <= ctx->capacity) {
-                         /* Move compressed data to front */
-                         if (using_internal_buf) {
-                             memmove(ctx->buffer + 2, comp_buf, comp_len);
-                         } else {
-                             memcpy(ctx->buffer + 2, comp_buf, comp_len);
-                         }
-                         
-                         ctx->buffer[0] = 0xFE;
-                         ctx->buffer[1] = 0x03; // LZ77 Transform
-                         frame_len = comp_len + 2;
+            /* Straight into out, or into the free tail of the work buffer */
+            uint8_t *comp_buf = in_place ? ctx->buffer + ctx->pos + 4 : out + 2;
+            size_t comp_cap = in_place ? ctx->capacity - ctx->pos - 4 : (out_cap > 2 ? out_cap - 2 : 0);
+
+            /* With room for a stored block, a compressed stream that would not fit is never cut short */
+            if (comp_cap >= frame_len + 5) {
+                size_t comp_len = packr_lz77_compress_ex(frame, frame_len, comp_buf, comp_cap,
+                                                         ctx->lz77_level, ctx->lz77_window);
+                if (comp_len >= frame_len) comp_len = 0;
+#if PACKR_STATS
+                /* Counted now, Huffman over the frame may overwrite it */
+                packr_stats_t lz_stats;
+                memset(&lz_stats, 0, sizeof(lz_stats));
+                if (comp_len) packr_lz77_count(comp_buf, comp_len, &lz_stats);
+#endif
+
+                uint8_t transform = 0x03; // LZ77 Transform
+                uint8_t *comp = comp_buf;
+                if (ctx->entropy) {
+                    uint8_t *huff;
+                    size_t huff_len;
+                    uint8_t t = encoder_entropy(ctx, frame, frame_len, comp_buf, comp_cap, comp_len, &huff, &huff_len);
+                    if (t) {
+                        transform = t;
+                        comp = huff;
+                        comp_len = huff_len;
                     }
                 }
-                
-                if (!using_internal_buf) {
-                    packr_free(comp_buf);
+
+                if (comp_len > 0 && comp_len + 2 <= out_cap) {
+#if PACKR_STATS
+                    if (transform != 0x04) {
+                        ctx->stats.lz77_literal_bytes += lz_stats.lz77_literal_bytes;
+                        ctx->stats.lz77_match_bytes += lz_stats.lz77_match_bytes;
+                        ctx->stats.lz77_matches += lz_stats.lz77_matches;
+                    }
+#endif
+                    if (comp != out + 2) memmove(out + 2, comp, comp_len);
+                    out[0] = 0xFE;
+                    out[1] = transform;
+                    return comp_len + 2;
                 }
             }
         }
-        
+
+        if (frame_len > out_cap) return 0;
+        if (frame != out) memmove(out, frame, frame_len);
         return frame_len;
     }
 }
 
+size_t packr_encoder_finish(packr_encoder_t *ctx, uint8_t *out_buffer) {
+    if (!out_buffer) out_buffer = ctx->buffer;
+    return packr_encoder_finish_to(ctx, out_buffer, packr_encoder_frame_bound(ctx));
+}
+
+size_t packr_encoder_frame_bound(const packr_encoder_t *ctx) {
+    if (ctx->flush_cb) return 0;
+    /* Header and CRC fit in the reserved 11 bytes plus 4, stored LZ77 adds 7 */
+    size_t bound = ctx->pos + 4 + 7;
+    /* Seek table still to come: marker, count, two varints per block, length */
+    if (ctx->seek_block_bytes) bound += 1 + 5 + (size_t)ctx->seek_count * 10 + 4;
+    return bound;
+}
+
 /* Decoder (Minimal for validation) */
 static uint32_t decode_varint(packr_decoder_t *ctx, int *bytes_read) {
     uint32_t res = 0;
@@ -562,38 +1284,136 @@ static uint32_t decode_varint(packr_decoder_t *ctx, int *bytes_read) {
     return res;
 }
 
+static uint64_t decode_varint64(packr_decoder_t *ctx, int *bytes_read) {
+    uint64_t res = 0;
+    int shift = 0;
+    *bytes_read = 0;
+    while (ctx->pos < ctx->size) {
+        uint8_t b = ctx->data[ctx->pos++];
+        (*bytes_read)++;
+        if (shift < 64) res |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+    }
+    return res;
+}
+
+/* Parse the trailer, then hide it (the last 4 bytes left are treated as the CRC) */
+static void decoder_read_seek_table(packr_decoder_t *ctx) {
+    if (ctx->size < ctx->body_start + 8) return;
+    size_t len_pos = ctx->size - 8;
+    uint32_t table_len = packr_load_le32(ctx->data + len_pos);
+    if (table_len == 0 || table_len > len_pos - ctx->body_start) return;
+    size_t start = len_pos - table_len;
+    if (ctx->data[start] != TOKEN_SEEK_TABLE) return;
+
+    size_t body_size = ctx->size;
+    ctx->pos = start + 1;
+    ctx->size = len_pos; /* keep varint reads inside the table */
+    int bytes;
+    uint32_t count = decode_varint(ctx, &bytes);
+    if (count == 0 || count > table_len) {
+        ctx->size = body_size;
+        ctx->pos = ctx->body_start;
+        return;
+    }
+
+    uint32_t *offsets = packr_malloc(count * sizeof(uint32_t));
+    uint32_t *records = packr_malloc(count * sizeof(uint32_t));
+    uint32_t off = 0, rec = 0;
+    for (uint32_t i = 0; offsets && records && i < count; i++) {
+        off += decode_varint(ctx, &bytes);
+        rec += decode_varint(ctx, &bytes);
+        offsets[i] = off;
+        records[i] = rec;
+    }
+
+    if (!offsets || !records || ctx->pos != len_pos || off >= start - ctx->body_start) {
+        packr_free(offsets);
+        packr_free(records);
+        ctx->size = body_size;
+    } else {
+        ctx->seek_offsets = offsets;
+        ctx->seek_records = records;
+        ctx->seek_count = count;
+        ctx->seek_owned = true;
+        ctx->total_alloc += 2 * count * sizeof(uint32_t);
+        ctx->size = start + 4;
+    }
+    ctx->pos = ctx->body_start;
+}
+
 void packr_decoder_init(packr_decoder_t *ctx, const uint8_t *data, size_t size) {
+    packr_decoder_init_ex(ctx, data, size, NULL, 0);
+}
+
+#define DECODER_MAX_FRAME (1024 * 1024 * 10) // Limit to 10MB sanity
+
+void packr_decoder_init_ex(packr_decoder_t *ctx, const uint8_t *data, size_t size, uint8_t *arena, size_t arena_cap) {
     memset(ctx, 0, sizeof(packr_decoder_t));
     ctx->data = data;
     ctx->size = size;
     ctx->pos = 0;
+    ctx->views = true;
     ctx->total_alloc = sizeof(packr_decoder_t);
     ctx->current_field = -1;
     memset(ctx->last_types, 0, sizeof(ctx->last_types));
     
-    /* Check for compression transform (0xFE 0x03) */
-    if (size > 7 && data[0] == 0xFE && data[1] == 0x03) {
-        /* LZ77 compressed */
-        uint32_t orig_len = data[3] | (data[4] << 8) | (data[5] << 16) | (data[6] << 24);
-        if (orig_len < 1024 * 1024 * 10) { // Limit to 10MB sanity
-            uint8_t *dec_buf = packr_malloc(orig_len + 4); // Extra for safety
-            if (dec_buf) {
-                size_t actual = packr_lz77_decompress(data + 2, size - 2, dec_buf, orig_len + 4);
-                if (actual > 0) {
-                    ctx->data = dec_buf;
-                    ctx->size = actual;
-                    ctx->internal_data = dec_buf;
-                    ctx->total_alloc += actual;
-                } else {
-                    packr_free(dec_buf);
+    /* Check for compression transform (0xFE 0x03 LZ77, 0x04 Huffman, 0x05 LZ77 + Huffman) */
+    if (size > 7 && data[0] == 0xFE && data[1] >= 0x03 && data[1] <= 0x05) {
+        const uint8_t *lz = data + 2;
+        size_t lz_len = size - 2;
+        uint8_t *huff_buf = NULL;
+
+        if (data[1] != 0x03) {
+            size_t huff_len = packr_huffman_decompressed_size(data + 2, size - 2);
+            if (huff_len > 0 && huff_len < DECODER_MAX_FRAME) huff_buf = packr_malloc(huff_len);
+            if (huff_buf && packr_huffman_decompress(data + 2, size - 2, huff_buf, huff_len, NULL) == huff_len) {
+                lz = huff_buf;
+                lz_len = huff_len;
+            } else {
+                packr_free(huff_buf);
+                huff_buf = NULL;
+                lz_len = 0;
+            }
+        }
+
+        if (data[1] == 0x04) {
+            /* Huffman alone: the payload is the frame */
+            if (huff_buf) {
+                ctx->data = huff_buf;
+                ctx->size = lz_len;
+                ctx->internal_data = huff_buf;
+                ctx->total_alloc += lz_len;
+            }
+        } else if (lz_len > 5) {
+            uint32_t orig_len = lz[1] | (lz[2] << 8) | (lz[3] << 16) | (lz[4] << 24);
+            if (orig_len == LZ77_LEN_STREAMED) {
+                /* Streaming encoder didn't know the length, walk the sequences for it */
+                orig_len = (uint32_t)packr_lz77_decompressed_size(lz, lz_len);
+            }
+            if (orig_len < DECODER_MAX_FRAME) {
+                uint8_t *dec_buf = packr_malloc(orig_len + 4); // Extra for safety
+                if (dec_buf) {
+                    size_t actual = packr_lz77_decompress(lz, lz_len, dec_buf, orig_len + 4);
+                    if (actual > 0) {
+                        ctx->data = dec_buf;
+                        ctx->size = actual;
+                        ctx->internal_data = dec_buf;
+                        ctx->total_alloc += actual;
+                    } else {
+                        packr_free(dec_buf);
+                    }
                 }
             }
+            packr_free(huff_buf);
         }
     }
     
-    dict_init(&ctx->fields);
-    dict_init(&ctx->strings);
-    dict_init(&ctx->macs);
+    arena_init(&ctx->arena, arena, arena_cap, &ctx->total_alloc);
+    dict_init(&ctx->fields, &ctx->arena);
+    dict_init(&ctx->strings, &ctx->arena);
+    dict_init(&ctx->macs, &ctx->arena);
     
     /* Skip Header: Magic(4) + Ver(1) + Flags(1) + SymCnt(varint) */
     if (ctx->size > 6) {
@@ -601,14 +1421,48 @@ void packr_decoder_init(packr_decoder_t *ctx, const uint8_t *data, size_t size)
             ctx->pos = 6;
             int v_len;
             decode_varint(ctx, &v_len); /* Symbol count */
+            ctx->body_start = ctx->pos;
+            ctx->primer_id = ctx->data[5] & PACKR_FLAG_PRIMER_MASK;
+            if (ctx->data[5] & PACKR_FLAG_SEEK_TABLE) decoder_read_seek_table(ctx);
         }
     }
 }
 
+void packr_decoder_attach(packr_decoder_t *ctx, const packr_decoder_t *src) {
+    memset(ctx, 0, sizeof(packr_decoder_t));
+    ctx->data = src->data;
+    ctx->size = src->size;
+    ctx->pos = src->body_start;
+    ctx->views = src->views;
+    ctx->total_alloc = sizeof(packr_decoder_t);
+    ctx->current_field = -1;
+    ctx->body_start = src->body_start;
+    ctx->seek_offsets = src->seek_offsets;
+    ctx->seek_records = src->seek_records;
+    ctx->seek_count = src->seek_count;
+    ctx->primer_id = src->primer_id;
+    ctx->primer = src->primer;
+    dict_init(&ctx->fields, NULL);
+    dict_init(&ctx->strings, NULL);
+    dict_init(&ctx->macs, NULL);
+    /* A failed load shows up as an error on the first block reset */
+    dicts_prime(&ctx->fields, &ctx->strings, &ctx->macs, ctx->primer, &ctx->total_alloc);
+}
+
+static void decoder_batch_free(packr_decoder_t *ctx);
+
 void packr_decoder_destroy(packr_decoder_t *ctx) {
     dict_destroy(&ctx->fields, &ctx->total_alloc);
     dict_destroy(&ctx->strings, &ctx->total_alloc);
     dict_destroy(&ctx->macs, &ctx->total_alloc);
+    arena_destroy(&ctx->arena, &ctx->total_alloc);
+    schema_cache_reset(&ctx->schemas, &ctx->total_alloc);
+    decoder_batch_free(ctx);
+    if (ctx->seek_owned) {
+        ctx->total_alloc -= 2 * ctx->seek_count * sizeof(uint32_t);
+        packr_free((void*)ctx->seek_offsets);
+        packr_free((void*)ctx->seek_records);
+    }
     if (ctx->internal_data) {
         ctx->total_alloc -= ctx->size; // Rough estimate
         packr_free(ctx->internal_data);
@@ -622,75 +1476,912 @@ static int32_t zigzag_decode(uint32_t val) {
     return (int32_t)((val >> 1) ^ -(int32_t)(val & 1));
 }
 
+static int64_t zigzag_decode64(uint64_t val) {
+    return (int64_t)((val >> 1) ^ (0 - (val & 1)));
+}
+
+/* Output Writer */
+
+void packr_writer_init(packr_writer_t *w, char *buf, size_t cap, packr_write_func write_cb, void *user_data) {
+    w->buf = buf;
+    w->cap = cap;
+    w->pos = 0;
+    w->write_cb = write_cb;
+    w->user_data = user_data;
+    w->flushed = 0;
+    w->error = 0;
+    if (buf && cap) buf[0] = '\0';
+}
+
+int packr_writer_flush(packr_writer_t *w) {
+    if (w->write_cb) {
+        if (w->pos && !w->error) {
+            if (w->write_cb(w->user_data, w->buf, w->pos) != 0) w->error = 1;
+            else w->flushed += w->pos;
+        }
+        w->pos = 0;
+    }
+    if (w->cap) w->buf[w->pos] = '\0';
+    return w->error ? -1 : 0;
+}
+
+static void writer_put_slow(packr_writer_t *w, const char *str, size_t len) {
+    if (w->cap < 2) {
+        if (len) w->error = 1;
+        return;
+    }
+    while (len) {
+        size_t room = w->cap - 1 - w->pos;
+        if (room == 0) {
+            if (!w->write_cb || w->error) {
+                w->error = 1;
+                return;
+            }
+            if (packr_writer_flush(w) != 0) return;
+            continue;
+        }
+        size_t n = MIN(room, len);
+        memcpy(w->buf + w->pos, str, n);
+        w->pos += n;
+        str += n;
+        len -= n;
+    }
+}
+
+/* One byte is always kept for the terminator */
+static inline void wr_bytes(packr_writer_t *w, const char *str, size_t len) {
+    if (len < w->cap - w->pos) {
+        memcpy(w->buf + w->pos, str, len);
+        w->pos += len;
+    } else {
+        writer_put_slow(w, str, len);
+    }
+}
+
+static inline void wr_char(packr_writer_t *w, char c) {
+    if (w->cap - w->pos > 1) w->buf[w->pos++] = c;
+    else writer_put_slow(w, &c, 1);
+}
+
+static inline void wr_str(packr_writer_t *w, const char *str) {
+    wr_bytes(w, str, strlen(str));
+}
+
+static inline void wr_int(packr_writer_t *w, int32_t value) {
+    char tmp[12];
+    wr_bytes(w, tmp, packr_format_i32(tmp, value));
+}
+
+static inline void wr_num(packr_writer_t *w, double value, int precision) {
+    char tmp[PACKR_FORMAT_MAX];
+    wr_bytes(w, tmp, packr_format_g(tmp, value, precision));
+}
+
+static inline void wr_quoted(packr_writer_t *w, const char *str, size_t len) {
+    wr_char(w, '"');
+    wr_bytes(w, str, len);
+    wr_char(w, '"');
+}
+
+static int decoder_reset_block(packr_decoder_t *ctx) {
+    memset(ctx->last_types, 0, sizeof(ctx->last_types));
+    schema_cache_reset(&ctx->schemas, &ctx->total_alloc);
+    return dicts_reset(&ctx->fields, &ctx->strings, &ctx->macs, &ctx->arena, ctx->primer, &ctx->total_alloc);
+}
+
+/*
+ * Batch columns keep decoded values as text, or as views of the raw string
+ * bytes where those stay put for the batch. Text goes into a pool of
+ * chunks that never move, so a cell costs no allocation of its own. A
+ * value too long for the scratch space spills into a growing heap copy.
+ */
 typedef struct {
-    const uint8_t *buf;
+    char *data;
+    size_t len;
     size_t cap;
-    size_t pos;
-    uint32_t bit_buf;
-    int bit_cnt;
-} bitreader_t;
+} capture_t;
+
+static int capture_write(void *user_data, const char *data, size_t len) {
+    capture_t *c = (capture_t*)user_data;
+    if (c->len + len + 1 > c->cap) {
+        size_t cap = (c->len + len + 1) * 2;
+        char *grown = packr_malloc(cap);
+        if (!grown) return -1;
+        if (c->len) memcpy(grown, c->data, c->len);
+        packr_free(c->data);
+        c->data = grown;
+        c->cap = cap;
+    }
+    memcpy(c->data + c->len, data, len);
+    c->len += len;
+    return 0;
+}
 
-static void br_init(bitreader_t *br, const uint8_t *buf, size_t cap) {
-    br->buf = buf; br->cap = cap; br->pos = 0; br->bit_buf = 0; br->bit_cnt = 0;
+#define POOL_CHUNK 2048
+#define POOL_SCRATCH 128    /* least room a value is decoded into */
+#define POOL_KEEP 8         /* spare chunks the decoder keeps between batches */
+
+typedef struct pool_chunk {
+    struct pool_chunk *next;
+    size_t used;
+    size_t cap;
+} pool_chunk_t;             /* text follows */
+
+typedef struct {
+    pool_chunk_t *head;     /* being filled, then the full ones */
+    pool_chunk_t *spare;    /* empty, POOL_CHUNK each */
+} text_pool_t;
+
+static char *pool_text(pool_chunk_t *chunk) {
+    return (char*)(chunk + 1);
 }
 
-static uint32_t br_read(bitreader_t *br, int bits) {
-    uint32_t res = 0;
-    for (int i = 0; i < bits; i++) {
-        if (br->bit_cnt == 0) {
-            if (br->pos >= br->cap) return 0xFFFFFFFF; // Error marker
-            br->bit_buf = br->buf[br->pos++];
-            br->bit_cnt = 8;
+/* Chunk with room for len bytes, the current one while it has them */
+static pool_chunk_t *pool_room(text_pool_t *pool, size_t len) {
+    pool_chunk_t *head = pool->head;
+    if (head && head->cap - head->used >= len) return head;
+
+    pool_chunk_t *chunk = pool->spare;
+    if (chunk && len <= POOL_CHUNK) {
+        pool->spare = chunk->next;
+    } else {
+        size_t cap = MAX(len, (size_t)POOL_CHUNK);
+        chunk = packr_malloc(sizeof(pool_chunk_t) + cap);
+        if (!chunk) return NULL;
+        chunk->cap = cap;
+    }
+    chunk->used = 0;
+    if (head && len > POOL_CHUNK) {
+        /* Oversized: keep filling the current chunk after it */
+        chunk->next = head->next;
+        head->next = chunk;
+    } else {
+        chunk->next = head;
+        pool->head = chunk;
+    }
+    return chunk;
+}
+
+static void pool_chain_free(pool_chunk_t *chunk) {
+    while (chunk) {
+        pool_chunk_t *next = chunk->next;
+        packr_free(chunk);
+        chunk = next;
+    }
+}
+
+static void pool_free(text_pool_t *pool) {
+    pool_chain_free(pool->head);
+    pool_chain_free(pool->spare);
+}
+
+/* Starts the pool of a batch on the decoder's spare chunks */
+static void pool_take(packr_decoder_t *ctx, text_pool_t *pool) {
+    pool->head = NULL;
+    pool->spare = ctx->batch_text;
+    ctx->batch_text = NULL;
+    for (pool_chunk_t *c = pool->spare; c; c = c->next) ctx->total_alloc -= sizeof(pool_chunk_t) + POOL_CHUNK;
+}
+
+/* Empties the pool back into the decoder's spare chunks, freeing beyond POOL_KEEP and oversized ones */
+static void pool_keep(packr_decoder_t *ctx, text_pool_t *pool) {
+    pool_chunk_t *kept = NULL;
+    int count = 0;
+    for (int round = 0; round < 2; round++) {
+        pool_chunk_t *c = round ? pool->head : pool->spare;
+        while (c) {
+            pool_chunk_t *next = c->next;
+            if (c->cap == POOL_CHUNK && count < POOL_KEEP) {
+                c->next = kept;
+                kept = c;
+                count++;
+            } else {
+                packr_free(c);
+            }
+            c = next;
         }
-        res = (res << 1) | ((br->bit_buf >> (br->bit_cnt - 1)) & 1);
-        br->bit_cnt--;
     }
-    return res;
+    ctx->batch_text = kept;
+    ctx->total_alloc += (size_t)count * (sizeof(pool_chunk_t) + POOL_CHUNK);
 }
 
-static uint32_t br_read_unary(bitreader_t *br) {
-    uint32_t count = 0;
-    while (1) {
-        uint32_t bit = br_read(br, 1);
-        if (bit == 1 || bit == 0xFFFFFFFF) break;
-        count++;
-        if (count > 65536) break; // Sanity
+/* Grows the block for typed columns to size bytes, keeping its contents. Returns 0 if out of memory */
+static int decoder_batch_out(packr_decoder_t *ctx, size_t size) {
+    void *grown = packr_malloc(size);
+    if (!grown) return 0;
+    if (ctx->batch_out_cap) memcpy(grown, ctx->batch_out, ctx->batch_out_cap);
+    packr_free(ctx->batch_out);
+    ctx->total_alloc += size - ctx->batch_out_cap;
+    ctx->batch_out = grown;
+    ctx->batch_out_cap = size;
+    return 1;
+}
+
+/* Frees the memory kept for the next batch */
+static void decoder_batch_free(packr_decoder_t *ctx) {
+    text_pool_t pool;
+    pool_take(ctx, &pool);
+    pool_free(&pool);
+    ctx->total_alloc -= ctx->batch_block_cap + ctx->batch_out_cap;
+    packr_free(ctx->batch_block);
+    packr_free(ctx->batch_out);
+    ctx->batch_block = ctx->batch_out = NULL;
+    ctx->batch_block_cap = ctx->batch_out_cap = 0;
+}
+
+static int decode_value(packr_decoder_t *ctx, packr_writer_t *w);
+
+/*
+ * Reads the payload of a typed string token (see Typed Strings) and writes
+ * its text to out, which needs PACKR_TYPED_MAX bytes. UUIDs and
+ * addresses go in the string dictionary, as they did in the encoder.
+ * Returns the length, 0 if the payload is invalid.
+ */
+static size_t decode_typed(packr_decoder_t *ctx, uint8_t token, char *out) {
+    int bytes;
+    size_t len;
+    if (token == TOKEN_TIMESTAMP) {
+        if (ctx->pos >= ctx->size) return 0;
+        packr_timestamp_t ts;
+        ts.format = ctx->data[ctx->pos++];
+        ts.ticks = zigzag_decode64(decode_varint64(ctx, &bytes));
+        ts.offset = 0;
+        if ((ts.format & PACKR_TS_ZONE) >= PACKR_TS_OFFSET) {
+            int32_t offset = zigzag_decode(decode_varint(ctx, &bytes));
+            if (offset <= INT16_MIN || offset > INT16_MAX) return 0;
+            ts.offset = (int16_t)offset;
+        }
+        return packr_format_timestamp(out, &ts);
+    }
+    if (token == TOKEN_UUID) {
+        if (ctx->pos + 17 > ctx->size) return 0;
+        len = packr_format_uuid(out, ctx->data + ctx->pos + 1, ctx->data[ctx->pos] != 0);
+        ctx->pos += 17;
+    } else {
+        if (ctx->pos + 4 > ctx->size) return 0;
+        len = packr_format_ipv4(out, ctx->data + ctx->pos);
+        ctx->pos += 4;
+    }
+    /* A copy: out is scratch */
+    int index;
+    if (dict_get_or_add(&ctx->strings, out, len, false, &index, &ctx->total_alloc) < 0) return 0;
+    return len;
+}
+
+/* Decodes one value as NUL terminated text in the pool (str NULL if out of memory). Returns the decoder result */
+static int decode_text(packr_decoder_t *ctx, text_pool_t *pool, packr_str_t *out) {
+    out->str = NULL;
+    out->len = 0;
+    pool_chunk_t *chunk = pool_room(pool, POOL_SCRATCH);
+    if (!chunk) return 0;
+
+    char *text = pool_text(chunk) + chunk->used;
+    capture_t c = { NULL, 0, 0 };
+    packr_writer_t w;
+    packr_writer_init(&w, text, chunk->cap - chunk->used, capture_write, &c);
+
+    int ok = decode_value(ctx, &w);
+
+    if (c.data || w.error) {
+        /* Spilled: move it all into a chunk of its own */
+        if (packr_writer_flush(&w) == 0 && (chunk = pool_room(pool, c.len + 1)) != NULL) {
+            text = pool_text(chunk) + chunk->used;
+            memcpy(text, c.data, c.len);
+            w.pos = c.len;
+        } else {
+            chunk = NULL;
+        }
+        packr_free(c.data);
+        if (!chunk) return ok;
+    }
+    text[w.pos] = 0;
+    chunk->used += w.pos + 1;
+    out->str = text;
+    out->len = w.pos;
+    return ok;
+}
+
+/* Cell kinds in col_data_t.types */
+#define CELL_T_TEXT   0   /* JSON text of the value */
+#define CELL_T_NUM    1   /* in nums */
+#define CELL_T_STRING 2   /* raw string bytes, not quoted or terminated */
+#define CELL_T_OBJECT 3   /* OBJECT column: the fields of its group */
+
+/*
+ * Decodes one cell value. A string is viewed where its bytes are: the
+ * frame for a new one, the dictionary for a reference to an entry that is
+ * itself a view. Anything else, or a copied entry (eviction would free
+ * it), goes to the pool as text.
+ */
+static int decode_cell(packr_decoder_t *ctx, text_pool_t *pool, packr_str_t *out, uint8_t *type) {
+    /* As decode_token, the frame CRC must follow */
+    uint8_t token = (ctx->pos + 4 <= ctx->size) ? ctx->data[ctx->pos] : TOKEN_NULL;
+    if (token == TOKEN_NEW_STRING) {
+        size_t start = ctx->pos++;
+        int bytes;
+        uint32_t len = decode_varint(ctx, &bytes);
+        const char *str = (const char*)ctx->data + ctx->pos;
+        int index;
+        if (ctx->pos + len <= ctx->size &&
+            dict_get_or_add(&ctx->strings, str, len, ctx->views, &index, &ctx->total_alloc) >= 0) {
+            PACKR_STAT(ctx->stats.tokens[TOKEN_NEW_STRING]++);
+            ctx->pos += len;
+            out->str = str;
+            out->len = len;
+            *type = CELL_T_STRING;
+            return 1;
+        }
+        ctx->pos = start;
+    } else if (token >= TOKEN_STRING && token < TOKEN_MAC) {
+        int index = token - TOKEN_STRING;
+        dict_entry_t *e = &ctx->strings.entries[index];
+        if (index < PACKR_DICT_SIZE && e->value && e->view) {
+            ctx->pos++;
+            PACKR_STAT(ctx->stats.tokens[TOKEN_STRING]++);
+            dict_touch(&ctx->strings, index);
+            out->str = e->value;
+            out->len = e->length;
+            *type = CELL_T_STRING;
+            return 1;
+        }
+    } else if (token >= TOKEN_TIMESTAMP && token <= TOKEN_IPV4) {
+        pool_chunk_t *chunk = pool_room(pool, PACKR_TYPED_MAX);
+        if (!chunk) return 0;
+        char *text = pool_text(chunk) + chunk->used;
+        ctx->pos++;
+        PACKR_STAT(ctx->stats.tokens[token]++);
+        size_t len = decode_typed(ctx, token, text);
+        if (len == 0) {
+            out->str = NULL;
+            out->len = 0;
+            *type = CELL_T_TEXT;
+            return 0;
+        }
+        chunk->used += len;
+        out->str = text;
+        out->len = len;
+        *type = CELL_T_STRING;
+        return 1;
     }
-    return count;
+    *type = CELL_T_TEXT;
+    return decode_text(ctx, pool, out);
 }
 
+/*
+ * Reads a TOKEN_SCHEMA_* prefix through the batch token it precedes. *schema
+ * gets the cached field list (left alone for TOKEN_SCHEMA_DEF). Returns 0
+ * if the prefix is invalid here.
+ */
+static int decode_schema_prefix(packr_decoder_t *ctx, uint8_t *token, const packr_schema_t **schema) {
+    packr_schema_cache_t *sc = &ctx->schemas;
+    if (sc->depth > 0) return 0; /* never written inside a batch */
 
-// Helper for safe appending
-static void buf_append_str(char **cursor, char *end, const char *str) {
-    while (*str && *cursor < end - 1) {
-        *(*cursor)++ = *str++;
+    if (*token == TOKEN_SCHEMA_REF) {
+        if (ctx->pos >= ctx->size || ctx->data[ctx->pos] >= PACKR_SCHEMA_SLOTS) return 0;
+        sc->last = ctx->data[ctx->pos++];
+    }
+    if (*token != TOKEN_SCHEMA_DEF) {
+        *schema = &sc->slots[sc->last];
+        if (!(*schema)->fields) return 0;
     }
-    **cursor = '\0';
+    if (ctx->pos >= ctx->size) return 0;
+    *token = ctx->data[ctx->pos++];
+    return *token == TOKEN_ULTRA_BATCH || *token == TOKEN_BATCH_PARTIAL;
+}
+
+/* Decoded values of one batch column, nums[r] or strs[r] as types[r] (CELL_T_*) says */
+typedef struct {
+    double *nums;
+    packr_str_t *strs;
+    uint8_t *types;
+    uint8_t *validity;
+} col_data_t;
+
+static int is_batch_token(uint8_t token) {
+    return token == TOKEN_ULTRA_BATCH || token == TOKEN_BATCH_PARTIAL || token == TOKEN_SCHEMA_DEF ||
+           token == TOKEN_SCHEMA_REF || token == TOKEN_SCHEMA_REPEAT;
 }
 
-static void buf_append_char(char **cursor, char *end, char c) {
-    if (*cursor < end - 1) {
-        *(*cursor)++ = c;
-        **cursor = '\0';
+static int batch_handoff(packr_decoder_t *ctx, col_data_t *cols, char **field_names, uint32_t field_count,
+                         uint32_t rows, const uint8_t *flags, const uint32_t *spans, uint32_t *ends,
+                         text_pool_t *pool, packr_batch_func batch_cb, void *user_data);
+
+/*
+ * Decodes the batch that token starts, written to w as JSON, or with
+ * batch_cb set handed to it as typed columns (w unused)
+ */
+static int decode_batch(packr_decoder_t *ctx, uint8_t token, packr_writer_t *w,
+                        packr_batch_func batch_cb, void *user_data) {
+    const packr_schema_t *schema = NULL;
+    bool define = (token == TOKEN_SCHEMA_DEF);
+    if (token != TOKEN_ULTRA_BATCH && token != TOKEN_BATCH_PARTIAL &&
+        !decode_schema_prefix(ctx, &token, &schema)) {
+        return 0;
+    }
+
+    bool partial = (token == TOKEN_BATCH_PARTIAL);
+    int bytes_read;
+    uint32_t record_count = decode_varint(ctx, &bytes_read);
+    uint32_t field_count = schema ? schema->count : decode_varint(ctx, &bytes_read);
+    if (define && field_count == 0) return 0;
+
+    /*
+     * Everything per column in one block: the columns, their cells (number,
+     * text, type, validity), then per field its name (unless the names of a
+     * cached schema are used in place), group size (OBJECT columns), room for
+     * the open group ends, and flags. Top level batches reuse the decoder's
+     * block, batches in their cells get one of their own.
+     */
+    size_t cells = (size_t)record_count * field_count;
+    size_t row_bytes = sizeof(double) + sizeof(packr_str_t) + 2;
+    size_t field_bytes = sizeof(col_data_t) + sizeof(char*) + 2 * sizeof(uint32_t) + 1;
+    if (field_count && cells / field_count != record_count) return 0;
+    if (cells > (SIZE_MAX - field_bytes * field_count) / row_bytes) return 0;
+    size_t block_bytes = (field_bytes * field_count + row_bytes * cells) | 1;
+    bool top = (ctx->schemas.depth == 0);
+    col_data_t *cols;
+    if (top && block_bytes <= ctx->batch_block_cap) {
+        cols = ctx->batch_block;
+    } else {
+        cols = packr_malloc(block_bytes);
+        if (!cols) return 0;
+        if (top) {
+            packr_free(ctx->batch_block);
+            ctx->total_alloc += block_bytes - ctx->batch_block_cap;
+            ctx->batch_block = cols;
+            ctx->batch_block_cap = block_bytes;
+        }
+    }
+    double *nums = (double*)(cols + field_count);
+    packr_str_t *strs = (packr_str_t*)(nums + cells);
+    char **names = (char**)(strs + cells);
+    uint32_t *spans = (uint32_t*)(names + field_count);
+    uint32_t *ends = spans + field_count;
+    uint8_t *types = (uint8_t*)(ends + field_count);
+    uint8_t *flags = types + 2 * cells;
+
+    /* Field names and all text cells live in the pool, emptied with the batch */
+    text_pool_t pool = { NULL, NULL };
+    if (top) pool_take(ctx, &pool);
+
+    /* Store field names and flags (the names of a cached schema are used in place) */
+    char **field_names = schema ? schema->fields : names;
+    bool own_names = !schema;
+    
+    for (uint32_t i = 0; i < field_count; i++) {
+        /* Field name is encoded as a regular value (string/token) */
+        if (own_names) {
+            packr_str_t name;
+            if (decode_text(ctx, &pool, &name) && name.str && name.len >= 2) {
+                /* Strip the quotes */
+                field_names[i] = (char*)name.str + 1;
+                field_names[i][name.len - 2] = 0;
+            } else {
+                field_names[i] = (char*)"unknown";
+            }
+        }
+        
+        if (ctx->pos < ctx->size) {
+            flags[i] = ctx->data[ctx->pos++];
+        } else {
+            flags[i] = 0;
+        }
+        if (flags[i] & 0x10) spans[i] = decode_varint(ctx, &bytes_read); // GROUP size
+    }
+
+    /* Keep each group inside the one it is in */
+    uint32_t open = 0;
+    for (uint32_t i = 0; i < field_count; i++) {
+        while (open && i >= ends[open - 1]) open--;
+        if (!(flags[i] & 0x10)) continue;
+        uint32_t end = open ? ends[open - 1] : field_count;
+        if (spans[i] > end - i - 1) spans[i] = end - i - 1;
+        ends[open++] = i + 1 + spans[i];
+    }
+
+    if (define) {
+        int slot = schema_store(&ctx->schemas, field_names, field_count, 0, &ctx->total_alloc);
+        if (slot < 0) {
+            if (top) pool_keep(ctx, &pool);
+            else pool_free(&pool);
+            if (cols != ctx->batch_block) packr_free(cols);
+            return 0;
+        }
+        field_names = ctx->schemas.slots[slot].fields;
+    }
+    /* Batches in the columns below don't touch the cache and block resets are refused
+     * in them (decode_token), so field_names stays put */
+    ctx->schemas.depth++;
+    
+    memset(nums, 0, sizeof(double) * cells);
+    memset(strs, 0, sizeof(packr_str_t) * cells);
+    memset(types, CELL_T_TEXT, cells);
+    memset(types + cells, 1, cells); // Default Valid
+    for(uint32_t i=0; i<field_count; i++) {
+        cols[i].nums = nums + (size_t)i * record_count;
+        cols[i].strs = strs + (size_t)i * record_count;
+        cols[i].types = types + (size_t)i * record_count;
+        cols[i].validity = types + cells + (size_t)i * record_count;
+    }
+    bool failed = false;
+    
+    /* Decode each column */
+    for (uint32_t i = 0; i < field_count; i++) {
+        if (flags[i] & 0x08) { // HAS_NULLS
+             size_t bytes = (record_count + 7) / 8;
+             size_t start = ctx->pos;
+             ctx->pos += bytes;
+             // Decode
+             for(uint32_t k=0; k<record_count; k++) {
+                 if (start + (k/8) < ctx->size) {
+                    uint8_t b = ctx->data[start + (k/8)];
+                    cols[i].validity[k] = (b >> (k%8)) & 1;
+                 }
+             }
+        }
+
+        /* TIME: rows are ticks relative to a base, in the column below */
+        packr_timestamp_t time = { 0, 0, 0 };
+        if (flags[i] & 0x20) {
+            if (ctx->pos < ctx->size) time.format = ctx->data[ctx->pos++];
+            if ((time.format & PACKR_TS_ZONE) >= PACKR_TS_OFFSET) {
+                time.offset = (int16_t)zigzag_decode(decode_varint(ctx, &bytes_read));
+            }
+            time.ticks = zigzag_decode64(decode_varint64(ctx, &bytes_read));
+        }
+
+        if (flags[i] & 0x10) { // GROUP
+            /* Null rows; its fields are the columns that follow */
+            size_t start = ctx->pos;
+            if (flags[i] & 0x01) ctx->pos += (record_count + 7) / 8;
+            for (uint32_t k = 0; k < record_count; k++) {
+                bool null = (flags[i] & 0x01) && start + (k/8) < ctx->size &&
+                            ((ctx->data[start + (k/8)] >> (k%8)) & 1);
+                cols[i].types[k] = null ? CELL_T_TEXT : CELL_T_OBJECT;
+            }
+        } else if (flags[i] & 0x01) { // CONSTANT
+            PACKR_STAT(ctx->stats.columns[PACKR_COL_CONST]++);
+            packr_str_t v;
+            uint8_t type;
+            decode_cell(ctx, &pool, &v, &type);
+            for(uint32_t j=0; j<record_count; j++) {
+                cols[i].strs[j] = v; // Shared
+                cols[i].types[j] = type;
+            }
+        } else if (flags[i] & 0x02) { // DELTA
+            /* Numeric Column */
+            uint8_t vtoken = ctx->data[ctx->pos]; // Peek
+            
+            if (vtoken == TOKEN_MFV_COLUMN) {
+                PACKR_STAT(ctx->stats.columns[PACKR_COL_MFV]++);
+                ctx->pos++;
+                int bytes_read;
+                uint32_t dcount = decode_varint(ctx, &bytes_read);
+                
+                // Decode Mode
+                double mode_val = 0;
+                if (ctx->pos < ctx->size) {
+                  uint8_t mt = ctx->data[ctx->pos++];
+                  if (mt == TOKEN_INT) mode_val = zigzag_decode(decode_varint(ctx, &bytes_read));
+                  else if (mt == TOKEN_FLOAT32) {
+                       int32_t scaled = ctx->data[ctx->pos] | (ctx->data[ctx->pos+1] << 8) | 
+                                        (ctx->data[ctx->pos+2] << 16) | (ctx->data[ctx->pos+3] << 24);
+                       ctx->pos += 4;
+                       mode_val = scaled / 65536.0;
+                  }
+                  else if (mt == TOKEN_BOOL_TRUE) mode_val = 1.0;
+                  else if (mt == TOKEN_BOOL_FALSE) mode_val = 0.0;
+                  else if (mt == TOKEN_DOUBLE) {
+                      uint64_t v64 = (uint64_t)ctx->data[ctx->pos] | ((uint64_t)ctx->data[ctx->pos+1] << 8) | 
+                                     ((uint64_t)ctx->data[ctx->pos+2] << 16) | ((uint64_t)ctx->data[ctx->pos+3] << 24) |
+                                     ((uint64_t)ctx->data[ctx->pos+4] << 32) | ((uint64_t)ctx->data[ctx->pos+5] << 40) |
+                                     ((uint64_t)ctx->data[ctx->pos+6] << 48) | ((uint64_t)ctx->data[ctx->pos+7] << 56);
+                      ctx->pos += 8;
+                      memcpy(&mode_val, &v64, sizeof(double));
+                  }
+                }
+                
+                // Mask
+                size_t mask_len = (dcount + 7) / 8;
+                size_t mask_start = ctx->pos;
+                ctx->pos += mask_len;
+                
+                uint32_t j = 0;
+                for(uint32_t k=0; k<dcount && j<record_count; k++) {
+                   uint8_t b = ctx->data[mask_start + (k/8)];
+                   double val;
+                   if ( (b >> (k%8)) & 1 ) {
+                       // Exception
+                       uint8_t et = ctx->data[ctx->pos++];
+                       double eval = 0;
+                       if (et == TOKEN_INT) eval = zigzag_decode(decode_varint(ctx, &bytes_read));
+                       else if (et == TOKEN_FLOAT32) {
+                           int32_t scaled = ctx->data[ctx->pos] | (ctx->data[ctx->pos+1] << 8) | 
+                                            (ctx->data[ctx->pos+2] << 16) | (ctx->data[ctx->pos+3] << 24);
+                           ctx->pos += 4;
+                           eval = scaled / 65536.0;
+                       }
+                       else if (et == TOKEN_BOOL_TRUE) eval = 1.0;
+                       else if (et == TOKEN_BOOL_FALSE) eval = 0.0;
+                       else if (et == TOKEN_DOUBLE) {
+                           uint64_t v64 = (uint64_t)ctx->data[ctx->pos] | ((uint64_t)ctx->data[ctx->pos+1] << 8) | 
+                                          ((uint64_t)ctx->data[ctx->pos+2] << 16) | ((uint64_t)ctx->data[ctx->pos+3] << 24) |
+                                          ((uint64_t)ctx->data[ctx->pos+4] << 32) | ((uint64_t)ctx->data[ctx->pos+5] << 40) |
+                                          ((uint64_t)ctx->data[ctx->pos+6] << 48) | ((uint64_t)ctx->data[ctx->pos+7] << 56);
+                           ctx->pos += 8;
+                           memcpy(&eval, &v64, sizeof(double));
+                       }
+                       val = eval;
+                   } else {
+                       val = mode_val;
+                   }
+                   cols[i].nums[j++] = val; cols[i].types[j-1] = CELL_T_NUM;
+                }
+            } else {
+                /* Base value */
+                vtoken = ctx->data[ctx->pos++];
+                double prev = 0;
+                if (vtoken == TOKEN_INT) {
+                    prev = zigzag_decode(decode_varint(ctx, &bytes_read));
+                } else if (vtoken == TOKEN_FLOAT32) {
+                    int32_t scaled = ctx->data[ctx->pos] | (ctx->data[ctx->pos+1] << 8) |
+                                     (ctx->data[ctx->pos+2] << 16) | (ctx->data[ctx->pos+3] << 24);
+                    ctx->pos += 4;
+                    prev = scaled / 65536.0;
+                } else if (vtoken == TOKEN_DOUBLE) {
+                    /* IEEE 754 double - 8 bytes LE. Deltas still use 65536 scaling. */
+                    uint64_t v64 = (uint64_t)ctx->data[ctx->pos] | ((uint64_t)ctx->data[ctx->pos+1] << 8) |
+                                   ((uint64_t)ctx->data[ctx->pos+2] << 16) | ((uint64_t)ctx->data[ctx->pos+3] << 24) |
+                                   ((uint64_t)ctx->data[ctx->pos+4] << 32) | ((uint64_t)ctx->data[ctx->pos+5] << 40) |
+                                   ((uint64_t)ctx->data[ctx->pos+6] << 48) | ((uint64_t)ctx->data[ctx->pos+7] << 56);
+                    ctx->pos += 8;
+                    memcpy(&prev, &v64, sizeof(double));
+                    vtoken = TOKEN_FLOAT32; /* Treat same as FLOAT32 for delta scaling */
+                }
+                cols[i].nums[0] = prev;
+                cols[i].types[0] = CELL_T_NUM;
+#if PACKR_STATS
+                if (record_count > 1 && ctx->pos < ctx->size) {
+                    uint8_t dt = ctx->data[ctx->pos];
+                    ctx->stats.columns[dt == TOKEN_BITPACK_COL ? PACKR_COL_BITPACK :
+                                       dt == TOKEN_RICE_COLUMN ? PACKR_COL_RICE : PACKR_COL_DELTA]++;
+                }
+#endif
+                
+                uint32_t j = 1;
+                while (j < record_count) {
+                    uint8_t dt = ctx->data[ctx->pos++];
+                    double delta = 0;
+                    if (dt == TOKEN_BITPACK_COL) {
+                        uint32_t dcount = decode_varint(ctx, &bytes_read);
+                        for(uint32_t k=0; k<dcount && j<record_count; k+=2) {
+                            uint8_t pack = ctx->data[ctx->pos++];
+                            int d1 = (pack >> 4) - 8;
+                            prev += (double)d1 / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
+                            cols[i].nums[j++] = prev; cols[i].types[j-1] = CELL_T_NUM;
+                            if (j < record_count && k+1 < dcount) {
+                                int d2 = (pack & 0x0F) - 8;
+                                prev += (double)d2 / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
+                                cols[i].nums[j++] = prev; cols[i].types[j-1] = CELL_T_NUM;
+                            }
+                        }
+                    } else if (dt == TOKEN_RICE_COLUMN) {
+                         uint32_t dcount = decode_varint(ctx, &bytes_read);
+                         if (ctx->pos < ctx->size) {
+                             int k = ctx->data[ctx->pos++];
+                             uint32_t max_j = j + dcount;
+                             if (max_j > record_count) max_j = record_count;
+                             
+                             packr_bitreader_t br; packr_br_init(&br, ctx->data + ctx->pos, ctx->size - ctx->pos);
+                             for(; j < max_j; j++) {
+                                 uint32_t u;
+                                 if (packr_br_get_rice(&br, k, &u) != 0) break;
+                                 int32_t d = zigzag_decode(u);
+                                 prev += (double)d / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
+                                 cols[i].nums[j] = prev; cols[i].types[j] = CELL_T_NUM;
+                             }
+                             // Account for consumed bytes, including any partially read byte
+                             ctx->pos += packr_br_used(&br);
+                         }
+                    } else if (dt == TOKEN_RLE_REPEAT) {
+                         uint32_t run = decode_varint(ctx, &bytes_read);
+                         for(uint32_t k=0; k<run && j<record_count; k++) {
+                             cols[i].nums[j++] = prev; cols[i].types[j-1] = CELL_T_NUM;
+                         }
+                    } else {
+                         /* Single delta tokens */
+                         if (dt == TOKEN_DELTA_ZERO) delta = 0;
+                         else if (dt == TOKEN_DELTA_ONE) delta = 1;
+                         else if (dt == TOKEN_DELTA_NEG_ONE) delta = -1;
+                         else if (dt >= 0xC3 && dt <= 0xD2) delta = (int)dt - 0xC3 - 8;
+                         else if (dt == TOKEN_DELTA_LARGE) delta = zigzag_decode(decode_varint(ctx, &bytes_read));
+                         else if (dt == TOKEN_DELTA_MEDIUM) delta = (int)ctx->data[ctx->pos++] - 64;
+                         
+                         prev += (double)delta / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
+                         cols[i].nums[j++] = prev; cols[i].types[j-1] = CELL_T_NUM;
+                    }
+                }
+            }
+        } else { // RLE
+            uint32_t j = 0;
+            // Check MFV first
+            if (ctx->data[ctx->pos] == TOKEN_MFV_COLUMN) {
+                 PACKR_STAT(ctx->stats.columns[PACKR_COL_MFV]++);
+                 ctx->pos++;
+                 int bytes_read;
+                 uint32_t dcount = decode_varint(ctx, &bytes_read);
+                 // Decode Mode String
+                 packr_str_t mode;
+                 uint8_t mode_type;
+                 if (!decode_cell(ctx, &pool, &mode, &mode_type)) {
+                     failed = true;
+                     break;
+                 }
+                 
+                 // Mask
+                 size_t mask_len = (dcount + 7) / 8;
+                 size_t mask_start = ctx->pos;
+                 ctx->pos += mask_len;
+                 
+                 for(uint32_t k=0; k<dcount && j<record_count; k++) {
+                       uint8_t b = (mask_start + (k/8) < ctx->size) ? ctx->data[mask_start + (k/8)] : 0;
+                       if ( (b >> (k%8)) & 1 ) {
+                           // Exception
+                           if (!decode_cell(ctx, &pool, &cols[i].strs[j], &cols[i].types[j])) {
+                               cols[i].strs[j].str = NULL;
+                               cols[i].types[j] = CELL_T_TEXT;
+                           }
+                           j++;
+                       } else {
+                           // Mode - Shared
+                           cols[i].strs[j] = mode;
+                           cols[i].types[j++] = mode_type;
+                       }
+                 }
+            } else {
+                PACKR_STAT(ctx->stats.columns[(flags[i] & 0x04) ? PACKR_COL_RLE : PACKR_COL_CUSTOM]++);
+                while (j < record_count) {
+                    uint32_t first = j;
+                    if (!decode_cell(ctx, &pool, &cols[i].strs[j], &cols[i].types[j])) {
+                        failed = true;
+                        break;
+                    }
+                    j++;
+                    if (j < record_count && ctx->data[ctx->pos] == TOKEN_RLE_REPEAT) {
+                         ctx->pos++;
+                         int bytes_read;
+                         uint32_t run = decode_varint(ctx, &bytes_read);
+                         for(uint32_t k=0; k<run && j<record_count; k++) {
+                             cols[i].strs[j] = cols[i].strs[first]; // Shared
+                             cols[i].types[j++] = cols[i].types[first];
+                         }
+                    }
+                }
+            }
+        }
+
+        if (flags[i] & 0x20) {
+            int64_t base = time.ticks;
+            for (uint32_t r = 0; r < record_count && !failed; r++) {
+                if (!cols[i].validity[r]) continue;
+                double rel = cols[i].nums[r];
+                if (cols[i].types[r] != CELL_T_NUM) {
+                    rel = cols[i].strs[r].str ? strtod(cols[i].strs[r].str, NULL) : 0; // Constant
+                }
+                pool_chunk_t *chunk = pool_room(&pool, PACKR_TIMESTAMP_MAX);
+                if (!chunk) {
+                    failed = true;
+                    break;
+                }
+                time.ticks = base + (int64_t)rel;
+                char *text = pool_text(chunk) + chunk->used;
+                size_t len = packr_format_timestamp(text, &time);
+                chunk->used += len;
+                cols[i].strs[r].str = len ? text : NULL;
+                cols[i].strs[r].len = len;
+                cols[i].types[r] = len ? CELL_T_STRING : CELL_T_TEXT;
+            }
+        }
+    }
+    
+    int ret = 1;
+    if (failed) {
+        ret = 0;
+    } else if (batch_cb) {
+        ret = batch_handoff(ctx, cols, field_names, field_count, record_count, flags, spans, ends, &pool,
+                            batch_cb, user_data);
+    } else {
+        /* Reconstruct JSON */
+        if (!partial) wr_char(w, '[');
+    
+        for(uint32_t r=0; r<record_count; r++) {
+            if (r > 0) wr_char(w, ',');
+            wr_char(w, '{');
+            bool first_field = true;
+            open = 0;
+            for(uint32_t c=0; c<field_count; c++) {
+                for (; open && c >= ends[open - 1]; open--) {
+                    wr_char(w, '}');
+                    first_field = false;
+                }
+                if (cols[c].validity[r] == 0) { // Skip missing field
+                    if (flags[c] & 0x10) c += spans[c];
+                    continue;
+                }
+            
+                if (!first_field) wr_char(w, ',');
+                first_field = false;
+            
+                wr_char(w, '"');
+                wr_str(w, field_names[c]);
+                wr_bytes(w, "\":", 2);
+            
+                if (cols[c].types[r] == CELL_T_OBJECT) {
+                    wr_char(w, '{');
+                    ends[open++] = c + 1 + spans[c];
+                    first_field = true;
+                } else if (cols[c].types[r] == CELL_T_NUM) {
+                    double v = cols[c].nums[r];
+                    if (v == (double)(int64_t)v && (v < 2147483648.0 && v > -2147483648.0)) {
+                         wr_int(w, (int32_t)v);
+                    }
+                    else wr_num(w, v, 17);
+                } else if (cols[c].types[r] == CELL_T_STRING) {
+                    wr_quoted(w, cols[c].strs[r].str, cols[c].strs[r].len);
+                } else if (cols[c].strs[r].str) {
+                    wr_bytes(w, cols[c].strs[r].str, cols[c].strs[r].len);
+                } else {
+                    if (flags[c] & 0x10) c += spans[c]; // Null object
+                    wr_bytes(w, "null", 4);
+                }
+            }
+            for (; open; open--) wr_char(w, '}');
+            wr_char(w, '}');
+        }
+        if (!partial) wr_char(w, ']');
     }
+    
+    /* Free memory */
+    if (top) pool_keep(ctx, &pool);
+    else pool_free(&pool);
+    if (cols != ctx->batch_block) packr_free(cols);
+    ctx->schemas.depth--;
+    return ret;
 }
 
-int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
+/* Reads the next value's token, applying block resets. Returns 0 if the data runs out */
+static int decode_token(packr_decoder_t *ctx, uint8_t *token) {
     if (ctx->pos >= ctx->size) return 0;
     
     if (ctx->pos > ctx->size - 4) return 0;
 
-    uint8_t token = ctx->data[ctx->pos++];
-    char temp[64];
+    *token = ctx->data[ctx->pos++];
+    
+    /* Block start: the encoder dropped its dictionaries here */
+    while (*token == TOKEN_BLOCK_RESET) {
+        /* Only written between top-level values: in a batch it would free the schema in use */
+        if (ctx->schemas.depth > 0) return 0;
+        PACKR_STAT(ctx->stats.tokens[TOKEN_BLOCK_RESET]++);
+        if (decoder_reset_block(ctx) != 0) return 0;
+        if (ctx->pos > ctx->size - 4) return 0;
+        *token = ctx->data[ctx->pos++];
+    }
+    PACKR_STAT(ctx->stats.tokens[stats_token_slot(*token)]++);
+    return 1;
+}
+
+static int decode_value(packr_decoder_t *ctx, packr_writer_t *w) {
+    uint8_t token;
+    if (!decode_token(ctx, &token)) return 0;
     
     if (token == TOKEN_NULL) {
-        buf_append_str(cursor, end, "null");
+        wr_bytes(w, "null", 4);
     }
     else if (token == TOKEN_BOOL_TRUE) {
-        buf_append_str(cursor, end, "true");
+        wr_bytes(w, "true", 4);
     }
     else if (token == TOKEN_BOOL_FALSE) {
-        buf_append_str(cursor, end, "false");
+        wr_bytes(w, "false", 5);
     }
     else if (token == TOKEN_FLOAT32) {
         if (ctx->pos + 4 > ctx->size) return 0;
@@ -702,8 +2393,7 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
             ctx->last_nums[ctx->current_field] = val;
             ctx->last_types[ctx->current_field] = 2;
         }
-        snprintf(temp, sizeof(temp), "%.7g", val);
-        buf_append_str(cursor, end, temp);
+        wr_num(w, val, 7);
     }
     else if (token == TOKEN_DOUBLE) {
         if (ctx->pos + 8 > ctx->size) return 0;
@@ -726,8 +2416,7 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
         }
         
         // Print with high precision
-        snprintf(temp, sizeof(temp), "%.17g", val);
-        buf_append_str(cursor, end, temp);
+        wr_num(w, val, 17);
     }
     else if (token == TOKEN_BINARY || token == TOKEN_BINARY_BITPACKED_1B || token == TOKEN_BINARY_BITPACKED_2B) {
         int bytes;
@@ -743,10 +2432,10 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
         if (ctx->pos + packed_len > ctx->size) return 0;
         ctx->pos += packed_len;
         
-        char msg[80];
-        if (token == TOKEN_BINARY) snprintf(msg, sizeof(msg), "\"<binary data len=%u>\"", (unsigned int)len);
-        else snprintf(msg, sizeof(msg), "\"<binary data len=%u bitpacked>\"", (unsigned int)len);
-        buf_append_str(cursor, end, msg);
+        char num[12];
+        wr_str(w, "\"<binary data len=");
+        wr_bytes(w, num, packr_format_u32(num, len));
+        wr_str(w, token == TOKEN_BINARY ? ">\"" : " bitpacked>\"");
     }
     else if (token == TOKEN_INT || token == TOKEN_DELTA_LARGE || (token >= 0xC3 && token <= 0xD2) || 
              token == TOKEN_DELTA_ZERO || token == TOKEN_DELTA_ONE || token == TOKEN_DELTA_NEG_ONE || 
@@ -779,39 +2468,34 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
                 if (ctx->last_types[ctx->current_field] == 2) { // Previous was float
                 double res = prev + (double)val / 65536.0;
                 ctx->last_nums[ctx->current_field] = res;
-                snprintf(temp, sizeof(temp), "%.7g", res);
+                wr_num(w, res, 7);
             } else { // Previous was int
                 int32_t res = (int32_t)prev + val;
                 ctx->last_nums[ctx->current_field] = (double)res;
-                snprintf(temp, sizeof(temp), "%d", res);
+                wr_int(w, res);
             }
         } else {
             if (ctx->current_field >= 0 && ctx->current_field < PACKR_DICT_SIZE) {
                 ctx->last_nums[ctx->current_field] = (double)val;
                 ctx->last_types[ctx->current_field] = 1; // Store as int
             }
-            snprintf(temp, sizeof(temp), "%d", val);
+            wr_int(w, val);
         }
-        buf_append_str(cursor, end, temp);
     }
     else if (token == TOKEN_NEW_STRING || token == TOKEN_NEW_FIELD) {
         int bytes;
         uint32_t len = decode_varint(ctx, &bytes);
         if (ctx->pos + len > ctx->size) return 0;
         
-        char *str_val = packr_malloc(len + 1);
-        memcpy(str_val, ctx->data + ctx->pos, len);
-        str_val[len] = '\0';
+        /* Added straight from the input, as a view of it when it stays put */
+        const char *str_val = (const char*)ctx->data + ctx->pos;
         ctx->pos += len;
         
-        int dummy;
-        if (token == TOKEN_NEW_FIELD) dict_get_or_add(&ctx->fields, str_val, len, &dummy, &ctx->total_alloc);
-        else dict_get_or_add(&ctx->strings, str_val, len, &dummy, &ctx->total_alloc);
+        packr_dict_t *d = (token == TOKEN_NEW_FIELD) ? &ctx->fields : &ctx->strings;
+        int index;
+        if (dict_get_or_add(d, str_val, len, ctx->views, &index, &ctx->total_alloc) < 0) return 0;
         
-        buf_append_char(cursor, end, '"');
-        buf_append_str(cursor, end, str_val); 
-        buf_append_char(cursor, end, '"');
-        packr_free(str_val);
+        wr_quoted(w, d->entries[index].value, d->entries[index].length);
     }
     else if ((token >= TOKEN_FIELD && token < TOKEN_STRING) || 
              (token >= TOKEN_STRING && token < TOKEN_MAC)) {
@@ -819,12 +2503,10 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
         int index = (token < TOKEN_STRING) ? (token - TOKEN_FIELD) : (token - TOKEN_STRING);
         
         if (index < PACKR_DICT_SIZE && d->entries[index].value) {
-            buf_append_char(cursor, end, '"');
-            buf_append_str(cursor, end, d->entries[index].value);
-            buf_append_char(cursor, end, '"');
-            d->entries[index].last_used = ++d->usage_counter;
+            wr_quoted(w, d->entries[index].value, d->entries[index].length);
+            dict_touch(d, index);
         } else {
-            buf_append_str(cursor, end, "\"\"");
+            wr_bytes(w, "\"\"", 2);
         }
     }
     else if (token == TOKEN_NEW_MAC || (token >= TOKEN_MAC && token < TOKEN_INT)) {
@@ -833,51 +2515,62 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
             if (ctx->pos + 6 > ctx->size) return 0;
             const uint8_t *m = ctx->data + ctx->pos;
             ctx->pos += 6;
-            snprintf(mac_str, sizeof(mac_str), "%02X:%02X:%02X:%02X:%02X:%02X",
-                     m[0], m[1], m[2], m[3], m[4], m[5]);
+            static const char hex[] = "0123456789ABCDEF";
+            for (int k = 0; k < 6; k++) {
+                mac_str[k * 3] = hex[m[k] >> 4];
+                mac_str[k * 3 + 1] = hex[m[k] & 0x0F];
+                mac_str[k * 3 + 2] = (k < 5) ? ':' : '\0';
+            }
             int dummy;
-            dict_get_or_add(&ctx->macs, mac_str, 17, &dummy, &ctx->total_alloc);
+            dict_get_or_add(&ctx->macs, mac_str, 17, false, &dummy, &ctx->total_alloc);
         } else {
             int index = token - TOKEN_MAC;
             if (index < PACKR_DICT_SIZE && ctx->macs.entries[index].value) {
-                strncpy(mac_str, ctx->macs.entries[index].value, 18);
-                ctx->macs.entries[index].last_used = ++ctx->macs.usage_counter;
+                /* Primer MACs are views, not terminated */
+                size_t n = MIN(ctx->macs.entries[index].length, sizeof(mac_str) - 1);
+                memcpy(mac_str, ctx->macs.entries[index].value, n);
+                mac_str[n] = 0;
+                dict_touch(&ctx->macs, index);
             } else {
                 mac_str[0] = 0;
             }
         }
-        buf_append_char(cursor, end, '"');
-        buf_append_str(cursor, end, mac_str);
-        buf_append_char(cursor, end, '"');
+        wr_quoted(w, mac_str, strlen(mac_str));
+    }
+    else if (token >= TOKEN_TIMESTAMP && token <= TOKEN_IPV4) {
+        char text[PACKR_TYPED_MAX];
+        size_t len = decode_typed(ctx, token, text);
+        if (len == 0) return 0;
+        wr_quoted(w, text, len);
     }
     else if (token == TOKEN_ARRAY_START) {
         int bytes;
         uint32_t count = decode_varint(ctx, &bytes);
-        buf_append_char(cursor, end, '[');
+        wr_char(w, '[');
         for (uint32_t i = 0; i < count; i++) {
-            if (i > 0) buf_append_char(cursor, end, ',');
-            if (!packr_decode_next(ctx, cursor, end)) break;
+            if (i > 0) wr_char(w, ',');
+            if (!decode_value(ctx, w)) return 0;
         }
         /* Consume END if present */
         if (ctx->pos < ctx->size && ctx->data[ctx->pos] == TOKEN_ARRAY_END) ctx->pos++;
-        buf_append_char(cursor, end, ']');
+        wr_char(w, ']');
     }
     else if (token == TOKEN_ARRAY_STREAM) {
-        buf_append_char(cursor, end, '[');
+        wr_char(w, '[');
         bool first = true;
         while (ctx->pos < ctx->size && ctx->data[ctx->pos] != TOKEN_ARRAY_END) {
-            if (!first) buf_append_char(cursor, end, ',');
-            if (!packr_decode_next(ctx, cursor, end)) break;
+            if (!first) wr_char(w, ',');
+            if (!decode_value(ctx, w)) return 0;
             first = false;
         }
         if (ctx->pos < ctx->size) ctx->pos++; // Skip END
-        buf_append_char(cursor, end, ']');
+        wr_char(w, ']');
     }
     else if (token == TOKEN_OBJECT_START) {
-        buf_append_char(cursor, end, '{');
+        wr_char(w, '{');
         bool first = true;
         while (ctx->pos < ctx->size && ctx->data[ctx->pos] != TOKEN_OBJECT_END) {
-            if (!first) buf_append_char(cursor, end, ',');
+            if (!first) wr_char(w, ',');
             first = false;
             
             /* Field Name (Key) */
@@ -887,384 +2580,1253 @@ int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
             else if (next_t == TOKEN_NEW_FIELD) {
             }
             
-            packr_decode_next(ctx, cursor, end); 
+            if (!decode_value(ctx, w)) return 0;
             
-            buf_append_char(cursor, end, ':');
+            wr_char(w, ':');
             
             int old_field = ctx->current_field;
             ctx->current_field = field_idx; // Track for value
-            packr_decode_next(ctx, cursor, end); // Value
+            int ok = decode_value(ctx, w); // Value
             ctx->current_field = old_field;
+            if (!ok) return 0;
         }
         if (ctx->pos < ctx->size) ctx->pos++; /* Skip END */
-        buf_append_char(cursor, end, '}');
+        wr_char(w, '}');
     }
-    else if (token == TOKEN_ULTRA_BATCH || token == TOKEN_BATCH_PARTIAL) {
-        bool partial = (token == TOKEN_BATCH_PARTIAL);
-        int bytes_read;
-        uint32_t record_count = decode_varint(ctx, &bytes_read);
-        uint32_t field_count = decode_varint(ctx, &bytes_read);
-        
-        /* Store field names and flags */
-        char **field_names = packr_malloc(sizeof(char*) * field_count);
-        uint8_t *flags = packr_malloc(field_count);
-        
-        for (uint32_t i = 0; i < field_count; i++) {
-            /* Field name is encoded as a regular value (string/token) */
-            char *old_cursor = *cursor;
-            if (packr_decode_next(ctx, cursor, end) && *cursor > old_cursor + 1) {
-                /* *cursor now points after "name". Extract. */
-                size_t slen = (*cursor - old_cursor) - 2;
-                field_names[i] = packr_malloc(slen + 1);
-                if (field_names[i]) {
-                    memcpy(field_names[i], old_cursor + 1, slen);
-                    field_names[i][slen] = 0;
-                }
-            } else {
-                field_names[i] = packr_malloc(8);
-                if (field_names[i]) strcpy(field_names[i], "unknown");
-            }
-            *cursor = old_cursor; // Rewind cursor!
-            
-            if (ctx->pos < ctx->size) {
-                flags[i] = ctx->data[ctx->pos++];
+    else if (is_batch_token(token)) {
+        return decode_batch(ctx, token, w, NULL, NULL);
+    }
+    
+    return 1;
+}
+
+int packr_decode_to(packr_decoder_t *ctx, packr_writer_t *w) {
+    /* Without its primer the frame's dictionary references mean nothing */
+    int ret = (ctx->primer_id && !ctx->primer) ? 0 : decode_value(ctx, w);
+    if (w->cap) w->buf[w->pos] = '\0';
+    return ret;
+}
+
+/* Typed Columns */
+
+enum {
+    CELL_NONE,
+    CELL_NUM,
+    CELL_STRING,
+    CELL_BOOL,
+    CELL_OTHER
+};
+
+static int batch_cell(const col_data_t *c, uint32_t r) {
+    if (!c->validity[r]) return CELL_NONE;
+    if (c->types[r] == CELL_T_NUM) return CELL_NUM;
+    if (c->types[r] == CELL_T_STRING) return CELL_STRING;
+    const char *t = c->strs[r].str;
+    if (!t || strcmp(t, "null") == 0) return CELL_NONE;
+    if (t[0] == '"') return CELL_STRING;
+    if (strcmp(t, "true") == 0 || strcmp(t, "false") == 0) return CELL_BOOL;
+    /* Constant columns keep their number as text */
+    if (t[0] == '-' || (t[0] >= '0' && t[0] <= '9')) return CELL_NUM;
+    return CELL_OTHER;
+}
+
+static double batch_num(const col_data_t *c, uint32_t r) {
+    return c->types[r] == CELL_T_NUM ? c->nums[r] : strtod(c->strs[r].str, NULL);
+}
+
+/* Same test as the JSON output */
+static int num_is_int32(double v) {
+    return v == (double)(int64_t)v && v < 2147483648.0 && v > -2147483648.0;
+}
+
+static size_t batch_elem(packr_column_type_t type) {
+    return (type == PACKR_COLUMN_INT32) ? sizeof(int32_t) :
+           (type == PACKR_COLUMN_DOUBLE) ? sizeof(double) :
+           (type == PACKR_COLUMN_BOOL) ? sizeof(uint8_t) : sizeof(packr_str_t);
+}
+
+/* Types out by the values c holds. Returns the bytes its values take (a multiple of 8) */
+static size_t batch_column_type(col_data_t *c, uint32_t rows, const char *name, packr_decoded_column_t *out) {
+    uint32_t seen[CELL_OTHER + 1] = { 0 };
+    bool all_int = true;
+    size_t text = 0; /* what a JSON column has to format */
+    for (uint32_t r = 0; r < rows; r++) {
+        int k = batch_cell(c, r);
+        seen[k]++;
+        if (k == CELL_NONE) c->validity[r] = 0; /* null reads as missing */
+        else if (k == CELL_NUM && !num_is_int32(batch_num(c, r))) all_int = false;
+        if (c->types[r] == CELL_T_NUM) text += PACKR_FORMAT_MAX;
+        else if (c->types[r] == CELL_T_STRING) text += c->strs[r].len + 2;
+    }
+
+    int kinds = !!seen[CELL_NUM] + !!seen[CELL_STRING] + !!seen[CELL_BOOL] + !!seen[CELL_OTHER];
+    out->name = name;
+    out->nulls = c->validity;
+    if (kinds == 0) {
+        out->type = PACKR_COLUMN_NULL;
+        return 0;
+    }
+    if (kinds > 1 || seen[CELL_OTHER]) out->type = PACKR_COLUMN_JSON;
+    else if (seen[CELL_NUM]) out->type = all_int ? PACKR_COLUMN_INT32 : PACKR_COLUMN_DOUBLE;
+    else if (seen[CELL_STRING]) out->type = PACKR_COLUMN_STRING;
+    else out->type = PACKR_COLUMN_BOOL;
+
+    /* A JSON column formats its numbers and quotes its raw strings behind the views */
+    size_t size = batch_elem(out->type) * rows + (out->type == PACKR_COLUMN_JSON ? text : 0);
+    return (size + 7) & ~(size_t)7;
+}
+
+/* Fills the values of out (typed by batch_column_type) from c into data */
+static void batch_column(col_data_t *c, uint32_t rows, packr_decoded_column_t *out, uint8_t *data, size_t size) {
+    if (out->type == PACKR_COLUMN_NULL) return;
+    size_t elem = batch_elem(out->type);
+    memset(data, 0, size);
+    char *formatted = (char*)data + elem * rows;
+
+    int32_t *ints = (int32_t*)data;
+    double *doubles = (double*)data;
+    packr_str_t *views = (packr_str_t*)data;
+    for (uint32_t r = 0; r < rows; r++) {
+        int k = batch_cell(c, r);
+        if (k == CELL_NONE) continue;
+        const char *t = c->strs[r].str;
+        switch (out->type) {
+        case PACKR_COLUMN_INT32:
+            ints[r] = (int32_t)batch_num(c, r);
+            break;
+        case PACKR_COLUMN_DOUBLE:
+            doubles[r] = batch_num(c, r);
+            break;
+        case PACKR_COLUMN_BOOL:
+            data[r] = (t[0] == 't');
+            break;
+        case PACKR_COLUMN_STRING:
+            if (c->types[r] == CELL_T_STRING) {
+                views[r] = c->strs[r];
+            } else {
+                views[r].str = t + 1;
+                views[r].len = c->strs[r].len - 2;
+            }
+            break;
+        default:
+            if (c->types[r] == CELL_T_NUM) {
+                double v = c->nums[r];
+                views[r].str = formatted;
+                views[r].len = num_is_int32(v) ? packr_format_i32(formatted, (int32_t)v)
+                                               : packr_format_g(formatted, v, 17);
+                formatted += views[r].len;
+            } else if (c->types[r] == CELL_T_STRING) {
+                views[r].str = formatted;
+                views[r].len = c->strs[r].len + 2;
+                formatted[0] = '"';
+                memcpy(formatted + 1, t, c->strs[r].len);
+                formatted[c->strs[r].len + 1] = '"';
+                formatted += views[r].len;
             } else {
-                flags[i] = 0;
+                views[r] = c->strs[r];
             }
+            break;
         }
-        
-        /* Buffers for each column */
-        typedef struct {
-            double *nums;
-            char **strs;
-            char *mode_str; // For MFV sharing
-            uint8_t *types;
-            uint8_t *validity;
-        } col_data_t;
-        
-        col_data_t *cols = packr_malloc(sizeof(col_data_t) * field_count);
-        for(uint32_t i=0; i<field_count; i++) {
-            cols[i].nums = (record_count > 0) ? packr_malloc(sizeof(double) * record_count) : NULL;
-            cols[i].strs = (record_count > 0) ? packr_malloc(sizeof(char*) * record_count) : NULL;
-            cols[i].mode_str = NULL;
-            cols[i].types = (record_count > 0) ? packr_malloc(record_count) : NULL;
-            cols[i].validity = (record_count > 0) ? packr_malloc(record_count) : NULL;
-            if (cols[i].nums) memset(cols[i].nums, 0, sizeof(double) * record_count);
-            if (cols[i].strs) memset(cols[i].strs, 0, sizeof(char*) * record_count);
-            if (cols[i].types) memset(cols[i].types, 0, record_count);
-            if (cols[i].validity) memset(cols[i].validity, 1, record_count); // Default Valid
+    }
+    if (out->type == PACKR_COLUMN_INT32) out->ints = ints;
+    else if (out->type == PACKR_COLUMN_DOUBLE) out->doubles = doubles;
+    else if (out->type == PACKR_COLUMN_BOOL) out->bools = data;
+    else out->strings = views;
+}
+
+/* "parent.name" in the pool, NULL if out of memory */
+static const char *batch_path(text_pool_t *pool, const char *parent, const char *name) {
+    size_t plen = strlen(parent), nlen = strlen(name);
+    pool_chunk_t *chunk = pool_room(pool, plen + nlen + 2);
+    if (!chunk) return NULL;
+    char *path = pool_text(chunk) + chunk->used;
+    memcpy(path, parent, plen);
+    path[plen] = '.';
+    memcpy(path + plen + 1, name, nlen + 1);
+    chunk->used += plen + nlen + 2;
+    return path;
+}
+
+/*
+ * Hands the columns over; the fields of OBJECT columns are columns of their
+ * own, named by path. Only top level batches have a batch_cb, so the typed
+ * columns go in the decoder's kept block.
+ */
+static int batch_handoff(packr_decoder_t *ctx, col_data_t *cols, char **field_names, uint32_t field_count,
+                         uint32_t rows, const uint8_t *flags, const uint32_t *spans, uint32_t *ends,
+                         text_pool_t *pool, packr_batch_func batch_cb, void *user_data) {
+    /* The columns and the bytes of their values, then the paths of the open groups */
+    size_t head = (sizeof(packr_decoded_column_t) + sizeof(size_t) + sizeof(char*)) *
+                  (field_count ? field_count : 1);
+    size_t need = head;
+    if (ctx->batch_out_cap < need) {
+        if (!decoder_batch_out(ctx, need)) return 0;
+    }
+    packr_decoded_column_t *out = ctx->batch_out;
+    size_t *sizes = (size_t*)(out + field_count);
+    const char **paths = (const char**)(sizes + field_count);
+    memset(out, 0, sizeof(packr_decoded_column_t) * field_count);
+
+    uint32_t n = 0, open = 0;
+    for (uint32_t c = 0; c < field_count; c++) {
+        while (open && c >= ends[open - 1]) open--;
+        const char *name = open ? batch_path(pool, paths[open - 1], field_names[c]) : field_names[c];
+        if (!name) return 0;
+        if (flags[c] & 0x10) {
+            paths[open] = name;
+            ends[open++] = c + 1 + spans[c];
+        } else {
+            sizes[n] = batch_column_type(&cols[c], rows, name, &out[n]);
+            need += sizes[n++];
         }
-        
-        /* Decode each column */
-        for (uint32_t i = 0; i < field_count; i++) {
-            if (flags[i] & 0x08) { // HAS_NULLS
-                 size_t bytes = (record_count + 7) / 8;
-                 size_t start = ctx->pos;
-                 ctx->pos += bytes;
-                 // Decode
-                 for(uint32_t k=0; k<record_count; k++) {
-                     if (start + (k/8) < ctx->size) {
-                        uint8_t b = ctx->data[start + (k/8)];
-                        cols[i].validity[k] = (b >> (k%8)) & 1;
-                     }
-                 }
+    }
+    if (ctx->batch_out_cap < need) {
+        /* Grown: what the first pass wrote moves with it */
+        if (!decoder_batch_out(ctx, need)) return 0;
+        out = ctx->batch_out;
+        sizes = (size_t*)(out + field_count);
+    }
+
+    uint8_t *data = (uint8_t*)ctx->batch_out + head;
+    for (uint32_t c = 0, i = 0; c < field_count; c++) {
+        if (flags[c] & 0x10) continue;
+        batch_column(&cols[c], rows, &out[i], data, sizes[i]);
+        data += sizes[i++];
+    }
+    return batch_cb(user_data, out, n, rows) == 0;
+}
+
+int packr_decode_columns(packr_decoder_t *ctx, packr_batch_func batch_cb, void *user_data, packr_writer_t *w) {
+    if (ctx->primer_id && !ctx->primer) return 0;
+
+    size_t start = ctx->pos;
+    uint8_t token;
+    if (!decode_token(ctx, &token)) return 0;
+
+    if (is_batch_token(token)) return decode_batch(ctx, token, NULL, batch_cb, user_data);
+    if (token != TOKEN_ARRAY_STREAM) {
+        if (!w) return 0;
+        ctx->pos = start;
+        return packr_decode_to(ctx, w);
+    }
+
+    /* Every element of a streamed array is a batch */
+    while (ctx->pos < ctx->size && ctx->data[ctx->pos] != TOKEN_ARRAY_END) {
+        if (!decode_token(ctx, &token) || !is_batch_token(token)) return 0;
+        if (!decode_batch(ctx, token, NULL, batch_cb, user_data)) return 0;
+    }
+    if (ctx->pos >= ctx->size) return 0;
+    ctx->pos++; /* Skip END */
+    return 1;
+}
+
+int packr_decode_next(packr_decoder_t *ctx, char **cursor, char *end) {
+    packr_writer_t w;
+    packr_writer_init(&w, *cursor, (size_t)(end - *cursor), NULL, NULL);
+    int ret = packr_decode_to(ctx, &w);
+    *cursor += w.pos;
+    return ret;
+}
+
+/* Incremental Decoder */
+
+/*
+ * Walks one value without side effects, reading exactly what decode_value
+ * would. Returns 0 if the value runs past the data seen so far.
+ */
+typedef struct {
+    const uint8_t *d;
+    size_t size;
+    size_t pos;
+    /* Field counts of the decoder's cached schemas (0 = empty slot), kept up as it would */
+    uint32_t schema_fields[PACKR_SCHEMA_SLOTS];
+    uint8_t schema_next;
+    uint8_t schema_last;
+} scan_t;
+
+static scan_t scan_at(const uint8_t *d, size_t size, size_t pos) {
+    scan_t s;
+    memset(&s, 0, sizeof(s));
+    s.d = d;
+    s.size = size;
+    s.pos = pos;
+    return s;
+}
+
+static int scan_byte(scan_t *s, uint8_t *b) {
+    if (s->pos >= s->size) return 0;
+    *b = s->d[s->pos++];
+    return 1;
+}
+
+static int scan_peek(scan_t *s, uint8_t *b) {
+    if (s->pos >= s->size) return 0;
+    *b = s->d[s->pos];
+    return 1;
+}
+
+static int scan_skip(scan_t *s, size_t n) {
+    if (n > s->size - s->pos) return 0;
+    s->pos += n;
+    return 1;
+}
+
+static int scan_varint(scan_t *s, uint32_t *value) {
+    uint32_t res = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+        if (!scan_byte(s, &b)) return 0;
+        if (shift < 32) res |= (uint32_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    *value = res;
+    return 1;
+}
+
+/* Payload of a batch number token (mode, exception or delta base) */
+static int scan_number(scan_t *s, uint8_t t) {
+    uint32_t v;
+    if (t == TOKEN_INT) return scan_varint(s, &v);
+    if (t == TOKEN_FLOAT32) return scan_skip(s, 4);
+    if (t == TOKEN_DOUBLE) return scan_skip(s, 8);
+    return 1;
+}
+
+/* Up to count Rice codes of parameter k, read as the decoder does. *done gets the codes read */
+static int scan_rice(scan_t *s, int k, uint32_t count, uint32_t *done) {
+    packr_bitreader_t br;
+    uint32_t u, i;
+    packr_br_init(&br, s->d + s->pos, s->size - s->pos);
+    for (i = 0; i < count; i++) {
+        if (packr_br_get_rice(&br, k, &u) != 0) {
+            if (br.pos == br.cap) return 0; /* More data needed */
+            break;                          /* Bad code, the decoder stops here too */
+        }
+    }
+    s->pos += packr_br_used(&br);
+    *done = i;
+    return 1;
+}
+
+static int scan_value(scan_t *s);
+
+static int scan_mask_bit(const scan_t *s, size_t mask_start, uint32_t k) {
+    return (s->d[mask_start + k / 8] >> (k % 8)) & 1;
+}
+
+static int scan_delta_column(scan_t *s, uint32_t rc) {
+    uint8_t t;
+    uint32_t v;
+    if (!scan_peek(s, &t)) return 0;
+
+    if (t == TOKEN_MFV_COLUMN) {
+        uint32_t dcount;
+        uint8_t mt;
+        s->pos++;
+        if (!scan_varint(s, &dcount) || !scan_byte(s, &mt) || !scan_number(s, mt)) return 0;
+        size_t mask_start = s->pos;
+        if (!scan_skip(s, (dcount + 7) / 8)) return 0;
+        for (uint32_t k = 0, j = 0; k < dcount && j < rc; k++, j++) {
+            if (scan_mask_bit(s, mask_start, k)) {
+                uint8_t et;
+                if (!scan_byte(s, &et) || !scan_number(s, et)) return 0;
             }
+        }
+        return 1;
+    }
 
-            if (flags[i] & 0x01) { // CONSTANT
-                char *old_cursor = *cursor;
-                packr_decode_next(ctx, cursor, end);
-                size_t vlen = *cursor - old_cursor;
-                char *vstr = packr_malloc(vlen + 1);
-                memcpy(vstr, old_cursor, vlen); vstr[vlen] = 0;
-                *cursor = old_cursor; // Rewind
-                for(uint32_t j=0; j<record_count; j++) cols[i].strs[j] = vstr; // Shared
-                // Note: Shared pointer, be careful but it's simpler
-            } else if (flags[i] & 0x02) { // DELTA
-                /* Numeric Column */
-                uint8_t vtoken = ctx->data[ctx->pos]; // Peek
-                
-                if (vtoken == TOKEN_MFV_COLUMN) {
-                    ctx->pos++;
-                    int bytes_read;
-                    uint32_t dcount = decode_varint(ctx, &bytes_read);
-                    
-                    // Decode Mode
-                    double mode_val = 0;
-                    if (ctx->pos < ctx->size) {
-                      uint8_t mt = ctx->data[ctx->pos++];
-                      if (mt == TOKEN_INT) mode_val = zigzag_decode(decode_varint(ctx, &bytes_read));
-                      else if (mt == TOKEN_FLOAT32) {
-                           int32_t scaled = ctx->data[ctx->pos] | (ctx->data[ctx->pos+1] << 8) | 
-                                            (ctx->data[ctx->pos+2] << 16) | (ctx->data[ctx->pos+3] << 24);
-                           ctx->pos += 4;
-                           mode_val = scaled / 65536.0;
-                      }
-                      else if (mt == TOKEN_BOOL_TRUE) mode_val = 1.0;
-                      else if (mt == TOKEN_BOOL_FALSE) mode_val = 0.0;
-                      else if (mt == TOKEN_DOUBLE) {
-                          uint64_t v64 = (uint64_t)ctx->data[ctx->pos] | ((uint64_t)ctx->data[ctx->pos+1] << 8) | 
-                                         ((uint64_t)ctx->data[ctx->pos+2] << 16) | ((uint64_t)ctx->data[ctx->pos+3] << 24) |
-                                         ((uint64_t)ctx->data[ctx->pos+4] << 32) | ((uint64_t)ctx->data[ctx->pos+5] << 40) |
-                                         ((uint64_t)ctx->data[ctx->pos+6] << 48) | ((uint64_t)ctx->data[ctx->pos+7] << 56);
-                          ctx->pos += 8;
-                          memcpy(&mode_val, &v64, sizeof(double));
-                      }
-                    }
-                    
-                    // Mask
-                    size_t mask_len = (dcount + 7) / 8;
-                    size_t mask_start = ctx->pos;
-                    ctx->pos += mask_len;
-                    
-                    uint32_t j = 0;
-                    for(uint32_t k=0; k<dcount && j<record_count; k++) {
-                       uint8_t b = ctx->data[mask_start + (k/8)];
-                       double val;
-                       if ( (b >> (k%8)) & 1 ) {
-                           // Exception
-                           uint8_t et = ctx->data[ctx->pos++];
-                           double eval = 0;
-                           if (et == TOKEN_INT) eval = zigzag_decode(decode_varint(ctx, &bytes_read));
-                           else if (et == TOKEN_FLOAT32) {
-                               int32_t scaled = ctx->data[ctx->pos] | (ctx->data[ctx->pos+1] << 8) | 
-                                                (ctx->data[ctx->pos+2] << 16) | (ctx->data[ctx->pos+3] << 24);
-                               ctx->pos += 4;
-                               eval = scaled / 65536.0;
-                           }
-                           else if (et == TOKEN_BOOL_TRUE) eval = 1.0;
-                           else if (et == TOKEN_BOOL_FALSE) eval = 0.0;
-                           else if (et == TOKEN_DOUBLE) {
-                               uint64_t v64 = (uint64_t)ctx->data[ctx->pos] | ((uint64_t)ctx->data[ctx->pos+1] << 8) | 
-                                              ((uint64_t)ctx->data[ctx->pos+2] << 16) | ((uint64_t)ctx->data[ctx->pos+3] << 24) |
-                                              ((uint64_t)ctx->data[ctx->pos+4] << 32) | ((uint64_t)ctx->data[ctx->pos+5] << 40) |
-                                              ((uint64_t)ctx->data[ctx->pos+6] << 48) | ((uint64_t)ctx->data[ctx->pos+7] << 56);
-                               ctx->pos += 8;
-                               memcpy(&eval, &v64, sizeof(double));
-                           }
-                           val = eval;
-                       } else {
-                           val = mode_val;
-                       }
-                       cols[i].nums[j++] = val; cols[i].types[j-1] = 1;
-                    }
-                } else {
-                    /* Base value */
-                    vtoken = ctx->data[ctx->pos++];
-                    double prev = 0;
-                    if (vtoken == TOKEN_INT) {
-                        prev = zigzag_decode(decode_varint(ctx, &bytes_read));
-                    } else if (vtoken == TOKEN_FLOAT32) {
-                        int32_t scaled = ctx->data[ctx->pos] | (ctx->data[ctx->pos+1] << 8) |
-                                         (ctx->data[ctx->pos+2] << 16) | (ctx->data[ctx->pos+3] << 24);
-                        ctx->pos += 4;
-                        prev = scaled / 65536.0;
-                    } else if (vtoken == TOKEN_DOUBLE) {
-                        /* IEEE 754 double - 8 bytes LE. Deltas still use 65536 scaling. */
-                        uint64_t v64 = (uint64_t)ctx->data[ctx->pos] | ((uint64_t)ctx->data[ctx->pos+1] << 8) |
-                                       ((uint64_t)ctx->data[ctx->pos+2] << 16) | ((uint64_t)ctx->data[ctx->pos+3] << 24) |
-                                       ((uint64_t)ctx->data[ctx->pos+4] << 32) | ((uint64_t)ctx->data[ctx->pos+5] << 40) |
-                                       ((uint64_t)ctx->data[ctx->pos+6] << 48) | ((uint64_t)ctx->data[ctx->pos+7] << 56);
-                        ctx->pos += 8;
-                        memcpy(&prev, &v64, sizeof(double));
-                        vtoken = TOKEN_FLOAT32; /* Treat same as FLOAT32 for delta scaling */
-                    }
-                    cols[i].nums[0] = prev;
-                    cols[i].types[0] = 1; // Number
-                    
-                    uint32_t j = 1;
-                    while (j < record_count) {
-                        uint8_t dt = ctx->data[ctx->pos++];
-                        double delta = 0;
-                        if (dt == TOKEN_BITPACK_COL) {
-                            uint32_t dcount = decode_varint(ctx, &bytes_read);
-                            for(uint32_t k=0; k<dcount && j<record_count; k+=2) {
-                                uint8_t pack = ctx->data[ctx->pos++];
-                                int d1 = (pack >> 4) - 8;
-                                prev += (double)d1 / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
-                                cols[i].nums[j++] = prev; cols[i].types[j-1] = 1;
-                                if (j < record_count && k+1 < dcount) {
-                                    int d2 = (pack & 0x0F) - 8;
-                                    prev += (double)d2 / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
-                                    cols[i].nums[j++] = prev; cols[i].types[j-1] = 1;
-                                }
-                            }
-                        } else if (dt == TOKEN_RICE_COLUMN) {
-                             uint32_t dcount = decode_varint(ctx, &bytes_read);
-                             if (ctx->pos < ctx->size) {
-                                 int k = ctx->data[ctx->pos++];
-                                 uint32_t max_j = j + dcount;
-                                 if (max_j > record_count) max_j = record_count;
-                                 
-                                 bitreader_t br; br_init(&br, ctx->data + ctx->pos, ctx->size - ctx->pos);
-                                 for(; j < max_j; j++) {
-                                     uint32_t q = br_read_unary(&br);
-                                     uint32_t r = br_read(&br, k);
-                                     if (q == 0xFFFFFFFF || r == 0xFFFFFFFF) break;
-                                     uint32_t u = (q << k) | r;
-                                     int32_t d = zigzag_decode(u);
-                                     prev += (double)d / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
-                                     cols[i].nums[j] = prev; cols[i].types[j] = 1;
-                                 }
-                                 // Account for consumed bytes. br.pos already includes any partially read byte.
-                                 ctx->pos += br.pos;
-                             }
-                        } else if (dt == TOKEN_RLE_REPEAT) {
-                             uint32_t run = decode_varint(ctx, &bytes_read);
-                             for(uint32_t k=0; k<run && j<record_count; k++) {
-                                 cols[i].nums[j++] = prev; cols[i].types[j-1] = 1;
-                             }
-                        } else {
-                             /* Single delta tokens */
-                             if (dt == TOKEN_DELTA_ZERO) delta = 0;
-                             else if (dt == TOKEN_DELTA_ONE) delta = 1;
-                             else if (dt == TOKEN_DELTA_NEG_ONE) delta = -1;
-                             else if (dt >= 0xC3 && dt <= 0xD2) delta = (int)dt - 0xC3 - 8;
-                             else if (dt == TOKEN_DELTA_LARGE) delta = zigzag_decode(decode_varint(ctx, &bytes_read));
-                             else if (dt == TOKEN_DELTA_MEDIUM) delta = (int)ctx->data[ctx->pos++] - 64;
-                             
-                             prev += (double)delta / (vtoken == TOKEN_FLOAT32 ? 65536.0 : 1.0);
-                             cols[i].nums[j++] = prev; cols[i].types[j-1] = 1;
-                        }
-                    }
-                }
-            } else { // RLE
-                uint32_t j = 0;
-                // Check MFV first
-                if (ctx->data[ctx->pos] == TOKEN_MFV_COLUMN) {
-                     ctx->pos++;
-                     int bytes_read;
-                     uint32_t dcount = decode_varint(ctx, &bytes_read);
-                     // Decode Mode String
-                     char *old_cursor = *cursor;
-                     if (!packr_decode_next(ctx, cursor, end)) {
-                         packr_free(cols); // Emergency
-                         return 0;
-                     }
-                     size_t vlen = *cursor - old_cursor;
-                     char *mode_str = packr_malloc(vlen + 1);
-                     if (mode_str) {
-                        memcpy(mode_str, old_cursor, vlen); mode_str[vlen] = 0;
-                        cols[i].mode_str = mode_str; // Save for cleanup
-                     }
-                     *cursor = old_cursor; // Reset cursor
-                     
-                     // Mask
-                     size_t mask_len = (dcount + 7) / 8;
-                     size_t mask_start = ctx->pos;
-                     ctx->pos += mask_len;
-                     
-                     for(uint32_t k=0; k<dcount && j<record_count; k++) {
-                           uint8_t b = (mask_start + (k/8) < ctx->size) ? ctx->data[mask_start + (k/8)] : 0;
-                           if ( (b >> (k%8)) & 1 ) {
-                               // Exception
-                               char *oc = *cursor;
-                               if (packr_decode_next(ctx, cursor, end)) {
-                                   size_t elen = *cursor - oc;
-                                   char *estr = packr_malloc(elen + 1);
-                                   if (estr) {
-                                       memcpy(estr, oc, elen); estr[elen] = 0;
-                                   }
-                                   *cursor = oc;
-                                   cols[i].strs[j++] = estr;
-                               } else {
-                                   cols[i].strs[j++] = NULL;
-                               }
-                           } else {
-                               // Mode - Shared pointer
-                               cols[i].strs[j++] = mode_str;
-                           }
-                     }
-                } else {
-                    while (j < record_count) {
-                        char *old_cursor = *cursor;
-                        packr_decode_next(ctx, cursor, end);
-                        size_t vlen = *cursor - old_cursor;
-                        char *vstr = packr_malloc(vlen + 1);
-                        memcpy(vstr, old_cursor, vlen); vstr[vlen] = 0;
-                        *cursor = old_cursor;
-                        
-                        cols[i].strs[j++] = vstr; // Shared
-                        if (j < record_count && ctx->data[ctx->pos] == TOKEN_RLE_REPEAT) {
-                             ctx->pos++;
-                             int bytes_read;
-                             uint32_t run = decode_varint(ctx, &bytes_read);
-                             for(uint32_t k=0; k<run && j<record_count; k++) {
-                                 cols[i].strs[j++] = vstr; // Shared
-                             }
-                        }
-                    }
-                }
+    s->pos++;
+    if (!scan_number(s, t)) return 0;
+    uint32_t j = 1;
+    while (j < rc) {
+        uint8_t dt;
+        if (!scan_byte(s, &dt)) return 0;
+        if (dt == TOKEN_BITPACK_COL) {
+            uint32_t dcount;
+            if (!scan_varint(s, &dcount)) return 0;
+            for (uint32_t k = 0; k < dcount && j < rc; k += 2) {
+                if (!scan_skip(s, 1)) return 0;
+                j++;
+                if (j < rc && k + 1 < dcount) j++;
             }
+        } else if (dt == TOKEN_RICE_COLUMN) {
+            uint32_t dcount;
+            uint8_t k;
+            if (!scan_varint(s, &dcount) || !scan_byte(s, &k)) return 0;
+            uint32_t max_j = (dcount > rc - j) ? rc : j + dcount;
+            uint32_t done;
+            if (!scan_rice(s, k, max_j - j, &done)) return 0;
+            j += done;
+        } else if (dt == TOKEN_RLE_REPEAT) {
+            if (!scan_varint(s, &v)) return 0;
+            j += (v > rc - j) ? rc - j : v;
+        } else {
+            if (dt == TOKEN_DELTA_LARGE && !scan_varint(s, &v)) return 0;
+            if (dt == TOKEN_DELTA_MEDIUM && !scan_skip(s, 1)) return 0;
+            j++;
         }
-        
-        /* Reconstruct JSON */
-        if (!partial) buf_append_char(cursor, end, '[');
-        
-        for(uint32_t r=0; r<record_count; r++) {
-            if (r > 0) buf_append_char(cursor, end, ',');
-            buf_append_char(cursor, end, '{');
-            bool first_field = true;
-            for(uint32_t c=0; c<field_count; c++) {
-                if (cols[c].validity[r] == 0) continue; // Skip missing field
-                
-                if (!first_field) buf_append_char(cursor, end, ',');
-                first_field = false;
-                
-                buf_append_char(cursor, end, '"');
-                buf_append_str(cursor, end, field_names[c]);
-                buf_append_str(cursor, end, "\":");
-                
-                if (cols[c].types[r] == 1) { // Numeric
-                    double v = cols[c].nums[r];
-                    if (v == (double)(int64_t)v && (v < 2147483648.0 && v > -2147483648.0)) {
-                         snprintf(temp, sizeof(temp), "%d", (int32_t)v);
-                    }
-                    else snprintf(temp, sizeof(temp), "%.17g", v);
-                    buf_append_str(cursor, end, temp);
-                } else if (cols[c].strs[r]) {
-                    buf_append_str(cursor, end, cols[c].strs[r]);
+    }
+    return 1;
+}
+
+static int scan_value_column(scan_t *s, uint32_t rc) {
+    uint8_t t;
+    uint32_t j = 0;
+    if (!scan_peek(s, &t)) return 0;
+
+    if (t == TOKEN_MFV_COLUMN) {
+        uint32_t dcount;
+        s->pos++;
+        if (!scan_varint(s, &dcount) || !scan_value(s)) return 0;
+        size_t mask_start = s->pos;
+        if (!scan_skip(s, (dcount + 7) / 8)) return 0;
+        for (uint32_t k = 0; k < dcount && j < rc; k++, j++) {
+            if (scan_mask_bit(s, mask_start, k) && !scan_value(s)) return 0;
+        }
+        return 1;
+    }
+
+    while (j < rc) {
+        if (!scan_value(s)) return 0;
+        j++;
+        if (j < rc) {
+            if (!scan_peek(s, &t)) return 0;
+            if (t == TOKEN_RLE_REPEAT) {
+                uint32_t run;
+                s->pos++;
+                if (!scan_varint(s, &run)) return 0;
+                j += (run > rc - j) ? rc - j : run;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Batch after its token. With cached set, *fc is the field count and the names are left out */
+static int scan_batch(scan_t *s, int cached, uint32_t *fc_out) {
+    uint32_t rc, fc = *fc_out;
+    if (!scan_varint(s, &rc) || (!cached && !scan_varint(s, &fc))) return 0;
+    *fc_out = fc;
+
+    uint8_t local[64];
+    uint8_t *flags = (fc <= sizeof(local)) ? local : packr_malloc(fc);
+    if (!flags) return 0;
+
+    int ok = 1;
+    for (uint32_t i = 0; i < fc && ok; i++) {
+        uint32_t span;
+        ok = (cached || scan_value(s)) && scan_byte(s, &flags[i]);
+        if (ok && (flags[i] & 0x10)) ok = scan_varint(s, &span);
+    }
+    for (uint32_t i = 0; i < fc && ok; i++) {
+        if (flags[i] & 0x08) ok = scan_skip(s, (rc + 7) / 8);
+        if (ok && (flags[i] & 0x20)) {
+            /* TIME format, offset and base */
+            uint8_t format;
+            uint32_t v;
+            ok = scan_byte(s, &format) && ((format & PACKR_TS_ZONE) < PACKR_TS_OFFSET || scan_varint(s, &v)) &&
+                 scan_varint(s, &v);
+        }
+        if (!ok) break;
+        if (flags[i] & 0x10) ok = !(flags[i] & 0x01) || scan_skip(s, (rc + 7) / 8);
+        else if (flags[i] & 0x01) ok = scan_value(s);
+        else if (flags[i] & 0x02) ok = scan_delta_column(s, rc);
+        else ok = scan_value_column(s, rc);
+    }
+
+    if (flags != local) packr_free(flags);
+    return ok;
+}
+
+/* TOKEN_SCHEMA_* prefix t and the batch it starts */
+static int scan_schema_batch(scan_t *s, uint8_t t) {
+    uint8_t slot = s->schema_last, bt;
+    uint32_t fc = 0;
+    if (t == TOKEN_SCHEMA_REF && !scan_byte(s, &slot)) return 0;
+    if (slot >= PACKR_SCHEMA_SLOTS || !scan_byte(s, &bt)) return 0;
+    if (bt != TOKEN_ULTRA_BATCH && bt != TOKEN_BATCH_PARTIAL) return 0;
+
+    if (t != TOKEN_SCHEMA_DEF) {
+        fc = s->schema_fields[slot];
+        s->schema_last = slot;
+        return fc && scan_batch(s, 1, &fc);
+    }
+    if (!scan_batch(s, 0, &fc) || fc == 0) return 0;
+    slot = s->schema_next;
+    s->schema_fields[slot] = fc;
+    s->schema_last = slot;
+    s->schema_next = (uint8_t)((slot + 1) % PACKR_SCHEMA_SLOTS);
+    return 1;
+}
+
+static int scan_value(scan_t *s) {
+    uint8_t t, next;
+    uint32_t n;
+    if (!scan_byte(s, &t)) return 0;
+    while (t == TOKEN_BLOCK_RESET) {
+        memset(s->schema_fields, 0, sizeof(s->schema_fields));
+        s->schema_next = 0;
+        s->schema_last = 0;
+        if (!scan_byte(s, &t)) return 0;
+    }
+
+    switch (t) {
+    case TOKEN_FLOAT32:
+        return scan_skip(s, 4);
+    case TOKEN_DOUBLE:
+        return scan_skip(s, 8);
+    case TOKEN_BINARY:
+    case TOKEN_BINARY_BITPACKED_1B:
+    case TOKEN_BINARY_BITPACKED_2B:
+        if (!scan_varint(s, &n)) return 0;
+        if (t == TOKEN_BINARY_BITPACKED_1B) n = (n + 7) / 8;
+        else if (t == TOKEN_BINARY_BITPACKED_2B) n = (n + 3) / 4;
+        return scan_skip(s, n);
+    case TOKEN_INT:
+    case TOKEN_DELTA_LARGE:
+        return scan_varint(s, &n);
+    case TOKEN_DELTA_MEDIUM:
+        return scan_skip(s, 1);
+    case TOKEN_NEW_STRING:
+    case TOKEN_NEW_FIELD:
+        return scan_varint(s, &n) && scan_skip(s, n);
+    case TOKEN_NEW_MAC:
+        return scan_skip(s, 6);
+    case TOKEN_TIMESTAMP:
+        if (!scan_byte(s, &next) || !scan_varint(s, &n)) return 0;
+        return (next & PACKR_TS_ZONE) < PACKR_TS_OFFSET || scan_varint(s, &n);
+    case TOKEN_UUID:
+        return scan_skip(s, 17);
+    case TOKEN_IPV4:
+        return scan_skip(s, 4);
+    case TOKEN_ARRAY_START:
+        if (!scan_varint(s, &n)) return 0;
+        for (uint32_t i = 0; i < n; i++) {
+            if (!scan_value(s)) return 0;
+        }
+        if (!scan_peek(s, &next)) return 0;
+        if (next == TOKEN_ARRAY_END) s->pos++;
+        return 1;
+    case TOKEN_ARRAY_STREAM:
+        for (;;) {
+            if (!scan_peek(s, &next)) return 0;
+            if (next == TOKEN_ARRAY_END) break;
+            if (!scan_value(s)) return 0;
+        }
+        s->pos++;
+        return 1;
+    case TOKEN_OBJECT_START:
+        for (;;) {
+            if (!scan_peek(s, &next)) return 0;
+            if (next == TOKEN_OBJECT_END) break;
+            if (!scan_value(s) || !scan_value(s)) return 0;
+        }
+        s->pos++;
+        return 1;
+    case TOKEN_ULTRA_BATCH:
+    case TOKEN_BATCH_PARTIAL:
+        n = 0;
+        return scan_batch(s, 0, &n);
+    case TOKEN_SCHEMA_DEF:
+    case TOKEN_SCHEMA_REF:
+    case TOKEN_SCHEMA_REPEAT:
+        return scan_schema_batch(s, t);
+    default:
+        /* Single byte tokens (dictionary refs, small deltas, literals) */
+        return 1;
+    }
+}
+
+enum {
+    FEED_DETECT,
+    FEED_RAW,
+    FEED_LZ77
+};
+
+enum {
+    FEED_HEADER,
+    FEED_TOP,
+    FEED_STREAM_ITEMS,  /* TOKEN_ARRAY_STREAM elements */
+    FEED_COUNTED_ITEMS, /* TOKEN_ARRAY_START elements */
+    FEED_DONE,
+    FEED_ERROR
+};
+
+/* Bytes that must follow a value before it is decoded (the frame CRC will) */
+#define FEED_LOOKAHEAD 4
+
+void packr_stream_decoder_init(packr_stream_decoder_t *sd, uint8_t *stage, size_t stage_cap, packr_writer_t *out,
+                               uint8_t *arena, size_t arena_cap) {
+    memset(sd, 0, sizeof(packr_stream_decoder_t));
+    packr_decoder_init_ex(&sd->dec, NULL, 0, arena, arena_cap);
+    sd->dec.views = false; /* the stage is reused for every value */
+    packr_lz77_dstream_init(&sd->lz);
+    sd->out = out;
+    sd->stage = stage;
+    sd->stage_cap = stage_cap;
+    sd->mode = FEED_DETECT;
+    sd->state = FEED_HEADER;
+}
+
+void packr_stream_decoder_destroy(packr_stream_decoder_t *sd) {
+    packr_decoder_destroy(&sd->dec);
+}
+
+/* Is a complete value (plus lookahead) waiting at the read position? */
+static int feed_value_ready(packr_stream_decoder_t *sd) {
+    const packr_schema_cache_t *sc = &sd->dec.schemas;
+    scan_t s = scan_at(sd->stage, sd->stage_len, sd->dec.pos);
+    for (int i = 0; i < PACKR_SCHEMA_SLOTS; i++) s.schema_fields[i] = sc->slots[i].count;
+    s.schema_next = sc->next;
+    s.schema_last = sc->last;
+    return scan_value(&s) && s.pos + FEED_LOOKAHEAD <= sd->stage_len;
+}
+
+/* Decodes whatever the stage holds completely. Returns 1 when done, -1 on error */
+static int feed_drain(packr_stream_decoder_t *sd) {
+    packr_decoder_t *ctx = &sd->dec;
+    packr_writer_t *w = sd->out;
+    int ret = 0;
+
+    ctx->data = sd->stage;
+    ctx->size = sd->stage_len;
+
+    while (ret == 0) {
+        if (sd->state == FEED_HEADER) {
+            /* Magic(4) + Ver(1) + Flags(1) + SymCnt(varint) */
+            scan_t s = scan_at(sd->stage, sd->stage_len, 6);
+            uint32_t symbols;
+            if (sd->stage_len >= 4 && memcmp(sd->stage, "PKR1", 4) != 0) ret = -1;
+            else if (sd->stage_len < 6 || !scan_varint(&s, &symbols)) break;
+            else {
+                ctx->pos = s.pos;
+                ctx->primer_id = sd->stage[5] & PACKR_FLAG_PRIMER_MASK;
+                if (packr_decoder_set_primers(ctx, sd->primers, sd->primer_count) != 0) ret = -1;
+                else sd->state = FEED_TOP;
+            }
+        } else if (sd->state == FEED_TOP) {
+            uint8_t t;
+            if (ctx->pos >= ctx->size) break;
+            t = ctx->data[ctx->pos];
+            if (t == TOKEN_ARRAY_STREAM) {
+                ctx->pos++;
+                wr_char(w, '[');
+                sd->first = true;
+                sd->state = FEED_STREAM_ITEMS;
+            } else if (t == TOKEN_ARRAY_START) {
+                scan_t s = scan_at(sd->stage, sd->stage_len, ctx->pos + 1);
+                if (!scan_varint(&s, &sd->left)) break;
+                ctx->pos = s.pos;
+                wr_char(w, '[');
+                sd->first = true;
+                sd->state = FEED_COUNTED_ITEMS;
+            } else {
+                if (!feed_value_ready(sd)) break;
+                if (!decode_value(ctx, w)) ret = -1;
+                else sd->state = FEED_DONE;
+            }
+        } else if (sd->state == FEED_STREAM_ITEMS || sd->state == FEED_COUNTED_ITEMS) {
+            bool counted = (sd->state == FEED_COUNTED_ITEMS);
+            if (ctx->pos >= ctx->size) break;
+            if (counted ? sd->left == 0 : ctx->data[ctx->pos] == TOKEN_ARRAY_END) {
+                /* Counted arrays may still carry an END */
+                if (ctx->data[ctx->pos] == TOKEN_ARRAY_END) ctx->pos++;
+                wr_char(w, ']');
+                sd->state = FEED_DONE;
+                continue;
+            }
+            if (!feed_value_ready(sd)) break;
+            if (!sd->first) wr_char(w, ',');
+            sd->first = false;
+            if (!decode_value(ctx, w)) ret = -1;
+            else if (counted) sd->left--;
+        } else {
+            ret = (sd->state == FEED_DONE) ? 1 : -1;
+        }
+    }
+
+    /* Keep only the undecoded tail */
+    if (sd->state == FEED_DONE) {
+        sd->stage_len = 0;
+        ctx->pos = 0;
+    } else if (sd->state != FEED_HEADER && ctx->pos > 0) {
+        memmove(sd->stage, sd->stage + ctx->pos, sd->stage_len - ctx->pos);
+        sd->stage_len -= ctx->pos;
+        ctx->pos = 0;
+    }
+    if (ret < 0) sd->state = FEED_ERROR;
+    return ret;
+}
+
+int packr_decoder_feed(packr_stream_decoder_t *sd, const uint8_t *chunk, size_t len) {
+    int ret = 0;
+
+    while (ret == 0 && sd->state != FEED_DONE && sd->state != FEED_ERROR) {
+        size_t used = 0, produced = 0;
+        uint8_t *room = sd->stage + sd->stage_len;
+        size_t room_len = sd->stage_cap - sd->stage_len;
+
+        if (sd->mode == FEED_DETECT) {
+            /*
+             * 0xFE 0x03 = LZ77 transform, anything else is read as a plain frame.
+             * The Huffman transforms need the whole payload (packr_decoder_init).
+             */
+            while (sd->magic_len < 2 && used < len) sd->magic[sd->magic_len++] = chunk[used++];
+            if (sd->magic_len == 2) {
+                if (sd->magic[0] == 0xFE && sd->magic[1] == 0x03) {
+                    sd->mode = FEED_LZ77;
+                } else if (sd->magic[0] == 0xFE && (sd->magic[1] == 0x04 || sd->magic[1] == 0x05)) {
+                    ret = -1;
+                } else if (room_len >= 2) {
+                    sd->mode = FEED_RAW;
+                    memcpy(room, sd->magic, 2);
+                    produced = 2;
                 } else {
-                    buf_append_str(cursor, end, "null");
+                    ret = -1;
                 }
             }
-            buf_append_char(cursor, end, '}');
+        } else if (sd->mode == FEED_RAW) {
+            produced = MIN(len, room_len);
+            memcpy(room, chunk, produced);
+            used = produced;
+        } else if (packr_lz77_decompress_stream(&sd->lz, chunk, len, &used, room, room_len, &produced) != 0) {
+            ret = -1;
         }
-        if (!partial) buf_append_char(cursor, end, ']');
-        
-        /* Free memory */
-        for(uint32_t i=0; i<field_count; i++) {
-            packr_free(field_names[i]);
-            
-            if (!(flags[i] & 0x01)) {
-                // Shared string handling (RLE and MFV)
-                for(uint32_t j=0; j<record_count; j++) {
-                    if (cols[i].strs && cols[i].strs[j]) {
-                        // Skip if it is the shared mode_str (freed separately below)
-                        if (cols[i].strs[j] == cols[i].mode_str) continue;
-                        
-                        // Check if it's the same as previous to avoid double free in RLE
-                        if (j == 0 || cols[i].strs[j] != cols[i].strs[j-1]) {
-                             packr_free(cols[i].strs[j]);
-                        }
-                    }
-                }
+        chunk += used;
+        len -= used;
+        sd->stage_len += produced;
+
+        if (ret == 0 && sd->mode != FEED_DETECT) ret = feed_drain(sd);
+        if (ret != 0) break;
+
+        /* A full stage after draining holds an element that can never complete */
+        if (sd->stage_len == sd->stage_cap) ret = -1;
+        /* Out of input, and no match still being copied out */
+        else if (len == 0 && produced == 0) break;
+    }
+
+    if (ret < 0) sd->state = FEED_ERROR;
+    if (sd->state == FEED_ERROR) ret = -1;
+    else if (sd->state == FEED_DONE) ret = 1;
+
+    if (sd->out->write_cb) packr_writer_flush(sd->out);
+    else if (sd->out->cap) sd->out->buf[sd->out->pos] = '\0';
+    return ret;
+}
+
+/* Random Access */
+
+uint32_t packr_decoder_block_count(const packr_decoder_t *ctx) {
+    return ctx->seek_count;
+}
+
+int packr_decoder_block_info(const packr_decoder_t *ctx, uint32_t block, uint32_t *first_record) {
+    if (block >= ctx->seek_count) return -1;
+    if (first_record) *first_record = ctx->seek_records[block];
+    return 0;
+}
+
+int packr_decode_block_to(packr_decoder_t *ctx, uint32_t block, packr_writer_t *w) {
+    if (block >= ctx->seek_count || (ctx->primer_id && !ctx->primer)) return -1;
+    if (decoder_reset_block(ctx) != 0) return -1;
+    ctx->current_field = -1;
+    ctx->pos = ctx->body_start + ctx->seek_offsets[block];
+    size_t stop = (block + 1 < ctx->seek_count) ? ctx->body_start + ctx->seek_offsets[block + 1] : ctx->size;
+
+    /* Records of the top-level array up to the next block (or the array end) */
+    bool first = true;
+    while (ctx->pos < stop && ctx->pos < ctx->size && ctx->data[ctx->pos] != TOKEN_ARRAY_END) {
+        if (!first) wr_char(w, ',');
+        if (!decode_value(ctx, w)) return -1;
+        first = false;
+    }
+    return 0;
+}
+
+int packr_decode_block(packr_decoder_t *ctx, uint32_t block, char **cursor, char *end) {
+    packr_writer_t w;
+    packr_writer_init(&w, *cursor, (size_t)(end - *cursor), NULL, NULL);
+    int ret = packr_decode_block_to(ctx, block, &w);
+    if (w.cap) w.buf[w.pos] = '\0';
+    *cursor += w.pos;
+    return ret;
+}
+
+/* Stats */
+
+#if PACKR_STATS
+static void stats_copy(packr_stats_t *stats, const packr_stats_t *own, const packr_dict_t *fields,
+                       const packr_dict_t *strings, const packr_dict_t *macs) {
+    *stats = *own;
+    stats->fields = fields->stats;
+    stats->strings = strings->stats;
+    stats->macs = macs->stats;
+}
+
+static void stats_reset(packr_stats_t *own, packr_dict_t *fields, packr_dict_t *strings, packr_dict_t *macs) {
+    memset(own, 0, sizeof(packr_stats_t));
+    memset(&fields->stats, 0, sizeof(packr_dict_stats_t));
+    memset(&strings->stats, 0, sizeof(packr_dict_stats_t));
+    memset(&macs->stats, 0, sizeof(packr_dict_stats_t));
+}
+#endif
+
+int packr_encoder_get_stats(const packr_encoder_t *ctx, packr_stats_t *stats) {
+#if PACKR_STATS
+    stats_copy(stats, &ctx->stats, &ctx->fields, &ctx->strings, &ctx->macs);
+    /* The streaming compressor keeps its own */
+    if (ctx->flush_cb && ctx->compress) {
+        stats->lz77_literal_bytes += ctx->lz77.literal_bytes;
+        stats->lz77_match_bytes += ctx->lz77.match_bytes;
+        stats->lz77_matches += ctx->lz77.matches;
+    }
+    return 0;
+#else
+    memset(stats, 0, sizeof(packr_stats_t));
+    (void)ctx;
+    return -1;
+#endif
+}
+
+void packr_encoder_reset_stats(packr_encoder_t *ctx) {
+#if PACKR_STATS
+    stats_reset(&ctx->stats, &ctx->fields, &ctx->strings, &ctx->macs);
+    ctx->lz77.literal_bytes = 0;
+    ctx->lz77.match_bytes = 0;
+    ctx->lz77.matches = 0;
+#else
+    (void)ctx;
+#endif
+}
+
+int packr_decoder_get_stats(const packr_decoder_t *ctx, packr_stats_t *stats) {
+#if PACKR_STATS
+    stats_copy(stats, &ctx->stats, &ctx->fields, &ctx->strings, &ctx->macs);
+    return 0;
+#else
+    memset(stats, 0, sizeof(packr_stats_t));
+    (void)ctx;
+    return -1;
+#endif
+}
+
+void packr_decoder_reset_stats(packr_decoder_t *ctx) {
+#if PACKR_STATS
+    stats_reset(&ctx->stats, &ctx->fields, &ctx->strings, &ctx->macs);
+#else
+    (void)ctx;
+#endif
+}
+
+/* Primer Dictionaries */
+
+#define PRIMER_HEAD 8 /* magic, id, three counts */
+#define PRIMER_MAC_LEN 17
+
+static int dicts_prime(packr_dict_t *fields, packr_dict_t *strings, packr_dict_t *macs,
+                       const packr_primer_t *primer, size_t *alloc_counter) {
+    if (!primer) return 0;
+    packr_dict_t *dicts[3] = { fields, strings, macs };
+    /* Checked by packr_primer_init */
+    scan_t s = scan_at(primer->data, primer->size - 4, PRIMER_HEAD);
+    for (int d = 0; d < 3; d++) {
+#if PACKR_STATS
+        packr_dict_stats_t stats = dicts[d]->stats;
+#endif
+        for (int i = 0; i < primer->counts[d]; i++) {
+            uint32_t len;
+            int index;
+            if (!scan_varint(&s, &len) || len > s.size - s.pos) return -1;
+            if (dict_get_or_add(dicts[d], (const char*)s.d + s.pos, len, true, &index, alloc_counter) < 0) return -1;
+            s.pos += len;
+        }
+#if PACKR_STATS
+        dicts[d]->stats = stats;
+#endif
+    }
+    return 0;
+}
+
+int packr_primer_init(packr_primer_t *primer, const uint8_t *data, size_t size) {
+    memset(primer, 0, sizeof(packr_primer_t));
+    if (!data || size < PRIMER_HEAD + 4 || memcmp(data, PACKR_PRIMER_MAGIC, 4) != 0) return -1;
+    if (data[4] == 0 || data[4] > PACKR_PRIMER_MAX_ID) return -1;
+
+    size_t body = size - 4;
+    if (packr_crc32(data, body) != packr_load_le32(data + body)) return -1;
+
+    scan_t s = scan_at(data, body, PRIMER_HEAD);
+    for (int d = 0; d < 3; d++) {
+        if (data[5 + d] > PACKR_DICT_SIZE) return -1;
+        for (int i = 0; i < data[5 + d]; i++) {
+            uint32_t len;
+            if (!scan_varint(&s, &len) || len > s.size - s.pos) return -1;
+            /* The decoder keeps MACs as AA:BB:CC:DD:EE:FF */
+            if (d == 2 && len != PRIMER_MAC_LEN) return -1;
+            s.pos += len;
+        }
+    }
+    if (s.pos != body) return -1;
+
+    primer->data = data;
+    primer->size = size;
+    primer->id = data[4];
+    memcpy(primer->counts, data + 5, 3);
+    return 0;
+}
+
+size_t packr_primer_build(uint8_t *out, size_t out_cap, uint8_t id,
+                          const packr_primer_entry_t *fields, size_t field_count,
+                          const packr_primer_entry_t *strings, size_t string_count,
+                          const packr_primer_entry_t *macs, size_t mac_count) {
+    const packr_primer_entry_t *lists[3] = { fields, strings, macs };
+    size_t counts[3] = { field_count, string_count, mac_count };
+    if (id == 0 || id > PACKR_PRIMER_MAX_ID || out_cap < PRIMER_HEAD + 4) return 0;
+
+    memcpy(out, PACKR_PRIMER_MAGIC, 4);
+    out[4] = id;
+    size_t pos = PRIMER_HEAD;
+    size_t end = out_cap - 4;
+    for (int d = 0; d < 3; d++) {
+        if (counts[d] > PACKR_DICT_SIZE) return 0;
+        out[5 + d] = (uint8_t)counts[d];
+        for (size_t i = 0; i < counts[d]; i++) {
+            const packr_primer_entry_t *e = &lists[d][i];
+            if (d == 2 && e->len != PRIMER_MAC_LEN) return 0;
+            uint32_t v = (uint32_t)e->len;
+            do {
+                if (pos >= end) return 0;
+                out[pos++] = (uint8_t)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+                v >>= 7;
+            } while (v);
+            if (e->len > end - pos) return 0;
+            memcpy(out + pos, e->str, e->len);
+            pos += e->len;
+        }
+    }
+    packr_store_le32(out + pos, packr_crc32(out, pos));
+    return pos + 4;
+}
+
+int packr_encoder_set_primer(packr_encoder_t *ctx, const packr_primer_t *primer) {
+    if (!primer || !primer->id || ctx->primer || encoder_body_offset(ctx) != 0) return -1;
+    if (dicts_prime(&ctx->fields, &ctx->strings, &ctx->macs, primer, &ctx->total_alloc) != 0) return -1;
+    ctx->primer = primer;
+    if (ctx->flush_cb) {
+        /* Header is still in the work buffer: name the primer and redo the CRC */
+        ctx->buffer[5] |= primer->id;
+        ctx->current_crc = 0xFFFFFFFF;
+        ctx->crc_pos = 0;
+    }
+    return 0;
+}
+
+int packr_decoder_set_primers(packr_decoder_t *ctx, const packr_primer_t *const *primers, size_t count) {
+    if (!ctx->primer_id || ctx->primer) return 0;
+    for (size_t i = 0; i < count; i++) {
+        if (primers[i] && primers[i]->id == ctx->primer_id) {
+            if (dicts_prime(&ctx->fields, &ctx->strings, &ctx->macs, primers[i], &ctx->total_alloc) != 0) return -1;
+            ctx->primer = primers[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void packr_stream_decoder_set_primers(packr_stream_decoder_t *sd, const packr_primer_t *const *primers, size_t count) {
+    sd->primers = primers;
+    sd->primer_count = count;
+}
+
+/* Suspend / Resume */
+
+#define SNAPSHOT_HEAD 27 /* magic, version, flags, primer, CRC state, flushed, symbols */
+#define SNAPSHOT_FLAG_COMPRESS 0x01
+
+typedef struct {
+    uint8_t *out;
+    size_t cap;
+    size_t pos;
+    int ok;     /* cleared once something did not fit */
+} snap_t;
+
+static void snap_bytes(snap_t *w, const void *data, size_t len) {
+    if (!w->ok || len > w->cap - w->pos) {
+        w->ok = 0;
+        return;
+    }
+    memcpy(w->out + w->pos, data, len);
+    w->pos += len;
+}
+
+static void snap_byte(snap_t *w, uint8_t b) {
+    snap_bytes(w, &b, 1);
+}
+
+static void snap_varint(snap_t *w, uint32_t v) {
+    do {
+        snap_byte(w, (uint8_t)((v & 0x7F) | (v > 0x7F ? 0x80 : 0)));
+        v >>= 7;
+    } while (v);
+}
+
+static void snap_u64(snap_t *w, uint64_t v) {
+    uint8_t b[8];
+    packr_store_le32(b, (uint32_t)v);
+    packr_store_le32(b + 4, (uint32_t)(v >> 32));
+    snap_bytes(w, b, 8);
+}
+
+static int scan_u64(scan_t *s, uint64_t *v) {
+    if (8 > s->size - s->pos) return 0;
+    *v = packr_load_le32(s->d + s->pos) | ((uint64_t)packr_load_le32(s->d + s->pos + 4) << 32);
+    s->pos += 8;
+    return 1;
+}
+
+/* Entries, least recently used first, so replaying them restores the recency order */
+static void snap_dict(snap_t *w, const packr_dict_t *dict) {
+    uint8_t order[PACKR_DICT_SIZE];
+    int n = 0;
+    for (int i = 0; i < PACKR_DICT_SIZE; i++) {
+        if (!dict->entries[i].value) continue;
+        int j = n++;
+        while (j > 0 && dict->entries[order[j - 1]].last_used > dict->entries[i].last_used) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = (uint8_t)i;
+    }
+    snap_byte(w, (uint8_t)n);
+    for (int k = 0; k < n; k++) {
+        const dict_entry_t *e = &dict->entries[order[k]];
+        snap_byte(w, order[k]);
+        snap_varint(w, (uint32_t)e->length);
+        snap_bytes(w, e->value, e->length);
+    }
+}
+
+static int resume_dict(scan_t *s, packr_dict_t *dict, size_t *alloc_counter) {
+    uint8_t n;
+    if (!scan_byte(s, &n) || n > PACKR_DICT_SIZE) return 0;
+    for (int k = 0; k < n; k++) {
+        uint8_t i;
+        uint32_t len;
+        if (!scan_byte(s, &i) || i >= PACKR_DICT_SIZE || dict->entries[i].value) return 0;
+#if PACKR_DICT_HASH
+        if (i >= n) return 0; /* slots fill in index order */
+#endif
+        if (!scan_varint(s, &len) || len > s->size - s->pos) return 0;
+        dict_entry_t *e = &dict->entries[i];
+        if (!dict_store(dict, i, len, alloc_counter)) return 0;
+        memcpy(e->value, s->d + s->pos, len);
+        e->value[len] = '\0';
+        s->pos += len;
+        e->length = len;
+        e->hash = dict_hash(e->value, len);
+        e->last_used = ++dict->usage_counter;
+#if PACKR_DICT_HASH
+        dict_index_insert(dict, i);
+        dict_lru_push_front(dict, i);
+        dict->count++;
+#endif
+    }
+    return 1;
+}
+
+static int resume_schema(scan_t *s, packr_schema_t *slot, size_t *alloc_counter) {
+    uint32_t count;
+    if (!scan_varint(s, &count)) return 0;
+    if (count == 0) return 1;
+    if (count > (s->size - s->pos) / 2) return 0; /* at least a length and a byte each */
+
+    /* Measure, then copy into one block laid out as schema_store does */
+    size_t size = count * sizeof(char*);
+    size_t start = s->pos;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len;
+        if (!scan_varint(s, &len) || len > s->size - s->pos || memchr(s->d + s->pos, '\0', len)) return 0;
+        s->pos += len;
+        size += len + 1;
+    }
+    char **block = packr_malloc(size);
+    if (!block) return 0;
+    char *names = (char*)(block + count);
+    s->pos = start;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len = 0;
+        scan_varint(s, &len);
+        memcpy(names, s->d + s->pos, len);
+        names[len] = '\0';
+        block[i] = names;
+        names += len + 1;
+        s->pos += len;
+    }
+    slot->fields = block;
+    slot->count = count;
+    slot->hash = schema_hash(block, count);
+    slot->size = size;
+    *alloc_counter += size;
+    return 1;
+}
+
+static size_t dict_snap_bound(const packr_dict_t *dict) {
+    size_t n = 1;
+    for (int i = 0; i < PACKR_DICT_SIZE; i++) {
+        if (dict->entries[i].value) n += 6 + dict->entries[i].length;
+    }
+    return n;
+}
+
+size_t packr_encoder_suspend_bound(const packr_encoder_t *ctx) {
+    if (!ctx->flush_cb || ctx->schemas.depth) return 0;
+    size_t n = SNAPSHOT_HEAD + 4;
+    n += 8 + (ctx->seek_block_bytes ? 8 + 5 + (size_t)ctx->seek_count * 10 : 0);
+    n += dict_snap_bound(&ctx->fields) + dict_snap_bound(&ctx->strings) + dict_snap_bound(&ctx->macs);
+    n += 2;
+    for (int i = 0; i < PACKR_SCHEMA_SLOTS; i++) n += 5 + ctx->schemas.slots[i].size;
+    if (ctx->compress) n += 24 + LZ77_BUFFER_SIZE + 5;
+    return n;
+}
+
+size_t packr_encoder_suspend(packr_encoder_t *ctx, uint8_t *out, size_t out_cap) {
+    if (!packr_encoder_suspend_bound(ctx)) return 0;
+    /* Everything but the LZ77 lookahead goes out, so the work buffer needn't be kept */
+    if (packr_flush_buffer(ctx) != 0) return 0;
+
+    snap_t w = { out, out_cap, 0, 1 };
+    uint8_t head[7];
+    memcpy(head, PACKR_SNAPSHOT_MAGIC, 4);
+    head[4] = PACKR_SNAPSHOT_VERSION;
+    head[5] = ctx->compress ? SNAPSHOT_FLAG_COMPRESS : 0;
+    head[6] = ctx->primer ? ctx->primer->id : 0;
+    snap_bytes(&w, head, 7);
+    uint8_t crc[4];
+    packr_store_le32(crc, ctx->current_crc);
+    snap_bytes(&w, crc, 4);
+    snap_u64(&w, ctx->flushed);
+    snap_u64(&w, ctx->symbol_count);
+
+    snap_u64(&w, ctx->seek_block_bytes);
+    if (ctx->seek_block_bytes) {
+        snap_u64(&w, ctx->seek_last);
+        snap_varint(&w, ctx->seek_count);
+        for (uint32_t i = 0; i < ctx->seek_count; i++) {
+            snap_varint(&w, ctx->seek_offsets[i]);
+            snap_varint(&w, ctx->seek_records[i]);
+        }
+    }
+
+    snap_dict(&w, &ctx->fields);
+    snap_dict(&w, &ctx->strings);
+    snap_dict(&w, &ctx->macs);
+
+    snap_byte(&w, ctx->schemas.next);
+    snap_byte(&w, ctx->schemas.last);
+    for (int i = 0; i < PACKR_SCHEMA_SLOTS; i++) {
+        const packr_schema_t *slot = &ctx->schemas.slots[i];
+        snap_varint(&w, slot->fields ? slot->count : 0);
+        for (uint32_t f = 0; slot->fields && f < slot->count; f++) {
+            size_t len = strlen(slot->fields[f]);
+            snap_varint(&w, (uint32_t)len);
+            snap_bytes(&w, slot->fields[f], len);
+        }
+    }
+
+    if (ctx->compress && w.ok) {
+        size_t n = packr_lz77_save(&ctx->lz77, w.out + w.pos, w.cap - w.pos);
+        if (n == 0) return 0;
+        w.pos += n;
+    }
+    if (!w.ok || 4 > w.cap - w.pos) return 0;
+    packr_store_le32(w.out + w.pos, packr_crc32(w.out, w.pos));
+    w.pos += 4;
+
+    encoder_wait_flushed(ctx, ctx->flush_submitted);
+    packr_encoder_destroy(ctx);
+    return w.pos;
+}
+
+int packr_encoder_resume(packr_encoder_t *ctx, const uint8_t *snap, size_t size, packr_flush_func flush_cb,
+                         void *user_data, uint8_t *work_buffer, size_t work_cap, const packr_primer_t *primer) {
+    memset(ctx, 0, sizeof(packr_encoder_t));
+    if (!flush_cb || !snap || size < SNAPSHOT_HEAD + 4) return -1;
+    if (memcmp(snap, PACKR_SNAPSHOT_MAGIC, 4) != 0 || snap[4] != PACKR_SNAPSHOT_VERSION) return -1;
+    size_t body = size - 4;
+    if (packr_crc32(snap, body) != packr_load_le32(snap + body)) return -1;
+    if (snap[6] != (primer ? primer->id : 0)) return -1;
+
+    /* As a buffered init, then switched to streaming with nothing pending */
+    packr_encoder_init_ex(ctx, false, NULL, NULL, work_buffer, work_cap, NULL, 0);
+    ctx->flush_cb = flush_cb;
+    ctx->user_data = user_data;
+    ctx->pos = 0;
+    ctx->crc_pos = 0;
+    ctx->compress = (snap[5] & SNAPSHOT_FLAG_COMPRESS) != 0;
+    ctx->primer = primer;
+    ctx->current_crc = packr_load_le32(snap + 7);
+    ctx->lz_head_sent = true;
+    if (ctx->compress) packr_lz77_init(&ctx->lz77);
+
+    scan_t s = scan_at(snap, body, 11);
+    uint64_t v;
+    int ok = scan_u64(&s, &v);
+    ctx->flushed = (size_t)v;
+    ok = ok && scan_u64(&s, &v);
+    ctx->symbol_count = (size_t)v;
+
+    ok = ok && scan_u64(&s, &v);
+    ctx->seek_block_bytes = (size_t)v;
+    if (ok && ctx->seek_block_bytes) {
+        uint32_t count;
+        ok = scan_u64(&s, &v) && scan_varint(&s, &count) && count <= (s.size - s.pos) / 2;
+        ctx->seek_last = (size_t)v;
+        if (ok && count) {
+            ctx->seek_offsets = packr_malloc(count * sizeof(uint32_t));
+            ctx->seek_records = packr_malloc(count * sizeof(uint32_t));
+            if (!ctx->seek_offsets || !ctx->seek_records) {
+                packr_free(ctx->seek_offsets);
+                packr_free(ctx->seek_records);
+                ctx->seek_offsets = ctx->seek_records = NULL;
+                ok = 0;
             } else {
-                 if (cols[i].strs && record_count > 0) {
-                     packr_free(cols[i].strs[0]); // Constant: all point to same memory
-                 }
+                ctx->seek_cap = count;
+                ctx->total_alloc += 2 * count * sizeof(uint32_t);
             }
-            
-            packr_free(cols[i].mode_str); // Freed once here if it existed
-            packr_free(cols[i].nums);
-            packr_free(cols[i].strs);
-            packr_free(cols[i].types);
-            packr_free(cols[i].validity);
         }
-        packr_free(field_names);
-        packr_free(flags);
-        packr_free(cols);
+        for (uint32_t i = 0; ok && i < count; i++) {
+            ok = scan_varint(&s, &ctx->seek_offsets[i]) && scan_varint(&s, &ctx->seek_records[i]);
+            ctx->seek_count = i + 1;
+        }
     }
-    
-    return 1;
+
+    ok = ok && resume_dict(&s, &ctx->fields, &ctx->total_alloc) &&
+         resume_dict(&s, &ctx->strings, &ctx->total_alloc) &&
+         resume_dict(&s, &ctx->macs, &ctx->total_alloc);
+
+    uint8_t next = 0, last = 0;
+    ok = ok && scan_byte(&s, &next) && scan_byte(&s, &last) &&
+         next < PACKR_SCHEMA_SLOTS && last < PACKR_SCHEMA_SLOTS;
+    for (int i = 0; ok && i < PACKR_SCHEMA_SLOTS; i++) {
+        ok = resume_schema(&s, &ctx->schemas.slots[i], &ctx->total_alloc);
+    }
+    ctx->schemas.next = next;
+    ctx->schemas.last = last;
+
+    if (ok && ctx->compress) {
+        size_t n = packr_lz77_load(&ctx->lz77, s.d + s.pos, s.size - s.pos);
+        ok = n > 0 && scan_skip(&s, n);
+    }
+    if (!ok || s.pos != s.size) {
+        packr_encoder_destroy(ctx);
+        return -1;
+    }
+    return 0;
 }
 
+int packr_encoder_set_hash_pool(packr_encoder_t *ctx, packr_lz77_hash_pool_t *pool) {
+    if (!ctx->flush_cb || !ctx->compress || ctx->lz77.ht) return -1;
+    ctx->lz77.hash_pool = pool;
+    return 0;
+}
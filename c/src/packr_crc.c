@@ -0,0 +1,290 @@
+/*
+ * PACKR - CRC-32
+ *
+ * The portable path is slice-by-N: N table lookups consume N bytes per
+ * step instead of one. The x86 path folds 64 bytes at a time with carry-less
+ * multiplies (Intel, "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ") and hands the tail to the tables. Tables and the backend are
+ * set up once, on first use.
+ */
+
+#include "packr_crc.h"
+#include "packr_platform.h"
+
+#if PACKR_CRC_SLICES != 1 && PACKR_CRC_SLICES != 8 && PACKR_CRC_SLICES != 16
+#error "PACKR_CRC_SLICES must be 1, 8 or 16"
+#endif
+
+#define CRC_POLY 0xEDB88320u
+
+#if PACKR_SIMD && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#define CRC_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+#if defined(ESP_PLATFORM)
+#define CRC_ESP32_ROM 1
+#include "esp_rom_crc.h"
+#endif
+
+static uint32_t crc_table[PACKR_CRC_SLICES][256];
+/* x^(2^k) mod p, for combining */
+static uint32_t crc_x2n[32];
+static int crc_inited = 0;
+
+/* a * b mod p, both reflected */
+static uint32_t crc_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+static void crc_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            if (c & 1) c = CRC_POLY ^ (c >> 1);
+            else c = c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+    for (int s = 1; s < PACKR_CRC_SLICES; s++) {
+        for (int n = 0; n < 256; n++) {
+            uint32_t c = crc_table[s - 1][n];
+            crc_table[s][n] = (c >> 8) ^ crc_table[0][c & 0xFF];
+        }
+    }
+
+    uint32_t p = 1u << 30; /* x^1 */
+    crc_x2n[0] = p;
+    for (int k = 1; k < 32; k++) {
+        p = crc_multmodp(p, p);
+        crc_x2n[k] = p;
+    }
+    /* Racing first calls all store the same tables */
+    packr_atomic_store(&crc_inited, 1);
+}
+
+/* Portable */
+
+static uint32_t crc_bytes(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+static uint32_t crc_slices(uint32_t crc, const uint8_t *p, size_t len) {
+#if PACKR_CRC_SLICES == 16
+    while (len >= 16) {
+        uint32_t a = packr_load_le32(p) ^ crc;
+        uint32_t b = packr_load_le32(p + 4);
+        uint32_t c = packr_load_le32(p + 8);
+        uint32_t d = packr_load_le32(p + 12);
+        crc = crc_table[15][a & 0xFF] ^ crc_table[14][(a >> 8) & 0xFF] ^
+              crc_table[13][(a >> 16) & 0xFF] ^ crc_table[12][a >> 24] ^
+              crc_table[11][b & 0xFF] ^ crc_table[10][(b >> 8) & 0xFF] ^
+              crc_table[9][(b >> 16) & 0xFF] ^ crc_table[8][b >> 24] ^
+              crc_table[7][c & 0xFF] ^ crc_table[6][(c >> 8) & 0xFF] ^
+              crc_table[5][(c >> 16) & 0xFF] ^ crc_table[4][c >> 24] ^
+              crc_table[3][d & 0xFF] ^ crc_table[2][(d >> 8) & 0xFF] ^
+              crc_table[1][(d >> 16) & 0xFF] ^ crc_table[0][d >> 24];
+        p += 16;
+        len -= 16;
+    }
+#elif PACKR_CRC_SLICES == 8
+    while (len >= 8) {
+        uint32_t a = packr_load_le32(p) ^ crc;
+        uint32_t b = packr_load_le32(p + 4);
+        crc = crc_table[7][a & 0xFF] ^ crc_table[6][(a >> 8) & 0xFF] ^
+              crc_table[5][(a >> 16) & 0xFF] ^ crc_table[4][a >> 24] ^
+              crc_table[3][b & 0xFF] ^ crc_table[2][(b >> 8) & 0xFF] ^
+              crc_table[1][(b >> 16) & 0xFF] ^ crc_table[0][b >> 24];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    return crc_bytes(crc, p, len);
+}
+
+/* x86 PCLMULQDQ (used if the CPU has it) */
+
+#if CRC_PCLMUL
+#define PCLMUL_FN __attribute__((target("pclmul,sse4.1")))
+
+/* Whole 16-byte blocks, len >= 64. Takes and returns the running (inverted) CRC */
+PCLMUL_FN static uint32_t crc_pclmul_blocks(uint32_t crc, const uint8_t *buf, size_t len) {
+    /* Bit-reflected fold constants x^(512+32), x^(512-32), x^(128+32), x^(128-32), x^64 mod p and Barrett mu, p */
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    /* Four lanes folded 64 bytes forward at a time */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Into one lane */
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, low32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+
+    /* Barrett reduction to 32 bits */
+    x2 = _mm_and_si128(x1, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t *p, size_t len) {
+    if (len >= 64) {
+        size_t blocks = len & ~(size_t)15;
+        crc = crc_pclmul_blocks(crc, p, blocks);
+        p += blocks;
+        len -= blocks;
+    }
+    return crc_slices(crc, p, len);
+}
+#endif
+
+/* ARMv8 CRC32 instructions (compile time) */
+
+#if CRC_ARMV8
+static uint32_t crc_armv8(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = __crc32b(crc, *p++);
+    return crc;
+}
+#endif
+
+/* ESP32 ROM (takes and returns the final CRC, not the running one) */
+
+#if CRC_ESP32_ROM
+static uint32_t crc_esp32_rom(uint32_t crc, const uint8_t *p, size_t len) {
+    return ~esp_rom_crc32_le(~crc, p, (uint32_t)len);
+}
+#endif
+
+/* Dispatch */
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+#define CRC_STR2(x) #x
+#define CRC_STR(x) CRC_STR2(x)
+
+static crc_fn crc_impl = NULL;
+static const char *crc_name = NULL;
+
+static crc_fn crc_get_impl(void) {
+    crc_fn fn = packr_atomic_load(&crc_impl);
+    if (fn) return fn;
+
+    if (!packr_atomic_load(&crc_inited)) crc_init();
+    const char *name = "slice-by-" CRC_STR(PACKR_CRC_SLICES);
+    fn = crc_slices;
+#if CRC_ESP32_ROM
+    fn = crc_esp32_rom;
+    name = "esp32-rom";
+#endif
+#if CRC_ARMV8
+    fn = crc_armv8;
+    name = "armv8";
+#endif
+#if CRC_PCLMUL
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        fn = crc_pclmul;
+        name = "pclmul";
+    }
+#endif
+    packr_atomic_store(&crc_name, name);
+    packr_atomic_store(&crc_impl, fn);
+    return fn;
+}
+
+uint32_t packr_crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    return crc_get_impl()(crc, data, len);
+}
+
+uint32_t packr_crc32(const uint8_t *data, size_t len) {
+    return packr_crc32_update(0xFFFFFFFF, data, len) ^ 0xFFFFFFFF;
+}
+
+uint32_t packr_crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b) {
+    if (!packr_atomic_load(&crc_inited)) crc_init();
+    /* crc_a times x^(8 * len_b) */
+    uint32_t p = 1u << 31;
+    unsigned k = 3;
+    for (size_t n = len_b; n; n >>= 1, k++) {
+        if (n & 1) p = crc_multmodp(crc_x2n[k & 31], p);
+    }
+    return crc_multmodp(p, crc_a) ^ crc_b;
+}
+
+const char *packr_crc32_backend(void) {
+    crc_get_impl();
+    return packr_atomic_load(&crc_name);
+}
@@ -0,0 +1,599 @@
+/*
+ * PACKR - Number Formatting
+ *
+ * packr_format_g converts the exact binary value to decimal with a small
+ * bignum (value = m * 2^e = m * 5^-e * 10^e), then rounds and lays it out
+ * the way %g does. Typical telemetry values need 2-3 words, the worst case
+ * (subnormals) about 80.
+ */
+
+#include "packr_format.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t packr_format_u32(char *out, uint32_t value) {
+    char tmp[10];
+    char *p = tmp + sizeof(tmp);
+
+    while (value >= 100) {
+        uint32_t r = value % 100;
+        value /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + r * 2, 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + value * 2, 2);
+    } else {
+        *--p = (char)('0' + value);
+    }
+
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(out, p, len);
+    return len;
+}
+
+size_t packr_format_i32(char *out, int32_t value) {
+    if (value < 0) {
+        out[0] = '-';
+        return 1 + packr_format_u32(out + 1, (uint32_t)0 - (uint32_t)value);
+    }
+    return packr_format_u32(out, (uint32_t)value);
+}
+
+#if PACKR_FAST_FORMAT
+
+/* 53-bit mantissa * 5^1074 fits in 80 words, the decimal form in 86 chunks */
+#define BIG_WORDS   82
+#define BIG_CHUNKS  88
+#define CHUNK_BASE  1000000000u
+#define POW5_13     1220703125u
+
+typedef struct {
+    uint32_t w[BIG_WORDS]; /* little endian */
+    int n;
+} big_t;
+
+static void big_mul_small(big_t *b, uint32_t m) {
+    uint64_t carry = 0;
+    for (int i = 0; i < b->n; i++) {
+        uint64_t t = (uint64_t)b->w[i] * m + carry;
+        b->w[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+    if (carry) b->w[b->n++] = (uint32_t)carry;
+}
+
+static void big_mul_pow5(big_t *b, int k) {
+    static const uint32_t pow5[13] = {
+        1, 5, 25, 125, 625, 3125, 15625, 78125, 390625, 1953125,
+        9765625, 48828125, 244140625
+    };
+    while (k >= 13) {
+        big_mul_small(b, POW5_13);
+        k -= 13;
+    }
+    if (k) big_mul_small(b, pow5[k]);
+}
+
+static void big_shl(big_t *b, int bits) {
+    int words = bits / 32;
+    bits %= 32;
+
+    if (bits) {
+        uint32_t carry = 0;
+        for (int i = 0; i < b->n; i++) {
+            uint32_t w = b->w[i];
+            b->w[i] = (w << bits) | carry;
+            carry = w >> (32 - bits);
+        }
+        if (carry) b->w[b->n++] = carry;
+    }
+    if (words) {
+        memmove(b->w + words, b->w, (size_t)b->n * sizeof(uint32_t));
+        memset(b->w, 0, (size_t)words * sizeof(uint32_t));
+        b->n += words;
+    }
+}
+
+/* b /= d, returns the remainder */
+static uint32_t big_divmod_small(big_t *b, uint32_t d) {
+    uint64_t rem = 0;
+    for (int i = b->n - 1; i >= 0; i--) {
+        uint64_t cur = (rem << 32) | b->w[i];
+        b->w[i] = (uint32_t)(cur / d);
+        rem = cur % d;
+    }
+    while (b->n > 0 && b->w[b->n - 1] == 0) b->n--;
+    return (uint32_t)rem;
+}
+
+static uint64_t pow5_u64(int k) {
+    uint64_t r = 1;
+    while (k--) r *= 5;
+    return r;
+}
+
+/* Writes the 9 digits of c to d */
+static void chunk_to_digits(uint32_t c, int *d) {
+    for (int i = 8; i >= 0; i--) {
+        d[i] = (int)(c % 10);
+        c /= 10;
+    }
+}
+
+size_t packr_format_g(char *out, double value, int precision) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int bexp = (int)((bits >> 52) & 0x7FF);
+    uint64_t m = bits & ((1ULL << 52) - 1);
+
+    if (precision < 1) precision = 1;
+    if (precision > 17 || bexp == 0x7FF) {
+        /* inf / nan are not JSON anyway */
+        int n = snprintf(out, PACKR_FORMAT_MAX, "%.*g", precision, value);
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    char *p = out;
+    if (bits >> 63) *p++ = '-';
+    if (bexp == 0 && m == 0) {
+        *p++ = '0';
+        return (size_t)(p - out);
+    }
+
+    int e;
+    if (bexp == 0) {
+        e = -1074;
+    } else {
+        m |= 1ULL << 52;
+        e = bexp - 1075;
+    }
+    while (!(m & 1)) { m >>= 1; e++; }
+
+    /* N * 10^dexp is the exact value */
+    int dexp = e < 0 ? e : 0;
+    uint32_t chunks[BIG_CHUNKS];
+    int nc = 0;
+
+    uint64_t p5 = (e < 0 && e >= -27) ? pow5_u64(-e) : 0;
+    if ((e >= 0 && e <= 10) || (p5 && m <= UINT64_MAX / p5)) {
+        /* Fits in 64 bits (most values that came in as text) */
+        uint64_t n = (e >= 0) ? m << e : m * p5;
+        while (n) {
+            chunks[nc++] = (uint32_t)(n % CHUNK_BASE);
+            n /= CHUNK_BASE;
+        }
+    } else {
+        big_t b;
+        b.w[0] = (uint32_t)m;
+        b.w[1] = (uint32_t)(m >> 32);
+        b.n = b.w[1] ? 2 : 1;
+        if (e > 0) big_shl(&b, e);
+        else big_mul_pow5(&b, -e);
+        while (b.n > 0) chunks[nc++] = big_divmod_small(&b, CHUNK_BASE);
+    }
+
+    /*
+     * The top three chunks hold at least 19 digits, enough for precision + 1;
+     * everything below only matters as a sticky bit.
+     */
+    int d[27];
+    int top = nc < 3 ? nc : 3;
+    for (int i = 0; i < top; i++) chunk_to_digits(chunks[nc - 1 - i], d + 9 * i);
+    int lead = 0;
+    while (d[lead] == 0) lead++;
+    int avail = 9 * top - lead;
+    int *dig = d + lead;
+
+    int ndig = avail + 9 * (nc - top);
+    int x = ndig - 1 + dexp; /* decimal exponent of the first digit */
+
+    /* Keep precision digits, round half to even on what follows */
+    int nd = ndig < precision ? ndig : precision;
+    if (ndig > precision) {
+        int next = dig[precision];
+        int sticky = 0;
+        for (int i = precision + 1; i < avail && !sticky; i++) sticky = dig[i] != 0;
+        for (int i = nc - top - 1; i >= 0 && !sticky; i--) sticky = chunks[i] != 0;
+
+        if (next > 5 || (next == 5 && (sticky || (dig[nd - 1] & 1)))) {
+            int i = nd - 1;
+            while (i >= 0 && dig[i] == 9) dig[i--] = 0;
+            if (i >= 0) {
+                dig[i]++;
+            } else {
+                dig[0] = 1;
+                x++;
+            }
+        }
+    }
+    while (nd > 1 && dig[nd - 1] == 0) nd--;
+
+    if (x < -4 || x >= precision) {
+        /* d.ddde+XX */
+        *p++ = (char)('0' + dig[0]);
+        if (nd > 1) {
+            *p++ = '.';
+            for (int i = 1; i < nd; i++) *p++ = (char)('0' + dig[i]);
+        }
+        *p++ = 'e';
+        *p++ = x < 0 ? '-' : '+';
+        int ax = x < 0 ? -x : x;
+        if (ax >= 100) {
+            *p++ = (char)('0' + ax / 100);
+            ax %= 100;
+        }
+        memcpy(p, digit_pairs + ax * 2, 2);
+        p += 2;
+    } else if (x >= 0) {
+        for (int i = 0; i <= x; i++) *p++ = (char)(i < nd ? '0' + dig[i] : '0');
+        if (nd > x + 1) {
+            *p++ = '.';
+            for (int i = x + 1; i < nd; i++) *p++ = (char)('0' + dig[i]);
+        }
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > x; i--) *p++ = '0';
+        for (int i = 0; i < nd; i++) *p++ = (char)('0' + dig[i]);
+    }
+
+    return (size_t)(p - out);
+}
+
+#else
+
+size_t packr_format_g(char *out, double value, int precision) {
+    int n = snprintf(out, PACKR_FORMAT_MAX, "%.*g", precision, value);
+    return n > 0 ? (size_t)n : 0;
+}
+
+#endif
+
+/*
+ * Number parsing: one pass collects up to 19 significant digits and the
+ * decimal exponent. Inside 2^53 * 10^+-22 one IEEE multiply or divide by
+ * an exact power of ten is correctly rounded (Clinger's fast path), which
+ * covers nearly every sensor reading; anything longer goes to strtod.
+ */
+
+#if PACKR_FAST_FORMAT
+
+static double parse_slow(const char *s, size_t len) {
+    char buf[64];
+    if (len > sizeof(buf) - 1) len = sizeof(buf) - 1;
+    memcpy(buf, s, len);
+    buf[len] = 0;
+    return strtod(buf, NULL);
+}
+
+#define MANTISSA_MAX  (1ULL << 53)
+#define DIGITS_MAX    19              /* always fit a uint64 */
+
+/* m * 10^e if it is exactly rounded in one operation, else -1 */
+static double parse_fast(uint64_t m, int e) {
+#if FLT_EVAL_METHOD == 0
+    static const double exact_pow10[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    if (e > 22 && e <= 22 + 15) {
+        /* 123e30 = 12300000000 * 1e22 */
+        for (; e > 22 && m < MANTISSA_MAX; e--) m *= 10;
+    }
+    if (m > MANTISSA_MAX) return -1;
+    if (e >= 0 && e <= 22) return (double)m * exact_pow10[e];
+    if (e < 0 && e >= -22) return (double)m / exact_pow10[-e];
+#else
+    /* Extended precision intermediates would round twice */
+    (void)m;
+    (void)e;
+#endif
+    return -1;
+}
+
+int packr_parse_number(const char *s, size_t len, int32_t *i, double *d) {
+    const char *p = s, *end = s + len;
+    int neg = (p < end && *p == '-');
+    p += neg;
+
+    uint64_t m = 0;
+    int digits = 0;     /* significant digits in m */
+    int exp10 = 0;
+    int exact = 1;      /* every significant digit is in m */
+
+    for (; p < end && (unsigned)(*p - '0') < 10; p++) {
+        if (digits < DIGITS_MAX) {
+            m = m * 10 + (unsigned)(*p - '0');
+            digits += (m != 0);
+        } else {
+            exact = 0;
+            exp10++;
+        }
+    }
+
+    if (p == end) {
+        /* strtol saturates at the range of long, then the cast wraps */
+        uint64_t limit = neg ? (1ULL << 63) : (1ULL << 63) - 1;
+        uint64_t v = (!exact || m > limit) ? limit : m;
+        *i = (int32_t)(uint32_t)(neg ? (uint64_t)0 - v : v);
+        /* A lone "-" converts nothing, so it is +0 */
+        *d = !exact ? parse_slow(s, len) : (neg && len > 1) ? -(double)m : (double)m;
+        return PACKR_NUMBER_INT;
+    }
+
+    if (*p == '.') {
+        for (p++; p < end && (unsigned)(*p - '0') < 10; p++) {
+            if (digits < DIGITS_MAX) {
+                m = m * 10 + (unsigned)(*p - '0');
+                digits += (m != 0);
+                exp10--;
+            } else if (*p != '0') {
+                exact = 0;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int eneg = (p < end && *p == '-');
+        if (p < end && (*p == '-' || *p == '+')) p++;
+        int e = 0;
+        for (; p < end && (unsigned)(*p - '0') < 10; p++) {
+            if (e < 100000) e = e * 10 + (*p - '0');
+        }
+        exp10 += eneg ? -e : e;
+    }
+
+    double v = (m == 0) ? 0.0 : exact ? parse_fast(m, exp10) : -1;
+    if (v < 0 || p != end) {
+        *d = parse_slow(s, len);
+    } else {
+        *d = neg ? -v : v;
+    }
+    return PACKR_NUMBER_FLOAT;
+}
+
+#else
+
+int packr_parse_number(const char *s, size_t len, int32_t *i, double *d) {
+    int type = PACKR_NUMBER_INT;
+    for (size_t k = 0; k < len; k++) {
+        if (s[k] == '.' || s[k] == 'e' || s[k] == 'E') type = PACKR_NUMBER_FLOAT;
+    }
+    char buf[64];
+    if (len > sizeof(buf) - 1) len = sizeof(buf) - 1;
+    memcpy(buf, s, len);
+    buf[len] = 0;
+    if (type == PACKR_NUMBER_INT) *i = (int32_t)strtol(buf, NULL, 10);
+    *d = strtod(buf, NULL);
+    return type;
+}
+
+#endif
+
+/*
+ * Typed strings. Dates go to days since 1970-01-01 and back with the
+ * proleptic Gregorian era arithmetic of H. Hinnant's chrono algorithms.
+ */
+
+static const int64_t pow10_i64[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static int64_t days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (int64_t)era * 146097 + doe - 719468;
+}
+
+static void civil_from_days(int64_t z, int *y, int *m, int *d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int doe = (int)(z - era * 146097);
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int)(yoe + era * 400) + (*m <= 2);
+}
+
+/* n digits at s as a number, -1 if any is not a digit */
+static int parse_digits(const char *s, int n) {
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned c = (unsigned)(s[i] - '0');
+        if (c > 9) return -1;
+        v = v * 10 + (int)c;
+    }
+    return v;
+}
+
+static char *put_digits(char *out, int v, int n) {
+    for (int i = n - 1; i >= 0; i--, v /= 10) out[i] = (char)('0' + v % 10);
+    return out + n;
+}
+
+int packr_parse_timestamp(const char *s, size_t len, packr_timestamp_t *ts) {
+    if (len < 19 || len > PACKR_TIMESTAMP_MAX) return -1;
+    if (s[4] != '-' || s[7] != '-' || (s[10] != 'T' && s[10] != ' ') || s[13] != ':' || s[16] != ':') return -1;
+    int y = parse_digits(s, 4), mo = parse_digits(s + 5, 2), d = parse_digits(s + 8, 2);
+    int h = parse_digits(s + 11, 2), mi = parse_digits(s + 14, 2), sec = parse_digits(s + 17, 2);
+    if (y < 0 || mo < 1 || mo > 12 || d < 1 || h < 0 || h > 23 || mi < 0 || mi > 59 || sec < 0 || sec > 59) {
+        return -1;
+    }
+    static const int mdays[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    if (d > mdays[mo - 1] || (mo == 2 && d == 29 && !leap)) return -1;
+
+    size_t p = 19;
+    int digits = 0;
+    int64_t frac = 0;
+    if (p < len && s[p] == '.') {
+        for (p++; p < len && digits < 10 && (unsigned)(s[p] - '0') < 10; p++, digits++) {
+            frac = frac * 10 + (s[p] - '0');
+        }
+        if (digits == 0 || digits > 9) return -1;
+    }
+
+    uint8_t zone = PACKR_TS_LOCAL;
+    int offset = 0;
+    if (p < len && s[p] == 'Z') {
+        zone = PACKR_TS_UTC;
+        p++;
+    } else if (p < len && (s[p] == '+' || s[p] == '-')) {
+        bool compact = (len - p == 5);
+        if (!compact && (len - p != 6 || s[p + 3] != ':')) return -1;
+        int oh = parse_digits(s + p + 1, 2), om = parse_digits(s + p + (compact ? 3 : 4), 2);
+        if (oh < 0 || oh > 23 || om < 0 || om > 59) return -1;
+        offset = oh * 60 + om;
+        if (s[p] == '-') {
+            if (offset == 0) return -1; /* -00:00 would come back as +00:00 */
+            offset = -offset;
+        }
+        zone = compact ? PACKR_TS_OFFSET_COMPACT : PACKR_TS_OFFSET;
+        p = len;
+    }
+    if (p != len) return -1;
+
+    /* Every year 0000-9999 fits in seconds, not every one in nanoseconds */
+    int64_t secs = days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + sec;
+    int64_t scale = pow10_i64[digits];
+    if (secs > (INT64_MAX - frac) / scale || secs < INT64_MIN / scale) return -1;
+
+    ts->ticks = secs * scale + frac;
+    ts->offset = (int16_t)offset;
+    ts->format = (uint8_t)(digits | zone | (s[10] == ' ' ? PACKR_TS_SPACE : 0));
+    return 0;
+}
+
+size_t packr_format_timestamp(char *out, const packr_timestamp_t *ts) {
+    int digits = ts->format & PACKR_TS_DIGITS;
+    uint8_t zone = ts->format & PACKR_TS_ZONE;
+    if (digits > 9 || (ts->format & 0x80)) return 0;
+    if (zone >= PACKR_TS_OFFSET && (ts->offset <= -24 * 60 || ts->offset >= 24 * 60)) return 0;
+
+    /* Floor division, so times before 1970 keep a positive fraction */
+    int64_t scale = pow10_i64[digits];
+    int64_t secs = ts->ticks / scale, frac = ts->ticks % scale;
+    if (frac < 0) {
+        secs--;
+        frac += scale;
+    }
+    int64_t days = secs / 86400, sod = secs % 86400;
+    if (sod < 0) {
+        days--;
+        sod += 86400;
+    }
+    /* Outside 0000-01-01 .. 9999-12-31 (civil_from_days would overflow far out) */
+    if (days < -719528 || days > 2932896) return 0;
+    int y, m, d;
+    civil_from_days(days, &y, &m, &d);
+
+    char *p = out;
+    p = put_digits(p, y, 4);
+    *p++ = '-';
+    p = put_digits(p, m, 2);
+    *p++ = '-';
+    p = put_digits(p, d, 2);
+    *p++ = (ts->format & PACKR_TS_SPACE) ? ' ' : 'T';
+    p = put_digits(p, (int)(sod / 3600), 2);
+    *p++ = ':';
+    p = put_digits(p, (int)(sod / 60 % 60), 2);
+    *p++ = ':';
+    p = put_digits(p, (int)(sod % 60), 2);
+    if (digits) {
+        *p++ = '.';
+        p = put_digits(p, (int)frac, digits);
+    }
+    if (zone == PACKR_TS_UTC) {
+        *p++ = 'Z';
+    } else if (zone != PACKR_TS_LOCAL) {
+        int off = ts->offset < 0 ? -ts->offset : ts->offset;
+        *p++ = ts->offset < 0 ? '-' : '+';
+        p = put_digits(p, off / 60, 2);
+        if (zone == PACKR_TS_OFFSET) *p++ = ':';
+        p = put_digits(p, off % 60, 2);
+    }
+    return (size_t)(p - out);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int packr_parse_uuid(const char *s, size_t len, uint8_t uuid[16], bool *upper) {
+    if (len != PACKR_UUID_LEN || s[8] != '-' || s[13] != '-' || s[18] != '-' || s[23] != '-') return -1;
+    bool lower_seen = false, upper_seen = false;
+    int n = 0;
+    for (size_t i = 0; i < len; i += 2) {
+        if (s[i] == '-') i++;
+        int hi = hex_value(s[i]), lo = hex_value(s[i + 1]);
+        if (hi < 0 || lo < 0) return -1;
+        for (int k = 0; k < 2; k++) {
+            char c = s[i + k];
+            if (c >= 'a') lower_seen = true;
+            else if (c >= 'A') upper_seen = true;
+        }
+        uuid[n++] = (uint8_t)(hi << 4 | lo);
+    }
+    if (lower_seen && upper_seen) return -1;
+    *upper = upper_seen;
+    return 0;
+}
+
+size_t packr_format_uuid(char *out, const uint8_t uuid[16], bool upper) {
+    const char *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *p = out;
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) *p++ = '-';
+        *p++ = hex[uuid[i] >> 4];
+        *p++ = hex[uuid[i] & 0x0F];
+    }
+    return PACKR_UUID_LEN;
+}
+
+int packr_parse_ipv4(const char *s, size_t len, uint8_t ip[4]) {
+    if (len < 7 || len > PACKR_IPV4_MAX) return -1;
+    size_t p = 0;
+    for (int part = 0; part < 4; part++) {
+        if (part > 0 && (p >= len || s[p++] != '.')) return -1;
+        size_t start = p;
+        int v = 0;
+        for (; p < len && p - start < 3 && (unsigned)(s[p] - '0') < 10; p++) v = v * 10 + (s[p] - '0');
+        if (p == start || v > 255 || (s[start] == '0' && p - start > 1)) return -1;
+        ip[part] = (uint8_t)v;
+    }
+    return p == len ? 0 : -1;
+}
+
+size_t packr_format_ipv4(char *out, const uint8_t ip[4]) {
+    size_t n = 0;
+    for (int part = 0; part < 4; part++) {
+        if (part > 0) out[n++] = '.';
+        n += packr_format_u32(out + n, ip[part]);
+    }
+    return n;
+}
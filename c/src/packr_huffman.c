@@ -0,0 +1,236 @@
+/*
+ * PACKR - Canonical Huffman
+ *
+ * Code lengths come from the usual two-queue construction over the sorted
+ * symbol counts; when a code would be longer than PACKR_HUFF_ENC_BITS the
+ * counts are halved and the tree built again, which flattens it a little
+ * each time at a small cost in ratio. Decoding looks the next
+ * PACKR_HUFF_LOOKUP_BITS bits up in a table of (symbol, length).
+ */
+
+#include "packr_huffman.h"
+#include "packr_bitio.h"
+#include "packr_platform.h"
+#include <string.h>
+
+#define HUFF_SYMBOLS   256
+#define HUFF_CODED     0x01
+#define HUFF_SINGLE    0x02
+#define HUFF_HEADER    7      /* marker, length, symbol count */
+
+typedef struct {
+    uint8_t len[HUFF_SYMBOLS];
+    uint16_t code[HUFF_SYMBOLS];
+    int used;                  /* symbols with a code */
+    uint64_t bits;             /* payload bits of the whole input */
+} huff_table_t;
+
+/* Code lengths for the symbol counts, none longer than PACKR_HUFF_ENC_BITS */
+static void huff_lengths(const uint32_t *freq, uint8_t *len, int *used) {
+    uint32_t w[2 * HUFF_SYMBOLS];
+    uint16_t parent[2 * HUFF_SYMBOLS];
+    uint8_t sym[HUFF_SYMBOLS];
+    int n = 0;
+
+    memset(len, 0, HUFF_SYMBOLS);
+    for (int s = 0; s < HUFF_SYMBOLS; s++) {
+        if (!freq[s]) continue;
+        /* Insertion sort by count, ties by symbol */
+        int i = n++;
+        while (i > 0 && freq[sym[i - 1]] > freq[s]) {
+            sym[i] = sym[i - 1];
+            i--;
+        }
+        sym[i] = (uint8_t)s;
+    }
+    *used = n;
+    if (n == 1) len[sym[0]] = 1;
+    if (n < 2) return;
+
+    uint32_t scale = 0;
+    for (;;) {
+        for (int i = 0; i < n; i++) w[i] = ((freq[sym[i]] - 1) >> scale) + 1;
+
+        /* Leaves 0..n-1 in count order, inner nodes n..2n-2 in the order they are made */
+        int leaf = 0, inner = n;
+        for (int next = n; next < 2 * n - 1; next++) {
+            int pick[2];
+            for (int k = 0; k < 2; k++) {
+                pick[k] = (leaf < n && (inner >= next || w[leaf] <= w[inner])) ? leaf++ : inner++;
+            }
+            w[next] = w[pick[0]] + w[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = (uint16_t)next;
+        }
+
+        /* Depths from the root down, reusing w */
+        int max = 0;
+        w[2 * n - 2] = 0;
+        for (int i = 2 * n - 3; i >= 0; i--) {
+            w[i] = w[parent[i]] + 1;
+            if (i < n && (int)w[i] > max) max = (int)w[i];
+        }
+        if (max <= PACKR_HUFF_ENC_BITS) {
+            for (int i = 0; i < n; i++) len[sym[i]] = (uint8_t)w[i];
+            return;
+        }
+        scale++;
+    }
+}
+
+/* Canonical codes: by length, then symbol, counting up */
+static void huff_codes(huff_table_t *t) {
+    uint16_t count[PACKR_HUFF_MAX_BITS + 1] = {0};
+    uint16_t next[PACKR_HUFF_MAX_BITS + 1];
+    for (int s = 0; s < HUFF_SYMBOLS; s++) count[t->len[s]]++;
+    count[0] = 0;
+    uint16_t code = 0;
+    for (int l = 1; l <= PACKR_HUFF_MAX_BITS; l++) {
+        code = (uint16_t)((code + count[l - 1]) << 1);
+        next[l] = code;
+    }
+    for (int s = 0; s < HUFF_SYMBOLS; s++) {
+        if (t->len[s]) t->code[s] = next[t->len[s]]++;
+    }
+}
+
+static int huff_build(huff_table_t *t, const uint8_t *in, size_t in_len) {
+    uint32_t freq[HUFF_SYMBOLS] = {0};
+    if (in_len == 0 || in_len > 0xFFFFFFFFu) return -1;
+    for (size_t i = 0; i < in_len; i++) freq[in[i]]++;
+
+    huff_lengths(freq, t->len, &t->used);
+    huff_codes(t);
+    t->bits = 0;
+    for (int s = 0; s < HUFF_SYMBOLS; s++) t->bits += (uint64_t)freq[s] * t->len[s];
+    return 0;
+}
+
+static size_t huff_coded_size(const huff_table_t *t) {
+    if (t->used == 1) return HUFF_HEADER - 1;
+    return HUFF_HEADER + 2 * (size_t)t->used + (size_t)((t->bits + 7) / 8);
+}
+
+size_t packr_huffman_size(const uint8_t *in, size_t in_len) {
+    huff_table_t t;
+    if (huff_build(&t, in, in_len) != 0) return 0;
+    return huff_coded_size(&t);
+}
+
+size_t packr_huffman_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap) {
+    huff_table_t t;
+    if (huff_build(&t, in, in_len) != 0) return 0;
+    size_t size = huff_coded_size(&t);
+    if (size > out_cap) return 0;
+
+    packr_store_le32(out + 1, (uint32_t)in_len);
+    if (t.used == 1) {
+        out[0] = HUFF_SINGLE;
+        out[5] = in[0];
+        return size;
+    }
+    out[0] = HUFF_CODED;
+    out[5] = (uint8_t)t.used;
+    out[6] = (uint8_t)(t.used >> 8);
+
+    size_t pos = HUFF_HEADER;
+    for (int l = 1; l <= PACKR_HUFF_ENC_BITS; l++) {
+        for (int s = 0; s < HUFF_SYMBOLS; s++) {
+            if (t.len[s] != l) continue;
+            out[pos++] = (uint8_t)s;
+            out[pos++] = (uint8_t)l;
+        }
+    }
+
+    packr_bitwriter_t bw;
+    packr_bw_init(&bw, out + pos, out_cap - pos);
+    for (size_t i = 0; i < in_len; i++) packr_bw_put(&bw, t.code[in[i]], t.len[in[i]]);
+    packr_bw_flush(&bw);
+    return pos + bw.pos;
+}
+
+size_t packr_huffman_decompressed_size(const uint8_t *in, size_t in_len) {
+    if (in_len < 5) return 0;
+    return packr_load_le32(in + 1);
+}
+
+/* Codes longer than the table, by length: the first code, its index in the pair list, how many */
+typedef struct {
+    uint16_t first[PACKR_HUFF_MAX_BITS + 1];
+    uint16_t base[PACKR_HUFF_MAX_BITS + 1];
+    uint16_t count[PACKR_HUFF_MAX_BITS + 1];
+    int max;
+} huff_long_t;
+
+size_t packr_huffman_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *in_used) {
+    if (in_len < 5) return 0;
+    size_t n = packr_load_le32(in + 1);
+    if (n == 0 || n > out_cap) return 0;
+
+    if (in[0] == HUFF_SINGLE) {
+        if (in_len < 6) return 0;
+        memset(out, in[5], n);
+        if (in_used) *in_used = 6;
+        return n;
+    }
+    if (in[0] != HUFF_CODED || in_len < HUFF_HEADER) return 0;
+
+    size_t used = (size_t)(in[5] | (in[6] << 8));
+    if (used == 0 || used > HUFF_SYMBOLS || in_len < HUFF_HEADER + 2 * used) return 0;
+    const uint8_t *pairs = in + HUFF_HEADER;
+
+    uint16_t table[1 << PACKR_HUFF_LOOKUP_BITS];
+    huff_long_t lg;
+    memset(table, 0, sizeof(table));
+    memset(&lg, 0, sizeof(lg));
+
+    /* Pairs must come sorted, and the lengths must not claim more than the code space */
+    uint32_t code = 0;
+    int prev_len = 1;
+    for (size_t i = 0; i < used; i++) {
+        int sym = pairs[2 * i], len = pairs[2 * i + 1];
+        if (len < prev_len || len > PACKR_HUFF_MAX_BITS) return 0;
+        if (i > 0 && len == prev_len && sym <= pairs[2 * i - 2]) return 0;
+        code <<= len - prev_len;
+        prev_len = len;
+        if (code >= (1u << len)) return 0;
+
+        if (len <= PACKR_HUFF_LOOKUP_BITS) {
+            int shift = PACKR_HUFF_LOOKUP_BITS - len;
+            uint16_t entry = (uint16_t)((sym << 4) | len);
+            for (uint32_t k = code << shift; k < (code + 1) << shift; k++) table[k] = entry;
+        } else {
+            if (!lg.count[len]) {
+                lg.first[len] = (uint16_t)code;
+                lg.base[len] = (uint16_t)i;
+            }
+            lg.count[len]++;
+            lg.max = len;
+        }
+        code++;
+    }
+
+    packr_bitreader_t br;
+    packr_br_init(&br, pairs + 2 * used, in_len - HUFF_HEADER - 2 * used);
+    for (size_t i = 0; i < n; i++) {
+        uint16_t entry = table[packr_br_peek(&br, PACKR_HUFF_LOOKUP_BITS)];
+        if (entry) {
+            if (packr_br_skip(&br, entry & 0x0F) != 0) return 0;
+            out[i] = (uint8_t)(entry >> 4);
+            continue;
+        }
+
+        uint32_t bits = packr_br_peek(&br, PACKR_HUFF_MAX_BITS);
+        int len = PACKR_HUFF_LOOKUP_BITS + 1;
+        for (; len <= lg.max; len++) {
+            uint32_t c = (bits >> (PACKR_HUFF_MAX_BITS - len)) - lg.first[len];
+            if (c < lg.count[len]) {
+                out[i] = pairs[2 * (lg.base[len] + c)];
+                break;
+            }
+        }
+        if (len > lg.max || packr_br_skip(&br, len) != 0) return 0;
+    }
+
+    if (in_used) *in_used = HUFF_HEADER + 2 * used + packr_br_used(&br);
+    return n;
+}
@@ -3,6 +3,8 @@
  */
 
 #include "packr_json.h"
+#include "packr_scan.h"
+#include "packr_format.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,12 +33,13 @@ typedef struct {
     const char *json;
     size_t len;
     size_t pos;
+    int depth;  /* containers open around the value being encoded */
 } jparser_t;
 
 static void skip_whitespace(jparser_t *p) {
-    while (p->pos < p->len && isspace((unsigned char)p->json[p->pos])) {
-        p->pos++;
-    }
+    /* Compact JSON has none, so don't pay for the call */
+    if (p->pos < p->len && !isspace((unsigned char)p->json[p->pos])) return;
+    p->pos = packr_scan_space(p->json, p->pos, p->len);
 }
 
 static jtoken_type_t peek_token(jparser_t *p) {
@@ -79,10 +82,12 @@ static jtoken_type_t next_token(jparser_t *p, char **out_start, size_t *out_len)
     if (c == '"') {
         p->pos++;
         *out_start = (char*)(p->json + p->pos);
-        while (p->pos < p->len && p->json[p->pos] != '"') {
-            if (p->json[p->pos] == '\\') p->pos++;
-            p->pos++;
+        for (;;) {
+            p->pos = packr_scan_string(p->json, p->pos, p->len);
+            if (p->pos >= p->len || p->json[p->pos] == '"') break;
+            p->pos += 2; /* backslash and the escaped byte */
         }
+        if (p->pos > p->len) p->pos = p->len;
         *out_len = (char*)(p->json + p->pos) - *out_start;
         if (p->pos < p->len) p->pos++; /* skip closing quote */
         return J_STRING;
@@ -125,18 +130,22 @@ static size_t skip_json_compound(jparser_t *p) {
     int in_quote = 0;
 
     while (p->pos < p->len) {
+        /* Jump straight to the next byte that can change the state */
+        p->pos = in_quote ? packr_scan_string(p->json, p->pos, p->len)
+                          : packr_scan_nesting(p->json, p->pos, p->len);
+        if (p->pos >= p->len) break;
         char cur = p->json[p->pos];
 
         if (in_quote) {
             if (cur == '\\') {
                 p->pos++;
-            } else if (cur == '"') {
+            } else {
                 in_quote = 0;
             }
         } else {
             if (cur == '"') in_quote = 1;
             else if (cur == '{' || cur == '[') depth++;
-            else if (cur == '}' || cur == ']') {
+            else {
                 depth--;
                 if (depth == 0) {
                     p->pos++;
@@ -162,20 +171,39 @@ static char* consume_json_object(jparser_t *p, size_t *out_len) {
     return res;
 }
 
+/* Same for any value, scalars taken as written (a string with its quotes) */
+static char* consume_json_value(jparser_t *p, size_t *out_len) {
+    jtoken_type_t t = peek_token(p);
+    if (t == J_OBJECT_START || t == J_ARRAY_START) return consume_json_object(p, out_len);
+    if (t != J_STRING && t != J_NUMBER && t != J_TRUE && t != J_FALSE && t != J_NULL) return NULL;
+
+    char *s; size_t sl;
+    skip_whitespace(p);
+    size_t start = p->pos;
+    if (next_token(p, &s, &sl) != t) return NULL;
+    *out_len = p->pos - start;
+    char *res = packr_malloc(*out_len + 1);
+    if (!res) return NULL;
+    memcpy(res, p->json + start, *out_len);
+    res[*out_len] = 0;
+    return res;
+}
+
 
 
 /* Custom Encoder Callback */
+static int encode_value(jparser_t *p, packr_encoder_t *enc);
+
 static int encode_json_blob(packr_encoder_t *ctx, void *data) {
     char *json = (char*)data;
     if (!json) return packr_encode_null(ctx);
-    // Recursively parse this blob
-    return json_encode_to_packr(json, strlen(json), ctx);
+    // Recursively parse this blob (nested, so never a block point)
+    jparser_t p = {json, strlen(json), 0, 1};
+    return encode_value(&p, ctx);
 }
 
 /* Recursive Encoder */
 
-static int encode_value(jparser_t *p, packr_encoder_t *enc);
-
 static int encode_object(jparser_t *p, packr_encoder_t *enc) {
     char *d1; size_t d2;
     /* Consume { */
@@ -198,7 +226,10 @@ static int encode_object(jparser_t *p, packr_encoder_t *enc) {
         
         if (next_token(p, &d1, &d2) != J_COLON) return -1;
         
-        if (encode_value(p, enc) != 0) return -1;
+        p->depth++;
+        int ret = encode_value(p, enc);
+        p->depth--;
+        if (ret != 0) return -1;
         
         t = peek_token(p);
         if (t == J_COMMA) {
@@ -216,335 +247,730 @@ static int encode_object(jparser_t *p, packr_encoder_t *enc) {
 #include "packr_ultra.h"
 
 #define MAX_BATCH_ROWS 128
-#define MAX_BATCH_COLS 32
+#define MAX_BATCH_COLS 64    /* keys, nested ones included */
+#define MAX_BATCH_BYTES 4096 /* string and blob bytes before a batch is flushed */
+#define MIN_BATCH_ROWS 4     /* smaller arrays aren't worth the batch overhead */
+#define MAX_BATCH_DEPTH 8    /* objects nested deeper stay CUSTOM values */
+#define BATCH_KEY_SLOTS 128  /* power of two, twice MAX_BATCH_COLS */
+#define BATCH_NAME_BYTES 1024 /* key names kept in the schema, longer ones are allocated */
+#define BATCH_SLOT_BYTES (MAX_BATCH_ROWS * sizeof(packr_timestamp_t)) /* a column of the widest cells */
+#define BATCH_TEXT_CHUNK MAX_BATCH_BYTES
+#define BATCH_CUT_ROWS 8     /* PACKR_BATCH_SMALLEST: fewest rows of a batch cut from a bigger one */
+#define BATCH_HEAD_BYTES 3   /* schema token, batch token and row count */
+
+/*
+ * Schema of an ultra array, built while the rows are parsed. Every key is
+ * tracked from its first appearance, but only gets a column (and a place in
+ * the batch) with its first non-null value, so columns keep the order in
+ * which their type became known.
+ * Keys of nested objects are keys of their own under the object's key,
+ * which gets an OBJECT column: sensor.gps.lat is the key lat under gps
+ * under sensor. Batches list each OBJECT column followed by its group.
+ * A value its column can't hold (text after numbers, a nested null after
+ * values) ends the batch before its row, and the column is CUSTOM from
+ * then on: JSON text, which holds anything. A row whose keys don't fit
+ * in MAX_BATCH_COLS does the same, and starts the schema over, without
+ * flattening if it still doesn't fit.
+ * The schema and its memory (column arrays, string text) stay with the
+ * encoder's column scratch for the next array, so once they have grown to
+ * the data, batching allocates nothing but CUSTOM values.
+ */
+typedef struct {
+    char *name;
+    size_t len;
+    uint32_t hash;
+    int parent;     /* key of the object it is in, -1 = the row */
+    int depth;
+    int col;        /* index into cols, -1 while only nulls were seen */
+    bool own_name;  /* allocated, not in names */
+    uint8_t *nulls; /* per row presence, shared with the column */
+} batch_key_t;
+
+/* String cell text, kept and refilled batch after batch */
+typedef struct batch_text {
+    struct batch_text *next;
+    size_t used;
+    size_t cap;
+} batch_text_t;             /* text follows */
+
+typedef struct {
+    batch_key_t keys[MAX_BATCH_COLS];
+    int key_count;
+    uint8_t slots[BATCH_KEY_SLOTS]; /* key index + 1, 0 = empty */
+
+    char *fields[MAX_BATCH_COLS];
+    packr_column_t cols[MAX_BATCH_COLS];
+    int col_keys[MAX_BATCH_COLS];
+    int col_count;
+    int groups;     /* OBJECT columns, and CUSTOM ones that were; with none, cols is the batch as is */
+    int conflict;   /* key whose column can't hold its value in the row (schema_fill returned 1), -1 = no room for a key */
+    bool flatten;   /* nested objects get OBJECT columns, else CUSTOM ones */
+
+    /* The columns in batch order, when there are groups */
+    char *group_fields[MAX_BATCH_COLS];
+    packr_column_t group_cols[MAX_BATCH_COLS];
+    void *no_values[MAX_BATCH_ROWS]; /* keys only seen as null, written as CUSTOM nulls */
+
+    uint8_t presence[MAX_BATCH_COLS][MAX_BATCH_ROWS]; /* the keys' nulls */
+    char names[BATCH_NAME_BYTES];
+    size_t names_used;
+    void *spare[MAX_BATCH_COLS + 1]; /* column arrays (BATCH_SLOT_BYTES) not in use */
+    int spare_count;
+    batch_text_t *text;     /* every chunk, emptied by each flush */
+    batch_text_t *text_at;  /* chunk being filled, NULL = none yet */
+    size_t bytes;           /* held, for the encoder's total_alloc */
+
+    /* Cutting batches, with PACKR_BATCH_SMALLEST (see schema_split) */
+    bool changed;           /* keys or column types changed in the row being filled */
+    int change_row;         /* last row of the batch where they did, 0 = none */
+    int cuts[MAX_BATCH_ROWS]; /* row ends of the batches the rows go out as, none = one batch */
+    int cut_count;
+    packr_column_t view[MAX_BATCH_COLS]; /* rows of the batch columns, to price or write a cut */
+} batch_schema_t;
+
+/* A column array of BATCH_SLOT_BYTES, zeroed */
+static void *schema_slot(batch_schema_t *b) {
+    void *data;
+    if (b->spare_count) {
+        data = b->spare[--b->spare_count];
+    } else {
+        data = packr_malloc(BATCH_SLOT_BYTES);
+        if (!data) return NULL;
+        b->bytes += BATCH_SLOT_BYTES;
+    }
+    memset(data, 0, BATCH_SLOT_BYTES);
+    return data;
+}
+
+/* Every column holds one array and widening takes one more, so spare never overflows */
+static void schema_unslot(batch_schema_t *b, void *data) {
+    b->spare[b->spare_count++] = data;
+}
+
+/* Room for len bytes of string cell text, which stays until the batch is flushed */
+static char *schema_text(batch_schema_t *b, size_t len) {
+    batch_text_t *t = b->text_at;
+    if (!t || t->cap - t->used < len) {
+        /* The chunks after the current one are empty */
+        batch_text_t *next = t ? t->next : b->text;
+        if (!next || next->cap < len) {
+            size_t cap = (len > BATCH_TEXT_CHUNK) ? len : BATCH_TEXT_CHUNK;
+            batch_text_t *chunk = packr_malloc(sizeof(batch_text_t) + cap);
+            if (!chunk) return NULL;
+            chunk->used = 0;
+            chunk->cap = cap;
+            chunk->next = next;
+            if (t) t->next = chunk;
+            else b->text = chunk;
+            b->bytes += sizeof(batch_text_t) + cap;
+            next = chunk;
+        }
+        t = b->text_at = next;
+    }
+    char *text = (char*)(t + 1) + t->used;
+    t->used += len;
+    return text;
+}
+
+/* Empties the text chunks, dropping oversized ones */
+static void schema_text_reset(batch_schema_t *b) {
+    batch_text_t **link = &b->text;
+    while (*link) {
+        batch_text_t *t = *link;
+        if (t->cap > BATCH_TEXT_CHUNK) {
+            *link = t->next;
+            b->bytes -= sizeof(batch_text_t) + t->cap;
+            packr_free(t);
+        } else {
+            t->used = 0;
+            link = &t->next;
+        }
+    }
+    b->text_at = NULL;
+}
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Index of key (in parent, -1 = the row) in the schema, adding it when new. -1 once the schema is full */
+static int schema_key(batch_schema_t *b, int parent, const char *key, size_t klen) {
+    uint32_t h = key_hash(key, klen) ^ (uint32_t)(parent + 1) * 2654435761u;
+    uint32_t slot = h & (BATCH_KEY_SLOTS - 1);
+
+    for (; b->slots[slot]; slot = (slot + 1) & (BATCH_KEY_SLOTS - 1)) {
+        batch_key_t *k = &b->keys[b->slots[slot] - 1];
+        if (k->hash == h && k->parent == parent && k->len == klen && memcmp(k->name, key, klen) == 0) {
+            return b->slots[slot] - 1;
+        }
+    }
+    if (b->key_count == MAX_BATCH_COLS) return -1;
+
+    batch_key_t *k = &b->keys[b->key_count];
+    k->own_name = (klen >= BATCH_NAME_BYTES - b->names_used);
+    if (k->own_name) {
+        k->name = packr_malloc(klen + 1);
+        if (!k->name) return -1;
+    } else {
+        k->name = b->names + b->names_used;
+        b->names_used += klen + 1;
+    }
+    k->nulls = b->presence[b->key_count];
+    memcpy(k->name, key, klen);
+    k->name[klen] = 0;
+    memset(k->nulls, 0, MAX_BATCH_ROWS); /* missing in the rows before */
+    k->len = klen;
+    k->hash = h;
+    k->parent = parent;
+    k->depth = (parent < 0) ? 0 : b->keys[parent].depth + 1;
+    k->col = -1;
+    b->slots[slot] = (uint8_t)(b->key_count + 1);
+    b->changed = true;
+    return b->key_count++;
+}
+
+/* Gives key a column of the value's type, or widens an INT column to FLOAT and a TIME one to STRING */
+static int schema_type(batch_schema_t *b, batch_key_t *k, col_type_t type) {
+    if (k->col < 0) {
+        void *data = schema_slot(b); /* earlier rows read as the default */
+        if (!data) return -1;
+        b->changed = true;
+
+        packr_column_t *c = &b->cols[b->col_count];
+        memset(c, 0, sizeof(packr_column_t));
+        c->type = type;
+        if (type == COL_TYPE_INT) c->ints = data;
+        else if (type == COL_TYPE_FLOAT) c->floats = data;
+        else if (type == COL_TYPE_STRING) c->strings = data;
+        else if (type == COL_TYPE_BOOL) c->bools = data;
+        else if (type == COL_TYPE_TIME) {
+            c->times = data;
+            for (int j = 0; j < MAX_BATCH_ROWS; j++) c->times[j].format = PACKR_TIME_NONE;
+        }
+        else if (type == COL_TYPE_OBJECT) {
+            /* The key was null in the rows where it was present before */
+            memcpy(data, k->nulls, MAX_BATCH_ROWS);
+            c->bools = data;
+            b->groups++;
+        } else {
+            c->custom_data = data;
+            c->custom_encoder = encode_json_blob;
+        }
+        c->nulls = k->nulls;
+        b->fields[b->col_count] = k->name;
+        b->col_keys[b->col_count] = (int)(k - b->keys);
+        k->col = b->col_count++;
+        return 0;
+    }
+
+    packr_column_t *c = &b->cols[k->col];
+    if (c->type == COL_TYPE_INT && type == COL_TYPE_FLOAT) {
+        double *floats = schema_slot(b);
+        if (!floats) return -1;
+        for (int j = 0; j < MAX_BATCH_ROWS; j++) floats[j] = c->ints[j];
+        schema_unslot(b, c->ints);
+        c->floats = floats;
+        c->type = COL_TYPE_FLOAT;
+        b->changed = true;
+    } else if (c->type == COL_TYPE_TIME && type == COL_TYPE_STRING) {
+        /* Back to text, the rows without a timestamp as the default */
+        char **strings = schema_slot(b);
+        if (!strings) return -1;
+        for (int j = 0; j < MAX_BATCH_ROWS; j++) {
+            if (c->times[j].format == PACKR_TIME_NONE) continue;
+            strings[j] = schema_text(b, PACKR_TIMESTAMP_MAX + 1);
+            if (!strings[j]) {
+                schema_unslot(b, strings);
+                return -1;
+            }
+            strings[j][packr_format_timestamp(strings[j], &c->times[j])] = 0;
+        }
+        schema_unslot(b, c->times);
+        c->strings = strings;
+        c->type = COL_TYPE_STRING;
+        b->changed = true;
+    }
+    return 0;
+}
+
+/* Key k's column can't hold its value in the row (see try_encode_ultra_array) */
+static int schema_conflict(batch_schema_t *b, int k) {
+    b->conflict = k;
+    return 1;
+}
+
+/* Makes key k's column CUSTOM, between batches (its rows are empty). -1 if it is already */
+static int schema_untype(batch_schema_t *b, int k) {
+    batch_key_t *key = &b->keys[k];
+    if (key->col < 0 || b->cols[key->col].type == COL_TYPE_CUSTOM) return -1;
+
+    /* An OBJECT column stays in groups: its keys have columns, no longer in the batch */
+    packr_column_t *c = &b->cols[key->col];
+    memset(c->custom_data, 0, BATCH_SLOT_BYTES);
+    c->type = COL_TYPE_CUSTOM;
+    c->custom_encoder = encode_json_blob;
+    b->changed = true;
+    return 0;
+}
+
+static int schema_fill_fields(jparser_t *p, batch_schema_t *b, int parent, int row, size_t *batch_bytes);
+
+/* Parses the value of key k into row. Returns -1 if the row can't be batched, 1 on a conflict (schema_conflict) */
+static int schema_fill(jparser_t *p, batch_schema_t *b, int k, int row, size_t *batch_bytes) {
+    batch_key_t *key = &b->keys[k];
+    packr_column_t *c;
+    char *val = NULL; size_t vlen = 0;
+
+    /* Present, even if null (decoded as the column default) */
+    key->nulls[row] = 1;
 
-/* Helper to skip any JSON value */
-static void skip_json_value(jparser_t *p) {
-    char *s; size_t sl;
     jtoken_type_t t = peek_token(p);
+    if (key->col >= 0 && b->cols[key->col].type == COL_TYPE_CUSTOM) {
+        c = &b->cols[key->col];
+        if (t == J_NULL) {
+            next_token(p, &val, &vlen);
+            return 0;
+        }
+        size_t blob_len = 0;
+        packr_free(c->custom_data[row]);
+        c->custom_data[row] = consume_json_value(p, &blob_len);
+        *batch_bytes += blob_len;
+        return c->custom_data[row] ? 0 : -1;
+    }
+    if (t == J_OBJECT_START && b->flatten && key->depth < MAX_BATCH_DEPTH &&
+        (key->col < 0 || b->cols[key->col].type == COL_TYPE_OBJECT)) {
+        /* Flattened: its fields are columns of the group */
+        if (schema_type(b, key, COL_TYPE_OBJECT) != 0) return -1;
+        b->cols[key->col].bools[row] = 0;
+        return schema_fill_fields(p, b, k, row, batch_bytes);
+    }
     if (t == J_OBJECT_START || t == J_ARRAY_START) {
-        skip_json_compound(p);
+        if (key->col >= 0) return schema_conflict(b, k); /* A scalar or OBJECT column */
+        if (schema_type(b, key, COL_TYPE_CUSTOM) != 0) return -1;
+        c = &b->cols[key->col];
+
+        size_t blob_len = 0;
+        c->custom_data[row] = consume_json_object(p, &blob_len);
+        *batch_bytes += blob_len;
+        return c->custom_data[row] ? 0 : -1;
+    }
+
+    t = next_token(p, &val, &vlen);
+    col_type_t type = COL_TYPE_NULL;
+    int32_t ival = 0;
+    double dval = 0;
+    packr_timestamp_t ts;
+    if (t == J_NUMBER) {
+        type = (packr_parse_number(val, vlen, &ival, &dval) == PACKR_NUMBER_INT) ? COL_TYPE_INT : COL_TYPE_FLOAT;
+    } else if (t == J_STRING) {
+        type = COL_TYPE_STRING;
+        /* A timestamp keeps a column of them, or starts one */
+        if ((key->col < 0 || b->cols[key->col].type == COL_TYPE_TIME) &&
+            packr_parse_timestamp(val, vlen, &ts) == 0) {
+            type = COL_TYPE_TIME;
+        }
+    } else if (t == J_TRUE || t == J_FALSE) {
+        type = COL_TYPE_BOOL;
+    } else if (t != J_NULL) {
+        return -1;
+    }
+
+    if (type == COL_TYPE_NULL) {
+        if (key->col < 0) return 0;
+        c = &b->cols[key->col];
+        if (c->type == COL_TYPE_OBJECT) {
+            c->bools[row] = 1;
+            return 0;
+        }
+        /* Top level keys read as the default, nested ones stay null as in the CUSTOM value they were */
+        return (key->parent < 0) ? 0 : schema_conflict(b, k);
+    }
+    if (key->col < 0 && key->parent >= 0 && memchr(key->nulls, 1, (size_t)row)) {
+        return schema_conflict(b, k); /* the rows before had it null */
+    }
+    if (schema_type(b, key, type) != 0) return -1;
+    c = &b->cols[key->col];
+
+    if (c->type == COL_TYPE_STRING && type == COL_TYPE_STRING) {
+        char *sv = schema_text(b, vlen + 1);
+        if (!sv) return -1;
+        if (val) memcpy(sv, val, vlen);
+        sv[vlen] = 0;
+        c->strings[row] = sv;
+        *batch_bytes += vlen;
+    } else if (c->type == COL_TYPE_TIME && type == COL_TYPE_TIME) {
+        c->times[row] = ts;
+        *batch_bytes += vlen;
+    } else if (c->type == COL_TYPE_INT && type == COL_TYPE_INT) {
+        c->ints[row] = ival;
+    } else if (c->type == COL_TYPE_FLOAT && t == J_NUMBER) {
+        c->floats[row] = dval;
+    } else if (c->type == COL_TYPE_BOOL && type == COL_TYPE_BOOL) {
+        c->bools[row] = (t == J_TRUE);
     } else {
-        next_token(p, &s, &sl);
+        return schema_conflict(b, k);
     }
+    return 0;
 }
 
-static int try_encode_ultra_array(jparser_t *p, packr_encoder_t *enc) {
-    size_t save = p->pos;
+/* Parses an object's keys and values into row, as keys under parent. Returns as schema_fill */
+static int schema_fill_fields(jparser_t *p, batch_schema_t *b, int parent, int row, size_t *batch_bytes) {
     char *s; size_t sl;
-    if (next_token(p, &s, &sl) != J_ARRAY_START) return 1; // Soft fail
-    
-    // 2. Check if empty
-    jtoken_type_t t = peek_token(p);
-    if (t == J_ARRAY_END) return 1; 
-    if (t != J_OBJECT_START) return 1;
-    
-    // 3. Schema Discovery (Union of all keys in batch)
-    char *fields[MAX_BATCH_COLS];
-    col_type_t types[MAX_BATCH_COLS];
-    int col_count = 0;
-    
-    size_t scan_pos = p->pos; // Start scanning from first object
-    int scan_rows = 0;
-    
-    // Save parser state
-    jparser_t scan_p = *p;
-    
-    while (scan_rows < MAX_BATCH_ROWS) {
-        t = peek_token(&scan_p);
-        if (t == J_ARRAY_END) break;
-        if (t == J_COMMA) next_token(&scan_p, &s, &sl);
-        
-        if (next_token(&scan_p, &s, &sl) != J_OBJECT_START) break;
-        
-        while (1) {
-            char *key; size_t klen;
-            if (next_token(&scan_p, &key, &klen) != J_STRING) break;
-            
-            // Check if key known
-            int found = -1;
-            for(int k=0; k<col_count; k++) {
-                if (strlen(fields[k]) == klen && strncmp(fields[k], key, klen) == 0) {
-                    found = k; break;
-                }
-            }
-            
-            if (next_token(&scan_p, &s, &sl) != J_COLON) break;
-            
-            // Peek value type
-            t = peek_token(&scan_p);
-            char *v; size_t vl;
-            
-            col_type_t new_type = COL_TYPE_NULL;
+    if (next_token(p, &s, &sl) != J_OBJECT_START) return -1;
+    if (peek_token(p) == J_OBJECT_END) {
+        next_token(p, &s, &sl);
+        return 0;
+    }
 
-            if (t == J_OBJECT_START || t == J_ARRAY_START) {
-                new_type = COL_TYPE_CUSTOM;
-                skip_json_compound(&scan_p); // Just scanning, no need to allocate
-            } else {
-                t = next_token(&scan_p, &v, &vl); // Consume scalar
-                
-                if (t == J_NUMBER) {
-                    int is_float = 0;
-                    for(size_t i=0; i<vl; i++) if(v[i]=='.' || v[i]=='e' || v[i]=='E') is_float = 1;
-                    new_type = is_float ? COL_TYPE_FLOAT : COL_TYPE_INT;
-                } else if (t == J_STRING) new_type = COL_TYPE_STRING;
-                else if (t == J_TRUE || t == J_FALSE) new_type = COL_TYPE_BOOL;
-                else if (t == J_NULL) new_type = COL_TYPE_NULL;
-            }
-            
-            if (found == -1 && new_type != COL_TYPE_NULL) {
-                if (col_count < MAX_BATCH_COLS) {
-                    fields[col_count] = packr_malloc(klen + 1);
-                    memcpy(fields[col_count], key, klen);
-                    fields[col_count][klen] = 0;
-                    types[col_count] = new_type;
-                    col_count++;
-                }
-            } else if (found != -1 && new_type != COL_TYPE_NULL) {
-                 if (types[found] == COL_TYPE_INT && new_type == COL_TYPE_FLOAT) {
-                     types[found] = COL_TYPE_FLOAT;
-                 }
-            }
-            
-            t = peek_token(&scan_p);
-            if (t == J_COMMA) next_token(&scan_p, &s, &sl);
-            else if (t == J_OBJECT_END) { next_token(&scan_p, &s, &sl); break; }
-            else break;
-        }
-        scan_rows++;
+    while (1) {
+        char *key; size_t klen;
+        if (next_token(p, &key, &klen) != J_STRING) return -1;
+        if (next_token(p, &s, &sl) != J_COLON) return -1;
+
+        int k = schema_key(b, parent, key, klen);
+        if (k < 0) return schema_conflict(b, -1); /* no room for another key */
+        int ret = schema_fill(p, b, k, row, batch_bytes);
+        if (ret != 0) return ret;
+
+        jtoken_type_t t = peek_token(p);
+        if (t == J_COMMA) next_token(p, &s, &sl);
+        else if (t == J_OBJECT_END) { next_token(p, &s, &sl); return 0; }
+        else return -1;
     }
-    
-    if (col_count == 0 || scan_rows == 0) {
-        for(int i=0; i<col_count; i++) packr_free(fields[i]);
-        return 1;
+}
+
+/*
+ * Copies the columns of keys under parent into group_cols from n on, in
+ * column order, each OBJECT column followed by its group. Keys that were
+ * only null so far follow as null columns for this batch, as the CUSTOM
+ * column a nested object used to be kept them. Returns the end
+ */
+static int schema_group(batch_schema_t *b, int parent, int n, int row_count) {
+    for (int i = 0; i < b->col_count; i++) {
+        if (b->keys[b->col_keys[i]].parent != parent) continue;
+        int at = n++;
+        b->group_fields[at] = b->fields[i];
+        b->group_cols[at] = b->cols[i];
+        if (b->cols[i].type == COL_TYPE_OBJECT) {
+            n = schema_group(b, b->col_keys[i], n, row_count);
+            b->group_cols[at].group = (uint32_t)(n - at - 1);
+        }
     }
-    if (scan_rows < 4) {
-        for(int i=0; i<col_count; i++) packr_free(fields[i]);
-        return 1; // Fallback for small arrays to avoid Ultra Batch overhead/bugs
+    for (int k = 0; k < b->key_count; k++) {
+        batch_key_t *key = &b->keys[k];
+        if (key->parent != parent || key->col >= 0 || !memchr(key->nulls, 1, row_count)) continue;
+        packr_column_t *c = &b->group_cols[n];
+        memset(c, 0, sizeof(packr_column_t));
+        c->type = COL_TYPE_CUSTOM;
+        c->count = (size_t)row_count;
+        c->custom_data = b->no_values;
+        c->custom_encoder = encode_json_blob;
+        c->nulls = key->nulls;
+        b->group_fields[n++] = key->name;
     }
+    return n;
+}
 
-    // 4. Parse Rows using Discovered Schema
-    packr_column_t cols[MAX_BATCH_COLS];
-    for(int i=0; i<col_count; i++) {
-        cols[i].type = types[i];
-        cols[i].count = 0;
-        if (types[i] == COL_TYPE_INT) {
-            cols[i].ints = packr_malloc(sizeof(int32_t) * scan_rows);
-            memset(cols[i].ints, 0, sizeof(int32_t) * scan_rows); // Default 0
+/* Sets the columns to row_count rows and lines them up in batch order (group_cols with groups). Returns how many */
+static int schema_columns(batch_schema_t *b, int row_count) {
+    for (int i = 0; i < b->col_count; i++) b->cols[i].count = (size_t)row_count;
+    return b->groups ? schema_group(b, -1, 0, row_count) : b->col_count;
+}
+
+/* Rows start..start+count-1 of the n batch columns, in view */
+static packr_column_t *schema_view(batch_schema_t *b, int n, int start, int count) {
+    const packr_column_t *cols = b->groups ? b->group_cols : b->cols;
+    for (int i = 0; i < n; i++) packr_column_slice(&b->view[i], &cols[i], (size_t)start, (size_t)count);
+    return b->view;
+}
+
+/*
+ * Cuts rows start..start+count-1 (costing whole as one batch) in two while
+ * that costs less, into b->cuts: where the schema last changed if that is
+ * among them, else in halves. Returns the cost.
+ */
+static size_t schema_cut(packr_encoder_t *enc, batch_schema_t *b, int n, int start, int count, size_t whole) {
+    int half = count / 2;
+    if (b->change_row >= start + BATCH_CUT_ROWS && b->change_row <= start + count - BATCH_CUT_ROWS) {
+        half = b->change_row - start;
+    }
+    if (half >= BATCH_CUT_ROWS && count - half >= BATCH_CUT_ROWS) {
+        /* Nested batches list their fields every time */
+        size_t head = BATCH_HEAD_BYTES + (enc->schemas.depth ? (size_t)n : 0);
+        size_t left = packr_ultra_cost(enc, n, schema_view(b, n, start, half));
+        size_t right = packr_ultra_cost(enc, n, schema_view(b, n, start + half, count - half));
+        if (left != SIZE_MAX && right != SIZE_MAX && left + right + head < whole) {
+            return schema_cut(enc, b, n, start, half, left) + head +
+                   schema_cut(enc, b, n, start + half, count - half, right);
         }
-        else if (types[i] == COL_TYPE_FLOAT) {
-            cols[i].floats = packr_malloc(sizeof(double) * scan_rows);
-            memset(cols[i].floats, 0, sizeof(double) * scan_rows); // Default 0.0
+    }
+    b->cuts[b->cut_count++] = start + count;
+    return whole;
+}
+
+/*
+ * PACKR_BATCH_SMALLEST: cuts the rows so far into shorter batches where
+ * that costs less, as when keys or types change, or values change regime,
+ * in the middle of them. Cutting costs slack more bytes (one batch becoming
+ * a stream of them). Returns the batch count.
+ */
+static int schema_split(packr_encoder_t *enc, batch_schema_t *b, int row_count, size_t slack) {
+    b->cut_count = 0;
+    int n = schema_columns(b, row_count);
+    size_t whole = packr_ultra_cost(enc, n, b->groups ? b->group_cols : b->cols);
+    if (whole == SIZE_MAX || schema_cut(enc, b, n, 0, row_count, whole) + slack >= whole) b->cut_count = 0;
+    return b->cut_count ? b->cut_count : 1;
+}
+
+/* Empties rows start..start+count-1 of every key and column */
+static void schema_clear(batch_schema_t *b, int start, int count) {
+    for (int i = 0; i < b->col_count; i++) {
+        packr_column_t *c = &b->cols[i];
+        if (c->type == COL_TYPE_CUSTOM) {
+            for (int j = start; j < start + count; j++) {
+                packr_free(c->custom_data[j]);
+                c->custom_data[j] = NULL;
+            }
+        } else if (c->type == COL_TYPE_STRING) {
+            memset(c->strings + start, 0, sizeof(char*) * count);
+        } else if (c->type == COL_TYPE_INT) {
+            memset(c->ints + start, 0, sizeof(int32_t) * count);
+        } else if (c->type == COL_TYPE_FLOAT) {
+            memset(c->floats + start, 0, sizeof(double) * count);
+        } else if (c->type == COL_TYPE_BOOL || c->type == COL_TYPE_OBJECT) {
+            memset(c->bools + start, 0, count);
+        } else if (c->type == COL_TYPE_TIME) {
+            for (int j = start; j < start + count; j++) c->times[j].format = PACKR_TIME_NONE;
         }
-        else if (types[i] == COL_TYPE_STRING) {
-            cols[i].strings = packr_malloc(sizeof(char*) * scan_rows);
-            memset(cols[i].strings, 0, sizeof(char*) * scan_rows);
-            // Default "" - handled in loop
+        c->count = 0;
+    }
+    for (int k = 0; k < b->key_count; k++) memset(b->keys[k].nulls + start, 0, count);
+}
+
+/* Encodes the rows collected so far (as b->cuts says) and clears them for the next batch */
+static int schema_flush(packr_encoder_t *enc, batch_schema_t *b, int row_count, int partial) {
+    int n = schema_columns(b, row_count);
+    char **fields = b->groups ? b->group_fields : b->fields;
+    int ret = 0;
+    if (b->cut_count > 1) {
+        for (int i = 0, start = 0; i < b->cut_count && ret == 0; start = b->cuts[i++]) {
+            packr_column_t *view = schema_view(b, n, start, b->cuts[i] - start);
+            ret = packr_encode_ultra_columns(enc, b->cuts[i] - start, n, fields, view, 1);
         }
-        else if (types[i] == COL_TYPE_BOOL) {
-            cols[i].bools = packr_malloc(sizeof(uint8_t) * scan_rows);
-            memset(cols[i].bools, 0, sizeof(uint8_t) * scan_rows); // Default False
+    } else {
+        ret = packr_encode_ultra_columns(enc, row_count, n, fields, b->groups ? b->group_cols : b->cols, partial);
+    }
+    b->cut_count = 0;
+
+    schema_clear(b, 0, row_count);
+    schema_text_reset(b);
+    return ret;
+}
+
+/* Drops the array's keys and columns, keeping their memory for the next one */
+static void schema_reset(batch_schema_t *b) {
+    for (int i = 0; i < b->col_count; i++) {
+        packr_column_t *c = &b->cols[i];
+        if (c->type == COL_TYPE_CUSTOM) {
+            for (int j = 0; j < MAX_BATCH_ROWS; j++) packr_free(c->custom_data[j]);
         }
-        else if (types[i] == COL_TYPE_CUSTOM) {
-            cols[i].custom_data = packr_malloc(sizeof(void*) * scan_rows);
-            memset(cols[i].custom_data, 0, sizeof(void*) * scan_rows);
-            cols[i].custom_encoder = encode_json_blob;
+        /* Any union member is the array */
+        schema_unslot(b, c->custom_data);
+    }
+    for (int k = 0; k < b->key_count; k++) {
+        if (b->keys[k].own_name) packr_free(b->keys[k].name);
+    }
+    b->key_count = 0;
+    b->col_count = 0;
+    b->groups = 0;
+    b->names_used = 0;
+    memset(b->slots, 0, sizeof(b->slots));
+    schema_text_reset(b);
+}
+
+static void schema_free(void *json, size_t *alloc_counter) {
+    batch_schema_t *b = json;
+    schema_reset(b);
+    while (b->spare_count) packr_free(b->spare[--b->spare_count]);
+    while (b->text) {
+        batch_text_t *next = b->text->next;
+        packr_free(b->text);
+        b->text = next;
+    }
+    if (alloc_counter) *alloc_counter -= b->bytes;
+    packr_free(b);
+}
+
+/*
+ * The encoder's schema, or a new one while that is taken (an array in a
+ * CUSTOM value of another). *held: the bytes of it already in total_alloc.
+ */
+static batch_schema_t *schema_take(packr_encoder_t *enc, size_t *held) {
+    batch_schema_t *b = enc->columns.json;
+    if (b) {
+        enc->columns.json = NULL;
+        *held = b->bytes;
+        return b;
+    }
+    b = packr_malloc(sizeof(batch_schema_t));
+    if (!b) return NULL;
+    memset(b, 0, sizeof(batch_schema_t));
+    b->bytes = sizeof(batch_schema_t);
+    *held = 0;
+    return b;
+}
+
+/* Hands b back to the encoder for the next array, or frees it if the encoder already has one */
+static void schema_give(packr_encoder_t *enc, batch_schema_t *b, size_t held) {
+    schema_reset(b);
+    enc->total_alloc += b->bytes - held;
+    if (enc->columns.json) {
+        schema_free(b, &enc->total_alloc);
+        return;
+    }
+    enc->columns.json = b;
+    enc->columns.json_free = schema_free;
+}
+
+/* Are there at least n more objects in the array? (does not move p) */
+static int objects_ahead(const jparser_t *p, int n) {
+    jparser_t ahead = *p;
+    char *s; size_t sl;
+    while (n > 0) {
+        jtoken_type_t t = peek_token(&ahead);
+        if (t == J_COMMA) {
+            next_token(&ahead, &s, &sl);
+            t = peek_token(&ahead);
         }
-        cols[i].nulls = packr_malloc(scan_rows);
-        memset(cols[i].nulls, 0, scan_rows); // Default Missing
+        if (t != J_OBJECT_START || skip_json_compound(&ahead) == 0) return 0;
+        n--;
     }
-    
+    return 1;
+}
+
+/*
+ * Should the rows so far go as batches rather than one object after
+ * another? Not with fewer than MIN_BATCH_ROWS in the array (more: rows
+ * follow the ones so far). Beyond PACKR_BATCH_FAST, only if they cost less.
+ */
+static int schema_pays(jparser_t *p, packr_encoder_t *enc, batch_schema_t *b, int row_count, int more) {
+    if (b->col_count == 0) return 0;
+    if (row_count < MIN_BATCH_ROWS && !(more && objects_ahead(p, MIN_BATCH_ROWS - row_count))) return 0;
+    if (enc->batch_effort == PACKR_BATCH_FAST || row_count < 2) return 1;
+    int n = schema_columns(b, row_count);
+    const packr_column_t *cols = b->groups ? b->group_cols : b->cols;
+    size_t cost = packr_ultra_cost(enc, n, cols);
+    return cost != SIZE_MAX && BATCH_HEAD_BYTES + cost < packr_ultra_row_cost(row_count, n, cols);
+}
+
+/*
+ * Encodes an array of objects as column batches in a single pass: rows are
+ * parsed straight into the columns, which are created and widened as new
+ * keys and types show up. Returns 1 (nothing written) if the array should
+ * be encoded as a plain array instead, -1 if it failed after output started.
+ */
+static int try_encode_ultra_array(jparser_t *p, packr_encoder_t *enc) {
+    char *s; size_t sl;
+    if (next_token(p, &s, &sl) != J_ARRAY_START) return 1; // Soft fail
+
+    /* Empty, or not an array of objects */
+    jtoken_type_t t = peek_token(p);
+    if (t != J_OBJECT_START) return 1;
+
+    size_t held;
+    batch_schema_t *b = schema_take(enc, &held);
+    if (!b) return 1;
+
     int row_count = 0;
     int success = 1;
     int is_streaming = 0;
-    
-    // Dynamic Flush Tracking
-    size_t current_batch_size = 0;
-    const size_t MAX_BATCH_BYTES = 4096;
-    
-    // Reset parser
-    p->pos = save;
-    next_token(p, &s, &sl); // [
-    
+    int top_level = (p->depth == 0);
+    uint32_t rows_done = 0;
+    size_t batch_bytes = 0;
+    int smallest = (enc->batch_effort == PACKR_BATCH_SMALLEST);
+    int restarts = 0;
+    b->change_row = 0;
+    b->flatten = true;
+
     while (1) {
         t = peek_token(p);
         if (t == J_ARRAY_END) { next_token(p, &s, &sl); break; }
         if (t == J_COMMA) next_token(p, &s, &sl);
-        
-        if (next_token(p, &s, &sl) != J_OBJECT_START) { success = 0; break; }
-        
-        // Init row defaults for Strings (others memset to 0)
-        for(int i=0; i<col_count; i++) {
-            if (cols[i].type == COL_TYPE_STRING) {
-                cols[i].strings[row_count] = NULL; // Use NULL for empty/default
-            }
-        }
-        
-        while (1) {
-            char *key; size_t klen;
-            if (next_token(p, &key, &klen) != J_STRING) { success = 0; break; }
-            
-            // Find column
-            int col_idx = -1;
-            for(int k=0; k<col_count; k++) {
-                if (strlen(fields[k]) == klen && strncmp(fields[k], key, klen) == 0) {
-                    col_idx = k; break;
-                }
-            }
-            
-            if (next_token(p, &s, &sl) != J_COLON) { success = 0; break; }
-            
-            // Parse Value
-            char *val = NULL; size_t vlen = 0;
-            
-            if (col_idx != -1) {
-                packr_column_t *c = &cols[col_idx];
-                
-                // Mark valid
-                c->nulls[row_count] = 1;
-                
-                t = peek_token(p);
-                if (c->type == COL_TYPE_CUSTOM) {
-                     if (t == J_OBJECT_START || t == J_ARRAY_START) {
-                         packr_free(c->custom_data[row_count]);
-                         size_t blob_len = 0;
-                         c->custom_data[row_count] = consume_json_object(p, &blob_len);
-                         current_batch_size += blob_len;
-                     } else {
-                         next_token(p, &val, &vlen); // Consume unexpected scalar
-                     }
-                } else if (c->type == COL_TYPE_STRING) {
-                     next_token(p, &val, &vlen);
-                     if (c->strings[row_count]) packr_free(c->strings[row_count]);
-                     char *sv = packr_malloc(vlen + 1);
-                     if (val) memcpy(sv, val, vlen);
-                     sv[vlen]=0;
-                     c->strings[row_count] = sv;
-                     current_batch_size += vlen;
-                } else if (c->type == COL_TYPE_INT || c->type == COL_TYPE_FLOAT || c->type == COL_TYPE_BOOL) {
-                     next_token(p, &val, &vlen);
-                     if (c->type == COL_TYPE_INT && t == J_NUMBER && val) {
-                        char tmp[64]; if(vlen>63)vlen=63; memcpy(tmp, val, vlen); tmp[vlen]=0;
-                        c->ints[row_count] = (int32_t)strtol(tmp, NULL, 10);
-                     } else if (c->type == COL_TYPE_FLOAT && t == J_NUMBER && val) {
-                        char tmp[64]; if(vlen>63)vlen=63; memcpy(tmp, val, vlen); tmp[vlen]=0;
-                        c->floats[row_count] = strtod(tmp, NULL);
-                     } else if (c->type == COL_TYPE_BOOL) {
-                        if (t == J_TRUE) c->bools[row_count] = 1;
-                        else if (t == J_FALSE) c->bools[row_count] = 0;
-                     }
+
+        jparser_t row_start = *p;
+        size_t row_bytes = batch_bytes;
+        b->changed = false;
+        int ret = schema_fill_fields(p, b, -1, row_count, &batch_bytes);
+        if (ret < 0) { success = 0; break; }
+        if (ret > 0) {
+            /* The rows before go as a batch, then the row again, into a CUSTOM column if it still conflicts */
+            schema_clear(b, row_count, 1);
+            *p = row_start;
+            batch_bytes = row_bytes;
+            if (row_count == 0) {
+                if (b->conflict >= 0) {
+                    if (schema_untype(b, b->conflict) != 0) { success = 0; break; }
                 } else {
-                    skip_json_value(p);
+                    /* Keys of the rows before fill the schema: start over from this one, then without flattening */
+                    if (++restarts > 2) { success = 0; break; }
+                    b->flatten = b->flatten && restarts == 1;
+                    schema_reset(b);
                 }
-            } else {
-                // Unknown field - skip
-                skip_json_value(p);
+                continue;
             }
-            
-            t = peek_token(p);
-            if (t == J_COMMA) next_token(p, &s, &sl);
-            else if (t == J_OBJECT_END) { next_token(p, &s, &sl); break; }
-            else { success = 0; break; }
-        }
-        
-        if (!success) break;
-        
-        if (success) {
-            // Inc counts
-            for(int i=0; i<col_count; i++) cols[i].count++;
+        } else {
+            restarts = 0;
+            if (b->changed) b->change_row = row_count;
             row_count++;
-            
-            static int total_debug = 0;
-            total_debug++;
-            if (total_debug % 100 == 0) fprintf(stderr, "JSON Row %d\n", total_debug);
-
-            // Flush Check
-            if (row_count >= MAX_BATCH_ROWS || current_batch_size >= MAX_BATCH_BYTES) {
-                if (!is_streaming) {
-                    packr_encode_token(enc, TOKEN_ARRAY_STREAM);
-                    is_streaming = 1;
-                }
-                
-                if (packr_encode_ultra_columns(enc, row_count, col_count, fields, cols, 1) != 0) {
-                    success = 0;
-                    break;
-                }
-                
-                // Reset for next batch
-                for(int i=0; i<col_count; i++) {
-                    if (cols[i].type == COL_TYPE_STRING) {
-                         for(int j=0; j<row_count; j++) {
-                             if (cols[i].strings[j]) packr_free(cols[i].strings[j]);
-                             cols[i].strings[j] = NULL;
-                         }
-                    }
-                    else if (cols[i].type == COL_TYPE_CUSTOM) {
-                         for(int j=0; j<row_count; j++) {
-                             if (cols[i].custom_data[j]) {
-                                 printf("FREE_FLUSH %p\n", cols[i].custom_data[j]);
-                                 packr_free(cols[i].custom_data[j]);
-                             }
-                             cols[i].custom_data[j] = NULL;
-                         }
-                    }
-                    
-                    cols[i].count = 0;
-                    if (cols[i].type == COL_TYPE_INT) memset(cols[i].ints, 0, sizeof(int32_t) * row_count);
-                    else if (cols[i].type == COL_TYPE_FLOAT) memset(cols[i].floats, 0, sizeof(double) * row_count);
-                    else if (cols[i].type == COL_TYPE_BOOL) memset(cols[i].bools, 0, sizeof(uint8_t) * row_count);
-
-                    memset(cols[i].nulls, 0, row_count);
-                }
-                row_count = 0;
-                current_batch_size = 0;
+            if (row_count < MAX_BATCH_ROWS && batch_bytes < MAX_BATCH_BYTES) continue;
+        }
+
+        if (!is_streaming) {
+            /* First flush commits to batches, so check the array qualifies */
+            if (!schema_pays(p, enc, b, row_count, 1)) {
+                success = 0;
+                break;
             }
+            packr_encode_token(enc, TOKEN_ARRAY_STREAM);
+            is_streaming = 1;
         }
+        if (smallest) schema_split(enc, b, row_count, 0);
+        if (top_level) packr_encoder_block_point(enc, rows_done);
+        if (schema_flush(enc, b, row_count, 1) != 0) { success = 0; break; }
+        rows_done += row_count;
+        row_count = 0;
+        batch_bytes = 0;
+        b->change_row = 0;
+    }
+
+    /* Fits in a single batch */
+    if (success && !is_streaming && !schema_pays(p, enc, b, row_count, 0)) success = 0;
+
+    /* Cut into batches, a single one goes as a stream of them */
+    if (success && smallest && row_count > 0 && schema_split(enc, b, row_count, is_streaming ? 0 : 2) > 1 &&
+        !is_streaming) {
+        packr_encode_token(enc, TOKEN_ARRAY_STREAM);
+        is_streaming = 1;
     }
 
     // Flush remaining
     if (success && row_count > 0) {
-        if (is_streaming) {
-             if (packr_encode_ultra_columns(enc, row_count, col_count, fields, cols, 1) != 0) success = 0;
-        } else {
-             // Standard Ultra Batch (Single)
-             if (packr_encode_ultra_columns(enc, row_count, col_count, fields, cols, 0) != 0) success = 0; 
-        }
+        if (is_streaming && top_level) packr_encoder_block_point(enc, rows_done);
+        if (schema_flush(enc, b, row_count, is_streaming) != 0) success = 0;
     }
-    
     if (success && is_streaming) {
         packr_encode_token(enc, TOKEN_ARRAY_END);
     }
-    
-    // Cleanup
-    for(int i=0; i<col_count; i++) {
-        packr_free(fields[i]); 
-        if (cols[i].type == COL_TYPE_STRING) {
-            for(int j=0; j<scan_rows; j++) packr_free(cols[i].strings[j]);
-            packr_free(cols[i].strings);
-        } else if (cols[i].type == COL_TYPE_INT) {
-            packr_free(cols[i].ints);
-        }
-        else if (cols[i].type == COL_TYPE_FLOAT) {
-            packr_free(cols[i].floats);
-        }
-        else if (cols[i].type == COL_TYPE_BOOL) {
-            packr_free(cols[i].bools);
-        }
-        else if (cols[i].type == COL_TYPE_CUSTOM) {
-             printf("CLEANUP_CUSTOM i=%d type=%d rows=%d ptr=%p\n", i, cols[i].type, scan_rows, cols[i].custom_data);
-             for(int j=0; j<scan_rows; j++) {
-                 if (cols[i].custom_data[j]) {
-                     printf("FREE_CLEANUP %p\n", cols[i].custom_data[j]);
-                     packr_free(cols[i].custom_data[j]);
-                 }
-             }
-             packr_free(cols[i].custom_data);
-        }
-        packr_free(cols[i].nulls);
-    }
-    
+
+    schema_give(enc, b, held);
+
     if (success) return 0;
-    
     if (is_streaming) return -1; // Fatal error, cannot rewind
     return 1; // Soft error, fallback valid
 }
@@ -552,13 +978,9 @@ static int try_encode_ultra_array(jparser_t *p, packr_encoder_t *enc) {
 static int encode_array(jparser_t *p, packr_encoder_t *enc) {
     size_t save = p->pos;
     int ret = try_encode_ultra_array(p, enc);
-    if (ret == 0) {
-        fprintf(stderr, "PACKR: Successfully encoded using Ultra Batch Streaming\n");
-        return 0;
-    }
+    if (ret == 0) return 0;
     if (ret == -1) return -1; // Fatal error
-    
-    fprintf(stderr, "PACKR: Ultra Batch failed (ret=%d), falling back to Recursive Array\n", ret);
+
     p->pos = save; // Fallback
     
     /* Count elements */
@@ -611,8 +1033,13 @@ static int encode_array(jparser_t *p, packr_encoder_t *enc) {
     if (t == J_ARRAY_END) {
         next_token(p, &d1, &d2);
     } else {
+        uint32_t index = 0;
         while (1) {
-            if (encode_value(p, enc) != 0) return -1;
+            if (p->depth == 0) packr_encoder_block_point(enc, index++);
+            p->depth++;
+            int ret = encode_value(p, enc);
+            p->depth--;
+            if (ret != 0) return -1;
             
             t = peek_token(p);
             if (t == J_COMMA) {
@@ -660,26 +1087,13 @@ static int encode_value(jparser_t *p, packr_encoder_t *enc) {
             mac[17] = 0;
             return packr_encode_mac(enc, mac);
         }
-        return packr_encode_string(enc, start, len);
+        return packr_encode_typed(enc, start, len);
     }
     else if (t == J_NUMBER) {
-        /* Check float */
-        int is_float = 0;
-        for (size_t i=0; i<len; i++) if (start[i]=='.' || start[i]=='e' || start[i]=='E') is_float = 1;
-
-        /* strtod/strtol need null-terminated input */
-        char buf[64];
-        if (len >= 64) len = 63;
-        memcpy(buf, start, len);
-        buf[len] = 0;
-
-        if (is_float) {
-            double v = strtod(buf, NULL);
-            return packr_encode_double(enc, v);
-        } else {
-            int32_t v = (int32_t)strtol(buf, NULL, 10);
-            return packr_encode_int(enc, v);
-        }
+        int32_t i;
+        double d;
+        if (packr_parse_number(start, len, &i, &d) == PACKR_NUMBER_FLOAT) return packr_encode_double(enc, d);
+        return packr_encode_int(enc, i);
     }
     else if (t == J_TRUE) return packr_encode_bool(enc, 1);
     else if (t == J_FALSE) return packr_encode_bool(enc, 0);
@@ -689,6 +1103,48 @@ static int encode_value(jparser_t *p, packr_encoder_t *enc) {
 }
 
 int json_encode_to_packr(const char *json, size_t len, packr_encoder_t *enc) {
-    jparser_t p = {json, len, 0};
+    jparser_t p = {json, len, 0, 0};
     return encode_value(&p, enc);
 }
+
+/* Top-level array record scanner */
+
+int json_array_begin(json_array_iter_t *it, const char *json, size_t len) {
+    jparser_t p = {json, len, 0, 0};
+    char *s; size_t sl;
+    it->json = json;
+    it->len = len;
+    it->pos = 0;
+    it->done = 0;
+    if (next_token(&p, &s, &sl) != J_ARRAY_START) return -1;
+    if (peek_token(&p) == J_ARRAY_END) {
+        next_token(&p, &s, &sl);
+        it->done = 1;
+    }
+    it->pos = p.pos;
+    return 0;
+}
+
+int json_array_next(json_array_iter_t *it, size_t *start, size_t *rec_len) {
+    if (it->done) return 0;
+    jparser_t p = {it->json, it->len, it->pos, 0};
+    char *s; size_t sl;
+
+    skip_whitespace(&p);
+    *start = p.pos;
+    jtoken_type_t t = peek_token(&p);
+    if (t == J_OBJECT_START || t == J_ARRAY_START) {
+        if (skip_json_compound(&p) == 0) return -1;
+    } else if (t == J_STRING || t == J_NUMBER || t == J_TRUE || t == J_FALSE || t == J_NULL) {
+        next_token(&p, &s, &sl);
+    } else {
+        return -1;
+    }
+    *rec_len = p.pos - *start;
+
+    t = next_token(&p, &s, &sl);
+    if (t == J_ARRAY_END) it->done = 1;
+    else if (t != J_COMMA) return -1;
+    it->pos = p.pos;
+    return 1;
+}
@@ -25,6 +25,131 @@ static void out_bytes(uint8_t **out, uint8_t *end, const uint8_t *data, size_t l
     }
 }
 
+/* Decompressed size, walking the sequences when the stream didn't know it up front */
+size_t packr_lz77_decompressed_size(const uint8_t *in, size_t in_len) {
+    if (in_len < 5) return 0;
+    uint32_t orig_len = in[1] | (in[2] << 8) | (in[3] << 16) | (in[4] << 24);
+    if (in[0] != 0x02 || orig_len != LZ77_LEN_STREAMED) return orig_len;
+    
+    size_t ip = 5;
+    size_t total = 0;
+    while (ip < in_len) {
+        uint8_t ctrl = in[ip++];
+        uint32_t lit_len = ctrl >> 4;
+        uint32_t match_len = (ctrl & 0x0F) + 3;
+        
+        if (lit_len == 15) {
+            while (ip < in_len) {
+                uint8_t val = in[ip++];
+                lit_len += val;
+                if (val < 255) break;
+            }
+        }
+        if (ip + lit_len > in_len) break;
+        ip += lit_len;
+        total += lit_len;
+        if (ip >= in_len) break;
+        
+        if (match_len == 18) {
+            while (ip < in_len) {
+                uint8_t val = in[ip++];
+                match_len += val;
+                if (val < 255) break;
+            }
+        }
+        if (ip + 2 > in_len) break;
+        if (in[ip] | in[ip+1]) total += match_len;
+        ip += 2;
+    }
+    return total;
+}
+
+/* Stops where packr_lz77_decompress stops, so the bytes after are the next payload's */
+size_t packr_lz77_stream_length(const uint8_t *in, size_t in_len) {
+    if (in_len < 5) return 0;
+    uint32_t orig_len = in[1] | (in[2] << 8) | (in[3] << 16) | (in[4] << 24);
+    if (in[0] == 0x00) return (in_len - 5 >= orig_len) ? 5 + (size_t)orig_len : 0;
+    if (in[0] != 0x02) return 0;
+    if (orig_len == LZ77_LEN_STREAMED) return in_len;
+    
+    size_t ip = 5;
+    size_t total = 0;
+    while (total < orig_len) {
+        if (ip >= in_len) return 0;
+        uint8_t ctrl = in[ip++];
+        uint32_t lit_len = ctrl >> 4;
+        uint32_t match_len = (ctrl & 0x0F) + 3;
+        
+        if (lit_len == 15) {
+            while (ip < in_len) {
+                uint8_t val = in[ip++];
+                lit_len += val;
+                if (val < 255) break;
+            }
+        }
+        if (ip + lit_len > in_len) return 0;
+        ip += lit_len;
+        total += lit_len;
+        if (total >= orig_len) break;
+        
+        if (match_len == 18) {
+            while (ip < in_len) {
+                uint8_t val = in[ip++];
+                match_len += val;
+                if (val < 255) break;
+            }
+        }
+        if (ip + 2 > in_len) return 0;
+        if (in[ip] | in[ip+1]) total += match_len;
+        ip += 2;
+    }
+    return ip;
+}
+
+#if PACKR_STATS
+/* Adds up a payload's sequences the way packr_lz77_decompressed_size walks them */
+void packr_lz77_count(const uint8_t *in, size_t in_len, packr_stats_t *stats) {
+    if (in_len < 5) return;
+    if (in[0] == 0x00) {
+        stats->lz77_literal_bytes += in_len - 5;
+        return;
+    }
+
+    size_t ip = 5;
+    while (ip < in_len) {
+        uint8_t ctrl = in[ip++];
+        uint32_t lit_len = ctrl >> 4;
+        uint32_t match_len = (ctrl & 0x0F) + 3;
+
+        if (lit_len == 15) {
+            while (ip < in_len) {
+                uint8_t val = in[ip++];
+                lit_len += val;
+                if (val < 255) break;
+            }
+        }
+        if (ip + lit_len > in_len) break;
+        ip += lit_len;
+        stats->lz77_literal_bytes += lit_len;
+        if (ip >= in_len) break;
+
+        if (match_len == 18) {
+            while (ip < in_len) {
+                uint8_t val = in[ip++];
+                match_len += val;
+                if (val < 255) break;
+            }
+        }
+        if (ip + 2 > in_len) break;
+        if (in[ip] | in[ip+1]) {
+            stats->lz77_match_bytes += match_len;
+            stats->lz77_matches++;
+        }
+        ip += 2;
+    }
+}
+#endif
+
 size_t packr_lz77_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap) {
     if (in_len < 5) return 0;
     
@@ -41,7 +166,11 @@ size_t packr_lz77_decompress(const uint8_t *in, size_t in_len, uint8_t *out, siz
     if (fmt != 0x02) return 0; // Unknown
     
     uint32_t orig_len = in[1] | (in[2] << 8) | (in[3] << 16) | (in[4] << 24);
-    if (orig_len > out_cap) return 0; // Output too small
+    if (orig_len == LZ77_LEN_STREAMED) {
+        orig_len = (out_cap < LZ77_LEN_STREAMED) ? (uint32_t)out_cap : LZ77_LEN_STREAMED - 1;
+    } else if (orig_len > out_cap) {
+        return 0; // Output too small
+    }
     
     size_t ip = 5;
     size_t op = 0;
@@ -85,6 +214,9 @@ size_t packr_lz77_decompress(const uint8_t *in, size_t in_len, uint8_t *out, siz
         uint16_t offset = in[ip] | (in[ip+1] << 8);
         ip += 2;
         
+        // Offset 0: literal-only sequence (streaming encoder)
+        if (offset == 0) continue;
+        
         // Copy match
         if (offset > op) break; // Invalid offset
         if (op + match_len > out_cap) break;
@@ -99,36 +231,474 @@ size_t packr_lz77_decompress(const uint8_t *in, size_t in_len, uint8_t *out, siz
     return op;
 }
 
-// 4-byte hash
-#define HASH_MASK 0xFFF // 4096 entries
-#define WINDOW_SIZE 8192
+/* Streaming Decompressor */
 
-typedef struct {
-    uint32_t head[4096];        // 16KB - absolute positions, 0 = empty
-    uint16_t prev[WINDOW_SIZE]; // 16KB - chain links within window
-} lz77_hash_t;                  // 32KB total
+enum {
+    DS_HEADER,
+    DS_STORED,
+    DS_CTRL,
+    DS_LIT_EXT,
+    DS_LIT,
+    DS_MATCH_EXT,
+    DS_OFF_LO,
+    DS_OFF_HI,
+    DS_MATCH,
+    DS_DONE
+};
+
+#define DS_MASK (PACKR_FEED_WINDOW - 1)
+
+void packr_lz77_dstream_init(packr_lz77_dstream_t *ctx) {
+    memset(ctx, 0, sizeof(packr_lz77_dstream_t));
+    ctx->state = DS_HEADER;
+}
 
+/* Copies literals to out and the history window */
+static size_t ds_literals(packr_lz77_dstream_t *ctx, const uint8_t *in, size_t n, uint8_t *out) {
+    memcpy(out, in, n);
+    for (size_t done = 0; done < n; ) {
+        size_t at = ctx->produced & DS_MASK;
+        size_t run = PACKR_FEED_WINDOW - at;
+        if (run > n - done) run = n - done;
+        memcpy(ctx->window + at, in + done, run);
+        ctx->produced += (uint32_t)run;
+        done += run;
+    }
+    return n;
+}
+
+int packr_lz77_decompress_stream(packr_lz77_dstream_t *ctx, const uint8_t *in, size_t in_len, size_t *in_used,
+                                 uint8_t *out, size_t out_cap, size_t *out_len) {
+    size_t ip = 0, op = 0;
+    
+    while (ctx->state != DS_DONE) {
+        /* Known length: stop there, whatever follows is not ours */
+        if (ctx->limit != LZ77_LEN_STREAMED && ctx->state > DS_HEADER && ctx->produced >= ctx->limit) {
+            ctx->state = DS_DONE;
+            break;
+        }
+        
+        if (ctx->state == DS_MATCH) {
+            if (op >= out_cap) break;
+            uint8_t b = ctx->window[(ctx->produced - ctx->offset) & DS_MASK];
+            ctx->window[ctx->produced & DS_MASK] = b;
+            ctx->produced++;
+            out[op++] = b;
+            if (--ctx->match_len == 0) ctx->state = DS_CTRL;
+            continue;
+        }
+        
+        if (ctx->state == DS_LIT || ctx->state == DS_STORED) {
+            size_t n = ctx->lit_left;
+            if (n > in_len - ip) n = in_len - ip;
+            if (n > out_cap - op) n = out_cap - op;
+            if (ctx->limit != LZ77_LEN_STREAMED && n > ctx->limit - ctx->produced) n = ctx->limit - ctx->produced;
+            if (n == 0 && ctx->lit_left > 0) break;
+            op += ds_literals(ctx, in + ip, n, out + op);
+            ip += n;
+            ctx->lit_left -= (uint32_t)n;
+            if (ctx->lit_left == 0 && ctx->state == DS_LIT) {
+                ctx->match_len = (ctx->ctrl & 0x0F) + 3;
+                ctx->state = ((ctx->ctrl & 0x0F) == 15) ? DS_MATCH_EXT : DS_OFF_LO;
+            }
+            continue;
+        }
+        
+        if (ip >= in_len) break;
+        uint8_t b = in[ip++];
+        
+        switch (ctx->state) {
+        case DS_HEADER:
+            ctx->hdr[ctx->hdr_len++] = b;
+            if (ctx->hdr_len == 5) {
+                ctx->limit = ctx->hdr[1] | (ctx->hdr[2] << 8) | (ctx->hdr[3] << 16) | ((uint32_t)ctx->hdr[4] << 24);
+                if (ctx->hdr[0] == 0x00) {
+                    ctx->lit_left = ctx->limit;
+                    ctx->state = DS_STORED;
+                } else if (ctx->hdr[0] == 0x02) {
+                    ctx->state = DS_CTRL;
+                } else {
+                    return -1; /* Unknown */
+                }
+            }
+            break;
+        case DS_CTRL:
+            ctx->ctrl = b;
+            ctx->lit_left = b >> 4;
+            ctx->state = (ctx->lit_left == 15) ? DS_LIT_EXT : DS_LIT;
+            break;
+        case DS_LIT_EXT:
+            ctx->lit_left += b;
+            if (b < 255) ctx->state = DS_LIT;
+            break;
+        case DS_MATCH_EXT:
+            ctx->match_len += b;
+            if (b < 255) ctx->state = DS_OFF_LO;
+            break;
+        case DS_OFF_LO:
+            ctx->offset = b;
+            ctx->state = DS_OFF_HI;
+            break;
+        case DS_OFF_HI:
+            ctx->offset |= (uint16_t)(b << 8);
+            if (ctx->offset == 0) {
+                /* Literal-only sequence (streaming encoder) */
+                ctx->state = DS_CTRL;
+            } else if (ctx->offset > ctx->produced || ctx->offset > PACKR_FEED_WINDOW) {
+                return -1;
+            } else {
+                ctx->state = DS_MATCH;
+            }
+            break;
+        }
+    }
+    
+    /* Trailing input after a known-length payload is consumed and ignored */
+    if (ctx->state == DS_DONE) ip = in_len;
+    *in_used = ip;
+    *out_len = op;
+    return 0;
+}
+
+/*
+ * Buffered compressor. The effort level sets how many hash chain candidates
+ * are tried and how they are chosen: greedily, one position lazily, or by a
+ * cheapest-path parse over all candidates. Every level writes the same
+ * sequence format, so the decoder doesn't know or care which one was used.
+ */
+
+#define LZ77_MAX_MATCH 258
 #define LZ77_NO_ENTRY 0
 
-// Hash helper: XOR-fold for better distribution across 4096 buckets
-static inline uint32_t lz77_hash4(const uint8_t *p) {
-    uint32_t h = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+typedef struct {
+    int hash_bits;
+    int chain;      // candidates tried per position
+    size_t nice;    // a match this long ends the search
+    int fill;       // hash the positions inside a match
+} lz77_effort_t;
+
+static const lz77_effort_t lz77_efforts[] = {
+    { 12, 1, 32, 0 },               // PACKR_LZ77_FAST
+    { 12, 32, 32, 1 },              // PACKR_LZ77_GREEDY
+    { 15, 64, 128, 1 },             // PACKR_LZ77_LAZY
+    { 16, 128, 64, 1 }              // PACKR_LZ77_OPTIMAL
+};
+
+typedef struct {
+    uint32_t *head;     // absolute positions + 1, 0 = empty
+    uint16_t *prev;     // distance back to the previous position with the same hash, 0 = none
+    uint32_t hash_mask;
+    size_t ring_mask;   // prev is a ring of ring_mask + 1 >= window entries
+    size_t window;
+} lz77_hash_t;
+
+// Hash helper: XOR-fold for better distribution across the buckets
+static inline uint32_t lz77_hash4(const uint8_t *p, uint32_t mask) {
+    uint32_t h = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
     h *= 0x1e35a7bd;
-    return (h ^ (h >> 16)) & HASH_MASK;
+    return (h ^ (h >> 16)) & mask;
+}
+
+static lz77_hash_t *lz77_hash_new(int hash_bits, size_t window) {
+    size_t ring = 1;
+    while (ring < window) ring <<= 1;
+
+    size_t buckets = (size_t)1 << hash_bits;
+    lz77_hash_t *ht = calloc(1, sizeof(lz77_hash_t) + buckets * sizeof(uint32_t) + ring * sizeof(uint16_t));
+    if (!ht) return NULL;
+    ht->head = (uint32_t *)(ht + 1);
+    ht->prev = (uint16_t *)(ht->head + buckets);
+    ht->hash_mask = (uint32_t)(buckets - 1);
+    ht->ring_mask = ring - 1;
+    ht->window = window;
+    return ht;
 }
 
 // Insert position into hash table (positions stored as pos+1, 0=empty)
 static inline void lz77_hash_insert(lz77_hash_t *ht, const uint8_t *in, size_t pos, size_t in_len) {
     if (pos + 3 < in_len) {
-        uint32_t h = lz77_hash4(in + pos);
+        uint32_t h = lz77_hash4(in + pos, ht->hash_mask);
         uint32_t old_head = ht->head[h];
-        ht->prev[pos % WINDOW_SIZE] = (uint16_t)old_head; // truncated for chain
+        size_t dist = old_head ? pos + 1 - old_head : 0;
+        ht->prev[pos & ht->ring_mask] = (dist <= ht->window) ? (uint16_t)dist : 0;
         ht->head[h] = (uint32_t)(pos + 1); // +1 so 0 means empty
     }
 }
 
-size_t packr_lz77_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap) {
+typedef struct {
+    uint16_t len;
+    uint16_t off;
+} lz77_cand_t;
+
+/*
+ * Inserts ip and returns the longest match for it (0 if none of 3+). With
+ * cands set, every candidate that beat the previous best is recorded in
+ * increasing length order and *ncands is their count.
+ */
+static size_t lz77_find(lz77_hash_t *ht, const uint8_t *in, size_t ip, size_t in_len,
+                        const lz77_effort_t *e, size_t *best_off, lz77_cand_t *cands, int *ncands) {
+    size_t best_len = 0;
+    if (ncands) *ncands = 0;
+    if (ip + 3 >= in_len) return 0;
+
+    // Find match - head stores pos+1 (0 = empty)
+    uint32_t stored = ht->head[lz77_hash4(in + ip, ht->hash_mask)];
+    // Insert current position into hash
+    lz77_hash_insert(ht, in, ip, in_len);
+    if (stored == LZ77_NO_ENTRY) return 0;
+
+    size_t max_len = in_len - ip;
+    if (max_len > LZ77_MAX_MATCH) max_len = LZ77_MAX_MATCH;
+
+    size_t curr_match = stored - 1;
+    int chain_len = e->chain;
+    while (chain_len-- > 0) {
+        // Check distance
+        if (ip <= curr_match) break;
+        size_t dist = ip - curr_match;
+        if (dist > ht->window) break;
+
+        // Only a candidate that also matches at best_len can be longer
+        size_t len = 0;
+        if (best_len == 0 || (best_len < max_len && in[curr_match + best_len] == in[ip + best_len])) {
+            len = packr_simd_match_len(in + ip, in + curr_match, max_len);
+        }
+
+        if (len >= 3 && len > best_len) {
+            best_len = len;
+            *best_off = dist;
+            if (cands) {
+                cands[*ncands].len = (uint16_t)len;
+                cands[*ncands].off = (uint16_t)dist;
+                (*ncands)++;
+            }
+            if (len >= e->nice) break; // Sufficient
+        }
+
+        // A link a whole ring back has been overwritten by a newer position
+        if (dist > ht->ring_mask) break;
+        uint16_t link = ht->prev[curr_match & ht->ring_mask];
+        if (link == 0) break;
+        curr_match -= link;
+    }
+    return best_len;
+}
+
+static void lz77_put_len(uint8_t **op, uint8_t *op_end, size_t rem) {
+    while (rem >= 255) {
+        out_byte(op, op_end, 255);
+        rem -= 255;
+    }
+    out_byte(op, op_end, (uint8_t)rem);
+}
+
+// One sequence: lit_len literals, then a match (match_len 0 = final literals, no match)
+static void lz77_put_sequence(uint8_t **op, uint8_t *op_end, const uint8_t *lit, size_t lit_len,
+                              size_t match_len, size_t off) {
+    uint8_t lit_nib = (lit_len >= 15) ? 15 : lit_len;
+    uint8_t match_nib = 0;
+    if (match_len) match_nib = (match_len - 3 >= 15) ? 15 : (match_len - 3);
+
+    out_byte(op, op_end, (lit_nib << 4) | match_nib);
+    if (lit_nib == 15) lz77_put_len(op, op_end, lit_len - 15);
+    out_bytes(op, op_end, lit, lit_len);
+    if (!match_len) return;
+
+    if (match_nib == 15) lz77_put_len(op, op_end, match_len - 18);
+    if (*op + 2 <= op_end) {
+        *(*op)++ = off & 0xFF;
+        *(*op)++ = (off >> 8) & 0xFF;
+    }
+}
+
+// Greedy and lazy parsing. Returns the anchor of the trailing literals
+static size_t lz77_parse_greedy(lz77_hash_t *ht, const uint8_t *in, size_t in_len, const lz77_effort_t *e,
+                                int lazy, uint8_t **op, uint8_t *op_end) {
+    size_t ip = 0;
+    size_t anchor = 0;
+    // Lazy mode holds a match back one position to see if the next one is longer
+    size_t held_len = 0, held_off = 0, held_ip = 0;
+
+    while (ip < in_len) {
+        size_t best_off = 0;
+        size_t best_len = lz77_find(ht, in, ip, in_len, e, &best_off, NULL, NULL);
+
+        if (held_len) {
+            if (best_len > held_len) {
+                // The held position becomes a literal
+                held_len = best_len;
+                held_off = best_off;
+                held_ip = ip++;
+                continue;
+            }
+            // ip is already hashed, the rest of the held match isn't
+            lz77_put_sequence(op, op_end, in + anchor, held_ip - anchor, held_len, held_off);
+            for (size_t j = ip + 1; j < held_ip + held_len; j++) {
+                lz77_hash_insert(ht, in, j, in_len);
+            }
+            ip = anchor = held_ip + held_len;
+            held_len = 0;
+            continue;
+        }
+
+        // Determine if we encode match
+        size_t min_match = (ip - anchor > 0) ? 3 : 4;
+        if (best_len < min_match) {
+            ip++;
+            continue;
+        }
+        if (lazy && best_len < e->nice) {
+            held_len = best_len;
+            held_off = best_off;
+            held_ip = ip++;
+            continue;
+        }
+
+        lz77_put_sequence(op, op_end, in + anchor, ip - anchor, best_len, best_off);
+        // Hash-fill: later matches can reference positions inside this one
+        if (e->fill) {
+            for (size_t j = ip + 1; j < ip + best_len; j++) {
+                lz77_hash_insert(ht, in, j, in_len);
+            }
+        }
+        ip += best_len;
+        anchor = ip;
+    }
+
+    if (held_len) {
+        lz77_put_sequence(op, op_end, in + anchor, held_ip - anchor, held_len, held_off);
+        anchor = held_ip + held_len;
+    }
+    return anchor;
+}
+
+/*
+ * Optimal parsing: a forward cheapest-path search over each block of
+ * OPT_BLOCK positions, pricing literals and matches in output bytes, then
+ * a walk back from the block end to recover the chosen sequences. Matches
+ * don't cross a block end.
+ */
+#define OPT_BLOCK 4096
+#define OPT_ALL_LENGTHS 32 // longer candidates are priced only at full length
+
+typedef struct {
+    uint32_t cost;      // output bytes to reach this position
+    uint32_t lits;      // literal run ending here
+    uint16_t len;       // match ending here, 0 = literal
+    uint16_t off;
+    uint16_t take_len;  // match chosen to start here
+    uint16_t take_off;
+} lz77_opt_node_t;
+
+// Cost of one more literal after a run of lits
+static inline uint32_t lz77_lit_price(uint32_t lits) {
+    uint32_t n = lits + 1;
+    return 1 + (n == 15 || (n > 15 && (n - 15) % 255 == 0));
+}
+
+// Control byte, offset and length extension bytes
+static inline uint32_t lz77_match_price(size_t len) {
+    return 3 + (len >= 18 ? 1 + (uint32_t)((len - 18) / 255) : 0);
+}
+
+static size_t lz77_parse_optimal(lz77_hash_t *ht, const uint8_t *in, size_t in_len, const lz77_effort_t *e,
+                                 lz77_opt_node_t *nodes, uint8_t **op, uint8_t *op_end) {
+    lz77_cand_t cands[LZ77_MAX_MATCH];
+    size_t anchor = 0;
+
+    for (size_t start = 0; start < in_len; ) {
+        size_t n = in_len - start;
+        if (n > OPT_BLOCK) n = OPT_BLOCK;
+
+        for (size_t i = 0; i <= n; i++) {
+            nodes[i].cost = UINT32_MAX;
+            nodes[i].take_len = 0;
+        }
+        nodes[0].cost = 0;
+        nodes[0].lits = (uint32_t)(start - anchor);
+        nodes[0].len = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            lz77_opt_node_t *cur = &nodes[i];
+            uint32_t c = cur->cost + lz77_lit_price(cur->lits);
+            if (c < nodes[i + 1].cost) {
+                nodes[i + 1].cost = c;
+                nodes[i + 1].lits = cur->lits + 1;
+                nodes[i + 1].len = 0;
+            }
+
+            // Every position is searched or filled, so every position is hashed
+            size_t off = 0;
+            int ncands;
+            size_t best = lz77_find(ht, in, start + i, in_len, e, &off, cands, &ncands);
+
+            // A long match is taken as is, repetitive input would be quadratic otherwise
+            if (best >= e->nice && best <= n - i) {
+                c = cur->cost + lz77_match_price(best);
+                if (c < nodes[i + best].cost) {
+                    nodes[i + best].cost = c;
+                    nodes[i + best].lits = 0;
+                    nodes[i + best].len = (uint16_t)best;
+                    nodes[i + best].off = (uint16_t)off;
+                }
+                for (size_t j = 1; j < best; j++) {
+                    lz77_hash_insert(ht, in, start + i + j, in_len);
+                }
+                i += best - 1;
+                continue;
+            }
+
+            size_t tried = 2;
+            for (int k = 0; k < ncands; k++) {
+                size_t len = cands[k].len;
+                if (len > n - i) len = n - i;
+                for (size_t l = tried + 1; l <= len; l++) {
+                    if (l > OPT_ALL_LENGTHS && l != len) l = len;
+                    c = cur->cost + lz77_match_price(l);
+                    if (c < nodes[i + l].cost) {
+                        nodes[i + l].cost = c;
+                        nodes[i + l].lits = 0;
+                        nodes[i + l].len = (uint16_t)l;
+                        nodes[i + l].off = cands[k].off;
+                    }
+                }
+                if (len > tried) tried = len;
+            }
+        }
+
+        for (size_t pos = n; pos > 0; ) {
+            size_t len = nodes[pos].len;
+            if (len) {
+                nodes[pos - len].take_len = (uint16_t)len;
+                nodes[pos - len].take_off = nodes[pos].off;
+                pos -= len;
+            } else {
+                pos--;
+            }
+        }
+
+        for (size_t i = 0; i < n; ) {
+            size_t len = nodes[i].take_len;
+            if (len) {
+                lz77_put_sequence(op, op_end, in + anchor, start + i - anchor, len, nodes[i].take_off);
+                i += len;
+                anchor = start + i;
+            } else {
+                i++;
+            }
+        }
+        start += n;
+    }
+    return anchor;
+}
+
+size_t packr_lz77_compress_ex(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap,
+                              int level, size_t window) {
     if (in_len == 0) return 0;
+    if (level < PACKR_LZ77_FAST || level > PACKR_LZ77_OPTIMAL) level = PACKR_LZ77_DEFAULT;
+    if (window == 0) window = PACKR_LZ77_WINDOW_DEFAULT;
+    if (window > PACKR_LZ77_WINDOW_MAX) window = PACKR_LZ77_WINDOW_MAX;
+    const lz77_effort_t *e = &lz77_efforts[level];
 
     uint8_t *op = out;
     uint8_t *op_end = out + out_cap;
@@ -165,126 +735,26 @@ size_t packr_lz77_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_
         }
     }
 
-    lz77_hash_t *ht = calloc(1, sizeof(lz77_hash_t));
+    lz77_hash_t *ht = lz77_hash_new(e->hash_bits, window);
     if (!ht) return 0;
 
-    size_t ip = 0;
-    size_t anchor = 0;
-
-    while (ip < in_len) {
-        size_t best_len = 0;
-        size_t best_off = 0;
-
-        // Hash check
-        if (ip + 3 < in_len) {
-            uint32_t h = lz77_hash4(in + ip);
-            
-            // Find match - head stores pos+1 (0 = empty)
-            uint32_t stored = ht->head[h];
-            // Insert current position into hash
-            lz77_hash_insert(ht, in, ip, in_len);
-
-            int chain_len = 32;
-            uint32_t chain_val = stored; // pos+1 format
-
-            while (chain_val != 0 && chain_len-- > 0) {
-                size_t curr_match = (size_t)(chain_val - 1);
-                // Check distance
-                if (ip <= curr_match) break;
-                size_t dist = ip - curr_match;
-                if (dist > WINDOW_SIZE) break;
-
-                size_t len = 0;
-                while (ip + len < in_len && in[ip + len] == in[curr_match + len]) {
-                    len++;
-                    if (len >= 258) break; // Cap
-                }
-
-                if (len >= 3 && len > best_len) {
-                    best_len = len;
-                    best_off = dist;
-                    if (len >= 32) break; // Sufficient
-                }
-
-                // Follow chain via prev array (stores pos+1 truncated to 16 bits)
-                chain_val = (uint32_t)ht->prev[curr_match % WINDOW_SIZE];
-            }
-        }
-        
-        // Determine if we encode match
-        int min_match = (ip - anchor > 0) ? 3 : 4;
-        
-        if (best_len >= min_match) {
-            // Flush literals
-            size_t lit_len = ip - anchor;
-            uint8_t lit_nib = (lit_len >= 15) ? 15 : lit_len;
-            uint8_t match_nib = (best_len - 3 >= 15) ? 15 : (best_len - 3);
-            
-            if (op < op_end) *op++ = (lit_nib << 4) | match_nib;
-            
-            // Extended lit len
-            if (lit_nib == 15) {
-                size_t rem = lit_len - 15;
-                while (rem >= 255) {
-                    if (op < op_end) *op++ = 255;
-                    rem -= 255;
-                }
-                if (op < op_end) *op++ = rem;
-            }
-            
-            // Copy literals
-            out_bytes(&op, op_end, in + anchor, lit_len);
-            
-            // Extended match len
-            if (match_nib == 15) {
-                size_t rem = (best_len - 3) - 15;
-                while (rem >= 255) {
-                    if (op < op_end) *op++ = 255;
-                    rem -= 255;
-                }
-                if (op < op_end) *op++ = rem;
-            }
-            
-            // Offset
-            if (op + 2 <= op_end) {
-                *op++ = best_off & 0xFF;
-                *op++ = (best_off >> 8) & 0xFF;
-            }
-
-            // Hash-fill: insert hash entries for all positions within the match
-            // This allows future matches to reference positions inside this match
-            {
-                size_t match_end = ip + best_len;
-                for (size_t j = ip + 1; j < match_end; j++) {
-                    lz77_hash_insert(ht, in, j, in_len);
-                }
-            }
-
-            // Advance
-            ip += best_len;
-            anchor = ip;
-        } else {
-            ip++;
+    size_t anchor;
+    if (level == PACKR_LZ77_OPTIMAL) {
+        lz77_opt_node_t *nodes = malloc((OPT_BLOCK + 1) * sizeof(lz77_opt_node_t));
+        if (!nodes) {
+            free(ht);
+            return 0;
         }
+        anchor = lz77_parse_optimal(ht, in, in_len, e, nodes, &op, op_end);
+        free(nodes);
+    } else {
+        anchor = lz77_parse_greedy(ht, in, in_len, e, level == PACKR_LZ77_LAZY, &op, op_end);
     }
-    
+    free(ht);
+
     // Final literals
-    size_t lit_len = ip - anchor;
-    if (lit_len > 0) {
-        uint8_t lit_nib = (lit_len >= 15) ? 15 : lit_len;
-        if (op < op_end) *op++ = (lit_nib << 4);
-        
-        if (lit_nib == 15) {
-            size_t rem = lit_len - 15;
-            while (rem >= 255) {
-                if (op < op_end) *op++ = 255;
-                rem -= 255;
-            }
-            if (op < op_end) *op++ = rem;
-        }
-        out_bytes(&op, op_end, in + anchor, lit_len);
-    }
-    
+    if (in_len > anchor) lz77_put_sequence(&op, op_end, in + anchor, in_len - anchor, 0, 0);
+
     // Check expansion
     size_t out_len = op - out;
     if (out_len >= in_len) {
@@ -296,38 +766,102 @@ size_t packr_lz77_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_
             out[3] = (in_len >> 16) & 0xFF;
             out[4] = (in_len >> 24) & 0xFF;
             memcpy(out + 5, in, in_len);
-            free(ht);
             return in_len + 5;
         }
     }
-    
-    free(ht);
+
     return out_len;
 }
 
-#define STREAM_WINDOW_SIZE 4096
+size_t packr_lz77_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap) {
+    return packr_lz77_compress_ex(in, in_len, out, out_cap, PACKR_LZ77_DEFAULT, PACKR_LZ77_WINDOW_DEFAULT);
+}
+
+/*
+ * Streaming compressor. The window is a ring of LZ77_BUFFER_SIZE bytes and
+ * every position is absolute (byte p lives at p % LZ77_BUFFER_SIZE), so
+ * nothing is ever moved or rebased: a hash entry is simply ignored once it
+ * is more than max_dist back. Positions are 32-bit and wrap after 4 GB;
+ * distances are taken modulo 2^32 and candidates are checked byte by byte,
+ * so a stale entry can only ever cost a probe.
+ */
+
+#define STREAM_RING_MASK (LZ77_BUFFER_SIZE - 1)
 #define STREAM_HASH_MASK 0x7FF // 2048 entries
+#define STREAM_MAX_MATCH 258
+
 typedef struct {
-    uint16_t head[2048];
-    uint16_t prev[STREAM_WINDOW_SIZE];
+    uint32_t head[2048];    // absolute position + 1, 0 = empty
 } lz77_stream_hash_t;
 
+void packr_lz77_hash_pool_init(packr_lz77_hash_pool_t *pool, size_t max_idle) {
+    memset(pool, 0, sizeof(packr_lz77_hash_pool_t));
+    pool->max_idle = max_idle;
+    pool->table_size = sizeof(lz77_stream_hash_t);
+}
+
+void packr_lz77_hash_pool_destroy(packr_lz77_hash_pool_t *pool) {
+    while (pool->free_list) {
+        void *next = *(void**)pool->free_list;
+        packr_free(pool->free_list);
+        pool->free_list = next;
+    }
+    pool->idle = 0;
+}
+
+/* An empty hash table, recycled from the pool when there is one */
+static lz77_stream_hash_t *stream_hash_take(packr_lz77_hash_pool_t *pool) {
+    void *ht;
+    if (pool && pool->free_list) {
+        ht = pool->free_list;
+        pool->free_list = *(void**)ht;
+        pool->idle--;
+    } else {
+        ht = packr_malloc(sizeof(lz77_stream_hash_t));
+        if (!ht) return NULL;
+    }
+    if (pool) pool->in_use++;
+    memset(ht, 0, sizeof(lz77_stream_hash_t));
+    return (lz77_stream_hash_t*)ht;
+}
+
+static void stream_hash_give(packr_lz77_hash_pool_t *pool, void *ht) {
+    if (!pool) {
+        packr_free(ht);
+        return;
+    }
+    pool->in_use--;
+    if (pool->max_idle && pool->idle >= pool->max_idle) {
+        packr_free(ht);
+        return;
+    }
+    *(void**)ht = pool->free_list;
+    pool->free_list = ht;
+    pool->idle++;
+}
+
 void packr_lz77_init(packr_lz77_stream_t *ctx) {
     memset(ctx, 0, sizeof(packr_lz77_stream_t));
-    ctx->ht = packr_malloc(sizeof(lz77_stream_hash_t));
-    if (ctx->ht) memset(ctx->ht, 0, sizeof(lz77_stream_hash_t));
+    ctx->max_dist = LZ77_WINDOW_SIZE;
+}
+
+int packr_lz77_set_window(packr_lz77_stream_t *ctx, size_t window) {
+    if (window == 0) window = LZ77_WINDOW_SIZE;
+    // Offsets are 16-bit whatever the ring size
+    if (window > LZ77_STREAM_WINDOW_MAX || window > 0xFFFF) return -1;
+    ctx->max_dist = (uint32_t)window;
+    return 0;
 }
 
 void packr_lz77_destroy(packr_lz77_stream_t *ctx) {
     if (ctx->ht) {
-        packr_free(ctx->ht);
+        stream_hash_give(ctx->hash_pool, ctx->ht);
         ctx->ht = NULL;
     }
 }
 
 static int flush_out(packr_lz77_stream_t *ctx, packr_flush_func flush_cb, void *user_data, size_t len) {
     if (len == 0) return 0;
-    // fprintf(stderr, "LZ77: Flushing %zu bytes to callback\n", len);
     return flush_cb(user_data, ctx->out_buf, len);
 }
 
@@ -339,230 +873,282 @@ static void emit_literal(packr_lz77_stream_t *ctx, uint8_t b, packr_flush_func f
     }
 }
 
-static void emit_match(packr_lz77_stream_t *ctx, size_t dist, size_t len, packr_flush_func flush_cb, void *user_data, size_t *out_idx) {
-    // Packr Format
-    size_t lit_len = ctx->process_pos - ctx->anchor;
+static void emit_len(packr_lz77_stream_t *ctx, size_t rem, packr_flush_func flush_cb, void *user_data, size_t *out_idx) {
+    while (rem >= 255) {
+        emit_literal(ctx, 255, flush_cb, user_data, out_idx);
+        rem -= 255;
+    }
+    emit_literal(ctx, (uint8_t)rem, flush_cb, user_data, out_idx);
+}
+
+/*
+ * Literals from anchor up to end, then a match. len 0 writes the offset 0
+ * marker instead (literals only, the decoder skips the match).
+ */
+static void emit_sequence(packr_lz77_stream_t *ctx, uint32_t end, size_t dist, size_t len,
+                          packr_flush_func flush_cb, void *user_data, size_t *out_idx) {
+    size_t lit_len = (uint32_t)(end - ctx->anchor);
+    PACKR_STAT(ctx->literal_bytes += lit_len; if (len) { ctx->match_bytes += len; ctx->matches++; });
     uint8_t lit_nib = (lit_len >= 15) ? 15 : lit_len;
-    uint8_t match_nib = (len - 3 >= 15) ? 15 : (len - 3);
-    
+    uint8_t match_nib = 0;
+    if (len) match_nib = (len - 3 >= 15) ? 15 : (len - 3);
+
     emit_literal(ctx, (lit_nib << 4) | match_nib, flush_cb, user_data, out_idx);
-    
-    // Extended lit len
-    if (lit_nib == 15) {
-        size_t rem = lit_len - 15;
-        while (rem >= 255) {
-            emit_literal(ctx, 255, flush_cb, user_data, out_idx);
-            rem -= 255;
-        }
-        emit_literal(ctx, (uint8_t)rem, flush_cb, user_data, out_idx);
-    }
-    
-    // Copy literals from window
-    for (size_t i = 0; i < lit_len; i++) {
-        emit_literal(ctx, ctx->window[ctx->anchor + i], flush_cb, user_data, out_idx);
-    }
-    
-    // Extended match len
-    if (match_nib == 15) {
-        size_t rem = (len - 3) - 15;
-        while (rem >= 255) {
-            emit_literal(ctx, 255, flush_cb, user_data, out_idx);
-            rem -= 255;
+    if (lit_nib == 15) emit_len(ctx, lit_len - 15, flush_cb, user_data, out_idx);
+
+    // Copy literals from the ring, a scratchpad at a time
+    uint32_t at = ctx->anchor & STREAM_RING_MASK;
+    while (lit_len > 0) {
+        size_t n = sizeof(ctx->out_buf) - *out_idx;
+        if (n > lit_len) n = lit_len;
+        if (n > LZ77_BUFFER_SIZE - at) n = LZ77_BUFFER_SIZE - at;
+        memcpy(ctx->out_buf + *out_idx, ctx->window + at, n);
+        *out_idx += n;
+        if (*out_idx >= sizeof(ctx->out_buf)) {
+            flush_out(ctx, flush_cb, user_data, *out_idx);
+            *out_idx = 0;
         }
-        emit_literal(ctx, (uint8_t)rem, flush_cb, user_data, out_idx);
+        at = (at + n) & STREAM_RING_MASK;
+        lit_len -= n;
     }
-    
+    ctx->anchor = end;
+
+    if (len && match_nib == 15) emit_len(ctx, len - 18, flush_cb, user_data, out_idx);
+
     // Offset (Little Endian)
     emit_literal(ctx, dist & 0xFF, flush_cb, user_data, out_idx);
     emit_literal(ctx, (dist >> 8) & 0xFF, flush_cb, user_data, out_idx);
 }
 
-// Internal window update
-static void slide_window(packr_lz77_stream_t *ctx) {
-    lz77_stream_hash_t *ht = (lz77_stream_hash_t*)ctx->ht;
-    
-    // Move upper half to lower half
-    memcpy(ctx->window, ctx->window + STREAM_WINDOW_SIZE, STREAM_WINDOW_SIZE);
-    ctx->window_pos -= STREAM_WINDOW_SIZE;
-    ctx->process_pos -= STREAM_WINDOW_SIZE;
-    ctx->anchor -= STREAM_WINDOW_SIZE;
-    
-    // Adjust Hash
-    if (ht) {
-        for(int i=0; i<2048; i++) {
-             if (ht->head[i] < STREAM_WINDOW_SIZE) ht->head[i] = 0;
-             else ht->head[i] -= STREAM_WINDOW_SIZE;
-        }
-        for(int i=0; i<STREAM_WINDOW_SIZE; i++) {
-             if (ht->prev[i] < STREAM_WINDOW_SIZE) ht->prev[i] = 0;
-             else ht->prev[i] -= STREAM_WINDOW_SIZE;
-        }
+static inline uint32_t stream_hash4(const packr_lz77_stream_t *ctx, uint32_t pos) {
+    const uint8_t *w = ctx->window;
+    uint32_t at = pos & STREAM_RING_MASK;
+    uint32_t h;
+    if (at + 4 <= LZ77_BUFFER_SIZE) {
+        h = w[at] | (w[at + 1] << 8) | (w[at + 2] << 16) | ((uint32_t)w[at + 3] << 24);
+    } else {
+        h = w[at] | (w[(pos + 1) & STREAM_RING_MASK] << 8) | (w[(pos + 2) & STREAM_RING_MASK] << 16) |
+            ((uint32_t)w[(pos + 3) & STREAM_RING_MASK] << 24);
+    }
+    return ((h * 0x1e35a7bd) >> 19) & STREAM_HASH_MASK;
+}
+
+static inline size_t stream_match_len(const packr_lz77_stream_t *ctx, uint32_t cand, uint32_t pos, size_t max_len) {
+    const uint8_t *w = ctx->window;
+    size_t len = 0;
+    // Compared in runs that stop where either side wraps around the ring
+    while (len < max_len) {
+        uint32_t a = (cand + (uint32_t)len) & STREAM_RING_MASK;
+        uint32_t b = (pos + (uint32_t)len) & STREAM_RING_MASK;
+        size_t run = max_len - len;
+        if (run > LZ77_BUFFER_SIZE - a) run = LZ77_BUFFER_SIZE - a;
+        if (run > LZ77_BUFFER_SIZE - b) run = LZ77_BUFFER_SIZE - b;
+        size_t n = packr_simd_match_len(w + b, w + a, run);
+        len += n;
+        if (n < run) break;
     }
+    return len;
+}
+
+/* First positions of the window the hash table should know about */
+static uint32_t stream_history_start(const packr_lz77_stream_t *ctx) {
+    uint32_t hist = ctx->process_pos < ctx->max_dist ? ctx->process_pos : ctx->max_dist;
+    return ctx->process_pos - hist;
 }
 
 int packr_lz77_compress_stream(packr_lz77_stream_t *ctx, const uint8_t *in, size_t in_len, 
                                packr_flush_func flush_cb, void *user_data, int flush) {
     if (!ctx->ht) {
-        fprintf(stderr, "LZ77: Error - Hash table not initialized\n");
-        return -1;
+        ctx->ht = stream_hash_take(ctx->hash_pool);
+        if (!ctx->ht) {
+            fprintf(stderr, "LZ77: Error - Hash table not initialized\n");
+            return -1;
+        }
+        // A resumed stream already has history: index it again
+        lz77_stream_hash_t *fresh = (lz77_stream_hash_t*)ctx->ht;
+        for (uint32_t p = stream_history_start(ctx); p != ctx->process_pos; p++) {
+            if ((uint32_t)(ctx->window_pos - p) >= 4) fresh->head[stream_hash4(ctx, p)] = p + 1;
+        }
     }
     lz77_stream_hash_t *ht = (lz77_stream_hash_t*)ctx->ht;
     
     size_t in_processed = 0;
     size_t out_idx = 0; // Scratchpad index
-    
-    // If we have very little data and no flush, just buffer it
-    if (!flush && (ctx->window_pos + in_len < STREAM_WINDOW_SIZE)) {
-        memcpy(ctx->window + ctx->window_pos, in, in_len);
-        ctx->window_pos += in_len;
-        // fprintf(stderr, "LZ77: Buffered small chunk, new window_pos=%u\n", ctx->window_pos);
-        return 0;
-    }
-
-    size_t loops = 0;
-    while (in_processed < in_len || (flush && ctx->process_pos < ctx->window_pos)) {
-        loops++;
-        if (loops > 20000000) {
-            fprintf(stderr, "LZ77: FATAL Loop! in_proc=%zu/%zu flush=%d w_pos=%u p_pos=%u\n",
-                    in_processed, in_len, flush, ctx->window_pos, ctx->process_pos);
-            return -1;
-        }
-        // 1. Move Data to Window
-        size_t space = sizeof(ctx->window) - ctx->window_pos;
-        
-        // If window is full (or near full), we must slide
-        if (space < 258 && ctx->process_pos >= STREAM_WINDOW_SIZE) {
-             size_t lit_len = ctx->process_pos - ctx->anchor;
-             if (ctx->anchor < STREAM_WINDOW_SIZE) {
-                 if (lit_len > 0) {
-                     uint8_t lit_nib = (lit_len >= 15) ? 15 : lit_len;
-                     uint8_t match_nib = 0; // len=3, but offset=0 triggers skip in custom decoder
-                     
-                     emit_literal(ctx, (lit_nib << 4) | match_nib, flush_cb, user_data, &out_idx);
-                     if (lit_nib == 15) {
-                         size_t rem = lit_len - 15;
-                         while (rem >= 255) { emit_literal(ctx, 255, flush_cb, user_data, &out_idx); rem -= 255; }
-                         emit_literal(ctx, (uint8_t)rem, flush_cb, user_data, &out_idx);
-                     }
-                     // Copy literals
-                     for (size_t i = 0; i < lit_len; i++) {
-                         emit_literal(ctx, ctx->window[ctx->anchor + i], flush_cb, user_data, &out_idx);
-                     }
-                     // Match len dummy
-                     // Offset 0
-                     emit_literal(ctx, 0, flush_cb, user_data, &out_idx);
-                     emit_literal(ctx, 0, flush_cb, user_data, &out_idx);
-                 }
-                 ctx->anchor = ctx->process_pos;
-             }
-        
-             // Now safe to slide
-             slide_window(ctx);
-             space = sizeof(ctx->window) - ctx->window_pos;
+    // Bytes that can be taken in ahead of process_pos without overwriting the match window
+    const uint32_t room = LZ77_BUFFER_SIZE - ctx->max_dist;
+
+    for (;;) {
+        // 1. Literals further back than the window are about to be overwritten
+        if ((uint32_t)(ctx->process_pos - ctx->anchor) > ctx->max_dist) {
+            emit_sequence(ctx, ctx->process_pos, 0, 0, flush_cb, user_data, &out_idx);
         }
 
-        size_t chunk = (in_len - in_processed);
+        // 2. Move data into the ring
+        size_t chunk = in_len - in_processed;
+        size_t space = room - (uint32_t)(ctx->window_pos - ctx->process_pos);
         if (chunk > space) chunk = space;
         if (chunk > 0) {
-            memcpy(ctx->window + ctx->window_pos, in + in_processed, chunk);
-            ctx->window_pos += chunk;
+            size_t at = ctx->window_pos & STREAM_RING_MASK;
+            size_t first = LZ77_BUFFER_SIZE - at;
+            if (first > chunk) first = chunk;
+            memcpy(ctx->window + at, in + in_processed, first);
+            memcpy(ctx->window, in + in_processed + first, chunk - first);
+            ctx->window_pos += (uint32_t)chunk;
             in_processed += chunk;
         }
-        
-        // 2. Compress Loop
-        size_t lookahead_limit = (flush && in_processed == in_len) ? ctx->window_pos : (ctx->window_pos - 3);
-        if (lookahead_limit > sizeof(ctx->window)) lookahead_limit = 0; // underflow protect
-        if (lookahead_limit < ctx->process_pos) lookahead_limit = ctx->process_pos;
-
-        while (ctx->process_pos < lookahead_limit) {
-            uint32_t h = (ctx->window[ctx->process_pos] | (ctx->window[ctx->process_pos+1] << 8) | 
-                         (ctx->window[ctx->process_pos+2] << 16) | (ctx->window[ctx->process_pos+3] << 24));
-            h = (h * 0x1e35a7bd) >> 19; // Tuned for 2048 (11 bits? 32-13=19) -> check mask
-            h &= STREAM_HASH_MASK;
-            
-            size_t match_pos = ht->head[h];
-            ht->prev[ctx->process_pos % STREAM_WINDOW_SIZE] = match_pos; // Store in ring
-            ht->head[h] = ctx->process_pos;
-            
+        int last = flush && in_processed == in_len;
+
+        // 3. Compress. Until the final flush, a full match length is kept in
+        // the lookahead so matches aren't cut short at chunk edges
+        uint32_t ahead = (uint32_t)(ctx->window_pos - ctx->process_pos);
+        uint32_t todo = last ? ahead : (ahead > STREAM_MAX_MATCH ? ahead - STREAM_MAX_MATCH : 0);
+
+        // Locals, so the hash stores can't be taken to alias ctx
+        uint32_t *head = ht->head;
+        const uint32_t window_pos = ctx->window_pos;
+        const uint32_t max_dist = ctx->max_dist;
+        uint32_t pos = ctx->process_pos;
+        const uint32_t stop = pos + todo;
+
+        while (pos != stop) {
+            size_t avail = (uint32_t)(window_pos - pos);
             size_t best_len = 0;
             size_t best_off = 0;
-            
-            // Check match
-            if (match_pos > 0 && ctx->process_pos > match_pos) {
-                 size_t dist = ctx->process_pos - match_pos;
-                 if (dist <= STREAM_WINDOW_SIZE) {
-                      // Check actual match
-                      size_t len = 0;
-                      size_t max_len = ctx->window_pos - ctx->process_pos;
-                      if (max_len > 258) max_len = 258;
-                      
-                      while (len < max_len && ctx->window[match_pos + len] == ctx->window[ctx->process_pos + len]) {
-                          len++;
-                      }
-                      
-                      if (len >= 3) {
-                          best_len = len;
-                          best_off = dist;
-                      }
-                 }
+
+            if (avail >= 4) {
+                uint32_t h = stream_hash4(ctx, pos);
+                uint32_t stored = head[h];
+                head[h] = pos + 1;
+
+                // Lazy validity: anything outside (0, max_dist] is stale
+                uint32_t dist = pos - (stored - 1);
+                if (stored != 0 && dist != 0 && dist <= max_dist) {
+                    size_t max_len = (avail > STREAM_MAX_MATCH) ? STREAM_MAX_MATCH : avail;
+                    size_t len = stream_match_len(ctx, pos - dist, pos, max_len);
+                    if (len >= 3) {
+                        best_len = len;
+                        best_off = dist;
+                    }
+                }
             }
-            
-            if (best_len >= 3) {
-                 emit_match(ctx, best_off, best_len, flush_cb, user_data, &out_idx);
-                 
-                 // Update hashes for matched bytes
-                 for (size_t k = 0; k < best_len; k++) {
-                     if (ctx->process_pos + k + 3 >= ctx->window_pos) break;
-                     uint32_t h2 = (ctx->window[ctx->process_pos+k] | (ctx->window[ctx->process_pos+k+1] << 8) | 
-                                  (ctx->window[ctx->process_pos+k+2] << 16) | (ctx->window[ctx->process_pos+k+3] << 24));
-                     h2 = (h2 * 0x1e35a7bd) >> 19; 
-                     h2 &= STREAM_HASH_MASK;
-                     ht->prev[(ctx->process_pos + k) % STREAM_WINDOW_SIZE] = ht->head[h2]; 
-                     ht->head[h2] = ctx->process_pos + k;
-                 }
-                 
-                 ctx->process_pos += best_len;
-                 ctx->anchor = ctx->process_pos;
-            } else {
-                 ctx->process_pos++;
+
+            if (best_len < 3) {
+                pos++;
+                continue;
             }
+
+            emit_sequence(ctx, pos, best_off, best_len, flush_cb, user_data, &out_idx);
+
+            // Update hashes for matched bytes
+            for (size_t k = 1; k < best_len && k + 4 <= avail; k++) {
+                head[stream_hash4(ctx, pos + (uint32_t)k)] = pos + (uint32_t)k + 1;
+            }
+
+            // A match may run past stop into the lookahead
+            if ((uint32_t)(stop - pos) <= best_len) {
+                pos += (uint32_t)best_len;
+                ctx->anchor = pos;
+                break;
+            }
+            pos += (uint32_t)best_len;
+            ctx->anchor = pos;
         }
-        
-        if (flush && ctx->process_pos < ctx->window_pos) {
-             // Final flush of literals using Offset=0 dummy match
-             size_t lit_len = ctx->process_pos - ctx->anchor;
-             if (lit_len > 0) {
-                 uint8_t lit_nib = (lit_len >= 15) ? 15 : lit_len;
-                 uint8_t match_nib = 0; // len=3
-                 
-                 emit_literal(ctx, (lit_nib << 4) | match_nib, flush_cb, user_data, &out_idx);
-                 
-                 if (lit_nib == 15) {
-                     size_t rem = lit_len - 15;
-                     while (rem >= 255) { emit_literal(ctx, 255, flush_cb, user_data, &out_idx); rem -= 255; }
-                     emit_literal(ctx, (uint8_t)rem, flush_cb, user_data, &out_idx);
-                 }
-                 
-                 for (size_t i = 0; i < lit_len; i++) {
-                     emit_literal(ctx, ctx->window[ctx->anchor + i], flush_cb, user_data, &out_idx);
-                 }
-                 
-                 // Offset 0
-                 emit_literal(ctx, 0, flush_cb, user_data, &out_idx);
-                 emit_literal(ctx, 0, flush_cb, user_data, &out_idx);
-             }
-             ctx->anchor = ctx->process_pos;
-             ctx->process_pos = ctx->window_pos; 
+        ctx->process_pos = pos;
+
+        if (last) {
+            // Final flush of literals using Offset=0 dummy match
+            if (ctx->anchor != ctx->window_pos) {
+                emit_sequence(ctx, ctx->window_pos, 0, 0, flush_cb, user_data, &out_idx);
+            }
+            ctx->process_pos = ctx->window_pos;
         }
-        
+
         if (out_idx > 0) {
             flush_out(ctx, flush_cb, user_data, out_idx);
             out_idx = 0;
         }
-        
-        if (in_processed == in_len && !flush) break; // Wait for more data
-        if (flush && in_processed == in_len && ctx->process_pos >= ctx->window_pos) break; // Done
+
+        if (in_processed == in_len) break; // Done, or wait for more data
     }
     
     return 0;
 }
+
+/* Suspend / Resume */
+
+#define LZ77_STATE_HEAD 24 /* six u32: window, positions, kept bytes, payload length */
+
+size_t packr_lz77_save(const packr_lz77_stream_t *ctx, uint8_t *out, size_t out_cap) {
+    // The match window, plus literals not emitted yet if they reach further back
+    uint32_t start = stream_history_start(ctx);
+    if ((uint32_t)(ctx->process_pos - ctx->anchor) > (uint32_t)(ctx->process_pos - start)) start = ctx->anchor;
+    uint32_t keep = ctx->window_pos - start;
+    if (out_cap < LZ77_STATE_HEAD || keep > LZ77_BUFFER_SIZE) return 0;
+
+    size_t payload = 0;
+    if (keep > 0) {
+        // Ring to one piece, then compressed behind it (room for the stored form, so never cut short)
+        uint8_t *tmp = packr_malloc(2 * (size_t)keep + 5);
+        if (!tmp) return 0;
+        uint32_t at = start & STREAM_RING_MASK;
+        size_t first = LZ77_BUFFER_SIZE - at;
+        if (first > keep) first = keep;
+        memcpy(tmp, ctx->window + at, first);
+        memcpy(tmp + first, ctx->window, keep - first);
+        payload = packr_lz77_compress(tmp, keep, tmp + keep, (size_t)keep + 5);
+        if (payload == 0 || payload > out_cap - LZ77_STATE_HEAD) {
+            packr_free(tmp);
+            return 0;
+        }
+        memcpy(out + LZ77_STATE_HEAD, tmp + keep, payload);
+        packr_free(tmp);
+    }
+
+    packr_store_le32(out, ctx->max_dist);
+    packr_store_le32(out + 4, ctx->window_pos);
+    packr_store_le32(out + 8, ctx->process_pos);
+    packr_store_le32(out + 12, ctx->anchor);
+    packr_store_le32(out + 16, keep);
+    packr_store_le32(out + 20, (uint32_t)payload);
+    return LZ77_STATE_HEAD + payload;
+}
+
+size_t packr_lz77_load(packr_lz77_stream_t *ctx, const uint8_t *in, size_t in_len) {
+    if (in_len < LZ77_STATE_HEAD) return 0;
+    uint32_t max_dist = packr_load_le32(in);
+    uint32_t window_pos = packr_load_le32(in + 4);
+    uint32_t process_pos = packr_load_le32(in + 8);
+    uint32_t anchor = packr_load_le32(in + 12);
+    uint32_t keep = packr_load_le32(in + 16);
+    uint32_t payload = packr_load_le32(in + 20);
+    if (max_dist == 0 || max_dist > LZ77_STREAM_WINDOW_MAX || keep > LZ77_BUFFER_SIZE) return 0;
+    // anchor <= process_pos <= window_pos, all within the kept bytes
+    if ((uint32_t)(window_pos - anchor) > keep || (uint32_t)(window_pos - process_pos) > (uint32_t)(window_pos - anchor)) return 0;
+    if (payload > in_len - LZ77_STATE_HEAD || (keep > 0) != (payload > 0)) return 0;
+
+    packr_lz77_hash_pool_t *pool = ctx->hash_pool;
+    packr_lz77_destroy(ctx);
+    packr_lz77_init(ctx);
+    ctx->hash_pool = pool;
+    ctx->max_dist = max_dist;
+    ctx->window_pos = window_pos;
+    ctx->process_pos = process_pos;
+    ctx->anchor = anchor;
+
+    if (keep > 0) {
+        uint8_t *tmp = packr_malloc(keep);
+        if (!tmp) return 0;
+        if (packr_lz77_decompress(in + LZ77_STATE_HEAD, payload, tmp, keep) != keep) {
+            packr_free(tmp);
+            return 0;
+        }
+        uint32_t start = window_pos - keep;
+        uint32_t at = start & STREAM_RING_MASK;
+        size_t first = LZ77_BUFFER_SIZE - at;
+        if (first > keep) first = keep;
+        memcpy(ctx->window + at, tmp, first);
+        memcpy(ctx->window, tmp + first, keep - first);
+        packr_free(tmp);
+    }
+    return LZ77_STATE_HEAD + payload;
+}
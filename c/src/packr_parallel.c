@@ -0,0 +1,328 @@
+/*
+ * PACKR - Block-Parallel Encoder & Multi-Block Container
+ */
+
+#include "packr_parallel.h"
+#include "packr_json.h"
+#include "packr_platform.h"
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif !defined(PACKR_NO_THREADS)
+#include <pthread.h>
+#endif
+
+/* Output buffer per block starts at 2x its JSON and doubles up to 8x */
+#define BLOCK_CAP_MIN       1024
+#define BLOCK_CAP_GROW_MAX  8
+#define BLOCK_CAP_SLACK     16  /* frame header and CRC */
+
+typedef struct {
+    size_t start;       /* first record offset in json */
+    size_t len;         /* through the end of the last record */
+    uint32_t records;
+    bool wrap;          /* re-wrap the records in [] (false = whole input) */
+
+    uint8_t *frame;
+    size_t frame_len;
+    int status;
+} par_block_t;
+
+typedef struct {
+    const char *json;
+    par_block_t *blocks;
+    size_t block_count;
+    size_t stride;
+    size_t first;
+    bool compress;
+} par_worker_t;
+
+/* Varint */
+static size_t put_varint(uint8_t *out, uint32_t value) {
+    size_t i = 0;
+    while (value > 0x7F) {
+        out[i++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[i++] = value & 0x7F;
+    return i;
+}
+
+static int get_varint(const uint8_t *data, size_t size, size_t *pos, uint32_t *value) {
+    uint32_t res = 0;
+    int shift = 0;
+    while (*pos < size && shift < 35) {
+        uint8_t b = data[(*pos)++];
+        res |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = res;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+/* Block Encoding */
+
+static int encode_block(const char *json, par_block_t *blk, bool compress) {
+    const char *text = json + blk->start;
+    size_t text_len = blk->len;
+    char *wrapped = NULL;
+
+    /* Re-wrap the records as an array so the block decodes on its own */
+    if (blk->wrap) {
+        wrapped = packr_malloc(blk->len + 2);
+        if (!wrapped) return -1;
+        wrapped[0] = '[';
+        memcpy(wrapped + 1, json + blk->start, blk->len);
+        wrapped[blk->len + 1] = ']';
+        text = wrapped;
+        text_len = blk->len + 2;
+    }
+
+    int ret = -1;
+    size_t cap = text_len * 2 + BLOCK_CAP_MIN;
+    size_t cap_max = text_len * BLOCK_CAP_GROW_MAX + BLOCK_CAP_MIN;
+
+    while (ret != 0 && cap <= cap_max) {
+        uint8_t *buf = packr_malloc(cap);
+        if (!buf) break;
+
+        packr_encoder_t enc;
+        packr_encoder_init(&enc, compress, NULL, NULL, buf, cap);
+        ret = json_encode_to_packr(text, text_len, &enc);
+        if (ret == 0 && enc.pos + BLOCK_CAP_SLACK < cap) {
+            blk->frame_len = packr_encoder_finish(&enc, buf);
+            blk->frame = buf;
+        } else {
+            ret = -1;
+            packr_free(buf);
+            cap *= 2;
+        }
+        packr_encoder_destroy(&enc);
+    }
+
+    packr_free(wrapped);
+    return ret;
+}
+
+static void run_worker(par_worker_t *w) {
+    for (size_t i = w->first; i < w->block_count; i += w->stride) {
+        par_block_t *blk = &w->blocks[i];
+        blk->status = encode_block(w->json, blk, w->compress);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI worker_entry(LPVOID arg) { run_worker((par_worker_t*)arg); return 0; }
+#elif !defined(PACKR_NO_THREADS)
+static void *worker_entry(void *arg) { run_worker((par_worker_t*)arg); return NULL; }
+#endif
+
+/* Runs all workers, worker 0 on the calling thread */
+static void run_workers(par_worker_t *workers, int n) {
+#if defined(_WIN32)
+    HANDLE threads[64];
+    int started = 0;
+    for (int t = 1; t < n && t <= 64; t++) {
+        threads[t - 1] = CreateThread(NULL, 0, worker_entry, &workers[t], 0, NULL);
+        if (!threads[t - 1]) break;
+        started++;
+    }
+#elif !defined(PACKR_NO_THREADS)
+    pthread_t threads[64];
+    int started = 0;
+    for (int t = 1; t < n && t <= 64; t++) {
+        if (pthread_create(&threads[t - 1], NULL, worker_entry, &workers[t]) != 0) break;
+        started++;
+    }
+#else
+    int started = 0;
+#endif
+
+    /* Anything we couldn't hand to a thread runs here */
+    run_worker(&workers[0]);
+    for (int t = started + 1; t < n; t++) run_worker(&workers[t]);
+
+#if defined(_WIN32)
+    for (int t = 0; t < started; t++) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+#elif !defined(PACKR_NO_THREADS)
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+#endif
+}
+
+/* Splits the array into blocks of at least target bytes, returns count or 0 on error */
+static size_t split_blocks(const char *json, size_t len, size_t target, par_block_t *blocks, size_t max_blocks) {
+    json_array_iter_t it;
+    size_t count = 0;
+    size_t start, rec_len;
+    int r;
+
+    if (json_array_begin(&it, json, len) != 0) return 0;
+
+    par_block_t *cur = NULL;
+    while ((r = json_array_next(&it, &start, &rec_len)) == 1) {
+        if (!cur) {
+            if (count >= max_blocks) return 0;
+            cur = &blocks[count++];
+            memset(cur, 0, sizeof(par_block_t));
+            cur->start = start;
+            cur->wrap = true;
+        }
+        cur->len = start + rec_len - cur->start;
+        cur->records++;
+        if (cur->len >= target) cur = NULL;
+    }
+    if (r < 0) return 0;
+
+    /* Empty array still gets one (empty) block */
+    if (count == 0) {
+        memset(&blocks[0], 0, sizeof(par_block_t));
+        blocks[0].start = it.pos;
+        blocks[0].wrap = true;
+        count = 1;
+    }
+    return count;
+}
+
+int packr_encode_parallel(const char *json, size_t len, int nthreads, bool compress, size_t block_bytes,
+                          uint8_t *out, size_t out_cap, size_t *out_len) {
+    if (!json || !out || !out_len) return -1;
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > 64) nthreads = 64;
+
+    size_t target = block_bytes ? block_bytes : PACKR_PARALLEL_BLOCK_BYTES;
+    size_t share = len / (size_t)nthreads + 1;
+    if (target > share) target = share;
+
+    /* Every block but the last holds >= target bytes */
+    size_t max_blocks = len / target + 1;
+    par_block_t *blocks = packr_malloc(max_blocks * sizeof(par_block_t));
+    if (!blocks) return -1;
+
+    json_array_iter_t probe;
+    size_t block_count;
+    if (json_array_begin(&probe, json, len) == 0) {
+        block_count = split_blocks(json, len, target, blocks, max_blocks);
+        if (block_count == 0) {
+            packr_free(blocks);
+            return -1;
+        }
+    } else {
+        /* Not an array: one block of the whole value */
+        memset(&blocks[0], 0, sizeof(par_block_t));
+        blocks[0].len = len;
+        blocks[0].records = 1;
+        block_count = 1;
+    }
+
+    int n = nthreads;
+    if ((size_t)n > block_count) n = (int)block_count;
+
+    par_worker_t workers[64];
+    for (int t = 0; t < n; t++) {
+        workers[t].json = json;
+        workers[t].blocks = blocks;
+        workers[t].block_count = block_count;
+        workers[t].stride = (size_t)n;
+        workers[t].first = (size_t)t;
+        workers[t].compress = compress;
+    }
+    run_workers(workers, n);
+
+    /* Assemble: header, index, frames */
+    int ret = 0;
+    size_t pos = 0;
+    uint8_t tmp[10];
+
+    if (out_cap < 5) ret = -1;
+    else {
+        packr_store_le32(out, PACKR_CONTAINER_MAGIC);
+        out[4] = PACKR_CONTAINER_VERSION;
+        pos = 5;
+    }
+
+    for (size_t i = 0; i < block_count && ret == 0; i++) {
+        if (blocks[i].status != 0) ret = -1;
+    }
+
+    if (ret == 0) {
+        size_t l = put_varint(tmp, (uint32_t)block_count);
+        if (pos + l > out_cap) ret = -1;
+        else { memcpy(out + pos, tmp, l); pos += l; }
+    }
+
+    for (size_t i = 0; i < block_count && ret == 0; i++) {
+        size_t l = put_varint(tmp, (uint32_t)blocks[i].frame_len);
+        l += put_varint(tmp + l, blocks[i].records);
+        if (pos + l > out_cap) ret = -1;
+        else { memcpy(out + pos, tmp, l); pos += l; }
+    }
+
+    for (size_t i = 0; i < block_count && ret == 0; i++) {
+        if (pos + blocks[i].frame_len > out_cap) ret = -1;
+        else { memcpy(out + pos, blocks[i].frame, blocks[i].frame_len); pos += blocks[i].frame_len; }
+    }
+
+    for (size_t i = 0; i < block_count; i++) packr_free(blocks[i].frame);
+    packr_free(blocks);
+
+    *out_len = (ret == 0) ? pos : 0;
+    return ret;
+}
+
+/* Container Reader */
+
+int packr_container_open(packr_container_t *c, const uint8_t *data, size_t size) {
+    memset(c, 0, sizeof(packr_container_t));
+    if (!data || size < 6) return -1;
+    if (packr_load_le32(data) != PACKR_CONTAINER_MAGIC) return -1;
+    if (data[4] != PACKR_CONTAINER_VERSION) return -1;
+
+    size_t pos = 5;
+    uint32_t count;
+    if (get_varint(data, size, &pos, &count) != 0) return -1;
+    size_t index_pos = pos;
+
+    /* Validate the index covers the payload */
+    size_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t frame_len, records;
+        if (get_varint(data, size, &pos, &frame_len) != 0) return -1;
+        if (get_varint(data, size, &pos, &records) != 0) return -1;
+        total += frame_len;
+    }
+    if (pos > size || total > size - pos) return -1;
+
+    c->data = data;
+    c->size = size;
+    c->block_count = count;
+    c->index_pos = index_pos;
+    c->data_pos = pos;
+    return 0;
+}
+
+int packr_container_block(const packr_container_t *c, uint32_t index,
+                          const uint8_t **frame, size_t *frame_len, uint32_t *records) {
+    if (!c->data || index >= c->block_count) return -1;
+
+    size_t pos = c->index_pos;
+    size_t offset = c->data_pos;
+    uint32_t len = 0, recs = 0;
+    for (uint32_t i = 0; i <= index; i++) {
+        if (i) offset += len;
+        if (get_varint(c->data, c->size, &pos, &len) != 0) return -1;
+        if (get_varint(c->data, c->size, &pos, &recs) != 0) return -1;
+    }
+
+    if (frame) *frame = c->data + offset;
+    if (frame_len) *frame_len = len;
+    if (records) *records = recs;
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * PACKR - Stream Context Pool
+ */
+
+#include "packr_pool.h"
+#include <string.h>
+
+int packr_pool_init(packr_ctx_pool_t *pool, size_t max_active, bool compress, size_t work_cap,
+                    const packr_primer_t *primer) {
+    memset(pool, 0, sizeof(packr_ctx_pool_t));
+    if (max_active == 0 || work_cap == 0) return -1;
+    pool->engines = packr_malloc(max_active * sizeof(packr_pool_engine_t*));
+    if (!pool->engines) return -1;
+    memset(pool->engines, 0, max_active * sizeof(packr_pool_engine_t*));
+    pool->max_active = max_active;
+    pool->work_cap = work_cap;
+    pool->compress = compress;
+    pool->primer = primer;
+    pool->free_head = PACKR_POOL_NONE;
+    /* Spare tables beyond one per engine would never be taken */
+    packr_lz77_hash_pool_init(&pool->hashes, max_active);
+    return 0;
+}
+
+void packr_pool_destroy(packr_ctx_pool_t *pool) {
+    for (size_t i = 0; i < pool->max_active; i++) {
+        packr_pool_engine_t *e = pool->engines[i];
+        if (!e) continue;
+        if (e->stream != PACKR_POOL_NONE) packr_encoder_destroy(&e->enc);
+        packr_free(e);
+    }
+    for (uint32_t i = 0; i < pool->stream_count; i++) packr_free(pool->streams[i].snap);
+    packr_lz77_hash_pool_destroy(&pool->hashes);
+    packr_free(pool->engines);
+    packr_free(pool->streams);
+    packr_free(pool->scratch);
+    memset(pool, 0, sizeof(packr_ctx_pool_t));
+}
+
+static packr_pool_stream_t *pool_stream(packr_ctx_pool_t *pool, uint32_t id) {
+    if (id >= pool->stream_count || !pool->streams[id].open) return NULL;
+    return &pool->streams[id];
+}
+
+/*
+ * Suspends the live stream on e into a snapshot of its own size and frees e.
+ * Fails (-1) with the stream still live if there is no room to suspend it:
+ * once the encoder is gone the snapshot is all that is left of the stream.
+ */
+static int pool_suspend_engine(packr_ctx_pool_t *pool, packr_pool_engine_t *e) {
+    packr_pool_stream_t *st = &pool->streams[e->stream];
+    size_t bound = packr_encoder_suspend_bound(&e->enc);
+    if (bound == 0) return -1;
+    if (bound > pool->scratch_cap) {
+        uint8_t *scratch = packr_malloc(bound);
+        if (!scratch) return -1;
+        packr_free(pool->scratch);
+        pool->scratch = scratch;
+        pool->scratch_cap = bound;
+    }
+
+    size_t len = packr_encoder_suspend(&e->enc, pool->scratch, pool->scratch_cap);
+    if (len == 0) return -1;
+    st->snap = packr_malloc(len);
+    if (st->snap) {
+        memcpy(st->snap, pool->scratch, len);
+        st->snap_cap = len;
+    } else {
+        /* No room for a copy: the snapshot keeps the scratch buffer */
+        st->snap = pool->scratch;
+        st->snap_cap = pool->scratch_cap;
+        pool->scratch = NULL;
+        pool->scratch_cap = 0;
+    }
+    st->snap_len = len;
+    pool->snap_bytes += st->snap_cap;
+    st->engine = NULL;
+    e->stream = PACKR_POOL_NONE;
+    return 0;
+}
+
+/* A free engine for stream id: an idle one, a new one, or the least recently used one suspended */
+static packr_pool_engine_t *pool_engine(packr_ctx_pool_t *pool, uint32_t id) {
+    packr_pool_engine_t *victim = NULL;
+    size_t empty = pool->max_active;
+    packr_pool_engine_t *e = NULL;
+    for (size_t i = 0; i < pool->max_active && !e; i++) {
+        packr_pool_engine_t *c = pool->engines[i];
+        if (!c) {
+            if (empty == pool->max_active) empty = i;
+        } else if (c->stream == PACKR_POOL_NONE) {
+            e = c;
+        } else if (!victim || c->last_used < victim->last_used) {
+            victim = c;
+        }
+    }
+
+    if (!e && empty < pool->max_active) {
+        e = packr_malloc(sizeof(packr_pool_engine_t) + pool->work_cap);
+        if (!e) return NULL;
+        e->stream = PACKR_POOL_NONE;
+        pool->engines[empty] = e;
+    }
+    if (!e) {
+        if (!victim || pool_suspend_engine(pool, victim) != 0) return NULL;
+        e = victim;
+    }
+    e->stream = id;
+    e->last_used = ++pool->clock;
+    return e;
+}
+
+int packr_pool_open(packr_ctx_pool_t *pool, packr_flush_func flush_cb, void *user_data, uint32_t *id) {
+    if (!flush_cb) return -1;
+    uint32_t sid = pool->free_head;
+    if (sid == PACKR_POOL_NONE) {
+        if (pool->stream_count == pool->stream_cap) {
+            uint32_t cap = pool->stream_cap ? pool->stream_cap * 2 : 64;
+            packr_pool_stream_t *streams = packr_malloc(cap * sizeof(packr_pool_stream_t));
+            if (!streams) return -1;
+            if (pool->stream_count) memcpy(streams, pool->streams, pool->stream_count * sizeof(packr_pool_stream_t));
+            packr_free(pool->streams);
+            pool->streams = streams;
+            pool->stream_cap = cap;
+        }
+        sid = pool->stream_count;
+    }
+
+    packr_pool_engine_t *e = pool_engine(pool, sid);
+    if (!e) return -1;
+    if (sid == pool->free_head) pool->free_head = pool->streams[sid].next_free;
+    else pool->stream_count++;
+
+    packr_pool_stream_t *st = &pool->streams[sid];
+    memset(st, 0, sizeof(packr_pool_stream_t));
+    st->flush_cb = flush_cb;
+    st->user_data = user_data;
+    st->next_free = PACKR_POOL_NONE;
+    st->engine = e;
+    st->open = true;
+
+    packr_encoder_init(&e->enc, pool->compress, flush_cb, user_data, e->work, pool->work_cap);
+    if (pool->compress) packr_encoder_set_hash_pool(&e->enc, &pool->hashes);
+    if (pool->primer) packr_encoder_set_primer(&e->enc, pool->primer);
+    *id = sid;
+    return 0;
+}
+
+packr_encoder_t *packr_pool_acquire(packr_ctx_pool_t *pool, uint32_t id) {
+    packr_pool_stream_t *st = pool_stream(pool, id);
+    if (!st) return NULL;
+    if (st->engine) {
+        st->engine->last_used = ++pool->clock;
+        return &st->engine->enc;
+    }
+
+    packr_pool_engine_t *e = pool_engine(pool, id);
+    if (!e) return NULL;
+    if (packr_encoder_resume(&e->enc, st->snap, st->snap_len, st->flush_cb, st->user_data,
+                             e->work, pool->work_cap, pool->primer) != 0) {
+        e->stream = PACKR_POOL_NONE;
+        return NULL;
+    }
+    if (pool->compress) packr_encoder_set_hash_pool(&e->enc, &pool->hashes);
+    pool->snap_bytes -= st->snap_cap;
+    packr_free(st->snap);
+    st->snap = NULL;
+    st->snap_len = 0;
+    st->snap_cap = 0;
+    st->engine = e;
+    return &e->enc;
+}
+
+int packr_pool_suspend(packr_ctx_pool_t *pool, uint32_t id) {
+    packr_pool_stream_t *st = pool_stream(pool, id);
+    if (!st) return -1;
+    if (!st->engine) return 0;
+    return pool_suspend_engine(pool, st->engine);
+}
+
+int packr_pool_close(packr_ctx_pool_t *pool, uint32_t id) {
+    packr_encoder_t *enc = packr_pool_acquire(pool, id);
+    if (!enc) return -1;
+    packr_pool_stream_t *st = &pool->streams[id];
+    packr_encoder_finish(enc, NULL);
+    packr_encoder_destroy(enc);
+    st->engine->stream = PACKR_POOL_NONE;
+    st->engine = NULL;
+    st->open = false;
+    st->next_free = pool->free_head;
+    pool->free_head = id;
+    return 0;
+}
+
+size_t packr_pool_memory(const packr_ctx_pool_t *pool) {
+    size_t n = pool->max_active * sizeof(packr_pool_engine_t*);
+    for (size_t i = 0; i < pool->max_active; i++) {
+        if (pool->engines[i]) n += sizeof(packr_pool_engine_t) + pool->work_cap;
+    }
+    n += (pool->hashes.idle + pool->hashes.in_use) * pool->hashes.table_size;
+    n += pool->stream_cap * sizeof(packr_pool_stream_t);
+    return n + pool->scratch_cap + pool->snap_bytes;
+}
@@ -0,0 +1,270 @@
+/*
+ * PACKR - JSON Byte Scanning
+ *
+ * Each backend builds a bitmap of the matching bytes in a 16 (or 32) byte
+ * block and jumps to the lowest set bit. The tail shorter than a block is
+ * left to the scalar loop, so nothing is read past len. The backend is
+ * picked once, on first use.
+ */
+
+#include "packr_scan.h"
+#include "packr_platform.h"
+#include <stdint.h>
+
+enum {
+    SCAN_STRING,
+    SCAN_NESTING,
+    SCAN_SPACE
+};
+
+#if PACKR_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if PACKR_SIMD && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if PACKR_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+#define SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+/* Scalar */
+
+static inline int scan_match(unsigned char c, int kind) {
+    switch (kind) {
+    case SCAN_STRING:
+        return c == '"' || c == '\\';
+    case SCAN_NESTING:
+        /* '[' and ']' are '{' and '}' without bit 5 */
+        return c == '"' || (c | 0x20) == '{' || (c | 0x20) == '}';
+    default:
+        /* ' ', '\t', '\n', '\v', '\f', '\r' */
+        return !(c == ' ' || (unsigned)(c - '\t') < 5);
+    }
+}
+
+static inline size_t scalar_find(const char *s, size_t pos, size_t len, int kind) {
+    while (pos < len && !scan_match((unsigned char)s[pos], kind)) pos++;
+    return pos;
+}
+
+static size_t scalar_string(const char *s, size_t pos, size_t len) {
+    return scalar_find(s, pos, len, SCAN_STRING);
+}
+
+static size_t scalar_nesting(const char *s, size_t pos, size_t len) {
+    return scalar_find(s, pos, len, SCAN_NESTING);
+}
+
+static size_t scalar_space(const char *s, size_t pos, size_t len) {
+    return scalar_find(s, pos, len, SCAN_SPACE);
+}
+
+#if SCAN_SSE2 || SCAN_AVX2
+static inline unsigned scan_ctz(uint32_t m) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(m);
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return (unsigned)i;
+#else
+    unsigned n = 0;
+    while (!(m & 1)) { m >>= 1; n++; }
+    return n;
+#endif
+}
+#endif
+
+/* SSE2 (every x86-64) */
+
+#if SCAN_SSE2
+static inline uint32_t sse2_mask(__m128i v, int kind) {
+    __m128i m;
+    if (kind == SCAN_STRING) {
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    } else if (kind == SCAN_NESTING) {
+        __m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                         _mm_or_si128(_mm_cmpeq_epi8(l, _mm_set1_epi8('{')), _mm_cmpeq_epi8(l, _mm_set1_epi8('}'))));
+    } else {
+        /* c - 9 <= 4 unsigned is '\t'..'\r' */
+        __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+        m = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        return (uint32_t)_mm_movemask_epi8(m) ^ 0xFFFFu;
+    }
+    return (uint32_t)_mm_movemask_epi8(m);
+}
+
+static inline size_t sse2_find(const char *s, size_t pos, size_t len, int kind) {
+    while (pos + 16 <= len) {
+        uint32_t m = sse2_mask(_mm_loadu_si128((const __m128i *)(s + pos)), kind);
+        if (m) return pos + scan_ctz(m);
+        pos += 16;
+    }
+    return scalar_find(s, pos, len, kind);
+}
+
+static size_t sse2_string(const char *s, size_t pos, size_t len) {
+    return sse2_find(s, pos, len, SCAN_STRING);
+}
+
+static size_t sse2_nesting(const char *s, size_t pos, size_t len) {
+    return sse2_find(s, pos, len, SCAN_NESTING);
+}
+
+static size_t sse2_space(const char *s, size_t pos, size_t len) {
+    return sse2_find(s, pos, len, SCAN_SPACE);
+}
+#endif
+
+/* AVX2 (built for any x86 GCC/Clang target, used if the CPU has it) */
+
+#if SCAN_AVX2
+#define AVX2_FN __attribute__((target("avx2")))
+
+AVX2_FN static inline uint32_t avx2_mask(__m256i v, int kind) {
+    __m256i m;
+    if (kind == SCAN_STRING) {
+        m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    } else if (kind == SCAN_NESTING) {
+        __m256i l = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(l, _mm256_set1_epi8('{')),
+                                            _mm256_cmpeq_epi8(l, _mm256_set1_epi8('}'))));
+    } else {
+        __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+        m = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        return ~(uint32_t)_mm256_movemask_epi8(m);
+    }
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+AVX2_FN static inline size_t avx2_find(const char *s, size_t pos, size_t len, int kind) {
+    while (pos + 32 <= len) {
+        uint32_t m = avx2_mask(_mm256_loadu_si256((const __m256i *)(s + pos)), kind);
+        if (m) return pos + scan_ctz(m);
+        pos += 32;
+    }
+    return scalar_find(s, pos, len, kind);
+}
+
+AVX2_FN static size_t avx2_string(const char *s, size_t pos, size_t len) {
+    return avx2_find(s, pos, len, SCAN_STRING);
+}
+
+AVX2_FN static size_t avx2_nesting(const char *s, size_t pos, size_t len) {
+    return avx2_find(s, pos, len, SCAN_NESTING);
+}
+
+AVX2_FN static size_t avx2_space(const char *s, size_t pos, size_t len) {
+    return avx2_find(s, pos, len, SCAN_SPACE);
+}
+#endif
+
+/* NEON (AArch64). No movemask, so a hit is located with the scalar loop */
+
+#if SCAN_NEON
+static inline uint8x16_t neon_mask(uint8x16_t v, int kind) {
+    if (kind == SCAN_STRING) {
+        return vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\')));
+    } else if (kind == SCAN_NESTING) {
+        uint8x16_t l = vorrq_u8(v, vdupq_n_u8(0x20));
+        return vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                        vorrq_u8(vceqq_u8(l, vdupq_n_u8('{')), vceqq_u8(l, vdupq_n_u8('}'))));
+    }
+    uint8x16_t ctl = vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4));
+    return vmvnq_u8(vorrq_u8(ctl, vceqq_u8(v, vdupq_n_u8(' '))));
+}
+
+static inline size_t neon_find(const char *s, size_t pos, size_t len, int kind) {
+    while (pos + 16 <= len) {
+        if (vmaxvq_u8(neon_mask(vld1q_u8((const uint8_t *)(s + pos)), kind))) {
+            return scalar_find(s, pos, pos + 16, kind);
+        }
+        pos += 16;
+    }
+    return scalar_find(s, pos, len, kind);
+}
+
+static size_t neon_string(const char *s, size_t pos, size_t len) {
+    return neon_find(s, pos, len, SCAN_STRING);
+}
+
+static size_t neon_nesting(const char *s, size_t pos, size_t len) {
+    return neon_find(s, pos, len, SCAN_NESTING);
+}
+
+static size_t neon_space(const char *s, size_t pos, size_t len) {
+    return neon_find(s, pos, len, SCAN_SPACE);
+}
+#endif
+
+/* Dispatch */
+
+typedef size_t (*scan_fn)(const char *s, size_t pos, size_t len);
+
+typedef struct {
+    const char *name;
+    scan_fn string;
+    scan_fn nesting;
+    scan_fn space;
+} scan_ops_t;
+
+static const scan_ops_t scalar_ops = { "scalar", scalar_string, scalar_nesting, scalar_space };
+#if SCAN_SSE2
+static const scan_ops_t sse2_ops = { "sse2", sse2_string, sse2_nesting, sse2_space };
+#endif
+#if SCAN_AVX2
+static const scan_ops_t avx2_ops = { "avx2", avx2_string, avx2_nesting, avx2_space };
+#endif
+#if SCAN_NEON
+static const scan_ops_t neon_ops = { "neon", neon_string, neon_nesting, neon_space };
+#endif
+
+static const scan_ops_t *scan_ops = NULL;
+
+static const scan_ops_t *scan_get_ops(void) {
+    const scan_ops_t *ops = packr_atomic_load(&scan_ops);
+    if (ops) return ops;
+
+    ops = &scalar_ops;
+#if SCAN_SSE2
+    ops = &sse2_ops;
+#endif
+#if SCAN_AVX2
+    if (__builtin_cpu_supports("avx2")) ops = &avx2_ops;
+#endif
+#if SCAN_NEON
+    ops = &neon_ops;
+#endif
+    /* Racing first calls all store the same table */
+    packr_atomic_store(&scan_ops, ops);
+    return ops;
+}
+
+size_t packr_scan_string(const char *s, size_t pos, size_t len) {
+    return scan_get_ops()->string(s, pos, len);
+}
+
+size_t packr_scan_nesting(const char *s, size_t pos, size_t len) {
+    return scan_get_ops()->nesting(s, pos, len);
+}
+
+size_t packr_scan_space(const char *s, size_t pos, size_t len) {
+    return scan_get_ops()->space(s, pos, len);
+}
+
+const char *packr_scan_backend(void) {
+    return scan_get_ops()->name;
+}
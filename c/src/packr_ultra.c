@@ -3,19 +3,75 @@
  */
 
 #include "packr_ultra.h"
+#include "packr_struct.h"
+#include "packr_format.h"
+#include "packr_bitio.h"
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
 
 #define MIN_RICE_ITEMS 10
+#define RICE_K_MAX 24       /* larger k never pays for 32-bit deltas */
 
-// Rice Encoder Helper
-/* MFV Helper */
-static int encode_mfv_column(packr_encoder_t *ctx, packr_column_t *col);
+/*
+ * Column codings. Under CONST (flags 0x01) one value; under DELTA (0x02)
+ * MFV, or the first value then its deltas as delta tokens, BITPACK or
+ * RICE; under RLE (0x04) MFV or the value runs. TIME columns with a base
+ * (0x20) code their relative ticks as an INT column under DELTA.
+ */
+enum {
+    CODING_CONST,
+    CODING_MFV,
+    CODING_DELTA,
+    CODING_BITPACK,
+    CODING_RICE,
+    CODING_RLE,
+    CODING_TIME,
+    CODING_OTHER        /* OBJECT and CUSTOM, as their flags say */
+};
+
+/* Grows the column scratch work arrays to rows rows. Returns 0 on success */
+static int column_scratch_reserve(packr_encoder_t *ctx, size_t rows) {
+    packr_column_scratch_t *cs = &ctx->columns;
+    if (rows <= cs->rows) return 0;
+    if (rows > (SIZE_MAX - 1024) / (3 * sizeof(int32_t) + 2)) return -1;
+
+    size_t size = rows * 3 * sizeof(int32_t) + PACKR_RICE_BOUND(rows);
+    int32_t *block = packr_malloc(size);
+    if (!block) return -1;
+    if (cs->rows) {
+        ctx->total_alloc -= cs->rows * 3 * sizeof(int32_t) + PACKR_RICE_BOUND(cs->rows);
+        packr_free(cs->deltas);
+    }
+    ctx->total_alloc += size;
+    cs->rows = rows;
+    cs->deltas = block;
+    cs->rel = block + rows;
+    cs->udeltas = (uint32_t*)(block + 2 * rows);
+    cs->bits = (uint8_t*)(block + 3 * rows);
+    return 0;
+}
+
+/* Grows the column scratch plans to cols columns, keeping them. Returns 0 on success */
+static int column_scratch_plans(packr_encoder_t *ctx, size_t cols) {
+    packr_column_scratch_t *cs = &ctx->columns;
+    if (cols <= cs->plan_cap) return 0;
+    if (cols > SIZE_MAX / sizeof(packr_column_plan_t) / 2) return -1;
+
+    size_t cap = cols * 2;
+    packr_column_plan_t *plans = packr_malloc(cap * sizeof(packr_column_plan_t));
+    if (!plans) return -1;
+    if (cs->plan_used) memcpy(plans, cs->plans, cs->plan_used * sizeof(packr_column_plan_t));
+    packr_free(cs->plans);
+    ctx->total_alloc += (cap - cs->plan_cap) * sizeof(packr_column_plan_t);
+    cs->plans = plans;
+    cs->plan_cap = cap;
+    return 0;
+}
 
 /* Float Viability Check */
-static int check_float_delta_viability(packr_column_t *col) {
+static int check_float_delta_viability(const packr_column_t *col) {
     if (col->count < 2) return 1;
     double prev = col->floats[0];
     
@@ -47,653 +103,794 @@ static int check_float_delta_viability(packr_column_t *col) {
     return 1;
 }
 
-typedef struct {
-    uint8_t *buf;
-    size_t cap;
-    size_t pos;
-    uint32_t bit_buf;
-    int bit_cnt;
-} bitwriter_t;
-
-static void bw_init(bitwriter_t *bw, uint8_t *buf, size_t cap) {
-    bw->buf = buf;
-    bw->cap = cap;
-    bw->pos = 0;
-    bw->bit_buf = 0;
-    bw->bit_cnt = 0;
-}
-
-static void bw_write(bitwriter_t *bw, uint32_t val, int bits) {
-    for (int i = bits - 1; i >= 0; i--) {
-        uint8_t bit = (val >> i) & 1;
-        bw->bit_buf = (bw->bit_buf << 1) | bit;
-        bw->bit_cnt++;
-        if (bw->bit_cnt == 8) {
-            if (bw->pos < bw->cap) bw->buf[bw->pos++] = bw->bit_buf & 0xFF;
-            bw->bit_buf = 0;
-            bw->bit_cnt = 0;
-        }
+
+/*
+ * Cost model: what each coding of a column writes, in bytes. Numbers are
+ * priced exactly. A string is priced as one dictionary token: every coding
+ * writes the same distinct strings in full once, so only the tokens differ.
+ */
+static size_t varint_size(uint32_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
     }
+    return n;
 }
 
-static void bw_flush(bitwriter_t *bw) {
-    if (bw->bit_cnt > 0) {
-        /* Pad with zeros to the right, matching Python's flush */
-        bw->bit_buf <<= (8 - bw->bit_cnt);
-        if (bw->pos < bw->cap) bw->buf[bw->pos++] = bw->bit_buf & 0xFF;
-        bw->bit_buf = 0;
-        bw->bit_cnt = 0;
+static size_t varint64_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
     }
+    return n;
 }
 
-static void bw_write_unary(bitwriter_t *bw, uint32_t val) {
-    for (uint32_t i = 0; i < val; i++) bw_write(bw, 0, 1);
-    bw_write(bw, 1, 1);
+static size_t value_size(const packr_column_t *col, size_t row) {
+    if (col->type == COL_TYPE_INT) return 1 + varint_size(zigzag_encode(col->ints[row]));
+    if (col->type == COL_TYPE_FLOAT) return 9;
+    return 1;
 }
 
-static int encode_rice_column(packr_encoder_t *ctx, int32_t *deltas, size_t count) {
-    if (count < MIN_RICE_ITEMS) return 0;
+static size_t timestamp_size(const packr_timestamp_t *t) {
+    if (t->format == PACKR_TIME_NONE) return 1; /* TOKEN_NULL */
+    size_t n = 2 + varint64_size(zigzag_encode64(t->ticks));
+    if ((t->format & PACKR_TS_ZONE) >= PACKR_TS_OFFSET) n += varint_size(zigzag_encode(t->offset));
+    return n;
+}
 
-    // 1. Convert to zig-zag and find Max
-    uint32_t *udeltas = packr_malloc(sizeof(uint32_t) * count);
-    if (!udeltas) return 0;
-    
-    uint32_t max_u = 0;
-    int32_t max_abs = 0;
-    for (size_t i=0; i<count; i++) {
-        udeltas[i] = (deltas[i] << 1) ^ (deltas[i] >> 31);
-        if (udeltas[i] > max_u) max_u = udeltas[i];
-        int32_t a = (deltas[i] < 0) ? -deltas[i] : deltas[i];
-        if (a > max_abs) max_abs = a;
+/* Strings compare as their text, a NULL one as "" */
+static int column_equal(const packr_column_t *col, size_t a, size_t b) {
+    switch (col->type) {
+    case COL_TYPE_INT: return col->ints[a] == col->ints[b];
+    case COL_TYPE_FLOAT: return col->floats[a] == col->floats[b];
+    case COL_TYPE_BOOL: return col->bools[a] == col->bools[b];
+    case COL_TYPE_STRING: {
+        const char *s1 = col->strings[a] ? col->strings[a] : "";
+        const char *s2 = col->strings[b] ? col->strings[b] : "";
+        return strcmp(s1, s2) == 0;
     }
-    
-    // Rice is beneficial when deltas are small-to-medium (< 1024)
-    if (max_abs >= 1024) { packr_free(udeltas); return 0; }
-
-    int bl = 0;
-    int32_t tmp = max_abs;
-    if (tmp > 0) {
-        while (tmp > 0) { tmp >>= 1; bl++; }
+    case COL_TYPE_TIME:
+        return col->times[a].format == col->times[b].format && col->times[a].ticks == col->times[b].ticks &&
+               col->times[a].offset == col->times[b].offset;
+    default:
+        return 0;
     }
-    
-    int k = bl - 2;
-    if (k < 0) k = 0;
-    if (k > 7) k = 7;
-    
-    // 3. Encode to temp buffer
-    size_t limit = count * 2 + 1024; 
-    uint8_t *temp = packr_malloc(limit);
-    if (!temp) { packr_free(udeltas); return 0; }
-    
-    bitwriter_t bw;
-    bw_init(&bw, temp, limit);
+}
 
-    for (size_t i=0; i<count; i++) {
-        uint32_t val = udeltas[i];
-        uint32_t q = val >> k;
-        uint32_t r = val & ((1 << k) - 1);
-        
-        bw_write_unary(&bw, q);
-        bw_write(&bw, r, k);
+static int column_constant(const packr_column_t *col) {
+    for (size_t j = 1; j < col->count; j++) {
+        if (!column_equal(col, j, 0)) return 0;
     }
-    bw_flush(&bw);
+    return 1;
+}
 
-    // 4. Check if actually beneficial (roughly < 1.5 bytes/value)
-    if (bw.pos < count * 1.5) {
-        packr_encode_token(ctx, TOKEN_RICE_COLUMN);
-        packr_encode_varint(ctx, count);
-        if (ctx->pos + bw.pos + 1 <= ctx->capacity) {
-            ctx->buffer[ctx->pos++] = (uint8_t)k; /* Prepend K */
-            memcpy(ctx->buffer + ctx->pos, temp, bw.pos);
-            ctx->pos += bw.pos;
-            packr_free(udeltas);
-            packr_free(temp);
-            return 1;
+/* Row of the most frequent value (Boyer-Moore vote) and how many rows hold it */
+static size_t mfv_find(const packr_column_t *col, size_t *occurrences) {
+    size_t mode = 0;
+    size_t votes = 0;
+    for (size_t i = 0; i < col->count; i++) {
+        if (votes == 0) {
+            mode = i;
+            votes = 1;
+        } else if (column_equal(col, i, mode)) {
+            votes++;
+        } else {
+            votes--;
         }
     }
-    
-    packr_free(udeltas);
-    packr_free(temp);
-    return 0; 
+    *occurrences = 0;
+    for (size_t i = 0; i < col->count; i++) {
+        if (column_equal(col, i, mode)) (*occurrences)++;
+    }
+    return mode;
 }
 
-static void encode_numeric_column(packr_encoder_t *ctx, packr_column_t *col, size_t field_idx) {
-    if (col->count == 0) return;
-    
-    
-    // Values
+static size_t mfv_cost(const packr_column_t *col, size_t mode) {
+    size_t cost = 1 + varint_size((uint32_t)col->count) + value_size(col, mode) + (col->count + 7) / 8;
+    for (size_t i = 0; i < col->count; i++) {
+        if (!column_equal(col, i, mode)) cost += value_size(col, i);
+    }
+    return cost;
+}
+
+static size_t rle_cost(const packr_column_t *col) {
+    size_t cost = 0;
+    for (size_t j = 0; j < col->count;) {
+        size_t run = 1;
+        while (j + run < col->count && column_equal(col, j + run, j)) run++;
+        cost += (col->type == COL_TYPE_TIME) ? timestamp_size(&col->times[j]) : value_size(col, j);
+        if (run > 1) cost += 1 + varint_size((uint32_t)(run - 1));
+        j += run;
+    }
+    return cost;
+}
+
+/*
+ * Deltas between the rows of a numeric column into the scratch (reserved
+ * by the caller), floats in 16.16 fixed point from the values the decoder
+ * rebuilds. Returns how many.
+ */
+static size_t column_deltas(packr_encoder_t *ctx, const packr_column_t *col) {
+    int32_t *deltas = ctx->columns.deltas;
     if (col->type == COL_TYPE_FLOAT) {
-        double first = col->floats[0];
-        packr_encode_double(ctx, first);
-        
-        if (col->count == 1) return;
-        
-        // Deltas - use reconstructed values to avoid cumulative error
-        int32_t *deltas = packr_malloc(sizeof(int32_t) * (col->count - 1));
-        double prev = first;
-        int all_small = 1;
-
-        for (size_t i=1; i<col->count; i++) {
-            double v = col->floats[i];
-            int32_t d = (int32_t)rint((v - prev) * 65536.0);
+        double prev = col->floats[0];
+        for (size_t i = 1; i < col->count; i++) {
+            int32_t d = (int32_t)rint((col->floats[i] - prev) * 65536.0);
             deltas[i-1] = d;
-            if (d < -8 || d > 7) all_small = 0;
-            // Use reconstructed value for next delta to match decoder behavior
             prev = prev + (double)d / 65536.0;
         }
-        
-        if (all_small) {
-            // Heuristic: Check if RLE is better than Bitpacking
-            // Bitpacking cost: ~0.5 bytes per value + overhead
-            size_t bitpack_cost = (col->count) / 2 + 5;
-            
-            size_t rle_cost = 0;
-            size_t k = 0;
-            while (k < col->count - 1) {
-                if (deltas[k] == 0) {
-                    size_t run = 0;
-                    while (k + run < col->count - 1 && deltas[k+run] == 0) run++;
-                    
-                    if (run > 3) {
-                        rle_cost += 2 + (run > 127 ? 1 : 0);
-                        k += run;
-                        continue;
-                    }
-                }
-                rle_cost += 1;
-                k++;
-            }
-            
-            if (rle_cost < bitpack_cost * 0.8) {
-                all_small = 0; // Force RLE path
+    } else {
+        int32_t prev = col->ints[0];
+        for (size_t i = 1; i < col->count; i++) {
+            int32_t d = col->ints[i] - prev;
+            deltas[i-1] = d;
+            prev = prev + d;
+        }
+    }
+    return col->count - 1;
+}
+
+static size_t delta_tokens_cost(const int32_t *deltas, size_t n) {
+    size_t cost = 0;
+    for (size_t i = 0; i < n;) {
+        int32_t d = deltas[i];
+        if (d == 0) {
+            size_t run = 0;
+            while (i + run < n && deltas[i+run] == 0) run++;
+            if (run > 3) {
+                cost += 1 + varint_size((uint32_t)run);
+                i += run;
+                continue;
             }
         }
+        if (d >= -8 && d <= 7) cost += 1;
+        else if (d >= -64 && d <= 63) cost += 2;
+        else cost += 1 + varint_size(zigzag_encode(d));
+        i++;
+    }
+    return cost;
+}
 
-        if (all_small) {
-            packr_encode_token(ctx, TOKEN_BITPACK_COL);
-            packr_encode_varint(ctx, col->count - 1);
+/* Bytes of the Rice code of the n zigzagged deltas with parameter k, 0 if the decoder can't take it */
+static size_t rice_bytes(const uint32_t *udeltas, size_t n, uint32_t max_u, int k) {
+    if ((max_u >> k) > PACKR_BITIO_MAX_UNARY) return 0;
+    uint64_t bits = 0;
+    for (size_t i = 0; i < n; i++) bits += (udeltas[i] >> k) + 1 + (uint32_t)k;
+    size_t bytes = (size_t)((bits + 7) / 8);
+    return bytes <= PACKR_RICE_BOUND(n) ? bytes : 0;
+}
 
-            // Pack - two deltas per byte
-            for (size_t i=0; i<col->count-1; i+=2) {
-                int d1 = deltas[i];
-                // For odd counts, pad with 0 delta (encoded as 8 in 4-bit unsigned)
-                int d2 = (i+1 < col->count-1) ? deltas[i+1] : 0;
-                uint8_t b = ((d1 + 8) << 4) | ((d2 + 8) & 0x0F);
+/* The fixed rules of PACKR_BATCH_FAST for the deltas of a column */
+static void plan_deltas_fast(packr_encoder_t *ctx, size_t n, packr_column_plan_t *plan) {
+    const int32_t *deltas = ctx->columns.deltas;
+    uint32_t *udeltas = ctx->columns.udeltas;
+    int all_small = 1;
+    int64_t max_abs = 0;
+    uint32_t max_u = 0;
+    for (size_t i = 0; i < n; i++) {
+        int32_t d = deltas[i];
+        if (d < -8 || d > 7) all_small = 0;
+        int64_t a = (d < 0) ? -(int64_t)d : d;
+        if (a > max_abs) max_abs = a;
+        udeltas[i] = zigzag_encode(d);
+        if (udeltas[i] > max_u) max_u = udeltas[i];
+    }
 
-                if (ctx->pos < ctx->capacity) ctx->buffer[ctx->pos++] = b;
+    if (all_small) {
+        /* Bitpacking takes ~0.5 bytes per value, zero runs may do better */
+        size_t bitpack_cost = (n + 1) / 2 + 5;
+        size_t rle_cost = 0;
+        for (size_t k = 0; k < n;) {
+            if (deltas[k] == 0) {
+                size_t run = 0;
+                while (k + run < n && deltas[k+run] == 0) run++;
+                if (run > 3) {
+                    rle_cost += 2 + (run > 127 ? 1 : 0);
+                    k += run;
+                    continue;
+                }
             }
-        } else {
-             // Try Rice Coding
-             if (encode_rice_column(ctx, deltas, col->count - 1)) {
-             } else {
-                 size_t i = 0;
-                 while (i < col->count - 1) {
-                     int32_t d = deltas[i];
-                     
-                     // Check for run of zeros
-                     if (d == 0) {
-                         size_t run = 0;
-                         while (i + run < col->count - 1 && deltas[i+run] == 0) {
-                             run++;
-                         }
-                         
-                         if (run > 3) {
-                             packr_encode_token(ctx, TOKEN_RLE_REPEAT);
-                             packr_encode_varint(ctx, run);
-                             i += run;
-                             continue;
-                         }
-                     }
-
-                     if (d == 0) packr_encode_token(ctx, TOKEN_DELTA_ZERO);
-                     else if (d == 1) packr_encode_token(ctx, TOKEN_DELTA_ONE);
-                     else if (d == -1) packr_encode_token(ctx, TOKEN_DELTA_NEG_ONE);
-                     else if (d >= -8 && d <= 7) {
-                         packr_encode_token(ctx, (packr_token_t)(0xC3 + d + 8));
-                     }
-                     else if (d >= -64 && d <= 63) {
-                         // Medium
-                         if (ctx->pos + 2 <= ctx->capacity) {
-                             ctx->buffer[ctx->pos++] = TOKEN_DELTA_MEDIUM;
-                             ctx->buffer[ctx->pos++] = (d + 64) & 0x7F;
-                             ctx->symbol_count++;
-                         }
-                     } else {
-                         packr_encode_token(ctx, TOKEN_DELTA_LARGE);
-                         packr_encode_varint(ctx, zigzag_encode(d));
-                     }
-                     i++;
-                 }
-             }
+            rle_cost += 1;
+            k++;
         }
-        packr_free(deltas);
-        
-    } else {
-        // Int logic
-        int32_t first = col->ints[0];
-        packr_encode_int(ctx, first);
-        
-        if (col->count == 1) return;
-        
-        // Deltas - use reconstructed values to avoid cumulative error
-        int32_t *deltas = packr_malloc(sizeof(int32_t) * (col->count - 1));
-        int32_t prev = first;
-        int all_small = 1;
-
-        for (size_t i=1; i<col->count; i++) {
-            int32_t v = col->ints[i];
-            int32_t d = v - prev;
-            deltas[i-1] = d;
-            if (d < -8 || d > 7) all_small = 0;
-            // Use reconstructed value for next delta to match decoder behavior
-            prev = prev + d;
+        if (rle_cost >= bitpack_cost * 0.8) {
+            plan->coding = CODING_BITPACK;
+            return;
         }
-        
-        if (all_small) {
-            // Heuristic: Check if RLE is better than Bitpacking
-            size_t bitpack_cost = (col->count) / 2 + 5;
-            
-            size_t rle_cost = 0;
-            size_t k = 0;
-            while (k < col->count - 1) {
-                if (deltas[k] == 0) {
-                    size_t run = 0;
-                    while (k + run < col->count - 1 && deltas[k+run] == 0) run++;
-                    
-                    if (run > 3) {
-                        rle_cost += 2 + (run > 127 ? 1 : 0);
-                        k += run;
-                        continue;
-                    }
-                }
-                rle_cost += 1;
-                k++;
-            }
-            
-            if (rle_cost < bitpack_cost * 0.8) {
-                all_small = 0; // Force RLE path
-            }
+    }
+
+    /* Rice pays for small-to-medium deltas, below ~1.5 bytes each */
+    plan->coding = CODING_DELTA;
+    if (n < MIN_RICE_ITEMS || max_abs >= 1024) return;
+    int bl = 0;
+    for (int64_t tmp = max_abs; tmp > 0; tmp >>= 1) bl++;
+    int k = bl - 2;
+    if (k < 0) k = 0;
+    if (k > 7) k = 7;
+    size_t bytes = rice_bytes(udeltas, n, max_u, k);
+    if (bytes && bytes < n * 1.5) {
+        plan->coding = CODING_RICE;
+        plan->rice_k = (uint8_t)k;
+    }
+}
+
+/* Prices the codings of the deltas of a column, taking the cheapest below plan->cost */
+static void plan_deltas_cost(packr_encoder_t *ctx, size_t n, size_t first, int effort, packr_column_plan_t *plan) {
+    const int32_t *deltas = ctx->columns.deltas;
+    uint32_t *udeltas = ctx->columns.udeltas;
+    int all_small = 1;
+    uint32_t max_u = 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (deltas[i] < -8 || deltas[i] > 7) all_small = 0;
+        udeltas[i] = zigzag_encode(deltas[i]);
+        if (udeltas[i] > max_u) max_u = udeltas[i];
+        sum += udeltas[i];
+    }
+
+    size_t cost = first + delta_tokens_cost(deltas, n);
+    if (cost < plan->cost) {
+        plan->coding = CODING_DELTA;
+        plan->cost = cost;
+    }
+    if (all_small) {
+        cost = first + 1 + varint_size((uint32_t)n) + (n + 1) / 2;
+        if (cost < plan->cost) {
+            plan->coding = CODING_BITPACK;
+            plan->cost = cost;
         }
-        
-        if (all_small) {
-            packr_encode_token(ctx, TOKEN_BITPACK_COL);
-            packr_encode_varint(ctx, col->count - 1);
-            // Pack - two deltas per byte
-            for (size_t i=0; i<col->count-1; i+=2) {
-                int d1 = deltas[i];
-                // For odd counts, pad with 0 delta (encoded as 8 in 4-bit unsigned)
-                int d2 = (i+1 < col->count-1) ? deltas[i+1] : 0;
-                uint8_t b = ((d1 + 8) << 4) | ((d2 + 8) & 0x0F);
-                if (ctx->pos < ctx->capacity) ctx->buffer[ctx->pos++] = b;
-            }
+    }
+
+    /* Rice: k near log2 of the mean delta, or every k */
+    int k_lo = 0, k_hi = RICE_K_MAX;
+    if (effort < PACKR_BATCH_SMALLEST) {
+        int k = 0;
+        for (uint64_t mean = sum / n; mean > 1; mean >>= 1) k++;
+        k_lo = k > 0 ? k - 1 : 0;
+        k_hi = k < RICE_K_MAX ? k + 1 : RICE_K_MAX;
+    }
+    size_t rice = SIZE_MAX;
+    int rice_k = 0;
+    for (int k = k_lo; k <= k_hi; k++) {
+        size_t bytes = rice_bytes(udeltas, n, max_u, k);
+        if (bytes && bytes < rice) {
+            rice = bytes;
+            rice_k = k;
+        }
+    }
+    if (rice == SIZE_MAX) return;
+    rice += first + 2 + varint_size((uint32_t)n);
+    /* LZ77 finds no matches in bit codes: before it, Rice has to halve the byte-aligned cost */
+    if ((ctx->compress ? rice * 2 : rice) < plan->cost) {
+        plan->coding = CODING_RICE;
+        plan->rice_k = (uint8_t)rice_k;
+        plan->cost = rice;
+    }
+}
+
+/*
+ * Plans a numeric column that isn't constant: MFV or, under DELTA, its
+ * first value and deltas, or (rle set) RLE of the values. Floats go under
+ * DELTA only while their 16.16 deltas are exact.
+ */
+static int plan_numeric(packr_encoder_t *ctx, const packr_column_t *col, int effort, int rle,
+                        packr_column_plan_t *plan) {
+    if (column_scratch_reserve(ctx, col->count) != 0) return -1;
+    size_t occurrences;
+    plan->mode = mfv_find(col, &occurrences);
+    int delta = (col->type != COL_TYPE_FLOAT) || check_float_delta_viability(col);
+    plan->flags = delta ? 0x02 : 0x04;
+
+    if (effort == PACKR_BATCH_FAST) {
+        if (col->count >= 8 && occurrences * 10 >= col->count * 6) {
+            plan->coding = CODING_MFV;
+        } else if (!delta) {
+            plan->coding = CODING_RLE;
         } else {
-             // Try Rice
-             if (encode_rice_column(ctx, deltas, col->count - 1)) {
-                 // Success
-             } else {
-                 // Fallback
-                 size_t i = 0;
-                 while (i < col->count - 1) {
-                     int32_t d = deltas[i];
-                     
-                     // Check for run of zeros
-                     if (d == 0) {
-                         size_t run = 0;
-                         while (i + run < col->count - 1 && deltas[i+run] == 0) {
-                             run++;
-                         }
-                         
-                         if (run > 3) {
-                             packr_encode_token(ctx, TOKEN_RLE_REPEAT);
-                             packr_encode_varint(ctx, run);
-                             i += run;
-                             continue;
-                         }
-                     }
-                     
-                     if (d == 0) packr_encode_token(ctx, TOKEN_DELTA_ZERO);
-                     else if (d == 1) packr_encode_token(ctx, TOKEN_DELTA_ONE);
-                     else if (d == -1) packr_encode_token(ctx, TOKEN_DELTA_NEG_ONE);
-                     else if (d >= -8 && d <= 7) {
-                         packr_encode_token(ctx, (packr_token_t)(0xC3 + d + 8));
-                     } else if (d >= -64 && d <= 63) {
-                         if (ctx->pos + 2 <= ctx->capacity) {
-                             ctx->buffer[ctx->pos++] = TOKEN_DELTA_MEDIUM;
-                             ctx->buffer[ctx->pos++] = (d + 64) & 0x7F;
-                             ctx->symbol_count++;
-                         }
-                     } else {
-                         packr_encode_token(ctx, TOKEN_DELTA_LARGE);
-                         packr_encode_varint(ctx, zigzag_encode(d));
-                     }
-                     i++;
-                 }
-             }
+            plan_deltas_fast(ctx, column_deltas(ctx, col), plan);
+        }
+        return 0;
+    }
+
+    plan->coding = CODING_MFV;
+    plan->cost = mfv_cost(col, plan->mode);
+    if (rle) {
+        size_t cost = rle_cost(col);
+        if (cost < plan->cost) {
+            plan->coding = CODING_RLE;
+            plan->flags = 0x04;
+            plan->cost = cost;
         }
-        packr_free(deltas);
     }
+    if (delta) {
+        uint8_t coding = plan->coding;
+        plan_deltas_cost(ctx, column_deltas(ctx, col), value_size(col, 0), effort, plan);
+        if (plan->coding != coding && coding == CODING_RLE) plan->flags = 0x02;
+    }
+    return 0;
 }
 
-static int encode_mfv_column(packr_encoder_t *ctx, packr_column_t *col) {
-    if (col->count < 8) return 0; // Not worth overhead
-    
-    // 1. Boyer-Moore Voting to find Mode Candidate
-    int32_t candidate_i = 0;
-    double candidate_f = 0;
-    char *candidate_s = NULL;
-    uint8_t candidate_b = 0;
-    
-    int count = 0;
-    
-    for (size_t i = 0; i < col->count; i++) {
-        if (count == 0) {
-            if (col->type == COL_TYPE_INT) candidate_i = col->ints[i];
-            else if (col->type == COL_TYPE_FLOAT) candidate_f = col->floats[i];
-            else if (col->type == COL_TYPE_STRING) candidate_s = col->strings[i];
-            else if (col->type == COL_TYPE_BOOL) candidate_b = col->bools[i];
-            count = 1;
+/*
+ * The rows of a TIME column as an INT column of ticks relative to row base
+ * (missing rows repeat the row before), in the scratch. Returns 0 on success.
+ */
+static int time_column_rel(packr_encoder_t *ctx, const packr_column_t *col, int base, packr_column_t *rel) {
+    if (column_scratch_reserve(ctx, col->count) != 0) return -1;
+    memset(rel, 0, sizeof(packr_column_t));
+    rel->type = COL_TYPE_INT;
+    rel->count = col->count;
+    rel->nulls = col->nulls;
+    rel->ints = ctx->columns.rel;
+    int32_t prev = 0;
+    for (size_t j = 0; j < col->count; j++) {
+        if (col->nulls[j]) prev = (int32_t)(col->times[j].ticks - col->times[base].ticks);
+        rel->ints[j] = prev;
+    }
+    return 0;
+}
+
+/*
+ * Can a TIME column go as ticks relative to its first timestamp (see
+ * packr_ultra.h)? The 2^30 bound keeps the deltas between rows in int32.
+ * Returns the row of the base, -1 if not; *constant is set if every row
+ * present is the base.
+ */
+static int time_column_base(const packr_column_t *col, int *constant) {
+    int base = -1;
+    *constant = 1;
+    for (size_t j = 0; j < col->count; j++) {
+        if (!col->nulls[j]) continue;
+        const packr_timestamp_t *t = &col->times[j];
+        if (t->format == PACKR_TIME_NONE) return -1;
+        if (base < 0) {
+            base = (int)j;
+            continue;
+        }
+        const packr_timestamp_t *b = &col->times[base];
+        if (t->format != b->format || t->offset != b->offset) return -1;
+        uint64_t dist = (t->ticks >= b->ticks) ? (uint64_t)t->ticks - (uint64_t)b->ticks
+                                               : (uint64_t)b->ticks - (uint64_t)t->ticks;
+        if (dist >= (1u << 30)) return -1;
+        if (dist) *constant = 0;
+    }
+    return base;
+}
+
+/* Picks the flags and coding of a column (and with effort beyond FAST, what it costs). Returns 0 on success */
+static int column_plan(packr_encoder_t *ctx, const packr_column_t *col, int effort, packr_column_plan_t *plan) {
+    memset(plan, 0, sizeof(packr_column_plan_t));
+    uint8_t nulls = memchr(col->nulls, 0, col->count) ? 0x08 : 0;
+
+    if (col->type == COL_TYPE_OBJECT) {
+        plan->flags = 0x10; // GROUP
+        plan->coding = CODING_OTHER;
+        plan->cost = varint_size(col->group);
+        if (memchr(col->bools, 1, col->count)) { // Null rows
+            plan->flags |= 0x01;
+            plan->cost += (col->count + 7) / 8;
+        }
+    } else if (col->type == COL_TYPE_CUSTOM) {
+        /* One value per row, not priced: they write the same row by row */
+        plan->coding = CODING_OTHER;
+    } else if (col->type == COL_TYPE_TIME) {
+        int constant;
+        int base = time_column_base(col, &constant);
+        if (base < 0) {
+            plan->flags = 0x04; // RLE of timestamp tokens
+            plan->coding = CODING_RLE;
+            if (effort > PACKR_BATCH_FAST) plan->cost = rle_cost(col);
         } else {
-            int match = 0;
-            if (col->type == COL_TYPE_INT) match = (col->ints[i] == candidate_i);
-            else if (col->type == COL_TYPE_FLOAT) match = (col->floats[i] == candidate_f);
-            else if (col->type == COL_TYPE_STRING) {
-                const char *s1 = col->strings[i] ? col->strings[i] : "";
-                const char *s2 = candidate_s ? candidate_s : "";
-                match = (strcmp(s1, s2) == 0);
+            plan->flags = 0x20 | (constant ? 0x01 : 0x02);
+            plan->coding = CODING_TIME;
+            if (effort > PACKR_BATCH_FAST) {
+                const packr_timestamp_t *b = &col->times[base];
+                plan->cost = timestamp_size(b) - 1;
+                if (constant) {
+                    plan->cost += 2;
+                } else {
+                    packr_column_t rel;
+                    packr_column_plan_t rel_plan;
+                    memset(&rel_plan, 0, sizeof(rel_plan));
+                    if (time_column_rel(ctx, col, base, &rel) != 0 ||
+                        plan_numeric(ctx, &rel, effort, 0, &rel_plan) != 0) {
+                        return -1;
+                    }
+                    plan->cost += rel_plan.cost;
+                }
             }
-            else if (col->type == COL_TYPE_BOOL) match = (col->bools[i] == candidate_b);
-            
-            if (match) count++; else count--;
         }
-    }
-    
-    // 2. Verify Count
-    size_t occurrences = 0;
-    for (size_t i = 0; i < col->count; i++) {
-        int match = 0;
-        if (col->type == COL_TYPE_INT) match = (col->ints[i] == candidate_i);
-        else if (col->type == COL_TYPE_FLOAT) match = (col->floats[i] == candidate_f);
-        else if (col->type == COL_TYPE_STRING) {
-            const char *s1 = col->strings[i] ? col->strings[i] : "";
-            const char *s2 = candidate_s ? candidate_s : "";
-            match = (strcmp(s1, s2) == 0);
+    } else if (col->type == COL_TYPE_NULL) {
+        plan->flags = 0x01; // CONSTANT, no value
+        plan->coding = CODING_CONST;
+    } else if (column_constant(col)) {
+        plan->flags = 0x01; // CONSTANT
+        plan->coding = CODING_CONST;
+        plan->cost = value_size(col, 0);
+        if (col->type == COL_TYPE_FLOAT && col->floats[0] == (double)(int32_t)col->floats[0]) {
+            plan->cost = 1 + varint_size(zigzag_encode((int32_t)col->floats[0]));
+        }
+    } else if (col->type == COL_TYPE_INT || col->type == COL_TYPE_FLOAT) {
+        if (plan_numeric(ctx, col, effort, 1, plan) != 0) return -1;
+    } else {
+        /* Strings and bools: MFV or RLE */
+        size_t occurrences;
+        plan->flags = 0x04;
+        plan->mode = mfv_find(col, &occurrences);
+        if (effort == PACKR_BATCH_FAST) {
+            plan->coding = (col->count >= 8 && occurrences * 10 >= col->count * 6) ? CODING_MFV : CODING_RLE;
+        } else {
+            size_t mfv = mfv_cost(col, plan->mode);
+            size_t rle = rle_cost(col);
+            plan->coding = (mfv < rle) ? CODING_MFV : CODING_RLE;
+            plan->cost = (mfv < rle) ? mfv : rle;
         }
-        else if (col->type == COL_TYPE_BOOL) match = (col->bools[i] == candidate_b);
-        if (match) occurrences++;
     }
-    
-    // Threshold: 60%
-    if (occurrences * 10 < col->count * 6) return 0;
-    
-    // 3. Encode
+
+    plan->flags |= nulls;
+    plan->cost += 1 + (nulls ? (col->count + 7) / 8 : 0);
+    return 0;
+}
+
+/* Writers */
+
+static int encode_value(packr_encoder_t *ctx, const packr_column_t *col, size_t row) {
+    if (col->type == COL_TYPE_INT) return packr_encode_int(ctx, col->ints[row]);
+    if (col->type == COL_TYPE_FLOAT) return packr_encode_double(ctx, col->floats[row]);
+    if (col->type == COL_TYPE_BOOL) return packr_encode_bool(ctx, col->bools[row]);
+    if (col->type == COL_TYPE_TIME) {
+        if (col->times[row].format == PACKR_TIME_NONE) return packr_encode_null(ctx);
+        return packr_encode_timestamp(ctx, &col->times[row]);
+    }
+    const char *s = col->strings[row] ? col->strings[row] : "";
+    return packr_encode_typed(ctx, s, strlen(s));
+}
+
+static void encode_mfv_column(packr_encoder_t *ctx, const packr_column_t *col, size_t mode) {
+    PACKR_STAT(ctx->stats.columns[PACKR_COL_MFV]++);
     packr_encode_token(ctx, TOKEN_MFV_COLUMN);
     packr_encode_varint(ctx, col->count);
-    
-    // Write Mode Value
-    if (col->type == COL_TYPE_INT) packr_encode_int(ctx, candidate_i);
-    else if (col->type == COL_TYPE_FLOAT) packr_encode_double(ctx, candidate_f);
-    else if (col->type == COL_TYPE_STRING) {
-        const char *s = candidate_s ? candidate_s : "";
-        packr_encode_string(ctx, s, strlen(s));
-    }
-    else if (col->type == COL_TYPE_BOOL) packr_encode_bool(ctx, candidate_b);
-    
+    encode_value(ctx, col, mode);
+
     // Write Bitmap (1 = Exception, 0 = Mode)
-    size_t bitmap_len = (col->count + 7) / 8;
     for (size_t i = 0; i < col->count; i += 8) {
         uint8_t b = 0;
         for (size_t j = 0; j < 8 && i + j < col->count; j++) {
-            int match = 0;
-            if (col->type == COL_TYPE_INT) match = (col->ints[i+j] == candidate_i);
-            else if (col->type == COL_TYPE_FLOAT) match = (col->floats[i+j] == candidate_f);
-            else if (col->type == COL_TYPE_STRING) {
-                const char *s1 = col->strings[i+j] ? col->strings[i+j] : "";
-                const char *s2 = candidate_s ? candidate_s : "";
-                match = (strcmp(s1, s2) == 0);
-            }
-            else if (col->type == COL_TYPE_BOOL) match = (col->bools[i+j] == candidate_b);
-            
-            if (!match) b |= (1 << j);
+            if (!column_equal(col, i + j, mode)) b |= (1 << j);
         }
-        if (ctx->pos < ctx->capacity) ctx->buffer[ctx->pos++] = b;
+        packr_encode_raw(ctx, &b, 1);
     }
-    
+
     // Write Exceptions
     for (size_t i = 0; i < col->count; i++) {
-        int match = 0;
-        if (col->type == COL_TYPE_INT) match = (col->ints[i] == candidate_i);
-        else if (col->type == COL_TYPE_FLOAT) match = (col->floats[i] == candidate_f);
-        else if (col->type == COL_TYPE_STRING) {
-            const char *s1 = col->strings[i] ? col->strings[i] : "";
-            const char *s2 = candidate_s ? candidate_s : "";
-            match = (strcmp(s1, s2) == 0);
-        }
-        else if (col->type == COL_TYPE_BOOL) match = (col->bools[i] == candidate_b);
-        
-        if (!match) {
-            if (col->type == COL_TYPE_INT) packr_encode_int(ctx, col->ints[i]);
-            else if (col->type == COL_TYPE_FLOAT) packr_encode_double(ctx, col->floats[i]);
-            else if (col->type == COL_TYPE_STRING) {
-                const char *s = col->strings[i] ? col->strings[i] : "";
-                packr_encode_string(ctx, s, strlen(s));
-            }
-            else if (col->type == COL_TYPE_BOOL) packr_encode_bool(ctx, col->bools[i]);
+        if (!column_equal(col, i, mode)) encode_value(ctx, col, i);
+    }
+}
+
+static void encode_rle_column(packr_encoder_t *ctx, const packr_column_t *col) {
+    PACKR_STAT(ctx->stats.columns[PACKR_COL_RLE]++);
+    size_t j = 0;
+    while (j < col->count) {
+        size_t run = 1;
+        while (j + run < col->count && column_equal(col, j + run, j)) run++;
+
+        encode_value(ctx, col, j);
+        if (run > 1) {
+            packr_encode_token(ctx, TOKEN_RLE_REPEAT);
+            packr_encode_varint(ctx, run - 1);
         }
+        j += run;
     }
-    
-    return 1;
 }
 
-// Public API
-int packr_encode_ultra_columns(packr_encoder_t *ctx, int row_count, int col_count, char **field_names, packr_column_t *columns, int partial) {
-    if (row_count == 0) return 0;
-    
-    packr_encode_token(ctx, partial ? TOKEN_BATCH_PARTIAL : TOKEN_ULTRA_BATCH);
-    packr_encode_varint(ctx, row_count);
-    packr_encode_varint(ctx, col_count);
+/* The first value and deltas of a numeric column as planned (DELTA, BITPACK or RICE) */
+static void encode_delta_column(packr_encoder_t *ctx, const packr_column_t *col, const packr_column_plan_t *plan) {
+    encode_value(ctx, col, 0);
+    size_t n = column_deltas(ctx, col);
+    const int32_t *deltas = ctx->columns.deltas;
 
-    // Emit fields and flags
-    for (int i=0; i<col_count; i++) {
-        packr_encode_field(ctx, field_names[i], strlen(field_names[i]));
-        
-        // Analyze
-        packr_column_t *col = &columns[i];
-        int is_constant = 1;
-        
-        if (col->type == COL_TYPE_INT) {
-             int32_t val = col->ints[0];
-             for(size_t j=1; j<col->count; j++) if(col->ints[j] != val) { is_constant = 0; break; }
-        } else if (col->type == COL_TYPE_FLOAT) {
-             double val = col->floats[0];
-             for(size_t j=1; j<col->count; j++) if(col->floats[j] != val) { is_constant = 0; break; }
-        } else if (col->type == COL_TYPE_STRING) {
-             char *val = col->strings[0] ? col->strings[0] : "";
-             for(size_t j=1; j<col->count; j++) {
-                 const char *v2 = col->strings[j] ? col->strings[j] : "";
-                 if(strcmp(v2, val) != 0) { is_constant = 0; break; }
-             }
-        } else if (col->type == COL_TYPE_BOOL) {
-             uint8_t val = col->bools[0];
-             for(size_t j=1; j<col->count; j++) if(col->bools[j] != val) { is_constant = 0; break; }
+    if (plan->coding == CODING_BITPACK) {
+        PACKR_STAT(ctx->stats.columns[PACKR_COL_BITPACK]++);
+        packr_encode_token(ctx, TOKEN_BITPACK_COL);
+        packr_encode_varint(ctx, n);
+        // Pack - two deltas per byte
+        for (size_t i = 0; i < n; i += 2) {
+            int d1 = deltas[i];
+            // For odd counts, pad with 0 delta (encoded as 8 in 4-bit unsigned)
+            int d2 = (i + 1 < n) ? deltas[i+1] : 0;
+            uint8_t b = ((d1 + 8) << 4) | ((d2 + 8) & 0x0F);
+            packr_encode_raw(ctx, &b, 1);
         }
-        
-        // Check for nulls
-        int has_nulls = 0;
-        for(size_t j=0; j<col->count; j++) {
-            if (col->nulls[j] == 0) {
-                has_nulls = 1;
-                break;
+    } else if (plan->coding == CODING_RICE) {
+        PACKR_STAT(ctx->stats.columns[PACKR_COL_RICE]++);
+        packr_bitwriter_t bw;
+        packr_bw_init(&bw, ctx->columns.bits, PACKR_RICE_BOUND(n));
+        for (size_t i = 0; i < n; i++) packr_bw_put_rice(&bw, zigzag_encode(deltas[i]), plan->rice_k);
+        packr_bw_flush(&bw);
+
+        packr_encode_token(ctx, TOKEN_RICE_COLUMN);
+        packr_encode_varint(ctx, n);
+        packr_encode_raw(ctx, &plan->rice_k, 1); /* Prepend K */
+        packr_encode_raw(ctx, ctx->columns.bits, bw.pos);
+    } else {
+        PACKR_STAT(ctx->stats.columns[PACKR_COL_DELTA]++);
+        size_t i = 0;
+        while (i < n) {
+            int32_t d = deltas[i];
+
+            // Check for run of zeros
+            if (d == 0) {
+                size_t run = 0;
+                while (i + run < n && deltas[i+run] == 0) run++;
+                if (run > 3) {
+                    packr_encode_token(ctx, TOKEN_RLE_REPEAT);
+                    packr_encode_varint(ctx, run);
+                    i += run;
+                    continue;
+                }
             }
-        }
-        
-        uint8_t flags = 0;
-        if (has_nulls) flags |= 0x08;
-        if (is_constant) {
-            flags |= 0x01; // CONSTANT
-        } else {
-            if (col->type == COL_TYPE_INT) {
-                flags |= 0x02; // ALL_DELTA
-            } else if (col->type == COL_TYPE_FLOAT) {
-                 if (check_float_delta_viability(col)) {
-                     flags |= 0x02; // ALL_DELTA
-                 } else {
-                     flags |= 0x04; // RLE (Exact Double Fallback)
-                 }
+
+            if (d == 0) packr_encode_token(ctx, TOKEN_DELTA_ZERO);
+            else if (d == 1) packr_encode_token(ctx, TOKEN_DELTA_ONE);
+            else if (d == -1) packr_encode_token(ctx, TOKEN_DELTA_NEG_ONE);
+            else if (d >= -8 && d <= 7) {
+                packr_encode_token(ctx, (packr_token_t)(0xC3 + d + 8));
+            } else if (d >= -64 && d <= 63) {
+                uint8_t mb = (d + 64) & 0x7F;
+                packr_encode_token(ctx, TOKEN_DELTA_MEDIUM);
+                packr_encode_raw(ctx, &mb, 1);
             } else {
-                flags |= 0x04; // RLE
+                packr_encode_token(ctx, TOKEN_DELTA_LARGE);
+                packr_encode_varint(ctx, zigzag_encode(d));
             }
+            i++;
         }
-        if (col->type == COL_TYPE_CUSTOM) {
-             flags = 0; // Reset flags, CUSTOM uses simple loop usually
-             if (has_nulls) flags |= 0x08;
-             // Custom columns don't use the standard compressions (yet)
-             // We could implement RLE if we had a comparator, but for now linear
-        }
-        packr_encode_token(ctx, (packr_token_t)flags);
     }
-    
-    for (int i=0; i<col_count; i++) {
-        packr_column_t *col = &columns[i];
+}
 
-        
-        // Check for nulls (Recalculate to match flags)
-        int has_nulls = 0;
-        for(size_t j=0; j<col->count; j++) {
-            if (col->nulls[j] == 0) {
-                has_nulls = 1;
-                break;
-            }
-        }
-        
-        if (has_nulls) {
-             for (size_t j = 0; j < col->count; j += 8) {
-                uint8_t b = 0;
-                for (size_t k = 0; k < 8 && j + k < col->count; k++) {
-                    if (col->nulls[j+k]) b |= (1 << k);
-                }
-                if (ctx->pos < ctx->capacity) ctx->buffer[ctx->pos++] = b;
+static int encode_time_column(packr_encoder_t *ctx, const packr_column_t *col) {
+    int constant;
+    int base = time_column_base(col, &constant);
+    const packr_timestamp_t *b = &col->times[base];
+    packr_encode_raw(ctx, &b->format, 1);
+    if ((b->format & PACKR_TS_ZONE) >= PACKR_TS_OFFSET) packr_encode_varint(ctx, zigzag_encode(b->offset));
+    packr_encode_varint64(ctx, zigzag_encode64(b->ticks));
+    if (constant) {
+        PACKR_STAT(ctx->stats.columns[PACKR_COL_CONST]++);
+        return packr_encode_int(ctx, 0);
+    }
+
+    /* The relative ticks, as an INT column */
+    packr_column_t rel;
+    packr_column_plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+    if (time_column_rel(ctx, col, base, &rel) != 0) return -1;
+    if (plan_numeric(ctx, &rel, ctx->batch_effort, 0, &plan) != 0) return -1;
+    if (plan.coding == CODING_MFV) encode_mfv_column(ctx, &rel, plan.mode);
+    else encode_delta_column(ctx, &rel, &plan);
+    return 0;
+}
+
+/* Flags count as a symbol like a token but aren't one, so they stay out of the token stats */
+static int encode_column_flags(packr_encoder_t *ctx, uint8_t flags) {
+    ctx->symbol_count++;
+    return packr_encode_raw(ctx, &flags, 1);
+}
+
+/* The values of a column as planned, after its flags. Returns 0 on success */
+static int encode_column(packr_encoder_t *ctx, const packr_column_t *col, const packr_column_plan_t *plan) {
+    if (plan->flags & 0x08) {
+        for (size_t j = 0; j < col->count; j += 8) {
+            uint8_t b = 0;
+            for (size_t k = 0; k < 8 && j + k < col->count; k++) {
+                if (col->nulls[j+k]) b |= (1 << k);
             }
+            packr_encode_raw(ctx, &b, 1);
         }
-        
-        int is_constant = 1;
-        if (col->type == COL_TYPE_INT) {
-             int32_t val = col->ints[0];
-             for(size_t j=1; j<col->count; j++) if(col->ints[j] != val) { is_constant = 0; break; }
-             
-             if (is_constant) {
-                 packr_encode_int(ctx, val);
-             } else {
-                 if (!encode_mfv_column(ctx, col)) {
-                     encode_numeric_column(ctx, col, i);
-                 }
-             }
-        } 
-        else if (col->type == COL_TYPE_FLOAT) {
-             double val = col->floats[0];
-             for(size_t j=1; j<col->count; j++) if(col->floats[j] != val) { is_constant = 0; break; }
-
-             if (is_constant) {
-                 if (val == (double)(int32_t)val) {
-                     packr_encode_int(ctx, (int32_t)val);
-                 } else {
-                     packr_encode_double(ctx, val);
-                 }
-             } else {
-                 if (!encode_mfv_column(ctx, col)) {
-                     if (check_float_delta_viability(col)) {
-                         encode_numeric_column(ctx, col, i);
-                     } else {
-                        // RLE Fallback for Exact Doubles
-                        size_t j = 0;
-                        while (j < col->count) {
-                            double curr = col->floats[j];
-                            size_t run = 1;
-                            while (j + run < col->count && col->floats[j+run] == curr) {
-                                run++;
-                            }
-                            
-                            packr_encode_double(ctx, curr);
-                            if (run > 1) {
-                                packr_encode_token(ctx, TOKEN_RLE_REPEAT);
-                                packr_encode_varint(ctx, run - 1);
-                            }
-                            j += run;
-                        }
-                     }
-                 }
-             }
+    }
+
+    switch (plan->coding) {
+    case CODING_CONST:
+        if (col->type == COL_TYPE_NULL) break;
+        PACKR_STAT(ctx->stats.columns[PACKR_COL_CONST]++);
+        if (col->type == COL_TYPE_FLOAT && col->floats[0] == (double)(int32_t)col->floats[0]) {
+            packr_encode_int(ctx, (int32_t)col->floats[0]);
+        } else {
+            encode_value(ctx, col, 0);
         }
-        else if (col->type == COL_TYPE_STRING) {
-            char *val = col->strings[0] ? col->strings[0] : "";
-            for(size_t j=1; j<col->count; j++) {
-                const char *v2 = col->strings[j] ? col->strings[j] : "";
-                if(strcmp(v2, val) != 0) { is_constant = 0; break; }
-            }
-            
-            if (is_constant) {
-                packr_encode_string(ctx, val, strlen(val));
-             } else {
-                 int mfv = encode_mfv_column(ctx, col);
-                 if (mfv) {
-                 } else {
-                    // RLE
-                    size_t j = 0;
-                    while (j < col->count) {
-                        char *curr = col->strings[j] ? col->strings[j] : "";
-                        size_t run = 1;
-                        while (j + run < col->count) {
-                            const char *next = col->strings[j+run] ? col->strings[j+run] : "";
-                            if (strcmp(next, curr) != 0) break;
-                            run++;
-                        }
-                        
-                        packr_encode_string(ctx, curr, strlen(curr));
-                        if (run > 1) {
-                            packr_encode_token(ctx, TOKEN_RLE_REPEAT);
-                            packr_encode_varint(ctx, run - 1);
-                        }
-                        j += run;
+        break;
+    case CODING_MFV:
+        encode_mfv_column(ctx, col, plan->mode);
+        break;
+    case CODING_RLE:
+        encode_rle_column(ctx, col);
+        break;
+    case CODING_DELTA:
+    case CODING_BITPACK:
+    case CODING_RICE:
+        if (column_scratch_reserve(ctx, col->count) != 0) return -1;
+        encode_delta_column(ctx, col, plan);
+        break;
+    case CODING_TIME:
+        return encode_time_column(ctx, col);
+    default:
+        if (col->type == COL_TYPE_OBJECT) {
+            /* Only the null rows bitmap, the fields are columns of their own */
+            if (plan->flags & 0x01) {
+                for (size_t j = 0; j < col->count; j += 8) {
+                    uint8_t b = 0;
+                    for (size_t k = 0; k < 8 && j + k < col->count; k++) {
+                        if (col->bools[j+k]) b |= (1 << k);
                     }
-                 }
-             }
-        }
-        else if (col->type == COL_TYPE_BOOL) {
-             uint8_t val = col->bools[0];
-             for(size_t j=1; j<col->count; j++) if(col->bools[j] != val) { is_constant = 0; break; }
-             
-             if (is_constant) {
-                 packr_encode_bool(ctx, val);
-             } else {
-                 if (encode_mfv_column(ctx, col)) {
-                 } else {
-                     // RLE Fallback for Booleans
-                     size_t j = 0;
-                     while (j < col->count) {
-                        uint8_t curr = col->bools[j];
-                        size_t run = 1;
-                        while (j + run < col->count && col->bools[j+run] == curr) {
-                            run++;
-                        }
-                        
-                        packr_encode_bool(ctx, curr);
-                        if (run > 1) {
-                            packr_encode_token(ctx, TOKEN_RLE_REPEAT);
-                            packr_encode_varint(ctx, run - 1);
-                        }
-                        j += run;
-                     }
-                 }
-             }
-        }
-        else if (col->type == COL_TYPE_CUSTOM) {
+                    packr_encode_raw(ctx, &b, 1);
+                }
+            }
+        } else if (col->type == COL_TYPE_CUSTOM) {
+            PACKR_STAT(ctx->stats.columns[PACKR_COL_CUSTOM]++);
             if (col->custom_encoder) {
-                for(size_t j=0; j<col->count; j++) {
-                     if (col->custom_encoder(ctx, col->custom_data[j]) != 0) {
-                         return -1;
-                     }
+                for (size_t j = 0; j < col->count; j++) {
+                    if (col->custom_encoder(ctx, col->custom_data[j]) != 0) return -1;
                 }
             }
         }
+        break;
+    }
+    return 0;
+}
+
+// Public API
+int packr_encode_ultra_columns(packr_encoder_t *ctx, int row_count, int col_count, char **field_names, packr_column_t *columns, int partial) {
+    if (row_count == 0) return 0;
+
+    /* Plan every column first: the flags all go ahead of the values */
+    size_t base = ctx->columns.plan_used;
+    if (column_scratch_plans(ctx, base + (size_t)col_count) != 0) return -1;
+    for (int i = 0; i < col_count; i++) {
+        if (column_plan(ctx, &columns[i], ctx->batch_effort, &ctx->columns.plans[base + i]) != 0) return -1;
+    }
+
+    /* Same fields as a cached batch: only the flags follow the row count */
+    int cached = packr_encode_schema(ctx, field_names, col_count);
+    if (cached < 0) return -1;
+
+    packr_encode_token(ctx, partial ? TOKEN_BATCH_PARTIAL : TOKEN_ULTRA_BATCH);
+    packr_encode_varint(ctx, row_count);
+    if (!cached) packr_encode_varint(ctx, col_count);
+
+    // Emit fields and flags
+    for (int i=0; i<col_count; i++) {
+        if (!cached) packr_encode_field(ctx, field_names[i], strlen(field_names[i]));
+        encode_column_flags(ctx, ctx->columns.plans[base + i].flags);
+        if (columns[i].type == COL_TYPE_OBJECT) packr_encode_varint(ctx, columns[i].group);
+    }
+
+    /* Batches nested in the columns (CUSTOM values) leave the schema cache alone, and plan above these */
+    ctx->schemas.depth++;
+    ctx->columns.plan_used = base + (size_t)col_count;
+    int ret = 0;
+    for (int i = 0; i < col_count && ret == 0; i++) {
+        packr_column_plan_t plan = ctx->columns.plans[base + i];
+        ret = encode_column(ctx, &columns[i], &plan);
+    }
+    ctx->columns.plan_used = base;
+    ctx->schemas.depth--;
+    return ret;
+}
+
+size_t packr_ultra_cost(packr_encoder_t *ctx, int col_count, const packr_column_t *columns) {
+    int effort = (ctx->batch_effort > PACKR_BATCH_BALANCED) ? ctx->batch_effort : PACKR_BATCH_BALANCED;
+    size_t cost = 0;
+    for (int i = 0; i < col_count; i++) {
+        packr_column_plan_t plan;
+        if (column_plan(ctx, &columns[i], effort, &plan) != 0) return SIZE_MAX;
+        cost += plan.cost;
+    }
+    return cost;
+}
+
+size_t packr_ultra_row_cost(int row_count, int col_count, const packr_column_t *columns) {
+    size_t cost = 2 * (size_t)row_count;
+    for (int i = 0; i < col_count; i++) {
+        const packr_column_t *col = &columns[i];
+        for (size_t r = 0; r < col->count; r++) {
+            if (!col->nulls[r]) continue;
+            cost += 1; /* field token */
+            if (col->type == COL_TYPE_OBJECT) cost += col->bools[r] ? 1 : 2;
+            else if (col->type == COL_TYPE_TIME) cost += timestamp_size(&col->times[r]);
+            else if (col->type != COL_TYPE_CUSTOM) cost += value_size(col, r);
+        }
+    }
+    return cost;
+}
+
+void packr_column_slice(packr_column_t *dst, const packr_column_t *src, size_t start, size_t count) {
+    size_t size = (src->type == COL_TYPE_INT) ? sizeof(int32_t) :
+                  (src->type == COL_TYPE_FLOAT) ? sizeof(double) :
+                  (src->type == COL_TYPE_STRING) ? sizeof(char*) :
+                  (src->type == COL_TYPE_TIME) ? sizeof(packr_timestamp_t) :
+                  (src->type == COL_TYPE_CUSTOM) ? sizeof(void*) :
+                  (src->type == COL_TYPE_NULL) ? 0 : sizeof(uint8_t);
+    *dst = *src;
+    dst->count = count;
+    dst->nulls = src->nulls + start;
+    dst->custom_data = (void**)((uint8_t*)src->custom_data + start * size);
+}
+
+/* Struct arrays (packr_struct.h): the JSON encoder's batching, without the parsing */
+static size_t struct_col_size(col_type_t type) {
+    size_t size = type == COL_TYPE_INT ? sizeof(int32_t)
+                : type == COL_TYPE_FLOAT ? sizeof(double)
+                : type == COL_TYPE_STRING ? sizeof(char *) + sizeof(packr_timestamp_t) /* and the rows parsed */
+                : sizeof(uint8_t);
+    return (size * PACKR_STRUCT_BATCH_ROWS + 7) & ~(size_t)7;
+}
+
+/*
+ * As in JSON batches, a string column goes as a TIME column while every
+ * row it had is a timestamp. Parses col's rows into times and makes it one,
+ * or returns 1 (text from then on) at the first row that isn't.
+ */
+static int struct_times(packr_column_t *col, packr_timestamp_t *times) {
+    for (size_t r = 0; r < col->count; r++) {
+        const char *s = col->strings[r];
+        if (!s || packr_parse_timestamp(s, strlen(s), &times[r]) != 0) return 1;
     }
+    col->type = COL_TYPE_TIME;
+    col->times = times;
     return 0;
 }
+
+int packr_encode_struct_array(packr_encoder_t *ctx, const void *items, size_t count, size_t item_size,
+                              int col_count, const char *const *names, const col_type_t *types,
+                              packr_struct_fill_func fill, packr_struct_item_func encode_item) {
+    if (count < PACKR_STRUCT_MIN_ROWS || col_count <= 0) {
+        packr_encode_token(ctx, TOKEN_ARRAY_START);
+        packr_encode_varint(ctx, (uint32_t)count);
+        for (size_t i = 0; i < count; i++) {
+            if (encode_item(ctx, (const uint8_t *)items + i * item_size) != 0) return -1;
+        }
+        return packr_encode_token(ctx, TOKEN_ARRAY_END);
+    }
+
+    /* Columns as filled and as sent, text flags, their rows and one all-present null map in a single block */
+    size_t head = (2 * col_count * sizeof(packr_column_t) + col_count + 7) & ~(size_t)7;
+    size_t size = head + PACKR_STRUCT_BATCH_ROWS;
+    for (int i = 0; i < col_count; i++) size += struct_col_size(types[i]);
+    uint8_t *block = packr_malloc(size);
+    if (!block) return -1;
+
+    packr_column_t *cols = (packr_column_t *)block;
+    packr_column_t *sent = cols + col_count;
+    uint8_t *text = (uint8_t *)(sent + col_count);
+    uint8_t *p = block + head;
+    for (int i = 0; i < col_count; i++) {
+        memset(&cols[i], 0, sizeof(packr_column_t));
+        cols[i].type = types[i];
+        cols[i].custom_data = (void **)p;
+        text[i] = 0;
+        p += struct_col_size(types[i]);
+    }
+    memset(p, 1, PACKR_STRUCT_BATCH_ROWS);
+    for (int i = 0; i < col_count; i++) cols[i].nulls = p;
+
+    int streaming = count > PACKR_STRUCT_BATCH_ROWS;
+    int ret = 0;
+    if (streaming) packr_encode_token(ctx, TOKEN_ARRAY_STREAM);
+    for (size_t first = 0; first < count && ret == 0; first += PACKR_STRUCT_BATCH_ROWS) {
+        size_t rows = count - first < PACKR_STRUCT_BATCH_ROWS ? count - first : PACKR_STRUCT_BATCH_ROWS;
+        fill(cols, items, first, rows);
+        for (int i = 0; i < col_count; i++) {
+            cols[i].count = rows;
+            sent[i] = cols[i];
+            if (types[i] == COL_TYPE_STRING && !text[i]) {
+                text[i] = (uint8_t)struct_times(&sent[i], (packr_timestamp_t *)(cols[i].strings + PACKR_STRUCT_BATCH_ROWS));
+            }
+        }
+        ret = packr_encode_ultra_columns(ctx, (int)rows, col_count, (char **)names, sent, streaming);
+    }
+    if (ret == 0 && streaming) ret = packr_encode_token(ctx, TOKEN_ARRAY_END);
+
+    packr_free(block);
+    return ret;
+}
@@ -1,172 +1,848 @@
 /*
- * PACKR Comprehensive Benchmark (Simplified Phase 1)
+ * PACKR Comprehensive Benchmark
+ *
+ * Times every stage of the pipeline separately on each corpus file, over a
+ * set number of runs on a monotonic clock, and reports the median, p99 and
+ * best run of each:
+ *
+ *   scan      record boundaries of a top-level array (json_array_next)
+ *   tokenize  JSON to a plain frame, ultra batches included
+ *   lz77      LZ77 over the plain frame, at the encoder's default level
+ *   huffman   Huffman over the LZ77 output
+ *   crc       CRC32 over the plain frame
+ *   encode    JSON to a compressed frame, the whole path
+ *   decode    compressed frame to JSON
+ *
+ * MB/s is the stage's input over its median time. The encode/decode figures
+ * are both over the JSON size, so they compare across files.
+ *
+ *   benchmark_comprehensive [-n runs] [-w warmup] [-f text|json|csv] [file.json...]
+ *
+ * Without files it runs the test/data_*.json corpus (missing ones are
+ * skipped). -e/-nc/-d in.json out keep the old encode/decode tool modes.
+ * Inputs the encoder once got wrong must round trip first (round_trip_cases),
+ * broken frames the decoder once misread must be refused (check_refused),
+ * struct arrays must encode as their JSON does (check_structs),
+ * and each file's compressed frame must decode back to it, or the run fails.
+ * -e/-nc fail the same way; -d fails if the frame doesn't decode to JSON.
  */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 #include "packr.h"
 #include "packr_json.h"
+#include "packr_struct.h"
+#include "packr_crc.h"
+#include "packr_huffman.h"
+#include "packr_scan.h"
 
 #ifdef _WIN32
 #include <windows.h>
-#include <psapi.h>
-#else
-#include <sys/time.h>
-#include <sys/resource.h>
 #endif
 
 #define MAX_BUFFER_SIZE (10 * 1024 * 1024)
+#define DEFAULT_RUNS 20
+#define DEFAULT_WARMUP 2
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV 2
+
+enum { STAGE_SCAN, STAGE_TOKENIZE, STAGE_LZ77, STAGE_HUFFMAN, STAGE_CRC, STAGE_ENCODE, STAGE_DECODE, STAGE_COUNT };
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "scan", "tokenize", "lz77", "huffman", "crc", "encode", "decode"
+};
+
+typedef struct {
+    int ran;
+    size_t in_bytes;
+    double median_ms;
+    double p99_ms;
+    double min_ms;
+} stage_result_t;
 
-static double get_time_ms(void) {
+typedef struct {
+    const char *name;
+    const char *path;
+    size_t json_size;
+    size_t frame_size;     /* plain frame */
+    size_t packed_size;    /* compressed frame */
+    size_t peak_alloc;
+    int differs;           /* the frame didn't decode back to the input */
+    stage_result_t stage[STAGE_COUNT];
+} bench_result_t;
+
+typedef struct {
+    int runs;
+    int warmup;
+    int format;
+} bench_opts_t;
+
+/* Scratch shared by all stages */
+typedef struct {
+    const char *json;
+    size_t json_len;
+    uint8_t *work;         /* encoder work buffer */
+    uint8_t *frame;        /* plain frame */
+    size_t frame_len;
+    uint8_t *lz;           /* LZ77 of the frame */
+    size_t lz_len;
+    uint8_t *packed;       /* compressed frame */
+    size_t packed_len;
+    uint8_t *scratch;
+    char *text;            /* decoded JSON */
+    size_t text_len;
+    volatile uint32_t sink;
+} bench_ctx_t;
+
+static double now_ms(void) {
 #ifdef _WIN32
-    LARGE_INTEGER frequency, counter;
-    QueryPerformanceFrequency(&frequency);
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
     QueryPerformanceCounter(&counter);
-    return (double)counter.QuadPart * 1000.0 / frequency.QuadPart;
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
 #else
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (tv.tv_sec * 1000.0) + (tv.tv_usec / 1000.0);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
 #endif
 }
 
-// Memory helpers removed - using library internal tracking
-
 static char *load_file(const char *path, size_t *size) {
     FILE *f = fopen(path, "rb");
     if (!f) return NULL;
     fseek(f, 0, SEEK_END);
-    *size = ftell(f);
+    long len = ftell(f);
     fseek(f, 0, SEEK_SET);
-    char *buf = malloc(*size + 1);
-    fread(buf, 1, *size, f);
-    buf[*size] = 0;
+    char *buf = len >= 0 ? malloc((size_t)len + 1) : NULL;
+    if (!buf || fread(buf, 1, (size_t)len, f) != (size_t)len) {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    buf[len] = 0;
+    *size = (size_t)len;
     fclose(f);
     return buf;
 }
 
+/*
+ * Round trip check: decoded JSON against the input, value by value. Keys
+ * may come back in another order (batch columns go in the order their type
+ * became known), floats within the 1e-6 that float deltas allow, and a null
+ * in a row of an array (a batch column) as the column default.
+ */
+typedef struct {
+    const char *s;
+    size_t pos;
+    size_t len;
+} json_in_t;
+
+static char json_peek(json_in_t *j) {
+    while (j->pos < j->len && strchr(" \t\r\n", j->s[j->pos])) j->pos++;
+    return j->pos < j->len ? j->s[j->pos] : 0;
+}
+
+/* Skips a string, returning its contents (escapes as written) */
+static const char *json_string(json_in_t *j, size_t *len) {
+    const char *start = j->s + j->pos + 1;
+    for (j->pos++; j->pos < j->len && j->s[j->pos] != '"'; j->pos++) {
+        if (j->s[j->pos] == '\\') j->pos++;
+    }
+    *len = (size_t)(j->s + j->pos - start);
+    j->pos++;
+    return start;
+}
+
+/* Skips a value. Returns 0 if it isn't one */
+static int json_skip(json_in_t *j) {
+    char c = json_peek(j);
+    size_t len;
+    if (c == '"') {
+        json_string(j, &len);
+    } else if (c == '{' || c == '[') {
+        char close = (c == '{') ? '}' : ']';
+        j->pos++;
+        while (json_peek(j) != close) {
+            if (c == '{') {
+                if (json_peek(j) != '"') return 0;
+                json_string(j, &len);
+                if (json_peek(j) != ':') return 0;
+                j->pos++;
+            }
+            if (!json_skip(j)) return 0;
+            if (json_peek(j) == ',') j->pos++;
+            else if (json_peek(j) != close) return 0;
+        }
+        j->pos++;
+    } else {
+        size_t start = j->pos;
+        while (j->pos < j->len && !strchr(",]} \t\r\n", j->s[j->pos])) j->pos++;
+        if (j->pos == start) return 0;
+    }
+    return j->pos <= j->len;
+}
+
+static int json_same(json_in_t *a, json_in_t *b, int row);
+
+/* Objects at a and b with the same keys and values, in any order */
+static int json_same_object(json_in_t *a, json_in_t *b, int row) {
+    size_t b_start = ++b->pos;
+    size_t keys = 0;
+    a->pos++;
+    while (json_peek(a) != '}') {
+        size_t klen, blen;
+        if (json_peek(a) != '"') return 0;
+        const char *key = json_string(a, &klen);
+        if (json_peek(a) != ':') return 0;
+        a->pos++;
+
+        /* Its value in b */
+        b->pos = b_start;
+        for (;;) {
+            if (json_peek(b) != '"') return 0;
+            const char *bkey = json_string(b, &blen);
+            json_peek(b);
+            b->pos++;
+            if (blen == klen && memcmp(bkey, key, klen) == 0) break;
+            if (!json_skip(b)) return 0;
+            if (json_peek(b) == ',') b->pos++;
+        }
+        if (!json_same(a, b, row)) return 0;
+        keys++;
+        if (json_peek(a) == ',') a->pos++;
+        else if (json_peek(a) != '}') return 0;
+    }
+    a->pos++;
+
+    /* No keys of its own in b */
+    b->pos = b_start;
+    while (json_peek(b) != '}') {
+        size_t blen;
+        if (json_peek(b) != '"' || keys-- == 0) return 0;
+        json_string(b, &blen);
+        json_peek(b);
+        b->pos++;
+        if (!json_skip(b)) return 0;
+        if (json_peek(b) == ',') b->pos++;
+    }
+    b->pos++;
+    return 1;
+}
+
+/* Values at a (the input) and b (decoded) the same. row: a is a key of a row */
+static int json_same(json_in_t *a, json_in_t *b, int row) {
+    char ca = json_peek(a), cb = json_peek(b);
+    if (ca == '{') return cb == '{' && json_same_object(a, b, 0);
+    if (ca == '[') {
+        if (cb != '[') return 0;
+        a->pos++;
+        b->pos++;
+        while (json_peek(a) != ']') {
+            /* Objects in an array are the rows of a batch */
+            if (json_peek(a) == '{') {
+                if (json_peek(b) != '{' || !json_same_object(a, b, 1)) return 0;
+            } else if (!json_same(a, b, 0)) {
+                return 0;
+            }
+            if (json_peek(a) == ',') a->pos++;
+            if (json_peek(b) == ',') b->pos++;
+        }
+        a->pos++;
+        return json_peek(b) == ']' ? (b->pos++, 1) : 0;
+    }
+
+    size_t a_start = a->pos, b_start = b->pos;
+    if (!json_skip(a) || !json_skip(b)) return 0;
+    size_t alen = a->pos - a_start, blen = b->pos - b_start;
+    const char *av = a->s + a_start, *bv = b->s + b_start;
+    if (alen == blen && memcmp(av, bv, alen) == 0) return 1;
+
+    if (ca == '-' || (ca >= '0' && ca <= '9')) {
+        if (cb != '-' && (cb < '0' || cb > '9')) return 0;
+        double x = strtod(av, NULL), y = strtod(bv, NULL);
+        double scale = fabs(x) > 1.0 ? fabs(x) : 1.0;
+        return fabs(x - y) <= 1e-6 * scale;
+    }
+    /* A null in a row reads as the column default */
+    if (row && ca == 'n') {
+        return (blen == 1 && *bv == '0') || (blen == 3 && memcmp(bv, "0.0", 3) == 0) ||
+               (blen == 2 && memcmp(bv, "\"\"", 2) == 0) || (blen == 5 && memcmp(bv, "false", 5) == 0);
+    }
+    return 0;
+}
+
+/* json (the input) and text (decoded, text_len bytes) the same */
+static int json_matches(const char *json, size_t len, const char *text, size_t text_len) {
+    json_in_t a = {json, 0, len}, b = {text, 0, text_len};
+    return json_same(&a, &b, 0) && json_peek(&a) == 0 && json_peek(&b) == 0;
+}
+
+/* Decodes frame into text (MAX_BUFFER_SIZE bytes). Returns its length, or 0 on error */
+static size_t decode_frame(const uint8_t *frame, size_t frame_len, char *text) {
+    packr_decoder_t dec;
+    packr_writer_t w;
+    packr_writer_init(&w, text, MAX_BUFFER_SIZE, NULL, NULL);
+    packr_decoder_init(&dec, frame, frame_len);
+    int r = packr_decode_to(&dec, &w);
+    packr_decoder_destroy(&dec);
+    return (r > 0 && !w.error) ? w.pos : 0;
+}
+
+/* Encodes json (compressed or not), decodes it and compares. Returns 0 if it comes back the same */
+static int round_trip(const char *json, size_t len, bool compress, uint8_t *work, uint8_t *frame, char *text) {
+    packr_encoder_t enc;
+    packr_encoder_init(&enc, compress, NULL, NULL, work, MAX_BUFFER_SIZE);
+    size_t frame_len = 0;
+    if (json_encode_to_packr(json, len, &enc) == 0) frame_len = packr_encoder_finish(&enc, frame);
+    packr_encoder_destroy(&enc);
+    if (!frame_len) return -1;
+
+    size_t text_len = decode_frame(frame, frame_len, text);
+    return text_len && json_matches(json, len, text, text_len) ? 0 : -1;
+}
+
+/* Inputs the encoder once got wrong, checked before every run */
+static const char *const round_trip_cases[] = {
+    /* A nested key changing type, in the first batch and after it */
+    "[{\"p\":{\"q\":1}},{\"p\":{\"q\":2}},{\"p\":{\"q\":3}},{\"p\":{\"q\":4}},{\"p\":{\"q\":\"x\"}},"
+    "{\"p\":{\"q\":null}},{\"p\":{\"q\":0}},{\"p\":{\"q\":0}},{\"p\":{\"q\":0}},{\"p\":{\"q\":0}}]",
+};
+
+/* Repeats row (with %d, the row number) n times as an array, appending tail rows */
+static char *round_trip_rows(const char *row, int n, const char *tail) {
+    size_t cap = (strlen(row) + 16) * (size_t)n + strlen(tail) + 4;
+    char *json = malloc(cap);
+    if (!json) return NULL;
+    size_t len = 0;
+    json[len++] = '[';
+    for (int i = 0; i < n; i++) {
+        if (i) json[len++] = ',';
+        len += (size_t)snprintf(json + len, cap - len, row, i);
+    }
+    snprintf(json + len, cap - len, "%s]", tail);
+    return json;
+}
+
+/*
+ * A block reset inside a cell of a REF batch: it would free the cached
+ * schema whose field names the batch is still using. Returns 0 if refused.
+ */
+static int check_refused(uint8_t *work, uint8_t *frame, char *text) {
+    static const char json[] =
+        "{\"x\":[{\"a\":1,\"c\":[true]},{\"a\":2,\"c\":[true]},{\"a\":3,\"c\":[true]},{\"a\":4,\"c\":[true]}],"
+        "\"y\":[{\"b\":1},{\"b\":2},{\"b\":3},{\"b\":4}],"
+        "\"z\":[{\"a\":1,\"c\":[true]},{\"a\":2,\"c\":[true]},{\"a\":3,\"c\":[true]},{\"a\":4,\"c\":[true]}]}";
+    packr_encoder_t enc;
+    packr_encoder_init(&enc, false, NULL, NULL, work, MAX_BUFFER_SIZE);
+    size_t len = 0;
+    if (json_encode_to_packr(json, sizeof(json) - 1, &enc) == 0) len = packr_encoder_finish(&enc, frame);
+    packr_encoder_destroy(&enc);
+
+    /* z reuses x's schema; its first cell is an array */
+    size_t at = 0;
+    while (at < len && frame[at] != TOKEN_SCHEMA_REF) at++;
+    while (at < len && frame[at] != TOKEN_ARRAY_START) at++;
+    if (at >= len) return -1;
+    frame[at] = TOKEN_BLOCK_RESET;
+    return decode_frame(frame, len, text) == 0 ? 0 : -1;
+}
+
+/* Struct encoders, whose frames must be the ones their rows give as JSON (check_structs) */
+typedef struct { int32_t id; char at[24]; } stamp_row_t;
+#define STAMP_ROW_FIELDS(X) X(id, INT) X(at, STRING)
+PACKR_STRUCT_ENCODER(stamp_row, stamp_row_t, STAMP_ROW_FIELDS)
+
+typedef struct { int16_t id; double temp; bool ok; const char *site; char mac[18]; } reading_row_t;
+#define READING_ROW_FIELDS(X) X(id, INT) X(temp, DOUBLE) X(ok, BOOL) X(site, STRING) X(mac, MAC)
+PACKR_STRUCT_ENCODER(reading_row, reading_row_t, READING_ROW_FIELDS)
+
+#define STRUCT_ROWS 300
+
+/* Encodes json to a plain frame. Returns its length, or 0 on error */
+static size_t encode_plain(const char *json, size_t len, uint8_t *work, uint8_t *frame) {
+    packr_encoder_t enc;
+    packr_encoder_init(&enc, false, NULL, NULL, work, MAX_BUFFER_SIZE);
+    size_t frame_len = 0;
+    if (json_encode_to_packr(json, len, &enc) == 0) frame_len = packr_encoder_finish(&enc, frame);
+    packr_encoder_destroy(&enc);
+    return frame_len;
+}
+
+/* Ends enc as a plain frame in out if ret (its encoding) is 0. Returns the frame's length, or 0 */
+static size_t finish_plain(packr_encoder_t *enc, int ret, uint8_t *out) {
+    size_t len = ret == 0 ? packr_encoder_finish(enc, out) : 0;
+    packr_encoder_destroy(enc);
+    return len;
+}
+
+/* Compares a struct encoder's frame with json's. Returns 0 if they are the same */
+static int same_frame(const char *what, const uint8_t *struct_frame, size_t struct_len,
+                      const char *json, size_t len, uint8_t *work, uint8_t *frame) {
+    size_t frame_len = encode_plain(json, len, work, frame);
+    if (frame_len && struct_len == frame_len && memcmp(struct_frame, frame, frame_len) == 0) return 0;
+    fprintf(stderr, "struct frame (%s): %zu bytes, %zu as JSON\n", what, struct_len, frame_len);
+    return -1;
+}
+
+/*
+ * Struct arrays against their rows as JSON: timestamp rows, all of them
+ * and with one that isn't after the first batch, then rows of every member
+ * type, in batches and as a plain array. Returns 0 if the frames are the same.
+ */
+static int check_structs(uint8_t *work, uint8_t *frame, uint8_t *struct_frame) {
+    static const char *const sites[] = {"north", "south", "east", NULL};
+    stamp_row_t *stamps = malloc(STRUCT_ROWS * sizeof(stamp_row_t));
+    reading_row_t *readings = malloc(STRUCT_ROWS * sizeof(reading_row_t));
+    char *json = malloc(STRUCT_ROWS * 128);
+    int failed = !stamps || !readings || !json;
+    packr_encoder_t enc;
+
+    for (int odd = 0; odd < 2 && !failed; odd++) {
+        size_t len = 0;
+        json[len++] = '[';
+        for (int i = 0; i < STRUCT_ROWS; i++) {
+            stamps[i].id = i;
+            if (odd && i == 200) strcpy(stamps[i].at, "never");
+            else sprintf(stamps[i].at, "2026-10-15T%02d:%02d:%02dZ", i / 3600, i / 60 % 60, i % 60);
+            len += (size_t)sprintf(json + len, "%s{\"id\":%d,\"at\":\"%s\"}", i ? "," : "", i, stamps[i].at);
+        }
+        json[len++] = ']';
+
+        packr_encoder_init(&enc, false, NULL, NULL, work, MAX_BUFFER_SIZE);
+        size_t struct_len = finish_plain(&enc, packr_encode_stamp_row_array(&enc, stamps, STRUCT_ROWS), struct_frame);
+        if (same_frame(odd ? "timestamps and text" : "timestamps", struct_frame, struct_len,
+                       json, len, work, frame) != 0) failed = 1;
+    }
+
+    for (int i = 0; i < STRUCT_ROWS && !failed; i++) {
+        readings[i].id = (int16_t)(i * 7 - 1000);
+        readings[i].temp = 20.25 + (i % 40) * 0.5;
+        readings[i].ok = i % 3 != 0;
+        readings[i].site = sites[i % 4];
+        sprintf(readings[i].mac, "02:00:5E:10:%02X:%02X", i / 16, i % 16 * 11);
+    }
+    static const int counts[] = {STRUCT_ROWS, PACKR_STRUCT_MIN_ROWS - 1};
+    for (int c = 0; c < 2 && !failed; c++) {
+        int count = counts[c];
+        size_t len = 0;
+        json[len++] = '[';
+        for (int i = 0; i < count; i++) {
+            const reading_row_t *r = &readings[i];
+            len += (size_t)sprintf(json + len, "%s{\"id\":%d,\"temp\":%.17g,\"ok\":%s,\"site\":\"%s\",\"mac\":\"%s\"}",
+                                   i ? "," : "", r->id, r->temp, r->ok ? "true" : "false", r->site ? r->site : "", r->mac);
+        }
+        json[len++] = ']';
+
+        packr_encoder_init(&enc, false, NULL, NULL, work, MAX_BUFFER_SIZE);
+        size_t struct_len = finish_plain(&enc, packr_encode_reading_row_array(&enc, readings, (size_t)count), struct_frame);
+        if (same_frame(c ? "every type, plain array" : "every type", struct_frame, struct_len,
+                       json, len, work, frame) != 0) failed = 1;
+    }
+    free(json); free(readings); free(stamps);
+    return failed;
+}
+
+static int check_round_trips(void) {
+    uint8_t *work = malloc(MAX_BUFFER_SIZE);
+    uint8_t *frame = malloc(MAX_BUFFER_SIZE);
+    char *text = malloc(MAX_BUFFER_SIZE);
+    char wide[1024];
+    char *rows[2];
+
+    /* Past the first batch, so the array is already streaming */
+    rows[0] = round_trip_rows("{\"p\":{\"q\":%d}}", 300, ",{\"p\":{\"q\":\"x\"}},{\"p\":{\"q\":null}},{\"p\":5}");
+    /* Nested keys filling the batch columns but for the top-level ones */
+    size_t len = (size_t)sprintf(wide, "{\"n\":{");
+    for (int k = 0; k < 63; k++) len += (size_t)sprintf(wide + len, "%s\"k%d\":%d", k ? "," : "", k, k);
+    sprintf(wide + len, "},\"a\":%%d,\"b\":\"x\"}");
+    rows[1] = round_trip_rows(wide, 300, "");
+    int failed = !work || !frame || !text || !rows[0] || !rows[1];
+
+    size_t count = sizeof(round_trip_cases) / sizeof(round_trip_cases[0]);
+    for (size_t i = 0; i < count + 2 && !failed; i++) {
+        const char *json = (i < count) ? round_trip_cases[i] : rows[i - count];
+        for (int compress = 0; compress < 2; compress++) {
+            if (round_trip(json, strlen(json), compress, work, frame, text) != 0) {
+                fprintf(stderr, "round trip case %zu (%s) differs: %.200s\n", i, compress ? "compressed" : "plain", text);
+                failed = 1;
+            }
+        }
+    }
+    if (!failed && check_refused(work, frame, text) != 0) {
+        fprintf(stderr, "block reset inside a batch not refused: %.200s\n", text);
+        failed = 1;
+    }
+    if (!failed && check_structs(work, frame, (uint8_t *)text) != 0) failed = 1;
+    free(rows[1]); free(rows[0]); free(text); free(frame); free(work);
+    return failed;
+}
+
 static int run_tool_encode(const char *in, const char *out, int compress) {
     size_t in_size;
     char *json = load_file(in, &in_size);
     if (!json) return 1;
-    
+
     uint8_t *buffer = malloc(MAX_BUFFER_SIZE);
+    char *text = malloc(MAX_BUFFER_SIZE);
+    if (!buffer || !text) {
+        free(json); free(buffer); free(text); return 1;
+    }
     packr_encoder_t enc;
-    packr_encoder_init(&enc, NULL, NULL, buffer, MAX_BUFFER_SIZE);
-    enc.compress = compress;
-    
+    packr_encoder_init(&enc, compress, NULL, NULL, buffer, MAX_BUFFER_SIZE);
+
     if (json_encode_to_packr(json, in_size, &enc) != 0) {
-        free(json); free(buffer); return 1;
+        packr_encoder_destroy(&enc);
+        free(json); free(buffer); free(text); return 1;
     }
-    
+
     size_t out_size = packr_encoder_finish(&enc, buffer);
-    
+
     FILE *f = fopen(out, "wb");
-    fwrite(buffer, 1, out_size, f);
-    fclose(f);
-    
+    if (f) {
+        fwrite(buffer, 1, out_size, f);
+        fclose(f);
+    }
+
     packr_encoder_destroy(&enc);
-    
+
     printf("Debug Peak Alloc: %zu bytes\n", packr_get_peak_alloc());
-    
-    free(json); free(buffer);
-    return 0;
+
+    /* The frame must decode back to the input */
+    size_t text_len = decode_frame(buffer, out_size, text);
+    int same = text_len && json_matches(json, in_size, text, text_len);
+    if (!same) fprintf(stderr, "%s: decoded JSON differs from the input\n", in);
+
+    free(json); free(buffer); free(text);
+    return (f && same) ? 0 : 1;
 }
 
 static int run_tool_decode(const char *in, const char *out) {
     size_t in_size;
     char *pkr = load_file(in, &in_size);
     if (!pkr) return 1;
-    
+
     char *json_out = malloc(MAX_BUFFER_SIZE);
-    json_out[0] = 0;
-    
-    packr_decoder_t dec;
-    packr_decoder_init(&dec, (uint8_t*)pkr, in_size);
-    char *cursor = json_out;
-    char *end = json_out + MAX_BUFFER_SIZE;
-    packr_decode_next(&dec, &cursor, end);
-    
+    if (!json_out) {
+        free(pkr); return 1;
+    }
+    size_t len = decode_frame((const uint8_t*)pkr, in_size, json_out);
+
+    /* One well-formed value, nothing after it */
+    json_in_t j = {json_out, 0, len};
+    int ok = len && json_skip(&j) && json_peek(&j) == 0;
+    if (!ok) fprintf(stderr, "%s: does not decode to JSON\n", in);
+
     FILE *f = fopen(out, "wb");
-    fwrite(json_out, 1, strlen(json_out), f);
-    fclose(f);
-    
-    packr_decoder_destroy(&dec);
+    if (f) {
+        fwrite(json_out, 1, len, f);
+        fclose(f);
+    }
+
     free(pkr); free(json_out);
-    return 0;
+    return (f && ok) ? 0 : 1;
 }
 
-static void run_benchmark(const char *name, const char *path) {
-    printf("Benchmarking: %s\n", name);
-    size_t size;
-    char *json = load_file(path, &size);
-    if (!json) { printf("Skipped\n"); return; }
-    
-    uint8_t *buffer = malloc(MAX_BUFFER_SIZE);
+/* Stages: each runs once and returns 0, or -1 if it cannot run on this input */
+
+static int stage_scan(bench_ctx_t *b) {
+    json_array_iter_t it;
+    size_t start, len;
+    uint32_t records = 0;
+    int r;
+    if (json_array_begin(&it, b->json, b->json_len) != 0) return -1;
+    while ((r = json_array_next(&it, &start, &len)) == 1) records++;
+    b->sink += records;
+    return r == 0 ? 0 : -1;
+}
+
+static size_t encode_json(bench_ctx_t *b, bool compress, uint8_t *out) {
     packr_encoder_t enc;
-    
-    /* Warmup */
-    packr_encoder_init(&enc, NULL, NULL, buffer, MAX_BUFFER_SIZE);
-    enc.compress = true;
-    json_encode_to_packr(json, size, &enc);
-    packr_encoder_finish(&enc, buffer);
+    packr_encoder_init(&enc, compress, NULL, NULL, b->work, MAX_BUFFER_SIZE);
+    size_t len = 0;
+    if (json_encode_to_packr(b->json, b->json_len, &enc) == 0) len = packr_encoder_finish(&enc, out);
     packr_encoder_destroy(&enc);
-    
-    /* Encode */
-    packr_reset_alloc_stats();
-    double start = get_time_ms();
-    size_t out_size = 0;
-    for (int i=0; i<10; i++) {
-        packr_encoder_init(&enc, NULL, NULL, buffer, MAX_BUFFER_SIZE);
-        enc.compress = true;
-        json_encode_to_packr(json, size, &enc);
-        out_size = packr_encoder_finish(&enc, buffer);
-        packr_encoder_destroy(&enc);
+    return len;
+}
+
+static int stage_tokenize(bench_ctx_t *b) {
+    b->frame_len = encode_json(b, false, b->frame);
+    return b->frame_len ? 0 : -1;
+}
+
+static int stage_lz77(bench_ctx_t *b) {
+    b->lz_len = packr_lz77_compress_ex(b->frame, b->frame_len, b->lz, MAX_BUFFER_SIZE,
+                                       PACKR_LZ77_DEFAULT, PACKR_LZ77_WINDOW_DEFAULT);
+    return b->lz_len ? 0 : -1;
+}
+
+static int stage_huffman(bench_ctx_t *b) {
+    size_t len = packr_huffman_compress(b->lz, b->lz_len, b->scratch, MAX_BUFFER_SIZE);
+    b->sink += (uint32_t)len;
+    return len ? 0 : -1;
+}
+
+static int stage_crc(bench_ctx_t *b) {
+    b->sink += packr_crc32(b->frame, b->frame_len);
+    return 0;
+}
+
+static int stage_encode(bench_ctx_t *b) {
+    b->packed_len = encode_json(b, true, b->packed);
+    return b->packed_len ? 0 : -1;
+}
+
+static int stage_decode(bench_ctx_t *b) {
+    b->text_len = decode_frame(b->packed, b->packed_len, b->text);
+    return b->text_len ? 0 : -1;
+}
+
+static int (*const stage_funcs[STAGE_COUNT])(bench_ctx_t *) = {
+    stage_scan, stage_tokenize, stage_lz77, stage_huffman, stage_crc, stage_encode, stage_decode
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void time_stage(bench_ctx_t *b, int stage, const bench_opts_t *opts, double *times, stage_result_t *res) {
+    int (*fn)(bench_ctx_t *) = stage_funcs[stage];
+    res->ran = 0;
+    for (int i = 0; i < opts->warmup; i++) {
+        if (fn(b) != 0) return;
     }
-    double enc_ms = (get_time_ms() - start) / 10.0;
-    size_t mem_peak = packr_get_peak_alloc();
-    size_t mem_delta = mem_peak / 1024;
-    
-    /* Decode */
-    char *json_out = malloc(MAX_BUFFER_SIZE);
-    packr_decoder_t dec;
-    start = get_time_ms();
-    for (int i=0; i<10; i++) {
-        json_out[0] = 0;
-        char *cursor = json_out;
-        char *end = json_out + MAX_BUFFER_SIZE;
-        packr_decoder_init(&dec, buffer, out_size);
-        packr_decode_next(&dec, &cursor, end);
-        packr_decoder_destroy(&dec);
-    }
-    double dec_ms = (get_time_ms() - start) / 10.0;
-    
-    printf("PACKR Compressed %zu %.1fx %.2fms %.2fms 0.0ms 0.0MB/s %.1f KB\n",
-           out_size, (double)size/out_size, enc_ms, dec_ms, (double)mem_delta);
-           
-    packr_encoder_destroy(&enc);
-    free(json); free(buffer); free(json_out);
+    for (int i = 0; i < opts->runs; i++) {
+        double start = now_ms();
+        if (fn(b) != 0) return;
+        times[i] = now_ms() - start;
+    }
+    qsort(times, (size_t)opts->runs, sizeof(double), cmp_double);
+
+    /* Nearest rank */
+    int n = opts->runs;
+    int p99 = (n * 99 + 99) / 100 - 1;
+    res->ran = 1;
+    res->min_ms = times[0];
+    res->median_ms = (n & 1) ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2.0;
+    res->p99_ms = times[p99 < n ? p99 : n - 1];
+}
+
+static int run_benchmark(bench_result_t *r, const bench_opts_t *opts) {
+    size_t size;
+    char *json = load_file(r->path, &size);
+    if (!json) return -1;
+
+    bench_ctx_t b;
+    memset(&b, 0, sizeof(b));
+    b.json = json;
+    b.json_len = size;
+    b.work = malloc(MAX_BUFFER_SIZE);
+    b.frame = malloc(MAX_BUFFER_SIZE);
+    b.lz = malloc(MAX_BUFFER_SIZE);
+    b.packed = malloc(MAX_BUFFER_SIZE);
+    b.scratch = malloc(MAX_BUFFER_SIZE);
+    b.text = malloc(MAX_BUFFER_SIZE);
+    double *times = malloc(sizeof(double) * (size_t)opts->runs);
+
+    int ret = -1;
+    if (b.work && b.frame && b.lz && b.packed && b.scratch && b.text && times) {
+        r->json_size = size;
+
+        /* Peak allocation of one full encode and decode, which must give the input back */
+        packr_reset_alloc_stats();
+        if (stage_encode(&b) == 0) {
+            r->differs = stage_decode(&b) != 0 || !json_matches(json, size, b.text, b.text_len);
+        }
+        r->peak_alloc = packr_get_peak_alloc();
+
+        /* Stages run in order, so each one's input is the previous one's output */
+        for (int s = 0; s < STAGE_COUNT && !r->differs; s++) {
+            time_stage(&b, s, opts, times, &r->stage[s]);
+        }
+        r->stage[STAGE_SCAN].in_bytes = size;
+        r->stage[STAGE_TOKENIZE].in_bytes = size;
+        r->stage[STAGE_LZ77].in_bytes = b.frame_len;
+        r->stage[STAGE_HUFFMAN].in_bytes = b.lz_len;
+        r->stage[STAGE_CRC].in_bytes = b.frame_len;
+        r->stage[STAGE_ENCODE].in_bytes = size;
+        r->stage[STAGE_DECODE].in_bytes = size;
+        r->frame_size = b.frame_len;
+        r->packed_size = b.packed_len;
+        ret = (r->stage[STAGE_ENCODE].ran && !r->differs) ? 0 : -1;
+    }
+
+    free(times);
+    free(b.text); free(b.scratch); free(b.packed); free(b.lz); free(b.frame); free(b.work);
+    free(json);
+    return ret;
+}
+
+static double mb_per_s(const stage_result_t *s) {
+    if (!s->ran || s->median_ms <= 0.0) return 0.0;
+    return (double)s->in_bytes / (1024.0 * 1024.0) / (s->median_ms / 1000.0);
+}
+
+static double ratio(const bench_result_t *r) {
+    return r->packed_size ? (double)r->json_size / (double)r->packed_size : 0.0;
+}
+
+/* Names and paths go into JSON and CSV as they are, minus quotes and backslashes */
+static void print_clean(const char *s) {
+    for (; *s; s++) {
+        if (*s != '"' && *s != '\\') putchar(*s);
+    }
+}
+
+static void print_text(const bench_result_t *r) {
+    if (r->name == r->path) printf("%s\n", r->name);
+    else printf("%s (%s)\n", r->name, r->path);
+    printf("  %zu -> %zu bytes (%.2fx), plain frame %zu, peak alloc %.1f KB\n",
+           r->json_size, r->packed_size, ratio(r), r->frame_size, (double)r->peak_alloc / 1024.0);
+    printf("  %-9s %10s %10s %10s %10s\n", "stage", "median ms", "p99 ms", "min ms", "MB/s");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const stage_result_t *st = &r->stage[s];
+        if (!st->ran) {
+            printf("  %-9s %10s\n", stage_names[s], "-");
+            continue;
+        }
+        printf("  %-9s %10.3f %10.3f %10.3f %10.1f\n", stage_names[s],
+               st->median_ms, st->p99_ms, st->min_ms, mb_per_s(st));
+    }
+    printf("\n");
+}
+
+static void print_json(const bench_result_t *r, int first) {
+    printf("%s\n    {\"name\": \"", first ? "" : ",");
+    print_clean(r->name);
+    printf("\", \"path\": \"");
+    print_clean(r->path);
+    printf("\", \"json_bytes\": %zu, \"frame_bytes\": %zu, \"packed_bytes\": %zu, \"ratio\": %.3f, \"peak_alloc\": %zu,\n",
+           r->json_size, r->frame_size, r->packed_size, ratio(r), r->peak_alloc);
+    printf("     \"stages\": {");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const stage_result_t *st = &r->stage[s];
+        printf("%s\n       \"%s\": ", s ? "," : "", stage_names[s]);
+        if (!st->ran) {
+            printf("null");
+            continue;
+        }
+        printf("{\"in_bytes\": %zu, \"median_ms\": %.4f, \"p99_ms\": %.4f, \"min_ms\": %.4f, \"mb_s\": %.2f}",
+               st->in_bytes, st->median_ms, st->p99_ms, st->min_ms, mb_per_s(st));
+    }
+    printf("}}");
+}
+
+/* One row per file and stage, so a regression check can key on (name, stage) */
+static void print_csv(const bench_result_t *r) {
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const stage_result_t *st = &r->stage[s];
+        if (!st->ran) continue;
+        printf("\"");
+        print_clean(r->name);
+        printf("\",%s,%zu,%zu,%zu,%.4f,%.4f,%.4f,%.2f,%.3f,%zu\n", stage_names[s],
+               r->json_size, r->packed_size, st->in_bytes, st->median_ms, st->p99_ms, st->min_ms,
+               mb_per_s(st), ratio(r), r->peak_alloc);
+    }
+}
+
+static const char *const corpus[][2] = {
+    {"Best Case - Highly Repetitive", "test/data_best_case.json"},
+    {"Typical Case - Realistic Telemetry", "test/data_typical_case.json"},
+    {"Worst Case - High Entropy", "test/data_worst_case.json"},
+    {"Sparse Case - Many Nulls", "test/data_sparse_case.json"},
+    {"Bursty Case - Event Driven", "test/data_bursty_case.json"},
+    {"Mixed Case - Real World", "test/data_mixed_case.json"},
+    {"IoT Sensor Fleet - Many Devices", "test/data_iot_fleet.json"},
+    {"Network Metrics - IPs/MACs/Floats", "test/data_network_metrics.json"},
+    {"Log Events - Long Strings", "test/data_log_events.json"},
+    {"Deeply Nested Structures", "test/data_deep_nested.json"},
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n runs] [-w warmup] [-f text|json|csv] [file.json...]\n", prog);
+    fprintf(stderr, "       %s -e|-nc|-d in out\n", prog);
 }
 
 int main(int argc, char **argv) {
-    if (argc > 1) {
+    if (argc > 3) {
         if (strcmp(argv[1], "-e") == 0) return run_tool_encode(argv[2], argv[3], 1);
         if (strcmp(argv[1], "-nc") == 0) return run_tool_encode(argv[2], argv[3], 0);
         if (strcmp(argv[1], "-d") == 0) return run_tool_decode(argv[2], argv[3]);
     }
-    
-    run_benchmark("Best Case - Highly Repetitive", "test/data_best_case.json");
-    run_benchmark("Typical Case - Realistic Telemetry", "test/data_typical_case.json");
-    run_benchmark("Worst Case - High Entropy", "test/data_worst_case.json");
-    run_benchmark("Sparse Case - Many Nulls", "test/data_sparse_case.json");
-    run_benchmark("Bursty Case - Event Driven", "test/data_bursty_case.json");
-    run_benchmark("Mixed Case - Real World", "test/data_mixed_case.json");
-    run_benchmark("IoT Sensor Fleet - Many Devices", "test/data_iot_fleet.json");
-    run_benchmark("Network Metrics - IPs/MACs/Floats", "test/data_network_metrics.json");
-    run_benchmark("Log Events - Long Strings", "test/data_log_events.json");
-    run_benchmark("Deeply Nested Structures", "test/data_deep_nested.json");
-    
-    return 0;
+
+    bench_opts_t opts = {DEFAULT_RUNS, DEFAULT_WARMUP, FORMAT_TEXT};
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *opt = argv[argi];
+        if (argi + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *val = argv[++argi];
+        if (strcmp(opt, "-n") == 0) {
+            opts.runs = atoi(val);
+        } else if (strcmp(opt, "-w") == 0) {
+            opts.warmup = atoi(val);
+        } else if (strcmp(opt, "-f") == 0) {
+            if (strcmp(val, "text") == 0) opts.format = FORMAT_TEXT;
+            else if (strcmp(val, "json") == 0) opts.format = FORMAT_JSON;
+            else if (strcmp(val, "csv") == 0) opts.format = FORMAT_CSV;
+            else { usage(argv[0]); return 1; }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.runs < 1 || opts.warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t count = argi < argc ? (size_t)(argc - argi) : sizeof(corpus) / sizeof(corpus[0]);
+
+    if (opts.format == FORMAT_TEXT) {
+        printf("PACKR benchmark: %d runs, %d warmup, scan %s, crc %s\n\n",
+               opts.runs, opts.warmup, packr_scan_backend(), packr_crc32_backend());
+    } else if (opts.format == FORMAT_JSON) {
+        printf("{\"runs\": %d, \"warmup\": %d, \"scan_backend\": \"%s\", \"crc_backend\": \"%s\", \"results\": [",
+               opts.runs, opts.warmup, packr_scan_backend(), packr_crc32_backend());
+    } else {
+        printf("name,stage,json_bytes,packed_bytes,in_bytes,median_ms,p99_ms,min_ms,mb_s,ratio,peak_alloc\n");
+    }
+
+    int printed = 0, failed = check_round_trips();
+    for (size_t i = 0; i < count; i++) {
+        bench_result_t r;
+        memset(&r, 0, sizeof(r));
+        if (argi < argc) {
+            r.name = r.path = argv[argi + (int)i];
+        } else {
+            r.name = corpus[i][0];
+            r.path = corpus[i][1];
+        }
+
+        if (run_benchmark(&r, &opts) != 0) {
+            /* Missing corpus files are skipped, files named on the command line are errors */
+            if (argi < argc || r.differs) failed = 1;
+            fprintf(stderr, "%s: %s\n", r.path,
+                    r.differs ? "decoded JSON differs from the input" : r.json_size ? "encode failed" : "skipped");
+            continue;
+        }
+
+        if (opts.format == FORMAT_TEXT) print_text(&r);
+        else if (opts.format == FORMAT_JSON) print_json(&r, !printed);
+        else print_csv(&r);
+        printed++;
+    }
+
+    if (opts.format == FORMAT_JSON) printf("%s]}\n", printed ? "\n  " : "");
+    return failed;
 }
@@ -0,0 +1,290 @@
+/*
+ * PACKR Primer Trainer
+ *
+ * Builds a primer dictionary from sample messages. Every message is one
+ * frame, and a frame spells out each field, string and MAC the first time
+ * it uses it, so an entry is worth (messages it appears in) x (its length
+ * + 1) bytes. The PACKR_DICT_SIZE best of each kind are kept, the best
+ * last so they are evicted last.
+ *
+ *   packr_train [-i id] [-r] [-m max_len] [-c name] -o primer.bin sample.json...
+ *
+ * -r takes every record of a top-level array as its own message (default:
+ * one message per file). -c also writes the primer as a C array to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "packr.h"
+#include "packr_json.h"
+
+#define KIND_FIELD 0
+#define KIND_STRING 1
+#define KIND_MAC 2
+
+typedef struct {
+    char *str;
+    size_t len;
+    uint32_t hash;
+    uint8_t kind;
+    uint32_t messages;  /* messages it appears in */
+    uint32_t last;      /* last message counted, 1-based */
+} train_entry_t;
+
+typedef struct {
+    train_entry_t *slots;
+    size_t cap;         /* power of two */
+    size_t count;
+    uint32_t message;
+    size_t max_len;
+} trainer_t;
+
+static char *load_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (n < 0) {
+        fclose(f);
+        return NULL;
+    }
+    char *buf = malloc((size_t)n + 1);
+    if (buf && fread(buf, 1, (size_t)n, f) != (size_t)n) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    if (!buf) return NULL;
+    buf[n] = 0;
+    *size = (size_t)n;
+    return buf;
+}
+
+static uint32_t train_hash(const char *s, size_t len, int kind) {
+    uint32_t h = 2166136261u ^ (uint32_t)kind;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int trainer_grow(trainer_t *t) {
+    size_t cap = t->cap ? t->cap * 2 : 1024;
+    train_entry_t *slots = calloc(cap, sizeof(train_entry_t));
+    if (!slots) return -1;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (!t->slots[i].str) continue;
+        size_t j = t->slots[i].hash & (cap - 1);
+        while (slots[j].str) j = (j + 1) & (cap - 1);
+        slots[j] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return 0;
+}
+
+static int trainer_count(trainer_t *t, const char *s, size_t len, int kind) {
+    if (len == 0 || len > t->max_len) return 0;
+    if ((t->count + 1) * 2 > t->cap && trainer_grow(t) != 0) return -1;
+
+    uint32_t h = train_hash(s, len, kind);
+    size_t j = h & (t->cap - 1);
+    while (t->slots[j].str) {
+        train_entry_t *e = &t->slots[j];
+        if (e->hash == h && e->kind == kind && e->len == len && memcmp(e->str, s, len) == 0) {
+            if (e->last != t->message) {
+                e->last = t->message;
+                e->messages++;
+            }
+            return 0;
+        }
+        j = (j + 1) & (t->cap - 1);
+    }
+
+    train_entry_t *e = &t->slots[j];
+    e->str = malloc(len);
+    if (!e->str) return -1;
+    memcpy(e->str, s, len);
+    e->len = len;
+    e->hash = h;
+    e->kind = (uint8_t)kind;
+    e->messages = 1;
+    e->last = t->message;
+    t->count++;
+    return 0;
+}
+
+/* Same test as the JSON encoder */
+static int is_mac(const char *s, size_t len) {
+    if (len != 17) return 0;
+    for (int i = 0; i < 17; i++) {
+        if (i % 3 == 2) {
+            if (s[i] != ':' && s[i] != '-') return 0;
+        } else if (!isxdigit((unsigned char)s[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Counts every key and string value of one message (raw bytes, as the encoder keeps them) */
+static int trainer_add(trainer_t *t, const char *json, size_t len) {
+    t->message++;
+    size_t i = 0;
+    while (i < len) {
+        if (json[i] != '"') {
+            i++;
+            continue;
+        }
+        size_t start = ++i;
+        while (i < len && json[i] != '"') i += (json[i] == '\\') ? 2 : 1;
+        if (i >= len) break;
+        size_t slen = i - start;
+        i++;
+
+        size_t k = i;
+        while (k < len && isspace((unsigned char)json[k])) k++;
+        int kind = (k < len && json[k] == ':') ? KIND_FIELD
+                 : is_mac(json + start, slen) ? KIND_MAC : KIND_STRING;
+        if (trainer_count(t, json + start, slen, kind) != 0) return -1;
+    }
+    return 0;
+}
+
+static uint64_t entry_score(const train_entry_t *e) {
+    /* A single message gains nothing from a shared entry */
+    return e->messages > 1 ? (uint64_t)e->messages * (e->len + 1) : 0;
+}
+
+static int by_score(const void *a, const void *b) {
+    const train_entry_t *x = *(const train_entry_t *const *)a;
+    const train_entry_t *y = *(const train_entry_t *const *)b;
+    uint64_t sx = entry_score(x), sy = entry_score(y);
+    if (sx != sy) return sx < sy ? -1 : 1;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    return memcmp(x->str, y->str, x->len);
+}
+
+/* Best PACKR_DICT_SIZE entries of kind, worst first */
+static size_t pick(trainer_t *t, int kind, packr_primer_entry_t *out) {
+    train_entry_t **list = malloc((t->count + 1) * sizeof(train_entry_t *));
+    size_t n = 0;
+    if (!list) return 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].str && t->slots[i].kind == kind && entry_score(&t->slots[i]) > 0) list[n++] = &t->slots[i];
+    }
+    qsort(list, n, sizeof(train_entry_t *), by_score);
+
+    size_t first = n > PACKR_DICT_SIZE ? n - PACKR_DICT_SIZE : 0;
+    for (size_t i = first; i < n; i++) {
+        out[i - first].str = list[i]->str;
+        out[i - first].len = list[i]->len;
+    }
+    free(list);
+    return n - first;
+}
+
+static void write_c_array(FILE *f, const char *name, const uint8_t *data, size_t len) {
+    fprintf(f, "static const uint8_t %s[%zu] = {", name, len);
+    for (size_t i = 0; i < len; i++) {
+        fprintf(f, "%s0x%02x,", (i % 12) ? " " : "\n    ", data[i]);
+    }
+    fprintf(f, "\n};\n");
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: packr_train [-i id] [-r] [-m max_len] [-c name] -o primer.bin sample.json...\n");
+}
+
+int main(int argc, char **argv) {
+    trainer_t t;
+    memset(&t, 0, sizeof(t));
+    t.max_len = 64;
+    int id = 1;
+    int records = 0;
+    const char *out_path = NULL;
+    const char *c_name = NULL;
+
+    int a = 1;
+    for (; a < argc && argv[a][0] == '-'; a++) {
+        const char *opt = argv[a];
+        if (!strcmp(opt, "-r")) {
+            records = 1;
+        } else if (a + 1 < argc && !strcmp(opt, "-i")) {
+            id = atoi(argv[++a]);
+        } else if (a + 1 < argc && !strcmp(opt, "-m")) {
+            t.max_len = (size_t)atoi(argv[++a]);
+        } else if (a + 1 < argc && !strcmp(opt, "-c")) {
+            c_name = argv[++a];
+        } else if (a + 1 < argc && !strcmp(opt, "-o")) {
+            out_path = argv[++a];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (!out_path || a >= argc || id < 1 || id > PACKR_PRIMER_MAX_ID) {
+        usage();
+        return 2;
+    }
+
+    for (; a < argc; a++) {
+        size_t len;
+        char *json = load_file(argv[a], &len);
+        if (!json) {
+            fprintf(stderr, "packr_train: cannot read %s\n", argv[a]);
+            return 1;
+        }
+        int ret = 0;
+        json_array_iter_t it;
+        if (records && json_array_begin(&it, json, len) == 0) {
+            size_t start, rec_len;
+            int r = 0;
+            while (ret == 0 && (r = json_array_next(&it, &start, &rec_len)) == 1) {
+                ret = trainer_add(&t, json + start, rec_len);
+            }
+            if (r < 0) fprintf(stderr, "packr_train: %s: malformed array, stopped early\n", argv[a]);
+        } else {
+            ret = trainer_add(&t, json, len);
+        }
+        free(json);
+        if (ret != 0) {
+            fprintf(stderr, "packr_train: out of memory\n");
+            return 1;
+        }
+    }
+
+    packr_primer_entry_t fields[PACKR_DICT_SIZE], strings[PACKR_DICT_SIZE], macs[PACKR_DICT_SIZE];
+    size_t nf = pick(&t, KIND_FIELD, fields);
+    size_t ns = pick(&t, KIND_STRING, strings);
+    size_t nm = pick(&t, KIND_MAC, macs);
+
+    size_t cap = 16 + 3 * PACKR_DICT_SIZE * (t.max_len + 5);
+    uint8_t *primer = malloc(cap);
+    size_t size = primer ? packr_primer_build(primer, cap, (uint8_t)id, fields, nf, strings, ns, macs, nm) : 0;
+    if (!size) {
+        fprintf(stderr, "packr_train: could not build the primer\n");
+        return 1;
+    }
+
+    FILE *f = fopen(out_path, "wb");
+    if (!f || fwrite(primer, 1, size, f) != size) {
+        fprintf(stderr, "packr_train: cannot write %s\n", out_path);
+        return 1;
+    }
+    fclose(f);
+    if (c_name) write_c_array(stdout, c_name, primer, size);
+
+    fprintf(stderr, "primer %d: %zu messages, %zu fields, %zu strings, %zu MACs, %zu bytes\n",
+            id, (size_t)t.message, nf, ns, nm, size);
+
+    for (size_t i = 0; i < t.cap; i++) free(t.slots[i].str);
+    free(t.slots);
+    free(primer);
+    return 0;
+}
@@ -7,6 +7,11 @@ __version__ = "0.1.0"
 from .tokens import TokenType, MAGIC, VERSION
 from .encoder import PackrEncoder
 from .decoder import PackrDecoder
+from .decoder import _native
+
+# True when the libpackr extension is built: it decodes, and encodes for
+# PackrEncoder(native=True)
+HAVE_NATIVE = _native is not None
 
 __all__ = [
     "TokenType",
@@ -14,4 +19,5 @@ __all__ = [
     "VERSION",
     "PackrEncoder",
     "PackrDecoder",
+    "HAVE_NATIVE",
 ]
@@ -0,0 +1,371 @@
+/*
+ * PACKR - CPython Extension
+ *
+ * packr._native runs libpackr for PackrEncoder and PackrDecoder. Inputs
+ * come in through the buffer protocol (bytes, bytearray, memoryview, mmap)
+ * and are read in place; the codec runs with the GIL released, so frames
+ * can be decoded on a thread pool. Values cross as JSON text, which the
+ * wrappers hand to the json module.
+ *
+ *   decode(frame) -> bytes                 JSON of the frame's value
+ *   decode_stream(data) -> (bytes, int)    JSON array of the objects in the
+ *                                          complete frames, bytes they took
+ *   encode(json, compress=True, records=False) -> bytes
+ *
+ * Frames the C codec rejects raise ValueError, and decode_stream stops
+ * before them, so the pure Python decoder can take over.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "packr.h"
+#include "packr_json.h"
+#include "packr_crc.h"
+#include "packr_platform.h"
+
+#define NATIVE_OK          0
+#define NATIVE_BAD_FRAME  -1
+#define NATIVE_NO_MEMORY  -2
+#define NATIVE_SPLIT       1          /* records that are not batches, go again one by one */
+
+#define FRAME_MIN_LEN     10          /* magic, version, flags, count, CRC */
+#define FRAME_MAX_LEN     (10u << 20) /* as packr_decoder_init */
+#define WRITER_STAGE      16384
+
+/* Same sizing as packr_parallel's blocks */
+#define ENCODE_CAP_MIN    256
+#define ENCODE_CAP_SLACK  64
+#define ENCODE_GROW_MAX   16
+
+/* Output grown with the raw allocator, which needs no GIL */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} grow_t;
+
+static int grow_reserve(grow_t *g, size_t extra) {
+    if (g->cap - g->len >= extra) return 0;
+    size_t cap = g->cap ? g->cap : 4096;
+    while (cap - g->len < extra) {
+        if (cap > ((size_t)-1) / 2) return -1;
+        cap *= 2;
+    }
+    char *data = PyMem_RawRealloc(g->data, cap);
+    if (!data) return -1;
+    g->data = data;
+    g->cap = cap;
+    return 0;
+}
+
+static int grow_write(void *user_data, const char *data, size_t len) {
+    grow_t *g = (grow_t *)user_data;
+    if (grow_reserve(g, len) != 0) return -1;
+    memcpy(g->data + g->len, data, len);
+    g->len += len;
+    return 0;
+}
+
+static int grow_put(grow_t *g, char c) {
+    return grow_write(g, &c, 1);
+}
+
+static int frame_crc_ok(const uint8_t *frame, size_t len) {
+    return packr_crc32(frame, len - 4) == packr_load_le32(frame + len - 4);
+}
+
+/*
+ * Finds the frame at the start of in: a PKR1 frame (the first length its
+ * CRC checks out at, unless whole, when it is all of in) or an LZ77 wrapped
+ * one, inflated into *owned. *used is the input it took up.
+ */
+static int open_frame(const uint8_t *in, size_t n, int whole, const uint8_t **frame, size_t *frame_len,
+                      size_t *used, uint8_t **owned) {
+    *owned = NULL;
+    if (n >= 2 && in[0] == 0xFE && in[1] == 0x03) {
+        size_t lz_len = packr_lz77_stream_length(in + 2, n - 2);
+        if (lz_len == 0) return NATIVE_BAD_FRAME;
+        size_t orig_len = packr_lz77_decompressed_size(in + 2, lz_len);
+        if (orig_len < FRAME_MIN_LEN || orig_len > FRAME_MAX_LEN) return NATIVE_BAD_FRAME;
+
+        uint8_t *buf = PyMem_RawMalloc(orig_len);
+        if (!buf) return NATIVE_NO_MEMORY;
+        size_t actual = packr_lz77_decompress(in + 2, lz_len, buf, orig_len);
+        if (actual < FRAME_MIN_LEN || memcmp(buf, "PKR1", 4) != 0 || !frame_crc_ok(buf, actual)) {
+            PyMem_RawFree(buf);
+            return NATIVE_BAD_FRAME;
+        }
+        *owned = buf;
+        *frame = buf;
+        *frame_len = actual;
+        *used = 2 + lz_len;
+        return NATIVE_OK;
+    }
+
+    if (n < FRAME_MIN_LEN || memcmp(in, "PKR1", 4) != 0) return NATIVE_BAD_FRAME;
+    if (whole) {
+        if (!frame_crc_ok(in, n)) return NATIVE_BAD_FRAME;
+        *frame_len = n;
+    } else {
+        /* Frames carry no length: take the first end the CRC confirms, as FrameParser does */
+        uint32_t crc = 0xFFFFFFFF;
+        size_t done = 0;
+        size_t end = FRAME_MIN_LEN;
+        for (; end <= n; end++) {
+            crc = packr_crc32_update(crc, in + done, end - 4 - done);
+            done = end - 4;
+            if ((crc ^ 0xFFFFFFFF) == packr_load_le32(in + done)) break;
+        }
+        if (end > n) return NATIVE_BAD_FRAME;
+        *frame_len = end;
+    }
+    *frame = in;
+    *used = *frame_len;
+    return NATIVE_OK;
+}
+
+/* Frames that hold records rather than one value, as PackrDecoder.decode_stream splits them */
+static int is_records_token(uint8_t t) {
+    return t == TOKEN_ULTRA_BATCH || t == TOKEN_BATCH_PARTIAL || t == TOKEN_ARRAY_STREAM ||
+           t == TOKEN_SCHEMA_DEF || t == TOKEN_SCHEMA_REF || t == TOKEN_SCHEMA_REPEAT;
+}
+
+/*
+ * Appends the frame's values to out. As records, each object is one comma
+ * led element (a records frame gives its rows, any other frame each of
+ * its values); otherwise out is the first value's JSON.
+ */
+static int decode_frame(const uint8_t *frame, size_t len, int records, grow_t *out) {
+    packr_decoder_t *d = PyMem_RawMalloc(sizeof(packr_decoder_t));
+    if (!d) return NATIVE_NO_MEMORY;
+    packr_decoder_init(d, frame, len);
+
+    char stage[WRITER_STAGE];
+    packr_writer_t w;
+    packr_writer_init(&w, stage, sizeof(stage), grow_write, out);
+
+    int ret = NATIVE_OK;
+    do {
+        size_t mark = out->len;
+        int rows = records && d->pos < d->size && is_records_token(d->data[d->pos]);
+        if (records && !rows && grow_put(out, ',') != 0) {
+            ret = NATIVE_NO_MEMORY;
+            break;
+        }
+        int ok = packr_decode_to(d, &w);
+        if (packr_writer_flush(&w) != 0 || w.error) {
+            ret = NATIVE_NO_MEMORY;
+            break;
+        }
+        if (!ok) {
+            ret = NATIVE_BAD_FRAME;
+            break;
+        }
+        if (rows) {
+            /* "[a,b]" becomes ",a,b" */
+            if (out->len - mark < 2 || out->data[mark] != '[' || out->data[out->len - 1] != ']') {
+                ret = NATIVE_BAD_FRAME;
+                break;
+            }
+            out->data[mark] = ',';
+            out->len -= (out->len - mark == 2) ? 2 : 1;
+        }
+    } while (records && d->pos + 4 < d->size);
+
+    packr_decoder_destroy(d);
+    PyMem_RawFree(d);
+    return ret;
+}
+
+static int decode_one(const uint8_t *in, size_t n, grow_t *out) {
+    const uint8_t *frame;
+    size_t frame_len, used;
+    uint8_t *owned;
+    int ret = open_frame(in, n, 1, &frame, &frame_len, &used, &owned);
+    if (ret == NATIVE_OK && used != n) ret = NATIVE_BAD_FRAME;
+    if (ret == NATIVE_OK) ret = decode_frame(frame, frame_len, 0, out);
+    PyMem_RawFree(owned);
+    return ret;
+}
+
+/* Decodes frames until one is incomplete or rejected. *consumed covers the ones decoded */
+static int decode_all(const uint8_t *in, size_t n, grow_t *out, size_t *consumed) {
+    *consumed = 0;
+    while (*consumed < n) {
+        const uint8_t *frame;
+        size_t frame_len, used;
+        uint8_t *owned;
+        size_t mark = out->len;
+        int ret = open_frame(in + *consumed, n - *consumed, 0, &frame, &frame_len, &used, &owned);
+        if (ret == NATIVE_OK) ret = decode_frame(frame, frame_len, 1, out);
+        PyMem_RawFree(owned);
+        if (ret == NATIVE_NO_MEMORY) return ret;
+        if (ret != NATIVE_OK) {
+            out->len = mark;
+            break;
+        }
+        *consumed += used;
+    }
+
+    /* ",a,b" becomes "[a,b]" */
+    if (out->len == 0 && grow_put(out, ',') != 0) return NATIVE_NO_MEMORY;
+    if (grow_put(out, ']') != 0) return NATIVE_NO_MEMORY;
+    out->data[0] = '[';
+    return NATIVE_OK;
+}
+
+static int encode_text(packr_encoder_t *enc, const char *json, size_t len, int records) {
+    if (!records) return json_encode_to_packr(json, len, enc);
+
+    /* Rows that did not make record batches go in one by one, not as an array */
+    size_t start = enc->pos;
+    int ret = json_encode_to_packr(json, len, enc);
+    if (ret != 0 || enc->pos == start || is_records_token(enc->buffer[start])) return ret;
+    packr_encoder_destroy(enc);
+    return NATIVE_SPLIT;
+}
+
+static int encode_records(packr_encoder_t *enc, const char *json, size_t len) {
+    json_array_iter_t it;
+    if (json_array_begin(&it, json, len) != 0) return -1;
+    size_t start, rec_len;
+    int r;
+    while ((r = json_array_next(&it, &start, &rec_len)) == 1) {
+        if (json_encode_to_packr(json + start, rec_len, enc) != 0) return -1;
+    }
+    return r;
+}
+
+static int encode_json(const char *json, size_t len, bool compress, int records, uint8_t **frame, size_t *frame_len) {
+    int ret = NATIVE_BAD_FRAME;
+    int split = 0;
+    size_t cap = len * 2 + ENCODE_CAP_MIN;
+    size_t cap_max = len * ENCODE_GROW_MAX + ENCODE_CAP_MIN;
+
+    packr_encoder_t *enc = PyMem_RawMalloc(sizeof(packr_encoder_t));
+    if (!enc) return NATIVE_NO_MEMORY;
+
+    while (ret != NATIVE_OK && cap <= cap_max) {
+        uint8_t *buf = PyMem_RawMalloc(cap);
+        if (!buf) {
+            ret = NATIVE_NO_MEMORY;
+            break;
+        }
+
+        packr_encoder_init(enc, compress, NULL, NULL, buf, cap);
+        int r = split ? encode_records(enc, json, len) : encode_text(enc, json, len, records);
+        if (r == NATIVE_SPLIT) {
+            /* encode_text tore the encoder down already */
+            PyMem_RawFree(buf);
+            split = 1;
+            continue;
+        }
+        if (r == 0 && enc->pos + ENCODE_CAP_SLACK < cap) {
+            *frame_len = packr_encoder_finish(enc, buf);
+            *frame = buf;
+            ret = *frame_len ? NATIVE_OK : NATIVE_BAD_FRAME;
+        } else {
+            PyMem_RawFree(buf);
+            cap *= 2;
+        }
+        packr_encoder_destroy(enc);
+        if (ret == NATIVE_OK) break;
+    }
+
+    PyMem_RawFree(enc);
+    return ret;
+}
+
+static PyObject *native_error(int ret) {
+    if (ret == NATIVE_NO_MEMORY) return PyErr_NoMemory();
+    PyErr_SetString(PyExc_ValueError, "packr: not a frame the C codec can decode");
+    return NULL;
+}
+
+static PyObject *native_decode(PyObject *self, PyObject *args) {
+    Py_buffer in;
+    (void)self;
+    if (!PyArg_ParseTuple(args, "y*:decode", &in)) return NULL;
+
+    grow_t out = {NULL, 0, 0};
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = decode_one((const uint8_t *)in.buf, (size_t)in.len, &out);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in);
+
+    PyObject *res = (ret == NATIVE_OK) ? PyBytes_FromStringAndSize(out.data, (Py_ssize_t)out.len) : native_error(ret);
+    PyMem_RawFree(out.data);
+    return res;
+}
+
+static PyObject *native_decode_stream(PyObject *self, PyObject *args) {
+    Py_buffer in;
+    (void)self;
+    if (!PyArg_ParseTuple(args, "y*:decode_stream", &in)) return NULL;
+
+    grow_t out = {NULL, 0, 0};
+    size_t consumed = 0;
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = decode_all((const uint8_t *)in.buf, (size_t)in.len, &out, &consumed);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in);
+
+    PyObject *res = (ret == NATIVE_OK)
+        ? Py_BuildValue("(y#n)", out.data, (Py_ssize_t)out.len, (Py_ssize_t)consumed)
+        : native_error(ret);
+    PyMem_RawFree(out.data);
+    return res;
+}
+
+static PyObject *native_encode(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"json", "compress", "records", NULL};
+    Py_buffer in;
+    int compress = 1;
+    int records = 0;
+    (void)self;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|pp:encode", keywords, &in, &compress, &records)) return NULL;
+
+    uint8_t *frame = NULL;
+    size_t frame_len = 0;
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = encode_json((const char *)in.buf, (size_t)in.len, compress != 0, records, &frame, &frame_len);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in);
+
+    PyObject *res;
+    if (ret == NATIVE_OK) {
+        res = PyBytes_FromStringAndSize((const char *)frame, (Py_ssize_t)frame_len);
+    } else if (ret == NATIVE_NO_MEMORY) {
+        res = PyErr_NoMemory();
+    } else {
+        PyErr_SetString(PyExc_ValueError, "packr: JSON the C encoder cannot take");
+        res = NULL;
+    }
+    PyMem_RawFree(frame);
+    return res;
+}
+
+static PyMethodDef native_methods[] = {
+    {"decode", native_decode, METH_VARARGS,
+     "decode(frame) -> bytes\n\nJSON text of the frame's value."},
+    {"decode_stream", native_decode_stream, METH_VARARGS,
+     "decode_stream(data) -> (bytes, int)\n\nJSON array of the objects in the complete frames at the start\n"
+     "of data, and the bytes those frames took up."},
+    {"encode", (PyCFunction)(void (*)(void))native_encode, METH_VARARGS | METH_KEYWORDS,
+     "encode(json, compress=True, records=False) -> bytes\n\nOne frame holding the JSON value, or with records,\n"
+     "the elements of the JSON array as objects."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef native_module = {
+    PyModuleDef_HEAD_INIT, "_native", "libpackr codec for PackrEncoder and PackrDecoder.", -1, native_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__native(void) {
+    return PyModule_Create(&native_module);
+}
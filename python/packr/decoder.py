@@ -7,6 +7,7 @@ Handles ultra-compact encoding with:
 - RLE strings
 """
 
+import json
 from typing import Any, List, Tuple, Optional
 
 from .tokens import (
@@ -27,6 +28,11 @@ from .dictionary import DictionarySet
 from .frame import FrameParser, Frame
 from .rice import RiceDecoder
 
+try:
+    from . import _native
+except ImportError:  # extension not built, pure Python only
+    _native = None
+
 
 def format_mac(mac_bytes: bytes) -> str:
     return ':'.join(f'{b:02X}' for b in mac_bytes)
@@ -72,6 +78,11 @@ class PackrDecoder:
         self._current_field_index: Optional[int] = None
     
     def decode(self, data: bytes) -> Any:
+        if _native is not None:
+            try:
+                return json.loads(_native.decode(data))
+            except ValueError:
+                pass  # a frame only the Python codec reads
         data, _ = self._maybe_decompress(data)
         frame = self._parser.parse(data)
         self._data = frame.data
@@ -99,6 +110,14 @@ class PackrDecoder:
         total_consumed = 0
         remaining = data
 
+        if _native is not None:
+            # The C codec takes the frames it can; the rest go on below
+            text, total_consumed = _native.decode_stream(data)
+            all_objects = json.loads(text)
+            if total_consumed == len(data):
+                return all_objects, total_consumed
+            remaining = data[total_consumed:]
+
         while len(remaining) > 0:
             try:
                 decompressed_data, consumed = self._maybe_decompress(remaining)
@@ -9,6 +9,7 @@ Ultra-compact encoding with:
 - Rice coding for final compression
 """
 
+import json
 import re
 from typing import Any, Union, Optional, List, Tuple, Dict
 from collections import OrderedDict
@@ -23,12 +24,18 @@ from .tokens import (
     encode_fixed16,
     encode_fixed32,
     encode_double,
+    fits_int,
     zigzag_encode,
 )
 from .dictionary import DictionarySet
 from .frame import FrameBuilder, FrameFlags
 from .rice import BitWriter, RiceEncoder
 
+try:
+    from . import _native
+except ImportError:  # extension not built, pure Python only
+    _native = None
+
 
 MAC_PATTERN = re.compile(r'^([0-9A-Fa-f]{2}[:-]){5}[0-9A-Fa-f]{2}$')
 
@@ -72,7 +79,8 @@ class ExtendedTokenType:
 class PackrEncoder:
     """Maximum compression PACKR encoder with optional compression pass."""
 
-    def __init__(self, use_delta: bool = True, use_schema: bool = True, compress: bool = True):
+    def __init__(self, use_delta: bool = True, use_schema: bool = True, compress: bool = True,
+                 native: bool = False):
         """
         Initialize encoder.
 
@@ -81,29 +89,46 @@ class PackrEncoder:
             use_schema: Enable schema-based batch encoding
             compress: Enable fast LZ77 compression (default True for best compression)
                      Set to False only if you need absolute minimum latency
+            native: Encode with libpackr when the extension is built. Its
+                    frames follow the C encoder's rules, which don't keep
+                    everything the Python encoder does: a null in a batch
+                    column reads back as the column default, integers are
+                    32-bit and floats in delta columns are kept to 1e-6
         """
         self._dicts = DictionarySet()
         self._use_delta = use_delta
         self._use_schema = use_schema
         self._compress = compress
+        self._native = native
         self._frame = FrameBuilder()
         self._last_values: dict = {}
         self._value_types: dict = {}
     
     def encode(self, obj: Any) -> bytes:
+        frame = self._encode_native(obj, records=False)
+        if frame is not None:
+            return frame
         self._frame.reset()
         self._encode_value(obj)
         frame = self._frame.finalize()
         return self._finalize(frame)
     
     def encode_stream(self, objects: list) -> bytes:
+        if objects:
+            frame = self._encode_native(list(objects), records=True)
+            if frame is not None:
+                return frame
         self._frame.reset()
         
         if not objects:
             return self._finalize(self._frame.finalize())
         
         if self._use_schema and self._is_homogeneous_object_array(objects):
-            self._encode_ultra_batch(objects)
+            if self._has_null_field(objects):
+                # A batch reads a null back as a missing key, an array keeps it
+                self._encode_value(list(objects))
+            else:
+                self._encode_ultra_batch(objects)
         else:
             for obj in objects:
                 self._encode_value(obj)
@@ -111,6 +136,22 @@ class PackrEncoder:
         frame = self._frame.finalize()
         return self._finalize(frame)
     
+    def _encode_native(self, obj: Any, records: bool) -> Optional[bytes]:
+        """
+        Encode with libpackr if asked to (native=True), or None to use the
+        Python encoder.
+
+        The frames are the C encoder's, so its batch rules apply (see
+        __init__), as they do to frames from devices.
+        """
+        if _native is None or not (self._native and self._use_delta and self._use_schema):
+            return None
+        try:
+            text = json.dumps(obj, separators=(',', ':'), ensure_ascii=False, allow_nan=False)
+            return _native.encode(text.encode('utf-8'), compress=self._compress, records=records)
+        except (TypeError, ValueError):
+            return None  # bytes, NaN or anything else JSON cannot carry
+
     def _finalize(self, frame) -> bytes:
         """Finalize frame with optional compression."""
         raw = frame.serialize()
@@ -132,6 +173,9 @@ class PackrEncoder:
         # Relaxed check: Just verify they are dicts. 
         return isinstance(objects[0], dict)
     
+    def _has_null_field(self, objects: list) -> bool:
+        return any(isinstance(obj, dict) and None in obj.values() for obj in objects)
+
     def _encode_ultra_batch(self, objects: List[dict]) -> None:
         """
         Ultra-compact batch encoding with:
@@ -186,7 +230,9 @@ class PackrEncoder:
              
             # Check if numeric (all valid values are numbers)
             # Boolean is handled separately in Packr usually, but here we treat as numeric/bool
-            is_numeric = all(isinstance(v, (int, float)) and not isinstance(v, bool) for v in valid_values)
+            # (an integer too wide for an INT keeps the column out of deltas)
+            is_numeric = all(isinstance(v, float) or (isinstance(v, int) and not isinstance(v, bool) and fits_int(v))
+                             for v in valid_values)
             
             # Prepare values for underlying encoders (Fill None with dummy to keep stream sync)
             prepared_values = []
@@ -280,9 +326,9 @@ class PackrEncoder:
         if isinstance(value, bool):
             self._frame.add_token(bytes([TokenType.BOOL_TRUE if value else TokenType.BOOL_FALSE]))
         elif isinstance(value, (int, float)) and not isinstance(value, bool):
-            is_float = isinstance(value, float) and not value.is_integer()
+            is_float = not value.is_integer() if isinstance(value, float) else not fits_int(value)
             if is_float:
-                self._frame.add_token(bytes([TokenType.DOUBLE]) + encode_double(value))
+                self._frame.add_token(bytes([TokenType.DOUBLE]) + encode_double(float(value)))
             else:
                 self._frame.add_token(bytes([TokenType.INT]) + encode_signed_varint(int(value)))
         elif isinstance(value, str):
@@ -477,10 +523,10 @@ class PackrEncoder:
             self._frame.add_token(bytes([TokenType.NULL]))
         elif isinstance(value, bool):
             self._frame.add_token(bytes([TokenType.BOOL_TRUE if value else TokenType.BOOL_FALSE]))
-        elif isinstance(value, int):
+        elif isinstance(value, int) and fits_int(value):
             self._frame.add_token(bytes([TokenType.INT]) + encode_signed_varint(value))
-        elif isinstance(value, float):
-            self._frame.add_token(bytes([TokenType.DOUBLE]) + encode_double(value))
+        elif isinstance(value, (int, float)):
+            self._frame.add_token(bytes([TokenType.DOUBLE]) + encode_double(float(value)))
         elif isinstance(value, str):
             self._encode_string(value)
         elif isinstance(value, dict):
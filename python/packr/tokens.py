@@ -125,6 +125,14 @@ def decode_varint(data: bytes, offset: int = 0) -> Tuple[int, int]:
     return result, bytes_read
 
 
+def fits_int(value: int) -> bool:
+    """
+    True if an INT token holds value. Integers are 32-bit in the format, as
+    in the C codec; wider ones go in a DOUBLE.
+    """
+    return -2147483648 <= value <= 2147483647
+
+
 def zigzag_encode(value: int) -> int:
     """
     Encode a signed integer using ZigZag encoding.
@@ -0,0 +1,57 @@
+"""
+PACKR Python package, with the optional libpackr extension.
+
+    python setup.py build_ext --inplace    # packr._native next to the sources
+    pip install .
+
+The extension is built from ../c; without a compiler the package still
+installs and runs on the pure Python codec.
+"""
+
+import glob
+import os
+
+from setuptools import setup, Extension
+from setuptools.command.build_ext import build_ext
+
+C_DIR = os.path.join('..', 'c')
+
+# Everything but the thread pool encoder, which the extension does not use
+C_SOURCES = sorted(
+    path for path in glob.glob(os.path.join(C_DIR, 'src', '*.c'))
+    if os.path.basename(path) != 'packr_parallel.c'
+)
+
+
+class OptionalBuildExt(build_ext):
+    """Falls back to the pure Python codec when the extension does not build."""
+
+    def run(self):
+        try:
+            super().run()
+        except Exception as exc:  # no compiler, missing headers
+            print(f"packr: not building the C extension ({exc})")
+
+    def build_extension(self, ext):
+        try:
+            super().build_extension(ext)
+        except Exception as exc:
+            print(f"packr: not building {ext.name} ({exc})")
+
+
+native = Extension(
+    'packr._native',
+    sources=['packr/_native.c'] + C_SOURCES,
+    include_dirs=[os.path.join(C_DIR, 'include')],
+    extra_compile_args=['-O2', '-std=c99'] if os.name != 'nt' else [],
+)
+
+setup(
+    name='packr',
+    version='0.1.0',
+    description='PACKR - Structure-First Streaming Compression',
+    packages=['packr'],
+    python_requires='>=3.7',
+    ext_modules=[native],
+    cmdclass={'build_ext': OptionalBuildExt},
+)
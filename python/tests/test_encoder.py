@@ -0,0 +1,126 @@
+"""
+Encoder tests: the same inputs through the Python encoder and libpackr.
+
+Run from python/: python -m unittest discover tests
+"""
+
+import os
+import sys
+import unittest
+from unittest import mock
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+
+import packr
+import packr.decoder
+import packr.encoder
+from packr import PackrEncoder, PackrDecoder
+
+ROWS = 40
+
+# Inputs the C encoder's batch rules don't keep (or once didn't)
+LOSSY = {
+    'string_after_ints': [{'id': i, 'v': i} for i in range(ROWS)] + [{'id': ROWS, 'v': 'x'}],
+    'nested_type_change': [{'id': i, 'p': {'q': i}} for i in range(ROWS)] + [{'id': ROWS, 'p': {'q': 'x'}}],
+    'wide_ints': [{'id': i, 'v': 2 ** 40 + i} for i in range(ROWS)],
+    'null_in_int_column': [{'id': i, 'v': i if i % 5 else None} for i in range(ROWS)],
+}
+
+# Inputs inside both encoders' rules
+EXACT = {
+    'records': [{'id': i, 'name': 'dev%d' % (i % 3), 'on': i % 2 == 0, 't': 20.5 + i}
+                for i in range(ROWS)],
+    'nested': [{'id': i, 'p': {'q': i, 'r': 'x'}} for i in range(ROWS)],
+    'document': {'a': [1, 2, 3], 'b': {'c': 'd'}, 'e': None},
+}
+
+
+def python_only():
+    """Run the encoder and decoder without libpackr."""
+    return mock.patch.multiple(packr.encoder, _native=None), \
+        mock.patch.multiple(packr.decoder, _native=None)
+
+
+def encode(data, **kwargs):
+    encoder = PackrEncoder(**kwargs)
+    if isinstance(data, list):
+        return encoder.encode_stream(data)
+    return encoder.encode(data)
+
+
+def encode_python(data, **kwargs):
+    enc, _ = python_only()
+    with enc:
+        return encode(data, **kwargs)
+
+
+def decode_python(frame):
+    _, dec = python_only()
+    with dec:
+        return PackrDecoder().decode(frame)
+
+
+class DefaultEncoderTest(unittest.TestCase):
+    """Without native=True, frames come from the Python encoder."""
+
+    def test_same_frames_as_python(self):
+        for name, data in {**LOSSY, **EXACT}.items():
+            for compress in (False, True):
+                with self.subTest(name, compress=compress):
+                    self.assertEqual(encode(data, compress=compress),
+                                     encode_python(data, compress=compress))
+
+    def test_round_trip(self):
+        for name, data in LOSSY.items():
+            with self.subTest(name):
+                self.assertEqual(decode_python(encode(data)), data)
+
+    def test_wide_ints(self):
+        # Past 32 bits an integer goes in a DOUBLE, exact up to 2**53
+        for value in (2 ** 31, -2 ** 31 - 1, 2 ** 40 + 1, -2 ** 53):
+            with self.subTest(value):
+                self.assertEqual(decode_python(encode(value)), value)
+
+
+@unittest.skipUnless(packr.HAVE_NATIVE, 'libpackr extension not built')
+class NativeEncoderTest(unittest.TestCase):
+    """native=True encodes with libpackr; both paths read the same inputs."""
+
+    def test_uses_libpackr(self):
+        data = EXACT['records']
+        frame = encode(data, compress=False, native=True)
+        self.assertEqual(frame, packr.encoder._native.encode(
+            packr.encoder.json.dumps(data, separators=(',', ':')).encode('utf-8'),
+            compress=False, records=True))
+        self.assertNotEqual(frame, encode_python(data, compress=False))
+
+    def test_both_paths_round_trip(self):
+        for name, data in EXACT.items():
+            for compress in (False, True):
+                with self.subTest(name, compress=compress):
+                    native = encode(data, compress=compress, native=True)
+                    python = encode(data, compress=compress)
+                    self.assertEqual(PackrDecoder().decode(native), data)
+                    self.assertEqual(PackrDecoder().decode(python), data)
+                    self.assertEqual(decode_python(python), data)
+
+    def test_lossy_inputs(self):
+        for name, data in LOSSY.items():
+            with self.subTest(name):
+                self.assertEqual(PackrDecoder().decode(encode(data)), data)
+        for name in ('string_after_ints', 'nested_type_change'):
+            with self.subTest(name, native=True):
+                data = LOSSY[name]
+                self.assertEqual(PackrDecoder().decode(encode(data, native=True)), data)
+
+    def test_native_rules(self):
+        # What native=True gives up: the C encoder's integers are 32-bit and
+        # a null in a batch column reads back as the column default
+        wide = PackrDecoder().decode(encode(LOSSY['wide_ints'], native=True))
+        self.assertNotEqual(wide, LOSSY['wide_ints'])
+        nulls = PackrDecoder().decode(encode(LOSSY['null_in_int_column'], native=True))
+        self.assertEqual(nulls[0], {'id': 0, 'v': 0})
+
+
+if __name__ == '__main__':
+    unittest.main()